@@ -0,0 +1,274 @@
+#include "bench.h"
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/sysinfo.h>
+
+#define BENCH_DEFAULT_SAMPLES 1000
+#define BENCH_DEFAULT_THREADS_MAX 8
+#define BENCH_CALIBRATE_NS 100000000ull // 100 мс на калибровку TSC
+
+static const char *filter = NULL;
+static int samples = BENCH_DEFAULT_SAMPLES;
+static int max_threads = 1;
+static int list_only = 0;
+static double cycles_per_ns = 1.0;
+static char last_listed[64];
+static FILE *results = NULL;    // Исходный stdout: только строки JSON
+
+typedef struct {
+    const bench_case_t *bc;
+    pthread_barrier_t *barrier;
+    atomic_int *failed;
+    int tid;
+    int cpu;
+    double *samples;             // Тактов на операцию в каждом замере
+    uint64_t cycles;             // Сумма тактов замеров
+} bench_thread_t;
+
+static void usage(const char *prog) {
+    fprintf(stderr,
+            "Usage: %s [-f substring] [-s samples] [-t max_threads] [-l]\n"
+            "  -f  run only benchmarks whose name contains substring\n"
+            "  -s  timed batches per benchmark (default %d)\n"
+            "  -t  largest thread count for contention cases (default: CPUs, up to %d)\n"
+            "  -l  list benchmark names and exit\n",
+            prog, BENCH_DEFAULT_SAMPLES, BENCH_DEFAULT_THREADS_MAX);
+}
+
+// Частота TSC относительно CLOCK_MONOTONIC
+static void calibrate(void) {
+    uint64_t ns0 = bench_now_ns();
+    uint64_t c0 = bench_cycles();
+    uint64_t ns1;
+    do {
+        ns1 = bench_now_ns();
+    } while (ns1 - ns0 < BENCH_CALIBRATE_NS);
+    uint64_t c1 = bench_cycles();
+    cycles_per_ns = (double)(c1 - c0) / (double)(ns1 - ns0);
+}
+
+void bench_init(int argc, char **argv) {
+    int nprocs = get_nprocs();
+    max_threads = nprocs < BENCH_DEFAULT_THREADS_MAX ? nprocs : BENCH_DEFAULT_THREADS_MAX;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "f:s:t:lh")) != -1) {
+        switch (opt) {
+        case 'f':
+            filter = optarg;
+            break;
+        case 's':
+            samples = atoi(optarg);
+            break;
+        case 't':
+            max_threads = atoi(optarg);
+            break;
+        case 'l':
+            list_only = 1;
+            break;
+        default:
+            usage(argv[0]);
+            exit(opt == 'h' ? EXIT_SUCCESS : EXIT_FAILURE);
+        }
+    }
+    if (samples < 10 || max_threads < 1) {
+        usage(argv[0]);
+        exit(EXIT_FAILURE);
+    }
+    // Подсистемы сервера печатают в stdout при инициализации - это
+    // уходит в stderr, результаты пишутся в исходный stdout
+    int fd = dup(STDOUT_FILENO);
+    results = fd != -1 ? fdopen(fd, "w") : NULL;
+    if (!results || dup2(STDERR_FILENO, STDOUT_FILENO) == -1) {
+        perror("bench: stdout");
+        exit(EXIT_FAILURE);
+    }
+    if (!list_only) {
+        calibrate();
+    }
+}
+
+int bench_enabled(const char *name) {
+    if (filter && !strstr(name, filter)) {
+        return 0;
+    }
+    if (list_only) {
+        // Случаи с конкуренцией повторяются для каждого числа тредов
+        if (strcmp(last_listed, name) != 0) {
+            fprintf(results, "%s\n", name);
+            snprintf(last_listed, sizeof(last_listed), "%s", name);
+        }
+        return 0;
+    }
+    return 1;
+}
+
+int bench_max_threads(void) {
+    return max_threads;
+}
+
+void bench_report_env(const char *scanner) {
+    if (list_only) {
+        return;
+    }
+    fprintf(results, "{\"suite\":\"micro\",\"bench\":\"env\",\"cpus\":%d,\"tsc_ghz\":%.3f,"
+           "\"scanner\":\"%s\",\"samples\":%d}\n",
+           get_nprocs(), cycles_per_ns, scanner, samples);
+    fflush(results);
+}
+
+static void *bench_thread(void *arg) {
+    bench_thread_t *t = arg;
+    const bench_case_t *bc = t->bc;
+
+    cpu_set_t cpuset;
+    CPU_ZERO(&cpuset);
+    CPU_SET(t->cpu, &cpuset);
+    pthread_setaffinity_np(pthread_self(), sizeof(cpuset), &cpuset);
+
+    if (bc->thread_init && bc->thread_init(bc->ctx, t->tid) != 0) {
+        atomic_store(t->failed, 1);
+    }
+    pthread_barrier_wait(t->barrier);
+    if (atomic_load(t->failed)) {
+        goto done;
+    }
+
+    // Прогрев: кэши, предсказатель переходов, частота ядра
+    int warmup = samples / 10;
+    for (int i = 0; i < warmup; ++i) {
+        bc->run(bc->ctx, t->tid, bc->batch);
+    }
+    pthread_barrier_wait(t->barrier);
+
+    for (int i = 0; i < samples; ++i) {
+        uint64_t c0 = bench_cycles();
+        bc->run(bc->ctx, t->tid, bc->batch);
+        uint64_t c1 = bench_cycles();
+        t->cycles += c1 - c0;
+        t->samples[i] = (double)(c1 - c0) / (double)bc->batch;
+    }
+    pthread_barrier_wait(t->barrier);
+
+done:
+    if (bc->thread_done) {
+        bc->thread_done(bc->ctx, t->tid);
+    }
+    return NULL;
+}
+
+static int compare_double(const void *a, const void *b) {
+    double x = *(const double *)a;
+    double y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+static double percentile_ns(const double *sorted, size_t n, double p) {
+    size_t index = (size_t)(p * (double)(n - 1) + 0.5);
+    return sorted[index] / cycles_per_ns;
+}
+
+static void report(const bench_case_t *bc, bench_thread_t *threads, uint64_t wall_ns) {
+    size_t n = (size_t)bc->threads * samples;
+    double *all = malloc(sizeof(double) * n);
+    if (!all) {
+        perror("malloc: samples");
+        return;
+    }
+    uint64_t cycles = 0;
+    for (int i = 0; i < bc->threads; ++i) {
+        memcpy(all + (size_t)i * samples, threads[i].samples, sizeof(double) * samples);
+        cycles += threads[i].cycles;
+    }
+    qsort(all, n, sizeof(double), compare_double);
+
+    uint64_t ops = (uint64_t)n * bc->batch;
+    double cycles_per_op = (double)cycles / (double)ops;
+    double ns_per_op = cycles_per_op / cycles_per_ns;
+    double p50 = percentile_ns(all, n, 0.50);
+    double p90 = percentile_ns(all, n, 0.90);
+    double p99 = percentile_ns(all, n, 0.99);
+    double p999 = percentile_ns(all, n, 0.999);
+    double max = all[n - 1] / cycles_per_ns;
+    // Пропускная способность - всех тредов вместе, по настенным часам
+    double mops = wall_ns ? (double)ops * 1000.0 / (double)wall_ns : 0.0;
+    free(all);
+
+    fprintf(results, "{\"suite\":\"micro\",\"bench\":\"%s\",\"threads\":%d,\"ops\":%llu,"
+           "\"ns_per_op\":%.2f,\"cycles_per_op\":%.1f,\"p50_ns\":%.2f,\"p90_ns\":%.2f,"
+           "\"p99_ns\":%.2f,\"p999_ns\":%.2f,\"max_ns\":%.2f,\"mops\":%.3f}\n",
+           bc->name, bc->threads, (unsigned long long)ops, ns_per_op, cycles_per_op,
+           p50, p90, p99, p999, max, mops);
+    fflush(results);
+
+    fprintf(stderr, "%-28s %2d thr %9.1f ns/op %8.0f cyc  p50 %8.1f  p99 %8.1f  p99.9 %8.1f  %9.2f Mops/s",
+            bc->name, bc->threads, ns_per_op, cycles_per_op, p50, p99, p999, mops);
+    if (bc->bytes) {
+        fprintf(stderr, "  %6.2f GB/s", (double)bc->bytes / ns_per_op);
+    }
+    fputc('\n', stderr);
+}
+
+int bench_run(const bench_case_t *bc) {
+    int nprocs = get_nprocs();
+    bench_thread_t *threads = calloc(bc->threads, sizeof(*threads));
+    pthread_t *ids = calloc(bc->threads, sizeof(*ids));
+    double *storage = calloc((size_t)bc->threads * samples, sizeof(double));
+    if (!threads || !ids || !storage) {
+        perror("calloc: bench threads");
+        free(threads);
+        free(ids);
+        free(storage);
+        return -1;
+    }
+
+    // Главный тред участвует в барьерах, чтобы засечь настенное время
+    pthread_barrier_t barrier;
+    pthread_barrier_init(&barrier, NULL, bc->threads + 1);
+    atomic_int failed = 0;
+
+    for (int i = 0; i < bc->threads; ++i) {
+        threads[i] = (bench_thread_t){
+            .bc = bc,
+            .barrier = &barrier,
+            .failed = &failed,
+            .tid = i,
+            .cpu = i % nprocs,
+            .samples = storage + (size_t)i * samples,
+        };
+        if (pthread_create(&ids[i], NULL, bench_thread, &threads[i]) != 0) {
+            // Созданные треды уже ждут у барьера на всех участников
+            perror("pthread_create");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    pthread_barrier_wait(&barrier);
+    uint64_t wall_ns = 0;
+    if (!atomic_load(&failed)) {
+        pthread_barrier_wait(&barrier); // Прогрев закончен
+        uint64_t start = bench_now_ns();
+        pthread_barrier_wait(&barrier);
+        wall_ns = bench_now_ns() - start;
+    }
+    for (int i = 0; i < bc->threads; ++i) {
+        pthread_join(ids[i], NULL);
+    }
+    pthread_barrier_destroy(&barrier);
+
+    int ret = atomic_load(&failed) ? -1 : 0;
+    if (ret == 0) {
+        report(bc, threads, wall_ns);
+    } else {
+        fprintf(stderr, "%-28s %2d thr  failed to set up\n", bc->name, bc->threads);
+    }
+    free(storage);
+    free(ids);
+    free(threads);
+    return ret;
+}
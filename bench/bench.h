@@ -0,0 +1,75 @@
+#ifndef BENCH_H
+#define BENCH_H
+
+#include <stdint.h>
+#include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+// Микробенчмарки горячих путей сервера. Тело бенчмарка выполняет
+// пачку операций, харнесс замеряет каждую пачку счетчиком тактов и
+// считает по замерам перцентили стоимости одной операции. Случай с
+// threads > 1 запускает тело одновременно в нескольких тредах,
+// закрепленных за разными CPU (конкуренция за пулы).
+//
+// Результат - по строке JSON на случай в stdout (для
+// bench/compare.sh), сводка для человека - в stderr
+
+// Тело бенчмарка: iters операций в треде tid (от 0)
+typedef void (*bench_fn)(void *ctx, int tid, uint64_t iters);
+
+// Подготовка и освобождение состояния треда до и после замеров; 0 - успех
+typedef int (*bench_thread_fn)(void *ctx, int tid);
+
+typedef struct {
+    const char *name;
+    bench_fn run;
+    bench_thread_fn thread_init; // NULL - не нужна
+    bench_thread_fn thread_done; // NULL - не нужна
+    void *ctx;
+    uint64_t batch;              // Операций в одном замере
+    int threads;
+    uint64_t bytes;              // Байт входа на операцию - для GB/s в сводке, 0 - нет
+} bench_case_t;
+
+// Разбор общих опций (-f фильтр, -s замеров, -t тредов, -l список)
+// и калибровка счетчика тактов
+void bench_init(int argc, char **argv);
+
+// Случай проходит фильтр -f (подстрока имени)
+int bench_enabled(const char *name);
+
+// Наибольшее число тредов для случаев с конкуренцией (-t)
+int bench_max_threads(void);
+
+// Прогрев, замеры и строка результата. -1 - тред не подготовился
+int bench_run(const bench_case_t *bc);
+
+// Строка JSON с окружением прогона (CPU, частота TSC, сканер)
+void bench_report_env(const char *scanner);
+
+// Значение не выбрасывается оптимизатором
+#define BENCH_KEEP(value) __asm__ volatile("" : : "r"(value) : "memory")
+
+static inline uint64_t bench_cycles(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    // lfence: rdtsc не выполняется раньше предыдущих инструкций
+    _mm_lfence();
+    uint64_t t = __rdtsc();
+    _mm_lfence();
+    return t;
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+#endif
+}
+
+static inline uint64_t bench_now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+#endif // BENCH_H
@@ -0,0 +1,95 @@
+#!/bin/bash
+
+# Сравнение результатов бенчмарков (строки JSON bench/micro и bench/loadgen)
+# с базовыми. Код выхода 1, если хотя бы одна метрика хуже базовой больше
+# чем на порог - для проверки перед слиянием.
+#
+#   bench/compare.sh baseline.jsonl current.jsonl [threshold_percent]
+#
+# Сравниваются: micro - p50_ns (медиана устойчивее среднего к шуму),
+# loadgen - rps и p99_us. Случаи, которых нет в одном из файлов, пропускаются
+
+set -e
+
+if [ $# -lt 2 ]; then
+    echo "Usage: $0 baseline.jsonl current.jsonl [threshold_percent]" >&2
+    exit 2
+fi
+
+BASELINE="$1"
+CURRENT="$2"
+THRESHOLD="${3:-${BENCH_THRESHOLD:-10}}"
+
+for f in "$BASELINE" "$CURRENT"; do
+    if [ ! -r "$f" ]; then
+        echo "Cannot read $f" >&2
+        exit 2
+    fi
+done
+
+awk -v threshold="$THRESHOLD" '
+function field(line, key,    re, v) {
+    re = "\"" key "\":(\"[^\"]*\"|[^,}]*)"
+    if (!match(line, re)) return ""
+    v = substr(line, RSTART + length(key) + 3, RLENGTH - length(key) - 3)
+    gsub(/"/, "", v)
+    return v
+}
+# Ключ случая: набор, имя и число тредов (у loadgen - еще режим и соединения)
+function case_key(line,    suite) {
+    suite = field(line, "suite")
+    if (suite == "loadgen") {
+        return suite "/" field(line, "bench") "/" field(line, "mode") "/t" field(line, "threads") \
+               "/c" field(line, "connections") "/P" field(line, "pipeline")
+    }
+    return suite "/" field(line, "bench") "/t" field(line, "threads")
+}
+# Метрики, по которым сравниваются: "+" - больше лучше, "-" - меньше лучше
+function metrics(line) {
+    return field(line, "suite") == "loadgen" ? "rps:+ p99_us:-" : "p50_ns:-"
+}
+FNR == 1 { file++ }
+!/^\{/ { next }
+{
+    if (field($0, "bench") == "env") next
+    key = case_key($0)
+    n = split(metrics($0), list, " ")
+    for (i = 1; i <= n; ++i) {
+        split(list[i], m, ":")
+        value = field($0, m[1])
+        if (value == "") continue
+        if (file == 1) {
+            base[key SUBSEP m[1]] = value
+        } else {
+            order[++count] = key SUBSEP m[1]
+            current[key SUBSEP m[1]] = value
+            better[key SUBSEP m[1]] = m[2]
+        }
+    }
+}
+END {
+    regressions = 0
+    printf "%-52s %-8s %14s %14s %9s\n", "case", "metric", "baseline", "current", "change"
+    for (i = 1; i <= count; ++i) {
+        k = order[i]
+        if (!(k in base)) continue
+        split(k, parts, SUBSEP)
+        b = base[k] + 0
+        c = current[k] + 0
+        change = b != 0 ? (c - b) * 100.0 / b : 0
+        # Ухудшение: рост метрики "меньше лучше" или падение "больше лучше"
+        worse = better[k] == "-" ? change : -change
+        mark = ""
+        if (worse > threshold) {
+            mark = "  REGRESSION"
+            regressions++
+        }
+        printf "%-52s %-8s %14.2f %14.2f %+8.1f%%%s\n", parts[1], parts[2], b, c, change, mark
+    }
+    if (regressions > 0) {
+        printf "%d regression(s) over %s%%\n", regressions, threshold
+        exit 1
+    }
+    printf "No regressions over %s%%\n", threshold
+}
+' "$BASELINE" "$CURRENT"
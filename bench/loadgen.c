@@ -0,0 +1,801 @@
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/timerfd.h>
+
+// Генератор нагрузки HTTP/1.1 на epoll, без внешних зависимостей.
+//
+// Закрытый цикл (-R 0): каждое соединение держит в полете pipeline
+// запросов и отправляет следующий, как только пришел ответ.
+// Открытый цикл (-R N): запросы идут по расписанию N в секунду на все
+// соединения, независимо от ответов. Латентность считается от
+// запланированного момента отправки, а не от фактического: если сервер
+// затормозил и соединение не может отправить запрос (pipeline заполнен),
+// ожидание входит в латентность (поправка на coordinated omission).
+// Латентность от фактической отправки выводится отдельно (raw_*).
+//
+// Итог - строка JSON в stdout (для bench/compare.sh), сводка - в stderr
+
+#define LG_MAX_PATHS 16
+#define LG_MAX_HEADERS 8
+#define LG_MAX_PIPELINE 256
+#define LG_REQUEST_MAX 2048
+#define LG_READ_BUF 65536
+#define LG_EVENTS 256
+
+// Гистограмма с логарифмическими группами по 64 линейных бакета
+// (погрешность значения до 1/64), в наносекундах
+#define HIST_SUB_BITS 6
+#define HIST_SUB (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS ((64 - HIST_SUB_BITS) * HIST_SUB + 2 * HIST_SUB)
+
+typedef struct {
+    uint64_t counts[HIST_BUCKETS];
+    uint64_t total;
+    uint64_t sum;
+    uint64_t max;
+} histogram_t;
+
+typedef struct {
+    int fd;
+    int index;                   // В conns треда
+    int connected;
+    int want_write;              // В epoll взведен EPOLLOUT
+    int close_after;             // Ответ с Connection: close - переподключиться после него
+    int ready;                   // В списке ready треда
+
+    // Запросы в полете (FIFO): запланированное и фактическое время отправки
+    uint64_t intended[LG_MAX_PIPELINE];
+    uint64_t sent[LG_MAX_PIPELINE];
+    int head;
+    int inflight;
+
+    // Открытый цикл: запросы, чей срок уже наступил, но не отправленные
+    uint64_t backlog;
+    uint64_t next_intended;      // Запланированное время старейшего из них
+    uint64_t interval_ns;
+
+    int path;                    // Следующий путь (по кругу)
+
+    char *out;                   // На pipeline самых длинных запросов
+    size_t out_len;
+    size_t out_off;
+
+    char in[LG_READ_BUF];
+    size_t in_len;
+    uint64_t body_left;          // Недочитанное тело текущего ответа
+    int in_body;
+    int status;
+} lg_conn_t;
+
+typedef struct {
+    int id;
+    int connections;
+    double rate;                 // Запросов в секунду на тред, 0 - закрытый цикл
+    lg_conn_t *conns;
+    lg_conn_t **ready;           // Могут отправить запросы: освободилось место или наступил срок
+    int ready_count;
+    int epoll_fd;
+    int timer_fd;
+    uint64_t start_ns;
+    uint64_t measure_ns;         // Начало окна замера (после прогрева)
+    uint64_t end_ns;
+
+    // Открытый цикл: расписание треда, запрос k - в start + k * interval
+    uint64_t schedule_next;
+    uint64_t schedule_interval;
+    uint64_t schedule_seq;
+
+    histogram_t corrected;
+    histogram_t raw;
+    uint64_t responses;
+    uint64_t status_errors;
+    uint64_t socket_errors;
+    uint64_t reconnects;
+    uint64_t unfinished;
+    pthread_t thread;
+} lg_thread_t;
+
+static struct {
+    struct sockaddr_storage addr;
+    socklen_t addr_len;
+    const char *host;
+    const char *port;
+    int connections;
+    int threads;
+    int pipeline;
+    double rate;
+    double duration;
+    double warmup;
+    const char *name;
+    char requests[LG_MAX_PATHS][LG_REQUEST_MAX];
+    size_t request_len[LG_MAX_PATHS];
+    size_t request_max;
+    int paths;
+} opts;
+
+static inline uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static int hist_bucket(uint64_t v) {
+    if (v < 2 * HIST_SUB) {
+        return (int)v;
+    }
+    int shift = 63 - __builtin_clzll(v) - HIST_SUB_BITS; // v >> shift в [64, 128)
+    return (shift << HIST_SUB_BITS) + (int)(v >> shift);
+}
+
+// Середина бакета
+static uint64_t hist_value(int bucket) {
+    if (bucket < 2 * HIST_SUB) {
+        return (uint64_t)bucket;
+    }
+    int shift = (bucket >> HIST_SUB_BITS) - 1;
+    uint64_t base = (uint64_t)(bucket - (shift << HIST_SUB_BITS)) << shift;
+    return base + ((1ull << shift) >> 1);
+}
+
+static void hist_record(histogram_t *h, uint64_t v) {
+    h->counts[hist_bucket(v)]++;
+    h->total++;
+    h->sum += v;
+    if (v > h->max) h->max = v;
+}
+
+static void hist_merge(histogram_t *to, const histogram_t *from) {
+    for (int i = 0; i < HIST_BUCKETS; ++i) {
+        to->counts[i] += from->counts[i];
+    }
+    to->total += from->total;
+    to->sum += from->sum;
+    if (from->max > to->max) to->max = from->max;
+}
+
+static double hist_percentile_us(const histogram_t *h, double p) {
+    if (h->total == 0) {
+        return 0.0;
+    }
+    uint64_t rank = (uint64_t)(p * (double)h->total + 0.5);
+    if (rank < 1) rank = 1;
+    uint64_t seen = 0;
+    for (int i = 0; i < HIST_BUCKETS; ++i) {
+        seen += h->counts[i];
+        if (seen >= rank) {
+            uint64_t v = hist_value(i);
+            return (double)(v < h->max ? v : h->max) / 1000.0;
+        }
+    }
+    return (double)h->max / 1000.0;
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr,
+            "Usage: %s [options]\n"
+            "  -a, --host HOST        server address (default 127.0.0.1)\n"
+            "  -p, --port PORT        server port (default 8080)\n"
+            "  -c, --connections N    connections over all threads (default 64)\n"
+            "  -t, --threads N        threads (default 1)\n"
+            "  -P, --pipeline N       requests in flight per connection (default 1, max %d)\n"
+            "  -R, --rate N           open loop: requests per second over all connections;\n"
+            "                         0 - closed loop (default)\n"
+            "  -d, --duration SEC     measured time (default 10)\n"
+            "  -w, --warmup SEC       time before measuring (default 1)\n"
+            "  -u, --path PATH        request path, repeatable, round robin (default /health)\n"
+            "  -H, --header 'K: V'    extra request header, repeatable\n"
+            "  -n, --name NAME        result name for bench/compare.sh (default loadgen)\n",
+            prog, LG_MAX_PIPELINE);
+}
+
+static int build_requests(const char **paths, int path_count,
+                          const char **headers, int header_count) {
+    for (int i = 0; i < path_count; ++i) {
+        char *req = opts.requests[i];
+        int len = snprintf(req, LG_REQUEST_MAX, "GET %s HTTP/1.1\r\nHost: %s:%s\r\n",
+                           paths[i], opts.host, opts.port);
+        for (int h = 0; h < header_count && len < LG_REQUEST_MAX; ++h) {
+            len += snprintf(req + len, LG_REQUEST_MAX - len, "%s\r\n", headers[h]);
+        }
+        if (len < LG_REQUEST_MAX) {
+            len += snprintf(req + len, LG_REQUEST_MAX - len, "\r\n");
+        }
+        if (len >= LG_REQUEST_MAX) {
+            fprintf(stderr, "Request for %s is too long\n", paths[i]);
+            return -1;
+        }
+        opts.request_len[i] = (size_t)len;
+        if ((size_t)len > opts.request_max) opts.request_max = (size_t)len;
+    }
+    opts.paths = path_count;
+    return 0;
+}
+
+static int parse_options(int argc, char **argv) {
+    static const struct option long_options[] = {
+        { "host", required_argument, NULL, 'a' },
+        { "port", required_argument, NULL, 'p' },
+        { "connections", required_argument, NULL, 'c' },
+        { "threads", required_argument, NULL, 't' },
+        { "pipeline", required_argument, NULL, 'P' },
+        { "rate", required_argument, NULL, 'R' },
+        { "duration", required_argument, NULL, 'd' },
+        { "warmup", required_argument, NULL, 'w' },
+        { "path", required_argument, NULL, 'u' },
+        { "header", required_argument, NULL, 'H' },
+        { "name", required_argument, NULL, 'n' },
+        { "help", no_argument, NULL, 'h' },
+        { NULL, 0, NULL, 0 },
+    };
+    const char *paths[LG_MAX_PATHS];
+    const char *headers[LG_MAX_HEADERS];
+    int path_count = 0;
+    int header_count = 0;
+
+    opts.host = "127.0.0.1";
+    opts.port = "8080";
+    opts.connections = 64;
+    opts.threads = 1;
+    opts.pipeline = 1;
+    opts.duration = 10.0;
+    opts.warmup = 1.0;
+    opts.name = "loadgen";
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, "a:p:c:t:P:R:d:w:u:H:n:h", long_options, NULL)) != -1) {
+        switch (opt) {
+        case 'a': opts.host = optarg; break;
+        case 'p': opts.port = optarg; break;
+        case 'c': opts.connections = atoi(optarg); break;
+        case 't': opts.threads = atoi(optarg); break;
+        case 'P': opts.pipeline = atoi(optarg); break;
+        case 'R': opts.rate = atof(optarg); break;
+        case 'd': opts.duration = atof(optarg); break;
+        case 'w': opts.warmup = atof(optarg); break;
+        case 'n': opts.name = optarg; break;
+        case 'u':
+            if (path_count == LG_MAX_PATHS) {
+                fprintf(stderr, "At most %d paths\n", LG_MAX_PATHS);
+                return -1;
+            }
+            paths[path_count++] = optarg;
+            break;
+        case 'H':
+            if (header_count == LG_MAX_HEADERS) {
+                fprintf(stderr, "At most %d headers\n", LG_MAX_HEADERS);
+                return -1;
+            }
+            headers[header_count++] = optarg;
+            break;
+        default:
+            usage(argv[0]);
+            return -1;
+        }
+    }
+    if (opts.threads < 1 || opts.connections < opts.threads || opts.pipeline < 1 ||
+        opts.pipeline > LG_MAX_PIPELINE || opts.rate < 0 || opts.duration <= 0 ||
+        opts.warmup < 0) {
+        fprintf(stderr, "Invalid options: need threads >= 1, connections >= threads, "
+                        "1 <= pipeline <= %d, rate >= 0, duration > 0\n", LG_MAX_PIPELINE);
+        return -1;
+    }
+    if (path_count == 0) {
+        paths[path_count++] = "/health";
+    }
+
+    struct addrinfo hints = { .ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM };
+    struct addrinfo *res;
+    int err = getaddrinfo(opts.host, opts.port, &hints, &res);
+    if (err != 0) {
+        fprintf(stderr, "%s:%s: %s\n", opts.host, opts.port, gai_strerror(err));
+        return -1;
+    }
+    memcpy(&opts.addr, res->ai_addr, res->ai_addrlen);
+    opts.addr_len = res->ai_addrlen;
+    freeaddrinfo(res);
+
+    return build_requests(paths, path_count, headers, header_count);
+}
+
+#define LG_TIMER_EVENT UINT64_MAX
+
+// В событии - и индекс соединения, и fd: события разорванного сокета
+// из той же пачки epoll_wait не достаются новому
+static void conn_watch(lg_thread_t *t, lg_conn_t *c, int op) {
+    struct epoll_event ev = {
+        .events = EPOLLIN | (c->want_write ? EPOLLOUT : 0),
+        .data.u64 = ((uint64_t)c->index << 32) | (uint32_t)c->fd,
+    };
+    epoll_ctl(t->epoll_fd, op, c->fd, &ev);
+}
+
+static void conn_mark_ready(lg_thread_t *t, lg_conn_t *c) {
+    if (!c->ready) {
+        c->ready = 1;
+        t->ready[t->ready_count++] = c;
+    }
+}
+
+static int conn_open(lg_thread_t *t, lg_conn_t *c) {
+    c->fd = socket(opts.addr.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (c->fd == -1) {
+        perror("socket");
+        return -1;
+    }
+    int one = 1;
+    setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    if (connect(c->fd, (struct sockaddr *)&opts.addr, opts.addr_len) != 0 &&
+        errno != EINPROGRESS) {
+        perror("connect");
+        close(c->fd);
+        c->fd = -1;
+        return -1;
+    }
+    c->connected = 0;
+    c->want_write = 1; // Готовность на запись - соединение установлено
+    c->close_after = 0;
+    c->in_len = 0;
+    c->in_body = 0;
+    c->out_len = c->out_off = 0;
+    conn_watch(t, c, EPOLL_CTL_ADD);
+    return 0;
+}
+
+// Соединение разорвано: ответы на запросы в полете потеряны. В открытом
+// цикле запросы отправятся заново, но со своим прежним сроком
+static void conn_reset(lg_thread_t *t, lg_conn_t *c, int error) {
+    if (error) {
+        t->socket_errors += c->inflight;
+    }
+    if (opts.rate > 0) {
+        // Неотвеченные запросы будут отправлены заново, со своим сроком
+        for (int i = c->inflight - 1; i >= 0; --i) {
+            c->backlog++;
+            c->next_intended = c->intended[(c->head + i) % LG_MAX_PIPELINE];
+        }
+    }
+    c->inflight = 0;
+    c->head = 0;
+    epoll_ctl(t->epoll_fd, EPOLL_CTL_DEL, c->fd, NULL);
+    close(c->fd);
+    c->fd = -1;
+    t->reconnects++;
+    conn_open(t, c);
+}
+
+static void conn_flush(lg_thread_t *t, lg_conn_t *c) {
+    while (c->out_off < c->out_len) {
+        ssize_t n = send(c->fd, c->out + c->out_off, c->out_len - c->out_off, MSG_NOSIGNAL);
+        if (n > 0) {
+            c->out_off += (size_t)n;
+            continue;
+        }
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            if (!c->want_write) {
+                c->want_write = 1;
+                conn_watch(t, c, EPOLL_CTL_MOD);
+            }
+            return;
+        }
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        conn_reset(t, c, 1);
+        return;
+    }
+    c->out_len = c->out_off = 0;
+    if (c->want_write) {
+        c->want_write = 0;
+        conn_watch(t, c, EPOLL_CTL_MOD);
+    }
+}
+
+static void conn_queue(lg_conn_t *c, uint64_t intended, uint64_t now) {
+    const char *req = opts.requests[c->path];
+    size_t len = opts.request_len[c->path];
+    c->path = (c->path + 1) % opts.paths;
+    memcpy(c->out + c->out_len, req, len);
+    c->out_len += len;
+
+    int slot = (c->head + c->inflight) % LG_MAX_PIPELINE;
+    c->intended[slot] = intended;
+    c->sent[slot] = now;
+    c->inflight++;
+}
+
+// Отправить все, что разрешают pipeline и расписание
+static void conn_fill(lg_thread_t *t, lg_conn_t *c, uint64_t now) {
+    if (!c->connected || c->close_after) {
+        return;
+    }
+    int queued = 0;
+    if (opts.rate > 0) {
+        while (c->backlog > 0 && c->inflight < opts.pipeline) {
+            conn_queue(c, c->next_intended, now);
+            c->next_intended += c->interval_ns;
+            c->backlog--;
+            queued = 1;
+        }
+    } else {
+        while (c->inflight < opts.pipeline) {
+            conn_queue(c, now, now);
+            queued = 1;
+        }
+    }
+    if (queued && !c->want_write) {
+        conn_flush(t, c);
+    }
+}
+
+static void response_done(lg_thread_t *t, lg_conn_t *c, uint64_t now) {
+    if (c->inflight == 0) {
+        t->socket_errors++; // Ответ без запроса
+        return;
+    }
+    uint64_t intended = c->intended[c->head];
+    uint64_t sent = c->sent[c->head];
+    c->head = (c->head + 1) % LG_MAX_PIPELINE;
+    c->inflight--;
+    conn_mark_ready(t, c);
+
+    // Окно замера - по запланированному времени запроса
+    if (intended >= t->measure_ns && now <= t->end_ns) {
+        hist_record(&t->corrected, now - intended);
+        hist_record(&t->raw, now - sent);
+        t->responses++;
+        if (c->status < 200 || c->status >= 400) {
+            t->status_errors++;
+        }
+    }
+}
+
+// Разбор ответов в c->in; -1 - ответ не разобрать, соединение сбрасывается
+static int conn_parse(lg_thread_t *t, lg_conn_t *c, uint64_t now) {
+    size_t off = 0;
+    while (off < c->in_len) {
+        if (c->in_body) {
+            size_t avail = c->in_len - off;
+            size_t take = c->body_left < avail ? (size_t)c->body_left : avail;
+            c->body_left -= take;
+            off += take;
+            if (c->body_left == 0) {
+                c->in_body = 0;
+                response_done(t, c, now);
+            }
+            continue;
+        }
+
+        const char *start = c->in + off;
+        const char *end = memmem(start, c->in_len - off, "\r\n\r\n", 4);
+        if (!end) {
+            if (off == 0 && c->in_len == sizeof(c->in)) {
+                return -1; // Заголовки не помещаются в буфер
+            }
+            break;
+        }
+        size_t header_len = (size_t)(end - start) + 4;
+        if (header_len < 12 || memcmp(start, "HTTP/1.", 7) != 0) {
+            return -1;
+        }
+        c->status = atoi(start + 9);
+
+        // Content-Length и Connection: close; chunked сервер не отправляет
+        int have_length = 0;
+        uint64_t length = 0;
+        for (const char *line = memchr(start, '\n', header_len); line && line < end;
+             line = memchr(line, '\n', (size_t)(end - line))) {
+            line++;
+            if (strncasecmp(line, "content-length:", 15) == 0) {
+                length = strtoull(line + 15, NULL, 10);
+                have_length = 1;
+            } else if (strncasecmp(line, "connection:", 11) == 0) {
+                const char *v = line + 11;
+                while (*v == ' ') v++;
+                if (strncasecmp(v, "close", 5) == 0) c->close_after = 1;
+            } else if (strncasecmp(line, "transfer-encoding:", 18) == 0) {
+                return -1;
+            }
+        }
+        // Тела нет у 304 и 1xx/204 независимо от заголовков
+        if (c->status == 304 || c->status == 204 || c->status < 200) {
+            length = 0;
+        } else if (!have_length) {
+            return -1;
+        }
+
+        off += header_len;
+        if (length > 0) {
+            c->in_body = 1;
+            c->body_left = length;
+        } else {
+            response_done(t, c, now);
+        }
+    }
+
+    if (off > 0) {
+        memmove(c->in, c->in + off, c->in_len - off);
+        c->in_len -= off;
+    }
+    return 0;
+}
+
+static void conn_readable(lg_thread_t *t, lg_conn_t *c) {
+    for (;;) {
+        ssize_t n = recv(c->fd, c->in + c->in_len, sizeof(c->in) - c->in_len, 0);
+        if (n > 0) {
+            c->in_len += (size_t)n;
+            if (conn_parse(t, c, now_ns()) != 0) {
+                conn_reset(t, c, 1);
+                return;
+            }
+            if (c->close_after && c->inflight == 0) {
+                conn_reset(t, c, 0);
+                return;
+            }
+            continue;
+        }
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return;
+        }
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        // Сервер закрыл соединение: ошибка, если ответы еще не пришли
+        conn_reset(t, c, 1);
+        return;
+    }
+}
+
+static void conn_writable(lg_thread_t *t, lg_conn_t *c) {
+    if (!c->connected) {
+        int err = 0;
+        socklen_t len = sizeof(err);
+        getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &err, &len);
+        if (err != 0) {
+            t->socket_errors++;
+            conn_reset(t, c, 0);
+            return;
+        }
+        c->connected = 1;
+        conn_mark_ready(t, c);
+    }
+    conn_flush(t, c);
+}
+
+// Открытый цикл: запросы расписания треда, чей срок наступил, по кругу
+// раскладываются по соединениям; взводит timerfd на следующий срок
+static void schedule_due(lg_thread_t *t, uint64_t now) {
+    while (t->schedule_next <= now) {
+        lg_conn_t *c = &t->conns[t->schedule_seq % t->connections];
+        if (c->backlog == 0) {
+            c->next_intended = t->schedule_next;
+        }
+        c->backlog++;
+        conn_mark_ready(t, c);
+        t->schedule_seq++;
+        t->schedule_next = t->start_ns + t->schedule_seq * t->schedule_interval;
+    }
+    struct itimerspec its = {
+        .it_value = {
+            .tv_sec = (time_t)(t->schedule_next / 1000000000ull),
+            .tv_nsec = (long)(t->schedule_next % 1000000000ull),
+        },
+    };
+    timerfd_settime(t->timer_fd, TFD_TIMER_ABSTIME, &its, NULL);
+}
+
+static void *lg_thread(void *arg) {
+    lg_thread_t *t = arg;
+    struct epoll_event events[LG_EVENTS];
+
+    for (int i = 0; i < t->connections; ++i) {
+        lg_conn_t *c = &t->conns[i];
+        c->index = i;
+        // Расписание соединения: каждый connections-й запрос расписания треда
+        c->interval_ns = t->schedule_interval * (uint64_t)t->connections;
+        if (conn_open(t, c) != 0) {
+            t->socket_errors++;
+            return NULL;
+        }
+    }
+    if (t->rate > 0) {
+        struct epoll_event ev = { .events = EPOLLIN, .data.u64 = LG_TIMER_EVENT };
+        epoll_ctl(t->epoll_fd, EPOLL_CTL_ADD, t->timer_fd, &ev);
+        schedule_due(t, now_ns());
+    }
+
+    for (;;) {
+        uint64_t now = now_ns();
+        if (now >= t->end_ns) {
+            break;
+        }
+        int timeout = (int)((t->end_ns - now) / 1000000ull) + 1;
+        int n = epoll_wait(t->epoll_fd, events, LG_EVENTS, timeout);
+        if (n < 0 && errno != EINTR) {
+            perror("epoll_wait");
+            break;
+        }
+        for (int i = 0; i < n; ++i) {
+            uint64_t data = events[i].data.u64;
+            if (data == LG_TIMER_EVENT) {
+                uint64_t expirations;
+                if (read(t->timer_fd, &expirations, sizeof(expirations)) < 0) {
+                    // Таймер уже перевзведен - срабатывание не важно
+                }
+                continue;
+            }
+            lg_conn_t *c = &t->conns[data >> 32];
+            if (c->fd == -1 || c->fd != (int)(uint32_t)data) {
+                continue;
+            }
+            if (events[i].events & (EPOLLOUT | EPOLLERR | EPOLLHUP)) {
+                conn_writable(t, c);
+            }
+            if (c->fd != -1 && c->connected && (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))) {
+                conn_readable(t, c);
+            }
+        }
+
+        now = now_ns();
+        if (t->rate > 0) {
+            schedule_due(t, now);
+        }
+        for (int i = 0; i < t->ready_count; ++i) {
+            lg_conn_t *c = t->ready[i];
+            c->ready = 0;
+            if (c->fd != -1) {
+                conn_fill(t, c, now);
+            }
+        }
+        t->ready_count = 0;
+    }
+
+    // Неотвеченные и просроченные к концу окна запросы - в unfinished
+    for (int i = 0; i < t->connections; ++i) {
+        lg_conn_t *c = &t->conns[i];
+        t->unfinished += (uint64_t)c->inflight + c->backlog;
+        if (c->fd != -1) {
+            close(c->fd);
+        }
+    }
+    return NULL;
+}
+
+int main(int argc, char **argv) {
+    if (parse_options(argc, argv) != 0) {
+        return EXIT_FAILURE;
+    }
+
+    lg_thread_t *threads = calloc(opts.threads, sizeof(*threads));
+    if (!threads) {
+        perror("calloc: threads");
+        return EXIT_FAILURE;
+    }
+    uint64_t start = now_ns() + 10000000ull; // Соединения успевают установиться
+    uint64_t measure = start + (uint64_t)(opts.warmup * 1e9);
+    uint64_t end = measure + (uint64_t)(opts.duration * 1e9);
+
+    for (int i = 0; i < opts.threads; ++i) {
+        lg_thread_t *t = &threads[i];
+        t->id = i;
+        // Соединения и скорость делятся между тредами поровну
+        t->connections = opts.connections / opts.threads +
+                         (i < opts.connections % opts.threads ? 1 : 0);
+        t->rate = opts.rate / opts.threads;
+        t->conns = calloc(t->connections, sizeof(lg_conn_t));
+        t->ready = calloc(t->connections, sizeof(lg_conn_t *));
+        t->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+        t->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+        if (!t->conns || !t->ready || t->epoll_fd == -1 || t->timer_fd == -1) {
+            perror("loadgen thread setup");
+            return EXIT_FAILURE;
+        }
+        for (int k = 0; k < t->connections; ++k) {
+            t->conns[k].out = malloc(opts.request_max * opts.pipeline);
+            if (!t->conns[k].out) {
+                perror("malloc: request buffers");
+                return EXIT_FAILURE;
+            }
+        }
+        t->start_ns = start;
+        t->measure_ns = measure;
+        t->end_ns = end;
+        if (t->rate > 0) {
+            t->schedule_interval = (uint64_t)(1e9 / t->rate);
+            if (t->schedule_interval == 0) t->schedule_interval = 1;
+            // Треды сдвинуты по фазе, чтобы запросы не шли залпами
+            t->schedule_next = start + t->schedule_interval * i / opts.threads;
+            t->start_ns = t->schedule_next;
+        }
+        if (pthread_create(&t->thread, NULL, lg_thread, t) != 0) {
+            perror("pthread_create");
+            return EXIT_FAILURE;
+        }
+    }
+
+    histogram_t *corrected = calloc(1, sizeof(histogram_t));
+    histogram_t *raw = calloc(1, sizeof(histogram_t));
+    if (!corrected || !raw) {
+        perror("calloc: histograms");
+        return EXIT_FAILURE;
+    }
+    uint64_t responses = 0, status_errors = 0, socket_errors = 0, reconnects = 0, unfinished = 0;
+    for (int i = 0; i < opts.threads; ++i) {
+        lg_thread_t *t = &threads[i];
+        pthread_join(t->thread, NULL);
+        hist_merge(corrected, &t->corrected);
+        hist_merge(raw, &t->raw);
+        responses += t->responses;
+        status_errors += t->status_errors;
+        socket_errors += t->socket_errors;
+        reconnects += t->reconnects;
+        unfinished += t->unfinished;
+        close(t->epoll_fd);
+        close(t->timer_fd);
+        for (int k = 0; k < t->connections; ++k) {
+            free(t->conns[k].out);
+        }
+        free(t->conns);
+        free(t->ready);
+    }
+    free(threads);
+
+    double rps = (double)responses / opts.duration;
+    double mean_us = corrected->total ? (double)corrected->sum / corrected->total / 1000.0 : 0.0;
+    const char *mode = opts.rate > 0 ? "open" : "closed";
+
+    printf("{\"suite\":\"loadgen\",\"bench\":\"%s\",\"mode\":\"%s\",\"threads\":%d,"
+           "\"connections\":%d,\"pipeline\":%d,\"rate\":%.0f,\"duration_s\":%.1f,"
+           "\"requests\":%llu,\"rps\":%.1f,\"status_errors\":%llu,\"socket_errors\":%llu,"
+           "\"reconnects\":%llu,\"unfinished\":%llu,\"mean_us\":%.1f,\"p50_us\":%.1f,"
+           "\"p90_us\":%.1f,\"p99_us\":%.1f,\"p999_us\":%.1f,\"max_us\":%.1f,"
+           "\"raw_p50_us\":%.1f,\"raw_p99_us\":%.1f,\"raw_p999_us\":%.1f}\n",
+           opts.name, mode, opts.threads, opts.connections, opts.pipeline, opts.rate,
+           opts.duration, (unsigned long long)responses, rps,
+           (unsigned long long)status_errors, (unsigned long long)socket_errors,
+           (unsigned long long)reconnects, (unsigned long long)unfinished, mean_us,
+           hist_percentile_us(corrected, 0.50), hist_percentile_us(corrected, 0.90),
+           hist_percentile_us(corrected, 0.99), hist_percentile_us(corrected, 0.999),
+           (double)corrected->max / 1000.0,
+           hist_percentile_us(raw, 0.50), hist_percentile_us(raw, 0.99),
+           hist_percentile_us(raw, 0.999));
+
+    fprintf(stderr, "%s: %s loop, %d threads, %d connections, pipeline %d",
+            opts.name, mode, opts.threads, opts.connections, opts.pipeline);
+    if (opts.rate > 0) {
+        fprintf(stderr, ", target %.0f req/s", opts.rate);
+    }
+    fprintf(stderr, "\n  %llu responses in %.1f s: %.1f req/s; errors: %llu status, %llu socket; "
+                    "%llu reconnects, %llu unfinished\n",
+            (unsigned long long)responses, opts.duration, rps,
+            (unsigned long long)status_errors, (unsigned long long)socket_errors,
+            (unsigned long long)reconnects, (unsigned long long)unfinished);
+    fprintf(stderr, "  latency%s: mean %.1f us, p50 %.1f, p90 %.1f, p99 %.1f, p99.9 %.1f, max %.1f\n",
+            opts.rate > 0 ? " (from intended send time)" : "", mean_us,
+            hist_percentile_us(corrected, 0.50), hist_percentile_us(corrected, 0.90),
+            hist_percentile_us(corrected, 0.99), hist_percentile_us(corrected, 0.999),
+            (double)corrected->max / 1000.0);
+    if (opts.rate > 0) {
+        fprintf(stderr, "  latency (from actual send time): p50 %.1f us, p99 %.1f, p99.9 %.1f\n",
+                hist_percentile_us(raw, 0.50), hist_percentile_us(raw, 0.99),
+                hist_percentile_us(raw, 0.999));
+    }
+    free(corrected);
+    free(raw);
+    return socket_errors > 0 ? 2 : EXIT_SUCCESS;
+}
@@ -0,0 +1,571 @@
+#include "bench.h"
+#include "config.h"
+#include "connection.h"
+#include "http_handler.h"
+#include "lockfree_pool.h"
+#include "loop_clock.h"
+#include "metrics.h"
+#include "routes.h"
+#include "simd_utils.h"
+#include "timer.h"
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Микробенчмарки горячих путей: сканер заголовков, колесо таймеров,
+// поиск роута, пул соединений (в том числе под конкуренцией тредов) и
+// подготовка ответа. Код сервера - те же объектные файлы, что и в
+// бинаре, без main.o
+
+// Воркерам нужен флаг работы процесса из main.c
+volatile sig_atomic_t g_running = 1;
+
+#define BENCH_POOL_CONNECTIONS 16384 // На слот пула соединений
+#define BENCH_IO_BUFFERS 4
+#define TIMER_POPULATION 16384       // Взведенных таймеров у воркера под нагрузкой
+#define TIMER_TICK_TIMERS 16         // Новых и истекших таймеров на тик
+#define TIMER_TICK_TIMEOUT_MS 1000
+#define HANDOFF_RING_SIZE 256        // Степень двойки
+
+// Запросы для сканера и обработчика
+
+static const char small_request[] =
+    "GET /health HTTP/1.1\r\n"
+    "Host: localhost:8080\r\n"
+    "User-Agent: curl/8.5.0\r\n"
+    "Accept: */*\r\n"
+    "\r\n";
+
+static const char browser_request[] =
+    "GET /games?page=2&sort=popular HTTP/1.1\r\n"
+    "Host: bff.example.com\r\n"
+    "Connection: keep-alive\r\n"
+    "sec-ch-ua: \"Chromium\";v=\"124\", \"Google Chrome\";v=\"124\", \"Not-A.Brand\";v=\"99\"\r\n"
+    "sec-ch-ua-mobile: ?0\r\n"
+    "sec-ch-ua-platform: \"Linux\"\r\n"
+    "Upgrade-Insecure-Requests: 1\r\n"
+    "User-Agent: Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36 (KHTML, like Gecko) "
+    "Chrome/124.0.0.0 Safari/537.36\r\n"
+    "Accept: application/json,text/html;q=0.9,*/*;q=0.8\r\n"
+    "Sec-Fetch-Site: same-origin\r\n"
+    "Sec-Fetch-Mode: cors\r\n"
+    "Sec-Fetch-Dest: empty\r\n"
+    "Referer: https://bff.example.com/lobby\r\n"
+    "Accept-Encoding: gzip, deflate, br, zstd\r\n"
+    "Accept-Language: en-US,en;q=0.9,ru;q=0.8\r\n"
+    "\r\n";
+
+// Запрос браузера с длинным Cookie, около 3 КБ
+static char large_request[3200];
+static size_t large_request_len;
+
+static void build_large_request(void) {
+    size_t headers = sizeof(browser_request) - 3; // Без завершающей пустой строки
+    memcpy(large_request, browser_request, headers);
+    size_t len = headers;
+    len += sprintf(large_request + len, "Cookie: ");
+    for (int i = 0; len < sizeof(large_request) - 64; ++i) {
+        len += sprintf(large_request + len, "%ssess_%02d=%016llx%016llx",
+                       i ? "; " : "", i, 0x9e3779b97f4a7c15ull * (i + 1),
+                       0xc2b2ae3d27d4eb4full * (i + 7));
+    }
+    len += sprintf(large_request + len, "\r\n\r\n");
+    large_request_len = len;
+}
+
+static inline uint64_t xorshift64(uint64_t *state) {
+    uint64_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    return *state = x;
+}
+
+// Сканер конца заголовков
+
+typedef struct {
+    const char *data;
+    size_t len;
+    size_t chunk;                // Размер куска при чтении по частям, 0 - запрос целиком
+} scan_ctx_t;
+
+static void scan_run(void *arg, int tid, uint64_t iters) {
+    (void)tid;
+    const scan_ctx_t *ctx = arg;
+    http_scan_t scan;
+    for (uint64_t i = 0; i < iters; ++i) {
+        http_scan_reset(&scan);
+        uint32_t end;
+        if (ctx->chunk == 0) {
+            end = http_scan_request(&scan, ctx->data, ctx->len);
+        } else {
+            // Как http_parse_request: тот же запрос, доступных байт все больше
+            size_t available = 0;
+            do {
+                available += ctx->chunk;
+                if (available > ctx->len) available = ctx->len;
+                end = http_scan_request(&scan, ctx->data, available);
+            } while (end == 0 && available < ctx->len);
+        }
+        BENCH_KEEP(end);
+    }
+}
+
+static void bench_scanner(void) {
+    static scan_ctx_t small = { small_request, sizeof(small_request) - 1, 0 };
+    static scan_ctx_t browser = { browser_request, sizeof(browser_request) - 1, 0 };
+    static scan_ctx_t large = { large_request, 0, 0 };
+    static scan_ctx_t chunked = { large_request, 0, 512 };
+    large.len = chunked.len = large_request_len;
+
+    const bench_case_t cases[] = {
+        { "scan_small", scan_run, NULL, NULL, &small, 1024, 1, sizeof(small_request) - 1 },
+        { "scan_browser", scan_run, NULL, NULL, &browser, 512, 1, sizeof(browser_request) - 1 },
+        { "scan_large", scan_run, NULL, NULL, &large, 128, 1, large_request_len },
+        { "scan_large_chunked", scan_run, NULL, NULL, &chunked, 128, 1, large_request_len },
+    };
+    for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); ++i) {
+        if (bench_enabled(cases[i].name)) bench_run(&cases[i]);
+    }
+}
+
+// Колесо таймеров воркера
+
+typedef struct {
+    timer_heap_t th;
+    connection_t *conns;
+    int count;
+    int cursor;
+    uint64_t rng;
+} timer_ctx_t;
+
+static int timer_init(void *arg, int tid) {
+    (void)tid;
+    timer_ctx_t *ctx = arg;
+    loop_clock_update();
+    ctx->count = TIMER_POPULATION + TIMER_TICK_TIMERS * (TIMER_TICK_TIMEOUT_MS + 64);
+    ctx->conns = aligned_alloc(CACHE_LINE_SIZE, sizeof(connection_t) * ctx->count);
+    if (!ctx->conns || timer_heap_init(&ctx->th, ctx->count) != 0) {
+        free(ctx->conns);
+        return -1;
+    }
+    memset(ctx->conns, 0, sizeof(connection_t) * ctx->count);
+    for (int i = 0; i < ctx->count; ++i) {
+        // Истекший таймер не закрывает соединение: колбэк воркера пропускается
+        ctx->conns[i].state = STATE_CLOSING;
+        ctx->conns[i].fd = -1;
+    }
+    ctx->rng = 0x2545f4914f6cdd1dull;
+    ctx->cursor = 0;
+    // Keep-alive и чтение: таймауты разброшены по всем уровням колеса
+    for (int i = 0; i < TIMER_POPULATION; ++i) {
+        timer_heap_add(&ctx->th, &ctx->conns[i], 1 + (int)(xorshift64(&ctx->rng) % 60000));
+    }
+    return 0;
+}
+
+static int timer_done(void *arg, int tid) {
+    (void)tid;
+    timer_ctx_t *ctx = arg;
+    timer_heap_destroy(&ctx->th);
+    free(ctx->conns);
+    ctx->conns = NULL;
+    return 0;
+}
+
+// Новое соединение: таймер взводится и снимается (запрос обработан)
+static void timer_add_remove_run(void *arg, int tid, uint64_t iters) {
+    (void)tid;
+    timer_ctx_t *ctx = arg;
+    for (uint64_t i = 0; i < iters; ++i) {
+        connection_t *conn = &ctx->conns[TIMER_POPULATION + (i & 1023)];
+        timer_heap_add(&ctx->th, conn, 1 + (int)(xorshift64(&ctx->rng) % 60000));
+        timer_heap_remove(&ctx->th, conn);
+    }
+}
+
+// Перевзвод таймера уже взведенного соединения (следующий keep-alive запрос)
+static void timer_rearm_run(void *arg, int tid, uint64_t iters) {
+    (void)tid;
+    timer_ctx_t *ctx = arg;
+    for (uint64_t i = 0; i < iters; ++i) {
+        uint64_t r = xorshift64(&ctx->rng);
+        connection_t *conn = &ctx->conns[r % TIMER_POPULATION];
+        timer_heap_add(&ctx->th, conn, 5000 + (int)((r >> 32) & 4095));
+    }
+}
+
+// Тик в 1 мс: TIMER_TICK_TIMERS новых таймеров и столько же истекших,
+// с каскадами верхних уровней на границах оборота
+static void timer_tick_run(void *arg, int tid, uint64_t iters) {
+    (void)tid;
+    timer_ctx_t *ctx = arg;
+    int ring = ctx->count - TIMER_POPULATION;
+    for (uint64_t i = 0; i < iters; ++i) {
+        for (int k = 0; k < TIMER_TICK_TIMERS; ++k) {
+            connection_t *conn = &ctx->conns[TIMER_POPULATION + ctx->cursor];
+            ctx->cursor = ctx->cursor + 1 < ring ? ctx->cursor + 1 : 0;
+            timer_heap_add(&ctx->th, conn, TIMER_TICK_TIMEOUT_MS);
+        }
+        loop_clock.now_ms++;
+        timer_heap_process_expired(&ctx->th);
+    }
+}
+
+static void bench_timers(void) {
+    static timer_ctx_t add_remove, rearm, tick;
+    const bench_case_t cases[] = {
+        { "timer_add_remove", timer_add_remove_run, timer_init, timer_done, &add_remove, 1024, 1, 0 },
+        { "timer_rearm", timer_rearm_run, timer_init, timer_done, &rearm, 1024, 1, 0 },
+        { "timer_tick", timer_tick_run, timer_init, timer_done, &tick, 64, 1, 0 },
+    };
+    for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); ++i) {
+        if (bench_enabled(cases[i].name)) bench_run(&cases[i]);
+    }
+}
+
+// Таблица роутов
+
+typedef struct {
+    const route_set_t *set;
+    const char *paths[8];
+    size_t lens[8];
+    int count;
+} route_ctx_t;
+
+static void route_lookup_run(void *arg, int tid, uint64_t iters) {
+    (void)tid;
+    const route_ctx_t *ctx = arg;
+    for (uint64_t i = 0; i < iters; ++i) {
+        unsigned k = i % ctx->count;
+        int id = route_set_lookup(ctx->set, ctx->paths[k], ctx->lens[k]);
+        BENCH_KEEP(id);
+    }
+}
+
+static int route_reader_init(void *arg, int tid) {
+    (void)arg;
+    routes_register_worker(tid + 1);
+    return 0;
+}
+
+static int route_reader_done(void *arg, int tid) {
+    (void)arg;
+    (void)tid;
+    routes_unregister_worker();
+    return 0;
+}
+
+// Ссылка пачки на таблицу и ее возврат - RCU-путь каждой пачки ответов
+static void route_hold_put_run(void *arg, int tid, uint64_t iters) {
+    (void)arg;
+    (void)tid;
+    for (uint64_t i = 0; i < iters; ++i) {
+        route_set_t *set = routes_hold();
+        BENCH_KEEP(set);
+        routes_put(set);
+    }
+}
+
+static void bench_routes(void) {
+    static route_ctx_t hit, miss;
+    const route_set_t *set = routes_hold();
+    hit.set = miss.set = set;
+    hit.count = set->count < 8 ? set->count : 8;
+    for (int i = 0; i < hit.count; ++i) {
+        hit.paths[i] = set->routes[i].path;
+        hit.lens[i] = set->routes[i].path_len;
+    }
+    // Промахи: длина как у существующих роутов и длина без роутов
+    static const char *missing[] = { "/gamez", "/healthz", "/favicon.ico", "/api/v1/unknown" };
+    miss.count = 4;
+    for (int i = 0; i < miss.count; ++i) {
+        miss.paths[i] = missing[i];
+        miss.lens[i] = strlen(missing[i]);
+    }
+
+    const bench_case_t cases[] = {
+        { "route_lookup_hit", route_lookup_run, NULL, NULL, &hit, 1024, 1, 0 },
+        { "route_lookup_miss", route_lookup_run, NULL, NULL, &miss, 1024, 1, 0 },
+        { "route_hold_put", route_hold_put_run, route_reader_init, route_reader_done, NULL, 1024, 1, 0 },
+    };
+    for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); ++i) {
+        if (bench_enabled(cases[i].name)) bench_run(&cases[i]);
+    }
+}
+
+// Пул соединений. Воркер берет соединение из своего слота и обычно сам
+// же его возвращает; закрытие чужого соединения (remote release) и
+// общий overflow-пул - пути с настоящей конкуренцией за cache line головы
+
+typedef struct {
+    _Atomic uint32_t head __attribute__((aligned(64))); // Пишет производитель
+    _Atomic uint32_t tail __attribute__((aligned(64))); // Пишет потребитель
+    connection_t *slots[HANDOFF_RING_SIZE];
+} handoff_ring_t;
+
+static lockfree_pool_t overflow_pool;
+static handoff_ring_t *handoff_rings;
+static int handoff_threads;
+
+static int pool_bind_init(void *arg, int tid) {
+    (void)arg;
+    return lockfree_pool_bind_thread(connection_pool_handle(), tid, 0, -1);
+}
+
+static void pool_local_run(void *arg, int tid, uint64_t iters) {
+    (void)arg;
+    (void)tid;
+    for (uint64_t i = 0; i < iters; ++i) {
+        connection_t *conn = connection_get();
+        BENCH_KEEP(conn);
+        connection_release(conn);
+    }
+}
+
+// Треды без привязки к слоту: все берут из общего overflow-стека
+static void pool_overflow_run(void *arg, int tid, uint64_t iters) {
+    (void)arg;
+    (void)tid;
+    for (uint64_t i = 0; i < iters; ++i) {
+        connection_t *conn = lockfree_pool_get(&overflow_pool);
+        BENCH_KEEP(conn);
+        lockfree_pool_release(&overflow_pool, conn);
+    }
+}
+
+static int handoff_push(handoff_ring_t *ring, connection_t *conn) {
+    uint32_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    if (head - atomic_load_explicit(&ring->tail, memory_order_acquire) == HANDOFF_RING_SIZE) {
+        return -1;
+    }
+    ring->slots[head & (HANDOFF_RING_SIZE - 1)] = conn;
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+    return 0;
+}
+
+static connection_t *handoff_pop(handoff_ring_t *ring) {
+    uint32_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    if (tail == atomic_load_explicit(&ring->head, memory_order_acquire)) {
+        return NULL;
+    }
+    connection_t *conn = ring->slots[tail & (HANDOFF_RING_SIZE - 1)];
+    atomic_store_explicit(&ring->tail, tail + 1, memory_order_release);
+    return conn;
+}
+
+// Соединение уходит соседнему треду, тот возвращает его в пул владельца
+static void pool_remote_run(void *arg, int tid, uint64_t iters) {
+    (void)arg;
+    handoff_ring_t *out = &handoff_rings[tid];
+    handoff_ring_t *in = &handoff_rings[(tid + handoff_threads - 1) % handoff_threads];
+    for (uint64_t i = 0; i < iters; ++i) {
+        connection_t *conn = connection_get();
+        if (!conn || handoff_push(out, conn) != 0) {
+            connection_release(conn);
+        }
+        connection_t *remote = handoff_pop(in);
+        if (remote) {
+            connection_release(remote);
+        }
+    }
+}
+
+static int pool_remote_done(void *arg, int tid) {
+    (void)arg;
+    handoff_ring_t *in = &handoff_rings[(tid + handoff_threads - 1) % handoff_threads];
+    connection_t *conn;
+    while ((conn = handoff_pop(in)) != NULL) {
+        connection_release(conn);
+    }
+    return 0;
+}
+
+static void bench_pools(void) {
+    int max_threads = bench_max_threads();
+    if (lockfree_pool_init(&overflow_pool, 1, 0, BENCH_POOL_CONNECTIONS) != 0) {
+        fprintf(stderr, "Failed to initialize the overflow pool\n");
+        return;
+    }
+    handoff_rings = aligned_alloc(CACHE_LINE_SIZE, sizeof(handoff_ring_t) * max_threads);
+    if (!handoff_rings) {
+        perror("aligned_alloc: handoff rings");
+        lockfree_pool_destroy(&overflow_pool);
+        return;
+    }
+    memset(handoff_rings, 0, sizeof(handoff_ring_t) * max_threads);
+
+    // 1, 2, 4... и последним шагом ровно max_threads
+    for (int threads = 1;; threads = threads * 2 < max_threads ? threads * 2 : max_threads) {
+        bench_case_t local = { "pool_local", pool_local_run, pool_bind_init, NULL, NULL, 1024, threads, 0 };
+        bench_case_t overflow = { "pool_overflow", pool_overflow_run, NULL, NULL, NULL, 1024, threads, 0 };
+        bench_case_t remote = { "pool_remote_release", pool_remote_run, pool_bind_init,
+                                pool_remote_done, NULL, 1024, threads, 0 };
+        if (bench_enabled(local.name)) bench_run(&local);
+        if (bench_enabled(overflow.name)) bench_run(&overflow);
+        if (threads > 1 && bench_enabled(remote.name)) {
+            handoff_threads = threads;
+            bench_run(&remote);
+        }
+        if (threads == max_threads) {
+            break;
+        }
+    }
+
+    free(handoff_rings);
+    lockfree_pool_destroy(&overflow_pool);
+}
+
+// Разбор запроса и подготовка ответа
+
+typedef struct {
+    const char *request;
+    size_t len;
+    int pipeline;                // 0 - только handle_request_and_prepare_response
+    connection_t *conn;
+} handler_ctx_t;
+
+static int handler_init(void *arg, int tid) {
+    handler_ctx_t *ctx = arg;
+    loop_clock_update();
+    metrics_register_worker(tid + 1);
+    routes_register_worker(tid + 1);
+    if (lockfree_pool_bind_thread(connection_pool_handle(), tid, 0, -1) != 0 ||
+        connection_io_pool_init(BENCH_IO_BUFFERS) != 0) {
+        return -1;
+    }
+    connection_t *conn = connection_get();
+    if (!conn || connection_io_acquire(conn) != 0) {
+        connection_release(conn);
+        return -1;
+    }
+    conn->state = STATE_READING;
+    conn->keep_alive = 1;
+    memcpy(conn->io->read_buf, ctx->request, ctx->len);
+    conn->bytes_read = (uint32_t)ctx->len;
+    conn->parse_offset = 0;
+    ctx->conn = conn;
+
+    if (!ctx->pipeline) {
+        // Запрос разобран один раз, замеряется только выбор и сборка ответа
+        conn->io->routes = routes_hold();
+        if (http_parse_request(conn) != 1) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static int handler_done(void *arg, int tid) {
+    (void)tid;
+    handler_ctx_t *ctx = arg;
+    if (ctx->conn) {
+        if (ctx->conn->io->routes) {
+            http_responses_sent(ctx->conn);
+        }
+        connection_release(ctx->conn);
+        ctx->conn = NULL;
+    }
+    connection_io_pool_destroy();
+    routes_unregister_worker();
+    return 0;
+}
+
+static void handler_prepare_run(void *arg, int tid, uint64_t iters) {
+    (void)tid;
+    handler_ctx_t *ctx = arg;
+    connection_t *conn = ctx->conn;
+    for (uint64_t i = 0; i < iters; ++i) {
+        conn->io->response_iovcnt = 0;
+        conn->io->batch_count = 0;
+        conn->keep_alive = 1;
+        handle_request_and_prepare_response(conn);
+        BENCH_KEEP(conn->io->response_iovcnt);
+    }
+}
+
+// Пачка целиком, как после чтения: разбор, ответы, отпускание пачки
+static void handler_pipeline_run(void *arg, int tid, uint64_t iters) {
+    (void)tid;
+    handler_ctx_t *ctx = arg;
+    connection_t *conn = ctx->conn;
+    for (uint64_t i = 0; i < iters; ++i) {
+        conn->parse_offset = 0;
+        conn->keep_alive = 1;
+        int prepared = http_process_pipeline(conn);
+        BENCH_KEEP(prepared);
+        http_responses_sent(conn);
+    }
+}
+
+static void bench_handler(void) {
+    static char pipelined[BUFFER_SIZE];
+    static char conditional[512];
+    size_t small_len = sizeof(small_request) - 1;
+    for (int i = 0; i < PIPELINE_MAX_REQUESTS; ++i) {
+        memcpy(pipelined + i * small_len, small_request, small_len);
+    }
+
+    // If-None-Match с текущим ETag роута - ответ 304
+    const route_set_t *set = routes_hold();
+    int games = route_set_lookup(set, "/games", 6);
+    const char *etag = games >= 0 ? set->routes[games].identity.etag : "\"0\"";
+    size_t conditional_len = snprintf(conditional, sizeof(conditional),
+        "GET /games HTTP/1.1\r\nHost: localhost\r\nIf-None-Match: %s\r\n\r\n", etag);
+
+    static handler_ctx_t prepare_ok, prepare_304, prepare_404, single, browser, batch;
+    prepare_ok = (handler_ctx_t){ small_request, small_len, 0, NULL };
+    prepare_304 = (handler_ctx_t){ conditional, conditional_len, 0, NULL };
+    prepare_404 = (handler_ctx_t){ "GET /missing HTTP/1.1\r\nHost: localhost\r\n\r\n", 0, 0, NULL };
+    prepare_404.len = strlen(prepare_404.request);
+    single = (handler_ctx_t){ small_request, small_len, 1, NULL };
+    browser = (handler_ctx_t){ browser_request, sizeof(browser_request) - 1, 1, NULL };
+    batch = (handler_ctx_t){ pipelined, small_len * PIPELINE_MAX_REQUESTS, 1, NULL };
+
+    const bench_case_t cases[] = {
+        { "handler_prepare_200", handler_prepare_run, handler_init, handler_done, &prepare_ok, 1024, 1, 0 },
+        { "handler_prepare_304", handler_prepare_run, handler_init, handler_done, &prepare_304, 1024, 1, 0 },
+        { "handler_prepare_404", handler_prepare_run, handler_init, handler_done, &prepare_404, 1024, 1, 0 },
+        { "pipeline_small", handler_pipeline_run, handler_init, handler_done, &single, 256, 1, small_len },
+        { "pipeline_browser", handler_pipeline_run, handler_init, handler_done, &browser, 256, 1,
+          sizeof(browser_request) - 1 },
+        { "pipeline_batch16", handler_pipeline_run, handler_init, handler_done, &batch, 32, 1,
+          small_len * PIPELINE_MAX_REQUESTS },
+    };
+    for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); ++i) {
+        if (bench_enabled(cases[i].name)) bench_run(&cases[i]);
+    }
+}
+
+int main(int argc, char **argv) {
+    bench_init(argc, argv);
+
+    // Размеры пулов и реестров - под число тредов бенчмарков
+    config_set_defaults(&g_config);
+    g_config.workers = bench_max_threads();
+    g_config.connections_per_worker = BENCH_POOL_CONNECTIONS;
+    g_config.overflow_connections = 0;
+    if (config_validate(&g_config) != 0 || connection_pool_init() != 0 ||
+        metrics_init(g_config.workers) != 0 || http_responses_init() != 0 ||
+        routes_init() != 0) {
+        fprintf(stderr, "Failed to initialize server subsystems\n");
+        return EXIT_FAILURE;
+    }
+    simd_scanner_init();
+    build_large_request();
+    bench_report_env(simd_scanner_name());
+
+    bench_scanner();
+    bench_timers();
+    bench_routes();
+    bench_pools();
+    bench_handler();
+
+    routes_destroy();
+    http_responses_destroy();
+    metrics_destroy();
+    connection_pool_destroy();
+    return EXIT_SUCCESS;
+}
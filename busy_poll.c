@@ -0,0 +1,39 @@
+#include "busy_poll.h"
+#include <time.h>
+
+void busy_poll_init(busy_poll_t *bp, int budget_us) {
+    bp->max_ns = budget_us > 0 ? (uint64_t)budget_us * 1000 : 0;
+    bp->budget_ns = bp->max_ns;
+}
+
+uint64_t busy_poll_budget(const busy_poll_t *bp, int timeout_ms) {
+    if (timeout_ms < 0) {
+        return bp->budget_ns;
+    }
+    // Ближайший таймер раньше конца бюджета - крутимся только до него
+    uint64_t timeout_ns = (uint64_t)timeout_ms * 1000000;
+    return bp->budget_ns < timeout_ns ? bp->budget_ns : timeout_ns;
+}
+
+void busy_poll_update(busy_poll_t *bp, int hit, uint64_t blocked_ns) {
+    if (bp->max_ns == 0 || hit) {
+        return; // Опрос окупился - бюджет подходит
+    }
+
+    if (blocked_ns <= bp->max_ns) {
+        // Событие пришло вскоре после засыпания: чуть больший бюджет его бы поймал
+        uint64_t grown = bp->budget_ns * 2;
+        if (grown < BUSY_POLL_MIN_NS) grown = BUSY_POLL_MIN_NS;
+        bp->budget_ns = grown < bp->max_ns ? grown : bp->max_ns;
+    } else {
+        // Долгий простой: опрос был напрасным
+        bp->budget_ns /= 2;
+        if (bp->budget_ns < BUSY_POLL_MIN_NS) bp->budget_ns = 0;
+    }
+}
+
+uint64_t busy_poll_now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
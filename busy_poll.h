@@ -0,0 +1,33 @@
+#ifndef BUSY_POLL_H
+#define BUSY_POLL_H
+
+#include <stdint.h>
+
+// Режим spin-then-block для event loop'а закрепленного воркера: прежде
+// чем уснуть в epoll_wait/io_uring_enter, воркер опрашивает очередь
+// событий без блокировки в течение бюджета. Пробуждение через
+// планировщик стоит десятки микросекунд, опрос их не тратит.
+//
+// Бюджет подстраивается по недавним простоям, как halt-polling в KVM:
+// если событие пришло вскоре после засыпания, бюджет растет; если воркер
+// спал дольше предела, бюджет сокращается, чтобы не жечь CPU впустую
+
+#define BUSY_POLL_MIN_NS 10000ull   // Наименьший ненулевой бюджет, 10 мкс
+
+typedef struct {
+    uint64_t max_ns;        // Предел из конфигурации, 0 - режим выключен
+    uint64_t budget_ns;     // Текущий бюджет опроса
+} busy_poll_t;
+
+void busy_poll_init(busy_poll_t *bp, int budget_us);
+
+// Сколько опрашивать перед ожиданием с таймаутом timeout_ms (-1 - без таймаута)
+uint64_t busy_poll_budget(const busy_poll_t *bp, int timeout_ms);
+
+// Итог ожидания: hit - событие найдено опросом, иначе blocked_ns - время сна
+void busy_poll_update(busy_poll_t *bp, int hit, uint64_t blocked_ns);
+
+// Монотонное время для границ опроса (loop_clock обновляется реже)
+uint64_t busy_poll_now_ns(void);
+
+#endif // BUSY_POLL_H
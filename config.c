@@ -0,0 +1,534 @@
+#include "config.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <stddef.h>
+#include <errno.h>
+#include <ctype.h>
+#include <limits.h>
+#include <netdb.h>
+#include <arpa/inet.h>
+
+server_config_t g_config;
+
+// Числовые параметры: имя ключа, смещение поля и допустимый диапазон.
+// CONFIG_LIVE - параметр, который воркеры читают через CONFIG_LIVE_GET
+// при каждом использовании: его можно менять на работающем сервере
+typedef struct {
+    const char *name;
+    size_t offset;
+    int min;
+    int max;
+    int live;
+} config_int_option_t;
+
+#define CONFIG_INT(name, min, max) { #name, offsetof(server_config_t, name), min, max, 0 }
+#define CONFIG_LIVE(name, min, max) { #name, offsetof(server_config_t, name), min, max, 1 }
+
+static const config_int_option_t int_options[] = {
+    CONFIG_INT(port, 1, 65535),
+    CONFIG_INT(backlog, 1, INT_MAX),
+    CONFIG_INT(defer_accept_s, 0, 3600),
+    CONFIG_INT(workers, 1, CONFIG_MAX_WORKERS),
+    CONFIG_INT(connections_per_worker, 1, 1 << 24),
+    CONFIG_INT(overflow_connections, 0, 1 << 24),
+    CONFIG_INT(io_buffers, 1, 1 << 24),
+    CONFIG_INT(timer_capacity, 0, 1 << 26),
+    CONFIG_LIVE(request_timeout_ms, 1, INT_MAX),
+    CONFIG_INT(keepalive_timeout_ms, 1000, INT_MAX),
+    CONFIG_INT(max_events, 1, 1 << 16),
+    CONFIG_INT(accept_batch, 1, 1 << 16),
+    CONFIG_INT(io_batch, 1, 1 << 16),
+    CONFIG_INT(uring_entries, 8, 1 << 15),
+    CONFIG_INT(uring_buffers, 8, 1 << 15),
+    CONFIG_INT(busy_poll_us, 0, 1000000),
+    CONFIG_LIVE(overload_shed_pct, 1, 100),
+    CONFIG_LIVE(overload_lag_ms, 1, 60000),
+    CONFIG_INT(overload_retry_after_s, 1, 86400),
+    CONFIG_INT(upstream_pool_size, 0, 4096),
+    CONFIG_INT(upstream_timeout_ms, 1, 600000),
+    CONFIG_INT(response_cache_ttl_ms, 0, 86400000),
+    CONFIG_LIVE(response_cache_stale_ms, 0, 86400000),
+    CONFIG_INT(response_cache_size_kb, 64, 1 << 22),
+    CONFIG_LIVE(zerocopy_threshold_kb, 0, 1 << 20),
+    CONFIG_INT(http2_max_streams, 0, 16), // Не больше PIPELINE_MAX_REQUESTS
+    CONFIG_LIVE(drain_timeout_ms, 1, 86400000),
+    CONFIG_LIVE(trace_sample, 0, 1 << 30),
+};
+
+void config_set_defaults(server_config_t *cfg) {
+    memset(cfg, 0, sizeof(*cfg));
+    cfg->port = 8080;
+    cfg->backlog = 4096;
+    cfg->defer_accept_s = 1;
+    cfg->workers = 4;
+    cfg->io_engine = CONFIG_ENGINE_EPOLL;
+    cfg->connections_per_worker = 65536;
+    cfg->overflow_connections = 4096;
+    cfg->io_buffers = 1024;
+    cfg->request_timeout_ms = 5000;
+    cfg->keepalive_timeout_ms = 10000;
+    cfg->max_events = 2048;
+    cfg->accept_batch = 128;
+    cfg->io_batch = 32;
+    cfg->uring_entries = 4096;
+    cfg->uring_buffers = 1024;
+    cfg->overload_shed_pct = 90;
+    cfg->overload_lag_ms = 100;
+    cfg->overload_retry_after_s = 1;
+    cfg->upstream_pool_size = 8;
+    cfg->upstream_timeout_ms = 1000;
+    cfg->response_cache_size_kb = 16384;
+    cfg->zerocopy_threshold_kb = 64;
+    cfg->http2_max_streams = 16;
+    cfg->drain_timeout_ms = 30000;
+    snprintf(cfg->trace_file, sizeof(cfg->trace_file), "/tmp/server-trace.json");
+}
+
+static int parse_int(const char *value, long min, long max, int *out) {
+    char *end;
+    errno = 0;
+    long v = strtol(value, &end, 10);
+    if (errno != 0 || end == value || *end != '\0' || v < min || v > max) {
+        return -1;
+    }
+    *out = (int)v;
+    return 0;
+}
+
+static int parse_bool(const char *value, int *out) {
+    if (!strcasecmp(value, "1") || !strcasecmp(value, "on") ||
+        !strcasecmp(value, "yes") || !strcasecmp(value, "true")) {
+        *out = 1;
+        return 0;
+    }
+    if (!strcasecmp(value, "0") || !strcasecmp(value, "off") ||
+        !strcasecmp(value, "no") || !strcasecmp(value, "false")) {
+        *out = 0;
+        return 0;
+    }
+    return -1;
+}
+
+// Список "0,2,4-7" в порядке воркеров
+static int parse_list(const char *value, int *out, int *out_len) {
+    int len = 0;
+    const char *p = value;
+
+    while (*p) {
+        char *end;
+        long first = strtol(p, &end, 10);
+        if (end == p || first < 0 || first > INT_MAX) return -1;
+        long last = first;
+        p = end;
+        if (*p == '-') {
+            last = strtol(p + 1, &end, 10);
+            if (end == p + 1 || last < first || last > INT_MAX) return -1;
+            p = end;
+        }
+        for (long v = first; v <= last; ++v) {
+            if (len >= CONFIG_MAX_WORKERS) return -1;
+            out[len++] = (int)v;
+        }
+        if (*p == ',') {
+            p++;
+        } else if (*p != '\0') {
+            return -1;
+        }
+    }
+
+    *out_len = len;
+    return 0;
+}
+
+// Имена бэкендов и ключи JSON: [A-Za-z0-9_-], чтобы ключ не требовал экранирования
+static int valid_name(const char *s, size_t len) {
+    if (len == 0 || len >= CONFIG_NAME_MAX) return 0;
+    for (size_t i = 0; i < len; ++i) {
+        unsigned char c = s[i];
+        if (!isalnum(c) && c != '_' && c != '-') return 0;
+    }
+    return 1;
+}
+
+static int find_upstream(const server_config_t *cfg, const char *name, size_t len) {
+    for (int i = 0; i < cfg->upstream_count; ++i) {
+        if (strlen(cfg->upstreams[i].name) == len && memcmp(cfg->upstreams[i].name, name, len) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+// "NAME HOST:PORT [TIMEOUT_MS]"
+static int parse_upstream(server_config_t *cfg, const char *value) {
+    char buf[CONFIG_URL_MAX * 2];
+    if (strlen(value) >= sizeof(buf)) return -1;
+    strcpy(buf, value);
+
+    char *save = NULL;
+    char *name = strtok_r(buf, " \t", &save);
+    char *addr = strtok_r(NULL, " \t", &save);
+    char *timeout = strtok_r(NULL, " \t", &save);
+    if (!name || !addr || strtok_r(NULL, " \t", &save) != NULL) return -1;
+    if (!valid_name(name, strlen(name)) || find_upstream(cfg, name, strlen(name)) >= 0) return -1;
+    if (cfg->upstream_count == CONFIG_MAX_UPSTREAMS) return -1;
+
+    config_upstream_t *up = &cfg->upstreams[cfg->upstream_count];
+    memset(up, 0, sizeof(*up));
+    if (timeout && parse_int(timeout, 1, 600000, &up->timeout_ms) != 0) return -1;
+
+    char *colon = strrchr(addr, ':');
+    int port;
+    if (!colon || colon == addr || parse_int(colon + 1, 1, 65535, &port) != 0) return -1;
+    size_t host_len = colon - addr;
+    if (host_len >= sizeof(up->host)) return -1;
+
+    // Разрешение имени блокирует - только здесь, до запуска воркеров
+    *colon = '\0';
+    struct addrinfo hints = { .ai_family = AF_INET, .ai_socktype = SOCK_STREAM };
+    struct addrinfo *res = NULL;
+    int err = getaddrinfo(addr, NULL, &hints, &res);
+    if (err != 0) {
+        fprintf(stderr, "Upstream %s: %s: %s\n", name, addr, gai_strerror(err));
+        return -1;
+    }
+    up->addr = ((struct sockaddr_in *)res->ai_addr)->sin_addr.s_addr;
+    freeaddrinfo(res);
+
+    up->port = htons((uint16_t)port);
+    memcpy(up->host, addr, host_len);
+    snprintf(up->name, sizeof(up->name), "%s", name);
+    cfg->upstream_count++;
+    return 0;
+}
+
+// "/PATH [KEY=]UPSTREAM:/path ..."; ключ по умолчанию - имя бэкенда
+static int parse_aggregate(server_config_t *cfg, const char *value) {
+    char buf[CONFIG_URL_MAX * (CONFIG_AGGREGATE_PARTS + 1)];
+    if (strlen(value) >= sizeof(buf)) return -1;
+    strcpy(buf, value);
+    if (cfg->aggregate_count == CONFIG_MAX_AGGREGATES) return -1;
+
+    config_aggregate_t *agg = &cfg->aggregates[cfg->aggregate_count];
+    memset(agg, 0, sizeof(*agg));
+
+    char *save = NULL;
+    char *path = strtok_r(buf, " \t", &save);
+    if (!path || path[0] != '/' || strlen(path) >= sizeof(agg->path) || strchr(path, '?')) return -1;
+    strcpy(agg->path, path);
+
+    char *token;
+    while ((token = strtok_r(NULL, " \t", &save)) != NULL) {
+        if (agg->part_count == CONFIG_AGGREGATE_PARTS) return -1;
+        config_aggregate_part_t *part = &agg->parts[agg->part_count];
+
+        char *target = strchr(token, ':');
+        if (!target || target[1] != '/' || strlen(target + 1) >= sizeof(part->path)) return -1;
+        char *eq = memchr(token, '=', target - token);
+        const char *upstream = eq ? eq + 1 : token;
+        size_t upstream_len = target - upstream;
+        const char *key = eq ? token : upstream;
+        size_t key_len = eq ? (size_t)(eq - token) : upstream_len;
+
+        part->upstream = find_upstream(cfg, upstream, upstream_len);
+        if (part->upstream < 0 || !valid_name(key, key_len)) return -1;
+        for (int i = 0; i < agg->part_count; ++i) {
+            if (strlen(agg->parts[i].key) == key_len && memcmp(agg->parts[i].key, key, key_len) == 0) {
+                return -1; // Ключи объединенного JSON должны различаться
+            }
+        }
+        memcpy(part->key, key, key_len);
+        part->key[key_len] = '\0';
+        strcpy(part->path, target + 1);
+        agg->part_count++;
+    }
+    if (agg->part_count == 0) return -1;
+
+    // Повторное объявление пути заменяет прежнее
+    for (int i = 0; i < cfg->aggregate_count; ++i) {
+        if (strcmp(cfg->aggregates[i].path, agg->path) == 0) {
+            cfg->aggregates[i] = *agg;
+            return 0;
+        }
+    }
+    cfg->aggregate_count++;
+    return 0;
+}
+
+// Опции командной строки пишутся через '-', ключи файла - через '_'
+static int config_key_name(const char *key, char *name, size_t size) {
+    size_t n = strlen(key);
+    if (n >= size) return -1;
+    for (size_t i = 0; i <= n; ++i) {
+        name[i] = key[i] == '-' ? '_' : key[i];
+    }
+    return 0;
+}
+
+static const config_int_option_t *find_int_option(const char *name) {
+    for (size_t i = 0; i < sizeof(int_options) / sizeof(int_options[0]); ++i) {
+        if (strcmp(name, int_options[i].name) == 0) {
+            return &int_options[i];
+        }
+    }
+    return NULL;
+}
+
+static void fill_int_info(const config_int_option_t *opt, config_int_info_t *info) {
+    info->name = opt->name;
+    info->value = __atomic_load_n((int *)((char *)&g_config + opt->offset), __ATOMIC_RELAXED);
+    info->min = opt->min;
+    info->max = opt->max;
+    info->live = opt->live;
+}
+
+int config_int_lookup(const char *key, config_int_info_t *info) {
+    char name[64];
+    const config_int_option_t *opt;
+    if (config_key_name(key, name, sizeof(name)) != 0 || !(opt = find_int_option(name))) {
+        return -1;
+    }
+    fill_int_info(opt, info);
+    return 0;
+}
+
+int config_int_at(int index, config_int_info_t *info) {
+    if (index < 0 || (size_t)index >= sizeof(int_options) / sizeof(int_options[0])) {
+        return -1;
+    }
+    fill_int_info(&int_options[index], info);
+    return 0;
+}
+
+int config_set_live(const char *key, const char *value) {
+    char name[64];
+    const config_int_option_t *opt;
+    int v;
+    if (config_key_name(key, name, sizeof(name)) != 0 || !(opt = find_int_option(name)) ||
+        !opt->live || parse_int(value, opt->min, opt->max, &v) != 0) {
+        return -1;
+    }
+    // Воркеры читают поле без синхронизации: int пишется одной инструкцией
+    __atomic_store_n((int *)((char *)&g_config + opt->offset), v, __ATOMIC_RELAXED);
+    return 0;
+}
+
+int config_set(server_config_t *cfg, const char *key, const char *value) {
+    char name[64];
+    if (config_key_name(key, name, sizeof(name)) != 0) goto unknown;
+
+    const config_int_option_t *opt = find_int_option(name);
+    if (opt) {
+        if (parse_int(value, opt->min, opt->max, (int *)((char *)cfg + opt->offset)) != 0) {
+            fprintf(stderr, "Invalid value for %s: '%s' (expected %d..%d)\n",
+                    key, value, opt->min, opt->max);
+            return -1;
+        }
+        return 0;
+    }
+
+    if (strcmp(name, "io_engine") == 0) {
+        if (strcmp(value, "uring") == 0 || strcmp(value, "io_uring") == 0) {
+            cfg->io_engine = CONFIG_ENGINE_URING;
+        } else if (strcmp(value, "epoll") == 0) {
+            cfg->io_engine = CONFIG_ENGINE_EPOLL;
+        } else {
+            fprintf(stderr, "Unknown I/O engine: %s\n", value);
+            return -1;
+        }
+        return 0;
+    }
+    if (strcmp(name, "cpu_steering") == 0) {
+        if (parse_bool(value, &cfg->cpu_steering) != 0) {
+            fprintf(stderr, "Invalid value for %s: '%s' (expected on/off)\n", key, value);
+            return -1;
+        }
+        return 0;
+    }
+    if (strcmp(name, "routes_dir") == 0) {
+        size_t len = strlen(value);
+        if (len >= sizeof(cfg->routes_dir)) {
+            fprintf(stderr, "Routes directory path is too long: '%s'\n", value);
+            return -1;
+        }
+        // Без завершающего '/': путь подставляется в сообщения как "dir/file"
+        while (len > 1 && value[len - 1] == '/') len--;
+        memcpy(cfg->routes_dir, value, len);
+        cfg->routes_dir[len] = '\0';
+        return 0;
+    }
+    if (strcmp(name, "tls_cert") == 0 || strcmp(name, "tls_key") == 0) {
+        char *dst = strcmp(name, "tls_cert") == 0 ? cfg->tls_cert : cfg->tls_key;
+        size_t len = strlen(value);
+        if (len >= CONFIG_PATH_MAX) {
+            fprintf(stderr, "Path is too long for %s: '%s'\n", key, value);
+            return -1;
+        }
+        memcpy(dst, value, len + 1);
+        return 0;
+    }
+    if (strcmp(name, "trace_file") == 0) {
+        size_t len = strlen(value);
+        if (len == 0 || len >= sizeof(cfg->trace_file)) {
+            fprintf(stderr, "Invalid trace file path: '%s'\n", value);
+            return -1;
+        }
+        memcpy(cfg->trace_file, value, len + 1);
+        return 0;
+    }
+    if (strcmp(name, "upgrade_socket") == 0) {
+        size_t len = strlen(value);
+        if (len >= sizeof(cfg->upgrade_socket)) {
+            fprintf(stderr, "Upgrade socket path is too long: '%s' (up to %zu bytes)\n",
+                    value, sizeof(cfg->upgrade_socket) - 1);
+            return -1;
+        }
+        memcpy(cfg->upgrade_socket, value, len + 1);
+        return 0;
+    }
+    if (strcmp(name, "control_socket") == 0) {
+        size_t len = strlen(value);
+        if (len >= sizeof(cfg->control_socket)) {
+            fprintf(stderr, "Control socket path is too long: '%s' (up to %zu bytes)\n",
+                    value, sizeof(cfg->control_socket) - 1);
+            return -1;
+        }
+        memcpy(cfg->control_socket, value, len + 1);
+        return 0;
+    }
+    if (strcmp(name, "stats_shm") == 0) {
+        // Имя для shm_open: "/имя" без других '/', пусто - выключено
+        size_t len = strlen(value);
+        if (len >= sizeof(cfg->stats_shm) ||
+            (len > 0 && (len == 1 || value[0] != '/' || strchr(value + 1, '/')))) {
+            fprintf(stderr, "Invalid shared memory name: '%s' (expected /NAME, up to %zu bytes)\n",
+                    value, sizeof(cfg->stats_shm) - 1);
+            return -1;
+        }
+        memcpy(cfg->stats_shm, value, len + 1);
+        return 0;
+    }
+    if (strcmp(name, "cpus") == 0) {
+        if (parse_list(value, cfg->cpu_map, &cfg->cpu_map_len) != 0) {
+            fprintf(stderr, "Invalid CPU list: '%s'\n", value);
+            return -1;
+        }
+        return 0;
+    }
+    if (strcmp(name, "upstream") == 0) {
+        if (parse_upstream(cfg, value) != 0) {
+            fprintf(stderr, "Invalid upstream: '%s' (expected NAME HOST:PORT [TIMEOUT_MS], "
+                    "up to %d upstreams)\n", value, CONFIG_MAX_UPSTREAMS);
+            return -1;
+        }
+        return 0;
+    }
+    if (strcmp(name, "aggregate") == 0) {
+        if (parse_aggregate(cfg, value) != 0) {
+            fprintf(stderr, "Invalid aggregate: '%s' (expected /PATH [KEY=]UPSTREAM:/path ..., "
+                    "up to %d parts; upstreams must be declared first)\n",
+                    value, CONFIG_AGGREGATE_PARTS);
+            return -1;
+        }
+        return 0;
+    }
+    if (strcmp(name, "numa_nodes") == 0) {
+        if (parse_list(value, cfg->numa_map, &cfg->numa_map_len) != 0) {
+            fprintf(stderr, "Invalid NUMA node list: '%s'\n", value);
+            return -1;
+        }
+        return 0;
+    }
+
+unknown:
+    fprintf(stderr, "Unknown configuration key: %s\n", key);
+    return -1;
+}
+
+static char *trim(char *s) {
+    while (isspace((unsigned char)*s)) s++;
+    char *end = s + strlen(s);
+    while (end > s && isspace((unsigned char)end[-1])) end--;
+    *end = '\0';
+    return s;
+}
+
+int config_load_file(server_config_t *cfg, const char *path) {
+    FILE *f = fopen(path, "r");
+    if (!f) {
+        perror(path);
+        return -1;
+    }
+
+    char line[4096];
+    int lineno = 0;
+    int ret = 0;
+    while (fgets(line, sizeof(line), f)) {
+        lineno++;
+        char *comment = strchr(line, '#');
+        if (comment) *comment = '\0';
+
+        char *s = trim(line);
+        if (*s == '\0') continue;
+
+        char *eq = strchr(s, '=');
+        if (!eq) {
+            fprintf(stderr, "%s:%d: expected 'key = value'\n", path, lineno);
+            ret = -1;
+            break;
+        }
+        *eq = '\0';
+        if (config_set(cfg, trim(s), trim(eq + 1)) != 0) {
+            fprintf(stderr, "%s:%d: invalid setting\n", path, lineno);
+            ret = -1;
+            break;
+        }
+    }
+
+    fclose(f);
+    return ret;
+}
+
+int config_validate(server_config_t *cfg) {
+    if (cfg->cpu_map_len > 0 && cfg->cpu_map_len < cfg->workers) {
+        fprintf(stderr, "CPU map has %d entries for %d workers\n",
+                cfg->cpu_map_len, cfg->workers);
+        return -1;
+    }
+    if (cfg->numa_map_len > 0 && cfg->numa_map_len < cfg->workers) {
+        fprintf(stderr, "NUMA node map has %d entries for %d workers\n",
+                cfg->numa_map_len, cfg->workers);
+        return -1;
+    }
+    if (cfg->uring_buffers & (cfg->uring_buffers - 1)) {
+        fprintf(stderr, "uring_buffers must be a power of two\n");
+        return -1;
+    }
+    if ((cfg->tls_cert[0] == '\0') != (cfg->tls_key[0] == '\0')) {
+        fprintf(stderr, "TLS needs both tls_cert and tls_key\n");
+        return -1;
+    }
+    for (int i = 0; i < cfg->upstream_count; ++i) {
+        if (cfg->upstreams[i].timeout_ms == 0) {
+            cfg->upstreams[i].timeout_ms = cfg->upstream_timeout_ms;
+        }
+    }
+    if (cfg->timer_capacity == 0) {
+        // Воркер может держать свой пул целиком и весь overflow-пул
+        cfg->timer_capacity = cfg->connections_per_worker + cfg->overflow_connections;
+    }
+    return 0;
+}
+
+int config_worker_cpu(const server_config_t *cfg, int index, int nprocs) {
+    if (cfg->cpu_map_len > 0) {
+        return cfg->cpu_map[index];
+    }
+    return (index + 1) % nprocs; // worker_id % nprocs, как раньше
+}
+
+int config_worker_numa_node(const server_config_t *cfg, int index) {
+    return cfg->numa_map_len > 0 ? cfg->numa_map[index] : -1;
+}
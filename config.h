@@ -0,0 +1,167 @@
+#ifndef CONFIG_H
+#define CONFIG_H
+
+#include <stdint.h>
+
+// Параметры сервера, задаваемые при запуске: значения по умолчанию,
+// затем файл конфигурации (-c), затем опции командной строки.
+// Пулы, колеса таймеров и очереди воркеров выделяются по этим значениям
+
+#define CONFIG_MAX_WORKERS 1024 // Предел для проверки, память под него не выделяется
+#define CONFIG_PATH_MAX 4096
+#define CONFIG_UPGRADE_PATH_MAX 108 // sun_path Unix-сокета
+#define CONFIG_SHM_NAME_MAX 64
+#define CONFIG_MAX_UPSTREAMS 16
+#define CONFIG_MAX_AGGREGATES 16
+#define CONFIG_AGGREGATE_PARTS 4        // Запросов к бэкендам на один агрегирующий роут
+#define CONFIG_NAME_MAX 32
+#define CONFIG_URL_MAX 256
+
+typedef enum {
+    CONFIG_ENGINE_EPOLL = 0,
+    CONFIG_ENGINE_URING,
+} config_engine_t;
+
+// Бэкенд: "upstream = NAME HOST:PORT [TIMEOUT_MS]". Адрес разрешается
+// один раз при загрузке конфигурации
+typedef struct {
+    char name[CONFIG_NAME_MAX];
+    char host[CONFIG_URL_MAX];          // Для заголовка Host
+    uint32_t addr;                      // IPv4 (сетевой порядок байт)
+    uint16_t port;                      // Сетевой порядок байт
+    int timeout_ms;                     // 0 - upstream_timeout_ms
+} config_upstream_t;
+
+// Часть ответа агрегирующего роута: поле key объединенного JSON
+typedef struct {
+    char key[CONFIG_NAME_MAX];
+    int upstream;                       // Индекс в upstreams
+    char path[CONFIG_URL_MAX];
+} config_aggregate_part_t;
+
+// "aggregate = /PATH [KEY=]UPSTREAM:/path ..."
+typedef struct {
+    char path[CONFIG_URL_MAX];
+    config_aggregate_part_t parts[CONFIG_AGGREGATE_PARTS];
+    int part_count;
+} config_aggregate_t;
+
+typedef struct {
+    // Сеть
+    int port;
+    int backlog;
+    int defer_accept_s;                 // TCP_DEFER_ACCEPT, 0 - accept без ожидания данных
+
+    // Воркеры и их размещение
+    int workers;
+    config_engine_t io_engine;
+    int cpu_steering;
+    int cpu_map[CONFIG_MAX_WORKERS];    // CPU воркера i; пустая карта - worker_id % nprocs
+    int cpu_map_len;
+    int numa_map[CONFIG_MAX_WORKERS];   // Предпочтительная NUMA-нода памяти воркера
+    int numa_map_len;
+
+    // Роуты: JSON-файлы каталога, пустая строка - только встроенные
+    char routes_dir[CONFIG_PATH_MAX];
+
+    // TLS с ключами в kTLS: цепочка сертификатов и ключ в PEM, пусто - без TLS
+    char tls_cert[CONFIG_PATH_MAX];
+    char tls_key[CONFIG_PATH_MAX];
+
+    // Плавное обновление: Unix-сокет передачи слушающих сокетов новому
+    // процессу (пусто - выключено) и предел дренажа старого процесса
+    char upgrade_socket[CONFIG_UPGRADE_PATH_MAX];
+    int drain_timeout_ms;
+
+    // Трассировка: каждая N-я пачка запросов (0 - выключено), выгрузка по SIGUSR2
+    int trace_sample;
+    char trace_file[CONFIG_PATH_MAX];
+
+    // Внешний мониторинг: сегмент shm со счетчиками воркеров и
+    // управляющий Unix-сокет (пусто - выключены)
+    char stats_shm[CONFIG_SHM_NAME_MAX];
+    char control_socket[CONFIG_UPGRADE_PATH_MAX];
+
+    // Пулы
+    int connections_per_worker;
+    int overflow_connections;
+    int io_buffers;                     // Буферов запросов на воркера (запросы в обработке)
+    int timer_capacity;                 // 0 - по размеру пулов
+
+    // Таймауты
+    int request_timeout_ms;
+    int keepalive_timeout_ms;
+
+    // Пакетная обработка
+    int max_events;                     // Событий за один epoll_wait
+    int accept_batch;                   // accept4 за одно пробуждение
+    int io_batch;                       // Соединений в пакетах чтения/записи
+    int uring_entries;
+    int uring_buffers;                  // Provided buffers на воркера (степень двойки)
+
+    // Опрос очереди событий перед сном, мкс; 0 - сразу блокироваться
+    int busy_poll_us;
+
+    // Контроль перегрузки
+    int overload_shed_pct;              // Давление, с которого новым соединениям отвечаем 503
+    int overload_lag_ms;                // Итерация event loop'а дольше - accept на паузе
+    int overload_retry_after_s;         // Retry-After в ответе 503
+
+    // Агрегирующие роуты и их бэкенды
+    config_upstream_t upstreams[CONFIG_MAX_UPSTREAMS];
+    int upstream_count;
+    config_aggregate_t aggregates[CONFIG_MAX_AGGREGATES];
+    int aggregate_count;
+    int upstream_pool_size;             // Простаивающих соединений на бэкенд у воркера
+    int upstream_timeout_ms;            // Срок ответа бэкенда по умолчанию
+    int response_cache_ttl_ms;          // Свежесть ответа в кэше, 0 - кэш выключен
+    int response_cache_stale_ms;        // Сверх TTL отдается устаревшим, пока идет обновление
+    int response_cache_size_kb;         // Объем кэша воркера
+    int zerocopy_threshold_kb;          // Пачка ответов от этого объема - MSG_ZEROCOPY, 0 - выключено
+    int http2_max_streams;              // Одновременных потоков соединения HTTP/2, 0 - только HTTP/1.1
+} server_config_t;
+
+extern server_config_t g_config;
+
+void config_set_defaults(server_config_t *cfg);
+
+// Ключ в форме файла ("keepalive_timeout_ms") или опции ("keepalive-timeout-ms").
+// Возвращает 0 или -1 с сообщением в stderr
+int config_set(server_config_t *cfg, const char *key, const char *value);
+
+// Числовой параметр для управляющего сокета
+typedef struct {
+    const char *name;
+    int value;                          // Текущее значение в g_config
+    int min;
+    int max;
+    int live;                           // Меняется без перезапуска
+} config_int_info_t;
+
+// Числовой параметр g_config по ключу (в любой из двух форм) или по
+// номеру в таблице (перебор от 0). 0 - найден, -1 - нет
+int config_int_lookup(const char *key, config_int_info_t *info);
+int config_int_at(int index, config_int_info_t *info);
+
+// Изменить живой параметр g_config на работающем сервере (главный тред).
+// Воркеры увидят значение при следующем чтении поля. -1 - ключ не
+// живой или значение вне диапазона
+int config_set_live(const char *key, const char *value);
+
+// Чтение живого параметра в воркере: поле пишет главный тред, и без
+// атомарной загрузки компилятор вправе держать старое значение в регистре
+#define CONFIG_LIVE_GET(field) __atomic_load_n(&g_config.field, __ATOMIC_RELAXED)
+
+// Файл "ключ = значение", # - комментарий до конца строки
+int config_load_file(server_config_t *cfg, const char *path);
+
+// Проверка согласованности после загрузки всех источников
+int config_validate(server_config_t *cfg);
+
+// CPU воркера с индексом index (worker_id - 1)
+int config_worker_cpu(const server_config_t *cfg, int index, int nprocs);
+
+// NUMA-нода воркера или -1, если карта не задана
+int config_worker_numa_node(const server_config_t *cfg, int index);
+
+#endif // CONFIG_H
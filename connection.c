@@ -1,105 +1,205 @@
 #include "connection.h"
+#include "lockfree_pool.h"
+#include "config.h"
+#include "numa_arena.h"
+#include "routes.h"
+#include "response_cache.h"
+#include "tls.h"
 #include <stdlib.h>
 #include <stdio.h>
-#include <pthread.h>
 #include <string.h>
 
-// Максимальное количество одновременных соединений
-#define MAX_CONNECTIONS 16384  // Reduced for better memory usage
+// Общий пул соединений: per-CPU пулы воркеров + overflow-пул.
+// Мьютекса больше нет - все операции идут через lock-free стеки
+static lockfree_pool_t connection_pool;
 
-// Пул соединений - статический массив, чтобы избежать malloc в рантайме
-static connection_t connection_pool[MAX_CONNECTIONS];
+int connection_pool_init(void) {
+    printf("Initializing connection pool: %d connections per worker, %d in overflow pool...\n",
+           g_config.connections_per_worker, g_config.overflow_connections);
+    return lockfree_pool_init(&connection_pool, g_config.workers,
+                              g_config.connections_per_worker,
+                              g_config.overflow_connections);
+}
 
-// Стек свободных соединений (LIFO) - используем индексы для лучшей cache locality
-static int free_connections_stack[MAX_CONNECTIONS];
-static int free_connections_top = -1;
+void connection_pool_destroy(void) {
+    print_pool_statistics(&connection_pool);
+    lockfree_pool_destroy(&connection_pool);
+}
 
-// Мьютекс для защиты стека свободных соединений
-static pthread_mutex_t pool_mutex = PTHREAD_MUTEX_INITIALIZER;
+struct lockfree_pool_s *connection_pool_handle(void) {
+    return &connection_pool;
+}
 
-// Статистика пула для мониторинга
-static volatile int pool_used_count = 0;
-static volatile int pool_peak_usage = 0;
+// Пул буферов запросов воркера. Соединение всегда обслуживает и закрывает
+// один воркер, поэтому список свободных - обычный стек без атомиков
+static __thread connection_io_t *io_free_list = NULL;
+static __thread connection_io_t *io_slab = NULL;
+static __thread int io_capacity = 0;
+static __thread int io_in_use = 0;
 
-int connection_pool_init(void) {
-    printf("Initializing connection pool for %d connections...\n", MAX_CONNECTIONS);
-    free_connections_top = -1;
-    pool_used_count = 0;
-    pool_peak_usage = 0;
-    
-    for (int i = 0; i < MAX_CONNECTIONS; ++i) {
-        connection_pool[i].fd = -1;
-        connection_pool[i].state = STATE_FREE;
-        connection_pool[i].timer_node = NULL;
-        // Используем индексы вместо указателей для лучшей cache locality
-        free_connections_stack[++free_connections_top] = i;
+int connection_io_pool_init(int count) {
+    if (io_slab) {
+        return 0; // Повторный вызов после отката io_uring -> epoll
+    }
+    io_slab = numa_local_alloc(sizeof(connection_io_t) * count);
+    if (!io_slab) {
+        return -1;
+    }
+
+    io_free_list = NULL;
+    io_capacity = count;
+    io_in_use = 0;
+    for (int i = count - 1; i >= 0; --i) {
+        io_slab[i].next_free = io_free_list;
+        io_free_list = &io_slab[i];
     }
     return 0;
 }
 
-void connection_pool_destroy(void) {
-    printf("Connection pool destroyed. Peak usage: %d/%d (%.1f%%)\n", 
-           pool_peak_usage, MAX_CONNECTIONS, 
-           (pool_peak_usage * 100.0) / MAX_CONNECTIONS);
+void connection_io_pool_destroy(void) {
+    numa_local_free(io_slab);
+    io_slab = NULL;
+    io_free_list = NULL;
+    io_capacity = 0;
+    io_in_use = 0;
 }
 
-connection_t *connection_get(void) {
-    pthread_mutex_lock(&pool_mutex);
+int connection_io_acquire(connection_t *conn) {
+    if (LIKELY(conn->io != NULL)) {
+        return 0;
+    }
 
-    if (free_connections_top == -1) {
-        // Пул исчерпан
-        pthread_mutex_unlock(&pool_mutex);
-        return NULL;
+    connection_io_t *io = io_free_list;
+    if (UNLIKELY(!io)) {
+        return -1;
     }
+    io_free_list = io->next_free;
+    io_in_use++;
+
+    // Буфер пуст: bytes_read == 0, пока буфера нет
+    io->url_len = 0;
+    io->route_id = -1;
+    io->routes = NULL;
+    http_scan_reset(&io->scan);
+    io->bytes_sent = 0;
+    io->response_iovcnt = 0;
+    io->response_iov_pos = 0;
+    io->response_owned = NULL;
+    io->response_cached = NULL;
+    io->zerocopy_pending = 0;
+    io->zerocopy_send = 0;
+    io->batch_count = 0;
+    io->trace.active = 0;
+    io->uring_pending_count = 0;
+    io->uring_pending_head = 0;
+    io->uring_pending_off = 0;
+    io->uring_poll = 0;
+    io->upstream_flight = NULL;
+    io->upstream_next = NULL;
+    io->tls = NULL;
+
+    http_parser_init(&io->parser, HTTP_REQUEST);
+    io->parser.data = conn;
+
+    conn->io = io;
+    return 0;
+}
 
-    int conn_index = free_connections_stack[free_connections_top--];
-    connection_t *conn = &connection_pool[conn_index];
-    
-    // Обновляем статистику
-    pool_used_count++;
-    if (pool_used_count > pool_peak_usage) {
-        pool_peak_usage = pool_used_count;
+void connection_io_release(connection_t *conn) {
+    connection_io_t *io = conn->io;
+    if (!io) {
+        return;
     }
 
-    pthread_mutex_unlock(&pool_mutex);
+    free(io->response_owned);
+    io->response_owned = NULL;
+    response_cache_put(io->response_cached);
+    io->response_cached = NULL;
+    if (UNLIKELY(io->tls != NULL)) {
+        tls_connection_free(io); // Закрыто посреди рукопожатия
+    }
+    routes_put(io->routes); // Соединение закрыто посреди отправки
+    io->routes = NULL;
 
+    io->next_free = io_free_list;
+    io_free_list = io;
+    io_in_use--;
+    conn->io = NULL;
+    conn->bytes_read = 0;
+    conn->parse_offset = 0;
+}
+
+int connection_io_occupancy(void) {
+    return io_capacity > 0 ? (int)((long)io_in_use * 1000 / io_capacity) : 0;
+}
+
+void connection_init_state(connection_t *conn) {
     // Быстрая инициализация только необходимых полей
     conn->fd = -1;
     conn->state = STATE_READING;
     conn->keep_alive = 0;
+    conn->uring_inflight = 0;
+    conn->role = CONN_ROLE_CLIENT;
+    conn->peer_addr = 0;
+    conn->peer_port = 0;
     conn->bytes_read = 0;
-    conn->bytes_sent = 0;
-    conn->url[0] = '\0';  // Быстрее чем memset для строки
+    conn->parse_offset = 0;
     conn->timer_node = NULL;
-    
-    // Инициализируем парсер
-    http_parser_init(&conn->parser, HTTP_REQUEST);
-    conn->parser.data = conn;
-
-    return conn;
+    conn->io = NULL;
+    conn->zerocopy = ZEROCOPY_UNSET;
+    conn->epoll_arm = CONN_ARM_NONE;
+    conn->epoll_added = 0;
+    conn->h2 = NULL;
 }
 
-void connection_release(connection_t *conn) {
-    if (!conn || conn->state == STATE_FREE) {
-        return; // Защита от double-free
+int connection_consume_iov(connection_t *conn, size_t written) {
+    connection_io_t *io = conn->io;
+    io->bytes_sent += written;
+
+    while (io->response_iov_pos < io->response_iovcnt) {
+        struct iovec *iov = &io->response_iov[io->response_iov_pos];
+        if (written < iov->iov_len) {
+            iov->iov_base = (char*)iov->iov_base + written;
+            iov->iov_len -= written;
+            break;
+        }
+        written -= iov->iov_len;
+        iov->iov_len = 0;
+        io->response_iov_pos++;
     }
-    
-    conn->state = STATE_FREE;
-    conn->fd = -1;
-    conn->timer_node = NULL;
 
-    pthread_mutex_lock(&pool_mutex);
+    return io->response_iovcnt - io->response_iov_pos;
+}
+
+size_t connection_unsent_bytes(const connection_t *conn) {
+    const connection_io_t *io = conn->io;
+    size_t total = 0;
+    for (int i = io->response_iov_pos; i < io->response_iovcnt; ++i) {
+        total += io->response_iov[i].iov_len;
+    }
+    return total;
+}
 
-    // Вычисляем индекс соединения в пуле
-    int conn_index = conn - connection_pool;
-    
-    // Проверяем валидность индекса
-    if (conn_index >= 0 && conn_index < MAX_CONNECTIONS && 
-        free_connections_top < MAX_CONNECTIONS - 1) {
-        free_connections_stack[++free_connections_top] = conn_index;
-        pool_used_count--;
+void connection_reset_for_next_request(connection_t *conn) {
+    connection_io_t *io = conn->io;
+    size_t leftover = conn->bytes_read - conn->parse_offset;
+    if (leftover > 0 && conn->parse_offset > 0) {
+        memmove(io->read_buf, io->read_buf + conn->parse_offset, leftover);
     }
-    // Если стек полон или индекс невалидный, это ошибка логики
+    conn->bytes_read = leftover;
+    conn->parse_offset = 0;
+
+    io->bytes_sent = 0;
+    io->response_iovcnt = 0;
+    io->response_iov_pos = 0;
+    io->url_len = 0;
+    io->route_id = -1;
+}
 
-    pthread_mutex_unlock(&pool_mutex);
+connection_t *connection_get(void) {
+    return lockfree_pool_get(&connection_pool);
+}
+
+void connection_release(connection_t *conn) {
+    lockfree_pool_release(&connection_pool, conn);
 }
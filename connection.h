@@ -4,10 +4,17 @@
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <time.h>
+#include <stdint.h>
 #include "http_parser.h"
+#include "simd_utils.h"
+#include "trace.h"
 
 #define BUFFER_SIZE 4096
 #define URL_MAX_LEN 256
+#define PIPELINE_MAX_REQUESTS 16 // Запросов, обрабатываемых из буфера за один writev
+#define RESPONSE_IOV_PER_REQUEST 4 // Заголовки до Date, строка Date, остаток заголовков, тело
+#define RESPONSE_IOV_MAX (PIPELINE_MAX_REQUESTS * RESPONSE_IOV_PER_REQUEST)
+#define URING_PENDING_BUFS 8     // Отложенных буферов io_uring на соединение
 
 // Состояния конечного автомата для соединения
 typedef enum {
@@ -15,33 +22,144 @@ typedef enum {
     STATE_READING,      // Чтение HTTP запроса
     STATE_WRITING,      // Запись HTTP ответа
     STATE_KEEP_ALIVE,   // Ожидание нового запроса в keep-alive соединении
+    STATE_UPSTREAM_WAIT, // Ответ ждет бэкендов агрегирующего роута
+    STATE_TLS_HANDSHAKE, // Рукопожатие TLS до передачи ключей в kTLS (tls.c)
     STATE_CLOSING       // Соединение помечано для закрытия
 } conn_state_t;
 
-// Структура соединения. Выделяется один раз при старте.
-typedef struct connection_s {
-    int fd;
-    conn_state_t state;
-    struct sockaddr_in client_addr;
+// Событие, которого соединение ждет после пачки (epoll-движок)
+typedef enum {
+    CONN_ARM_NONE = 0,
+    CONN_ARM_READ,
+    CONN_ARM_WRITE,
+    CONN_ARM_ERRQUEUE,  // Только уведомления MSG_ZEROCOPY (EPOLLERR)
+} conn_arm_t;
+
+// Отправка с MSG_ZEROCOPY на сокете: SO_ZEROCOPY включается при первой
+// большой пачке и выключается, если ядро все равно копирует (loopback)
+typedef enum {
+    ZEROCOPY_UNSET = 0,
+    ZEROCOPY_ON,
+    ZEROCOPY_OFF,
+} zerocopy_state_t;
+
+// Чье это соединение: клиента или воркера к бэкенду (upstream.c)
+typedef enum {
+    CONN_ROLE_CLIENT = 0,
+    CONN_ROLE_UPSTREAM,
+} conn_role_t;
+
+struct route_set_s;
+struct upstream_flight_s;
+struct ssl_st;
+struct h2_session_s;
 
+// Буферы и состояние разбора запроса. Берутся из пула воркера только на
+// время обработки запроса и возвращаются, когда соединение уходит в
+// keep-alive без недочитанных данных
+typedef struct connection_io_s {
     http_parser parser;
-    char url[URL_MAX_LEN];
-    int keep_alive;
+    // Срезы текущего запроса - смещения в request_buf без копирования:
+    // это read_buf или запрос HTTP/2, декодированный из HPACK (h2.c)
+    const char *request_buf;
+    uint16_t url_off;
+    uint16_t url_len;            // 0 - URL еще не разобран
+    uint16_t path_len;           // Путь без query-строки
+    uint8_t method;              // enum http_method
+    uint8_t accept_encoding;     // CONTENT_ENCODING_BIT кодировок из Accept-Encoding
+    uint8_t header_match;        // http_parser: какой из нужных заголовков сейчас разбирается
+    uint16_t if_none_match_off;  // Значение If-None-Match в request_buf
+    uint16_t if_none_match_len;  // 0 - заголовка нет
+    int route_id;                // Индекс в routes, -1 - роут не найден
+    struct route_set_s *routes;  // Таблица роутов пачки: держится, пока ответы не отправлены
 
-    char read_buf[BUFFER_SIZE];
-    size_t bytes_read;
+    http_scan_t scan;            // Прогресс сканера для запроса с parse_offset
 
-    struct iovec response_iov[2];
-    char response_headers[512];
+    // Ответы на все запросы пачки собираются из готовых блобов роутов;
+    // своя здесь только копия Date, общая для пачки
+    struct iovec response_iov[RESPONSE_IOV_MAX];
+    int response_iovcnt;
+    int response_iov_pos;        // Первый неотправленный элемент response_iov
+    char response_date[48];
+    char *response_owned;        // Динамическое тело ответа (malloc), NULL - только блобы
+    struct response_cache_entry_s *response_cached; // Ссылка на запись кэша в пачке
     size_t bytes_sent;
 
+    // Пачка, ушедшая с MSG_ZEROCOPY: ядро читает ее страницы и после
+    // возврата из send, поэтому пачка держится до уведомлений о завершении
+    uint32_t zerocopy_pending;   // Отправок без уведомления
+    uint8_t zerocopy_send;       // Текущая отправка io_uring - SENDMSG_ZC
+    struct msghdr zerocopy_msg;  // Для SENDMSG_ZC: живет, пока отправка в пути
+
+    // Запросы текущей пачки (metric_id роутов) для гистограмм латентности
+    uint64_t batch_start_ns;
+    int8_t batch_route[PIPELINE_MAX_REQUESTS];
+    uint8_t batch_count;
+    trace_span_t trace;          // Отметки этапов, если пачка в выборке trace_sample
+
+    // Буферы io_uring, принятые сверх места в read_buf (FIFO). Multishot recv
+    // не дает притормозить клиента, поэтому данные ждут здесь, пока отправка
+    // ответов не освободит read_buf
+    uint16_t uring_pending_bid[URING_PENDING_BUFS];
+    uint16_t uring_pending_len[URING_PENDING_BUFS];
+    uint16_t uring_pending_off;  // Уже скопировано из головного буфера
+    uint8_t uring_pending_head;
+    uint8_t uring_pending_count;
+    uint8_t uring_poll;          // Взведенные poll io_uring на сокет бэкенда (POLLIN/POLLOUT)
+
+    // Агрегирующие роуты. У клиента - запрос, ждущий ответов бэкендов, и
+    // следующий ожидающий того же запроса. У соединения к бэкенду - его
+    // текущий запрос: часть part запроса flight (NULL - в простое)
+    struct upstream_flight_s *upstream_flight;
+    struct connection_s *upstream_next;
+    int16_t upstream_id;         // Индекс бэкенда в g_config.upstreams
+    int8_t upstream_part;
+    uint8_t upstream_reused;     // Запрос ушел в соединение из простоя
+
+    struct ssl_st *tls;          // Незавершенное рукопожатие TLS
+
+    struct connection_io_s *next_free; // Список свободных в пуле воркера
+
+    char read_buf[BUFFER_SIZE] __attribute__((aligned(64)));
+} connection_io_t;
+
+// Горячая часть соединения - одна cache line. Выделяется один раз при
+// старте; простаивающее keep-alive соединение занимает только ее
+typedef struct connection_s {
+    int fd;
+    uint8_t state;               // conn_state_t
+    uint8_t keep_alive;
+    // Незавершенные запросы io_uring-движка: соединение нельзя вернуть
+    // в пул, пока по нему могут прийти CQE
+    uint8_t uring_inflight;
+    uint8_t role;                // conn_role_t
+
+    // Индекс per-CPU пула-владельца (-1 - глобальный overflow-пул).
+    // Задается при инициализации пула и больше не меняется
+    int16_t pool_id;
+    uint16_t peer_port;          // Адрес клиента (сетевой порядок байт)
+    uint32_t peer_addr;
+
+    uint32_t bytes_read;         // Принято в io->read_buf
+    uint32_t parse_offset;       // Начало первого неразобранного запроса (pipelining)
+
     // Указатель на узел в куче таймеров для быстрого удаления
     void *timer_node;
-    struct timespec last_active;
 
-} connection_t;
+    connection_io_t *io;         // NULL, пока запрос не в обработке
+    uint8_t zerocopy;            // zerocopy_state_t
+    // epoll-движок: отложенный до конца итерации перевзвод (conn_arm_t)
+    // и сокет уже добавлен в epoll
+    uint8_t epoll_arm;
+    uint8_t epoll_added;
+    // Потоки и HPACK соединения HTTP/2 (h2.c) - живут между запросами,
+    // в отличие от io. NULL - HTTP/1.1
+    struct h2_session_s *h2;
+} __attribute__((aligned(64))) connection_t;
 
-// Инициализация пула соединений
+_Static_assert(sizeof(connection_t) == 64, "connection_t must fit one cache line");
+
+// Инициализация пула соединений по g_config (число воркеров и размеры пулов)
 int connection_pool_init(void);
 
 // Освобождение ресурсов пула
@@ -53,4 +171,40 @@ connection_t *connection_get(void);
 // Вернуть соединение обратно в пул
 void connection_release(connection_t *conn);
 
+// Сброс полей соединения перед выдачей из пула
+void connection_init_state(connection_t *conn);
+
+// Пул буферов запросов текущего воркера: count буферов из его арены
+int connection_io_pool_init(int count);
+void connection_io_pool_destroy(void);
+
+// Выдать соединению буфер (если его еще нет). -1 - пул воркера исчерпан
+int connection_io_acquire(connection_t *conn);
+
+// Вернуть буфер соединения в пул воркера (динамический ответ освобождается)
+void connection_io_release(connection_t *conn);
+
+// Занятость пула буферов текущего воркера, в промилле
+int connection_io_occupancy(void);
+
+// Продвигает response_iov на отправленные байты.
+// Возвращает число еще не отправленных элементов начиная с response_iov_pos
+int connection_consume_iov(connection_t *conn, size_t written);
+
+// Неотправленные байты response_iov
+size_t connection_unsent_bytes(const connection_t *conn);
+
+// Отправлять ли остаток пачки без копирования (zerocopy_threshold_kb)
+static inline int connection_wants_zerocopy(const connection_t *conn, int threshold_kb) {
+    return threshold_kb > 0 && conn->zerocopy != ZEROCOPY_OFF &&
+           connection_unsent_bytes(conn) >= (size_t)threshold_kb * 1024;
+}
+
+// Подготовка к следующей пачке запросов keep-alive соединения:
+// неразобранный остаток read_buf сдвигается в начало буфера
+void connection_reset_for_next_request(connection_t *conn);
+
+// Общий lock-free пул, из которого воркеры берут соединения
+struct lockfree_pool_s *connection_pool_handle(void);
+
 #endif // CONNECTION_H
@@ -0,0 +1,288 @@
+#include "control.h"
+#include "config.h"
+#include "metrics.h"
+#include "trace.h"
+#include <errno.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#define CONTROL_TIMEOUT_MS 1000      // Срок клиента от подключения до конца ответа
+#define CONTROL_LINE_MAX 256
+#define CONTROL_CLIENTS_MAX 8        // Одновременных клиентов; остальные ждут в backlog
+
+// Клиент: сначала копит строку команды, затем отдает готовый ответ
+typedef struct {
+    int fd;                          // -1 - слот свободен
+    uint64_t deadline_ms;
+    char line[CONTROL_LINE_MAX];
+    size_t line_len;
+    char *out;                       // Ответ (malloc); NULL - команда еще читается
+    size_t out_len;
+    size_t out_sent;
+} control_client_t;
+
+static int listen_fd = -1;
+static ino_t listen_ino;             // Путь занят этим процессом, пока inode тот же
+static control_client_t clients[CONTROL_CLIENTS_MAX];
+static int client_count;
+
+static uint64_t control_now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+int control_listen(void) {
+    for (int i = 0; i < CONTROL_CLIENTS_MAX; ++i) {
+        clients[i].fd = -1;
+    }
+    if (g_config.control_socket[0] == '\0') {
+        return 0;
+    }
+
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    // Длина пути проверена config_set
+    memcpy(addr.sun_path, g_config.control_socket, strlen(g_config.control_socket) + 1);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd == -1) {
+        perror("socket(AF_UNIX)");
+        return -1;
+    }
+    // Путь прежнего процесса (обновление бинаря) или оставшийся от аварии
+    unlink(g_config.control_socket);
+    struct stat st;
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+        chmod(g_config.control_socket, 0600) != 0 || stat(g_config.control_socket, &st) != 0 ||
+        listen(fd, CONTROL_CLIENTS_MAX) != 0) {
+        fprintf(stderr, "Control: listen %s: %s (live tuning unavailable)\n",
+                g_config.control_socket, strerror(errno));
+        close(fd);
+        return -1;
+    }
+    listen_fd = fd;
+    listen_ino = st.st_ino;
+    printf("Control: listening on %s\n", g_config.control_socket);
+    return 0;
+}
+
+static void command_set(FILE *out, const char *key, const char *value) {
+    config_int_info_t info;
+    if (!key || !value) {
+        fprintf(out, "error: usage: set KEY VALUE\n");
+        return;
+    }
+    if (config_int_lookup(key, &info) != 0) {
+        fprintf(out, "error: unknown key %s\n", key);
+        return;
+    }
+    if (!info.live) {
+        fprintf(out, "error: %s is applied at startup only\n", info.name);
+        return;
+    }
+    // Кольца трассировки создаются при запуске: включить или выключить
+    // ее на ходу нельзя, только сменить частоту
+    if (strcmp(info.name, "trace_sample") == 0 && (info.value == 0 || strcmp(value, "0") == 0)) {
+        fprintf(out, "error: tracing is switched on or off at startup only\n");
+        return;
+    }
+    int old = info.value;
+    if (config_set_live(key, value) != 0) {
+        fprintf(out, "error: invalid value for %s: '%s' (expected %d..%d)\n",
+                info.name, value, info.min, info.max);
+        return;
+    }
+    config_int_lookup(key, &info);
+    printf("Control: %s = %d (was %d)\n", info.name, info.value, old);
+    fprintf(out, "ok\n%s %d\n", info.name, info.value);
+}
+
+static void command_keys(FILE *out) {
+    config_int_info_t info;
+    fprintf(out, "ok\n");
+    for (int i = 0; config_int_at(i, &info) == 0; ++i) {
+        fprintf(out, "%s %d %d..%d %s\n", info.name, info.value, info.min, info.max,
+                info.live ? "live" : "fixed");
+    }
+}
+
+static void command_metrics(FILE *out) {
+    char *body = NULL;
+    size_t len = 0;
+    if (metrics_render(&body, &len) != 0) {
+        fprintf(out, "error: out of memory\n");
+        return;
+    }
+    fprintf(out, "ok\n");
+    fwrite(body, 1, len, out);
+    free(body);
+}
+
+static void execute(FILE *out, char *line) {
+    char *save = NULL;
+    char *cmd = strtok_r(line, " \t\r", &save);
+    char *key = strtok_r(NULL, " \t\r", &save);
+    char *value = strtok_r(NULL, " \t\r", &save);
+    config_int_info_t info;
+
+    if (!cmd) {
+        fprintf(out, "error: empty command\n");
+    } else if (strcmp(cmd, "get") == 0) {
+        if (!key || config_int_lookup(key, &info) != 0) {
+            fprintf(out, "error: unknown key %s\n", key ? key : "(none)");
+        } else {
+            fprintf(out, "ok\n%s %d\n", info.name, info.value);
+        }
+    } else if (strcmp(cmd, "set") == 0) {
+        command_set(out, key, value);
+    } else if (strcmp(cmd, "keys") == 0) {
+        command_keys(out);
+    } else if (strcmp(cmd, "metrics") == 0) {
+        command_metrics(out);
+    } else if (strcmp(cmd, "trace") == 0) {
+        trace_request_dump();
+        if (trace_dump_pending()) {
+            fprintf(out, "ok\n%s\n", g_config.trace_file);
+        } else {
+            fprintf(out, "error: tracing is off or the dump failed\n");
+        }
+    } else {
+        fprintf(out, "error: unknown command %s (get, set, keys, metrics, trace)\n", cmd);
+    }
+}
+
+static void client_close(control_client_t *c) {
+    close(c->fd);
+    free(c->out);
+    c->fd = -1;
+    c->out = NULL;
+    client_count--;
+}
+
+// Строка прочитана (или клиент закрыл запись): ответ целиком в памяти
+static int client_execute(control_client_t *c, int too_long) {
+    FILE *out = open_memstream(&c->out, &c->out_len);
+    if (!out) {
+        return -1;
+    }
+    if (too_long) {
+        fprintf(out, "error: command is too long\n");
+    } else {
+        c->line[c->line_len] = '\0';
+        char *eol = strchr(c->line, '\n');
+        if (eol) *eol = '\0';
+        execute(out, c->line);
+    }
+    if (fclose(out) != 0) {
+        free(c->out);
+        c->out = NULL;
+        return -1;
+    }
+    c->out_sent = 0;
+    return 0;
+}
+
+// Продвинуть клиента, пока сокет не скажет EAGAIN. -1 - клиент закончен
+static int client_progress(control_client_t *c) {
+    while (!c->out) {
+        ssize_t n = recv(c->fd, c->line + c->line_len, sizeof(c->line) - 1 - c->line_len, 0);
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+        }
+        if (n == 0 && c->line_len == 0) {
+            return -1; // Клиент ушел, ничего не прислав
+        }
+        c->line_len += (size_t)n;
+        int complete = n == 0 || memchr(c->line + c->line_len - n, '\n', (size_t)n) != NULL;
+        int too_long = !complete && c->line_len == sizeof(c->line) - 1;
+        if ((complete || too_long) && client_execute(c, too_long) != 0) {
+            return -1;
+        }
+    }
+    while (c->out_sent < c->out_len) {
+        ssize_t n = send(c->fd, c->out + c->out_sent, c->out_len - c->out_sent, MSG_NOSIGNAL);
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+        }
+        c->out_sent += (size_t)n;
+    }
+    return -1; // Ответ отдан
+}
+
+int control_poll_fds(struct pollfd *fds, int max) {
+    int n = 0;
+    // При занятых слотах сокет не слушаем: иначе poll не давал бы спать
+    if (listen_fd != -1 && client_count < CONTROL_CLIENTS_MAX && n < max) {
+        fds[n++] = (struct pollfd){ .fd = listen_fd, .events = POLLIN };
+    }
+    for (int i = 0; i < CONTROL_CLIENTS_MAX && n < max; ++i) {
+        if (clients[i].fd != -1) {
+            fds[n++] = (struct pollfd){
+                .fd = clients[i].fd,
+                .events = clients[i].out ? POLLOUT : POLLIN,
+            };
+        }
+    }
+    return n;
+}
+
+void control_serve(void) {
+    if (listen_fd == -1) {
+        return;
+    }
+    uint64_t now = control_now_ms();
+    for (int i = 0; i < CONTROL_CLIENTS_MAX; ++i) {
+        control_client_t *c = &clients[i];
+        if (c->fd != -1 && (now >= c->deadline_ms || client_progress(c) != 0)) {
+            client_close(c);
+        }
+    }
+
+    for (int i = 0; i < CONTROL_CLIENTS_MAX && client_count < CONTROL_CLIENTS_MAX; ++i) {
+        control_client_t *c = &clients[i];
+        if (c->fd != -1) continue;
+        int fd = accept4(listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd == -1) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                perror("Control: accept");
+            }
+            return;
+        }
+        *c = (control_client_t){ .fd = fd, .deadline_ms = now + CONTROL_TIMEOUT_MS };
+        client_count++;
+        // Команда обычно приходит вместе с подключением
+        if (client_progress(c) != 0) {
+            client_close(c);
+        }
+    }
+}
+
+void control_close(void) {
+    for (int i = 0; i < CONTROL_CLIENTS_MAX && client_count > 0; ++i) {
+        if (clients[i].fd != -1) {
+            client_close(&clients[i]);
+        }
+    }
+    if (listen_fd == -1) {
+        return;
+    }
+    close(listen_fd);
+    listen_fd = -1;
+    // После обновления бинаря путь уже принадлежит новому процессу
+    struct stat st;
+    if (stat(g_config.control_socket, &st) == 0 && st.st_ino == listen_ino) {
+        unlink(g_config.control_socket);
+    }
+}
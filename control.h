@@ -0,0 +1,35 @@
+#ifndef CONTROL_H
+#define CONTROL_H
+
+// Управляющий сокет (control_socket, Unix stream, доступ только
+// владельцу): наблюдение и настройка работающего сервера. Одна команда
+// на соединение, строка до '\n':
+//   get KEY          значение числового параметра
+//   set KEY VALUE    изменить живой параметр (CONFIG_LIVE в config.c)
+//   keys             числовые параметры: имя, значение, диапазон, live/fixed
+//   metrics          счетчики в формате Prometheus, как /metrics
+//   trace            выгрузить трассу в trace_file, как SIGUSR2
+// Первая строка ответа - "ok" или "error: причина", за ней данные.
+// Команды выполняет главный тред. Клиенты обслуживаются неблокирующими
+// сокетами вместе с остальными событиями главного треда, так что
+// медленный клиент ничего не задерживает; клиент, не успевший за
+// CONTROL_TIMEOUT_MS прислать команду и забрать ответ, отключается
+
+struct pollfd;
+
+// Главный тред, после запуска воркеров. 0 - сокет слушается или не
+// задан, -1 - недоступен (сервер работает без него)
+int control_listen(void);
+
+// События сокета и клиентов для routes_watch: заполняет не больше max
+// элементов fds и возвращает их число
+int control_poll_fds(struct pollfd *fds, int max);
+
+// После ожидания: принять клиентов, продвинуть чтение команд и отправку
+// ответов, отключить просроченных. Не блокируется
+void control_serve(void);
+
+// Завершение: закрыть сокет и удалить путь, если его не занял новый процесс
+void control_close(void);
+
+#endif // CONTROL_H
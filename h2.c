@@ -0,0 +1,800 @@
+#include "h2.h"
+#include "hpack.h"
+#include "routes.h"
+#include "upstream.h"
+#include "response_cache.h"
+#include "loop_clock.h"
+#include "metrics.h"
+#include "config.h"
+#include "upgrade.h"
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define H2_PREFACE "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n"
+#define H2_PREFACE_LEN 24
+#define H2_FRAME_HEADER 9
+#define H2_FRAME_SIZE 16384          // SETTINGS_MAX_FRAME_SIZE по умолчанию: больше не шлем и не принимаем
+#define H2_DEFAULT_WINDOW 65535
+#define H2_MAX_WINDOW 0x7fffffff
+#define H2_MAX_STREAMS PIPELINE_MAX_REQUESTS
+#define H2_INM_MAX 256               // If-None-Match длиннее не сравниваем
+#define H2_CTRL_MAX 256              // Управляющие кадры пачки
+#define H2_GOAWAY_LEN (H2_FRAME_HEADER + 8)
+#define H2_RST_LEN (H2_FRAME_HEADER + 4)
+
+enum {
+    H2_DATA = 0x0,
+    H2_HEADERS = 0x1,
+    H2_PRIORITY = 0x2,
+    H2_RST_STREAM = 0x3,
+    H2_SETTINGS = 0x4,
+    H2_PUSH_PROMISE = 0x5,
+    H2_PING = 0x6,
+    H2_GOAWAY = 0x7,
+    H2_WINDOW_UPDATE = 0x8,
+    H2_CONTINUATION = 0x9,
+};
+
+#define H2_FLAG_END_STREAM 0x1
+#define H2_FLAG_ACK 0x1
+#define H2_FLAG_END_HEADERS 0x4
+#define H2_FLAG_PADDED 0x8
+#define H2_FLAG_PRIORITY 0x20
+
+enum {
+    H2_NO_ERROR = 0x0,
+    H2_PROTOCOL_ERROR = 0x1,
+    H2_FLOW_CONTROL_ERROR = 0x3,
+    H2_FRAME_SIZE_ERROR = 0x6,
+    H2_REFUSED_STREAM = 0x7,
+    H2_COMPRESSION_ERROR = 0x9,
+    H2_ENHANCE_YOUR_CALM = 0xb,
+};
+
+enum {
+    H2_SETTINGS_ENABLE_PUSH = 0x2,
+    H2_SETTINGS_MAX_CONCURRENT_STREAMS = 0x3,
+    H2_SETTINGS_INITIAL_WINDOW_SIZE = 0x4,
+    H2_SETTINGS_MAX_FRAME_SIZE = 0x5,
+    H2_SETTINGS_MAX_HEADER_LIST_SIZE = 0x6,
+};
+
+// Итог разбора кадра
+enum {
+    H2_FAIL = -1,                // Ошибка соединения: GOAWAY уже в пачке
+    H2_STOP = 0,                 // Нужны еще данные или место в пачке
+    H2_NEXT = 1,
+    H2_WAIT = 2,                 // Агрегирующий запрос ждет бэкендов
+};
+
+typedef enum {
+    H2_STREAM_FREE = 0,
+    H2_STREAM_DEFERRED,          // Агрегирующий запрос ждет пустой пачки
+    H2_STREAM_UPSTREAM,          // Ждет бэкендов
+    H2_STREAM_SENDING,           // Ответ назначен, кадры уходят по мере окон
+    H2_STREAM_DONE,              // Последний кадр в текущей пачке
+} h2_stream_state_t;
+
+typedef struct {
+    uint32_t id;
+    int32_t window;              // Окно отправки потока
+    uint8_t state;               // h2_stream_state_t
+    uint8_t headers_sent;
+    const uint8_t *headers;      // HPACK-блок блоба ответа
+    uint32_t headers_len;
+    const char *body;
+    size_t body_len;
+    size_t body_sent;
+    // Ресурсы ответа, переданные потоку пачкой (освобождаются с потоком)
+    char *owned;
+    response_cache_entry_t *cached;
+    route_set_t *routes;
+} h2_stream_t;
+
+// Декодированный запрос: на buf указывает io->request_buf; URL в
+// начале, If-None-Match - с URL_MAX_LEN
+typedef struct {
+    uint16_t url_len;
+    uint16_t inm_len;
+    uint8_t method;
+    uint8_t has_method;
+    uint8_t bad;                 // :path пустой, длинный или повторен
+    uint8_t accept_encoding;
+    char buf[URL_MAX_LEN + H2_INM_MAX];
+} h2_request_t;
+
+struct h2_session_s {
+    hpack_table_t hpack;
+    h2_stream_t streams[H2_MAX_STREAMS];
+    int active;                  // Занятых слотов
+    int current;                 // Слот, которому пойдет ответ h2_respond
+    int upstream_stream;         // Слот агрегирующего запроса (ждет пачки или бэкендов), -1 - нет
+    uint32_t last_stream_id;
+    int32_t send_window;         // Окно отправки соединения
+    int32_t peer_window;         // SETTINGS_INITIAL_WINDOW_SIZE клиента
+    uint32_t data_skip;          // Непрочитанный остаток кадра DATA (тела запросов не нужны)
+    uint32_t recv_unacked;       // Принято DATA без WINDOW_UPDATE соединения
+    uint8_t processing;          // Внутри h2_process: пачку соберет он
+    uint8_t goaway;              // Новые потоки не принимаются
+    uint8_t closing;             // GOAWAY отправлен - после пачки соединение закрывается
+    h2_request_t req;
+
+    // Пачка: управляющие кадры перед ответами, заголовки кадров и
+    // HPACK-литерал Date
+    uint16_t ctrl_len;
+    uint8_t date_len;
+    int frames;
+    uint8_t ctrl[H2_CTRL_MAX];
+    uint8_t date[48];
+    uint8_t frame[RESPONSE_IOV_MAX][H2_FRAME_HEADER];
+};
+
+typedef struct h2_session_s h2_session_t;
+
+static void put32(uint8_t *p, uint32_t v) {
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+}
+
+static uint32_t get32(const uint8_t *p) {
+    return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+}
+
+static void frame_header(uint8_t *p, uint32_t len, uint8_t type, uint8_t flags, uint32_t id) {
+    p[0] = len >> 16;
+    p[1] = len >> 8;
+    p[2] = len;
+    p[3] = type;
+    p[4] = flags;
+    put32(p + 5, id & 0x7fffffff);
+}
+
+// Место под управляющий кадр; на GOAWAY место остается всегда
+static int ctrl_room(const h2_session_t *s, size_t len) {
+    return s->ctrl_len + len + H2_GOAWAY_LEN <= H2_CTRL_MAX;
+}
+
+static void ctrl_frame(h2_session_t *s, uint8_t type, uint8_t flags, uint32_t id,
+                       const uint8_t *payload, size_t len) {
+    frame_header(s->ctrl + s->ctrl_len, len, type, flags, id);
+    if (len > 0) {
+        memcpy(s->ctrl + s->ctrl_len + H2_FRAME_HEADER, payload, len);
+    }
+    s->ctrl_len += H2_FRAME_HEADER + len;
+}
+
+static void ctrl_rst_stream(h2_session_t *s, uint32_t id, uint32_t code) {
+    uint8_t payload[4];
+    put32(payload, code);
+    ctrl_frame(s, H2_RST_STREAM, 0, id, payload, sizeof(payload));
+}
+
+// Ошибка соединения (RFC 9113, 5.4.1): GOAWAY и закрытие после пачки
+// GOAWAY: место под него ctrl_room держит всегда
+static void ctrl_goaway(h2_session_t *s, uint32_t code) {
+    uint8_t payload[8];
+    put32(payload, s->last_stream_id);
+    put32(payload + 4, code);
+    ctrl_frame(s, H2_GOAWAY, 0, 0, payload, sizeof(payload));
+    s->goaway = 1;
+}
+
+static int h2_fail(connection_t *conn, h2_session_t *s, uint32_t code) {
+    if (!s->closing) {
+        ctrl_goaway(s, code);
+        s->closing = 1;
+    }
+    conn->keep_alive = 0;
+    return H2_FAIL;
+}
+
+int h2_preface(const connection_t *conn) {
+    if (g_config.http2_max_streams == 0 || conn->parse_offset != 0) {
+        return 0;
+    }
+    size_t n = conn->bytes_read < H2_PREFACE_LEN ? conn->bytes_read : H2_PREFACE_LEN;
+    return n > 0 && memcmp(conn->io->read_buf, H2_PREFACE, n) == 0;
+}
+
+static h2_session_t *session_new(void) {
+    h2_session_t *s = calloc(1, sizeof(*s));
+    if (!s) {
+        return NULL;
+    }
+    hpack_table_init(&s->hpack);
+    s->upstream_stream = -1;
+    s->send_window = H2_DEFAULT_WINDOW;
+    s->peer_window = H2_DEFAULT_WINDOW;
+
+    // SETTINGS сервера - первый кадр соединения
+    uint8_t settings[12];
+    settings[0] = 0;
+    settings[1] = H2_SETTINGS_MAX_CONCURRENT_STREAMS;
+    put32(settings + 2, g_config.http2_max_streams);
+    settings[6] = 0;
+    settings[7] = H2_SETTINGS_MAX_HEADER_LIST_SIZE;
+    put32(settings + 8, BUFFER_SIZE);
+    ctrl_frame(s, H2_SETTINGS, 0, 0, settings, sizeof(settings));
+
+    if (worker_metrics) {
+        metric_add(&worker_metrics->h2_connections, 1);
+    }
+    return s;
+}
+
+static void stream_release(h2_session_t *s, h2_stream_t *st) {
+    free(st->owned);
+    response_cache_put(st->cached);
+    routes_put(st->routes);
+    memset(st, 0, sizeof(*st));
+    s->active--;
+}
+
+static int stream_find(const h2_session_t *s, uint32_t id) {
+    for (int i = 0; i < H2_MAX_STREAMS; ++i) {
+        if (s->streams[i].state != H2_STREAM_FREE && s->streams[i].id == id) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+// Поток, которому можно отправить кадр, не дожидаясь клиента
+static int stream_sendable(const h2_session_t *s, const h2_stream_t *st) {
+    return st->state == H2_STREAM_SENDING &&
+           (!st->headers_sent ||
+            (st->body_sent < st->body_len && st->window > 0 && s->send_window > 0));
+}
+
+static int batch_empty(const h2_session_t *s) {
+    if (s->ctrl_len > 0) {
+        return 0;
+    }
+    for (int i = 0; i < H2_MAX_STREAMS; ++i) {
+        if (stream_sendable(s, &s->streams[i])) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+int h2_pending(const connection_t *conn) {
+    const h2_session_t *s = conn->h2;
+    if (s->upstream_stream >= 0 && s->streams[s->upstream_stream].state == H2_STREAM_DEFERRED) {
+        return 1;
+    }
+    return !batch_empty(s);
+}
+
+// HPACK-литерал Date, один на пачку - как копия Date в HTTP/1.1
+static void build_date(h2_session_t *s) {
+    if (UNLIKELY(loop_clock.date_header_len == 0)) {
+        loop_clock_update();
+    }
+    // "Date: " и "\r\n" вокруг значения
+    s->date_len = hpack_encode_literal(s->date, sizeof(s->date), HPACK_DATE, NULL, 0,
+                                       loop_clock.date_header + 6,
+                                       loop_clock.date_header_len - 8);
+}
+
+// Кадры пачки в response_iov: управляющие, HEADERS новых ответов, затем
+// DATA по кадру на поток за проход в пределах окон - короткий ответ не
+// ждет за большим телом. Недочитанное тело запроса после полного ответа
+// пропускается без RST_STREAM: часть клиентов теряет на нем и сам ответ
+static void h2_fill(connection_t *conn) {
+    h2_session_t *s = conn->h2;
+    connection_io_t *io = conn->io;
+    struct iovec *iov = io->response_iov;
+    const int limit = RESPONSE_IOV_MAX;
+    int n = 0;
+
+    if (s->ctrl_len > 0) {
+        iov[n].iov_base = s->ctrl;
+        iov[n++].iov_len = s->ctrl_len;
+    }
+    for (int i = 0; i < H2_MAX_STREAMS && n + 3 <= limit; ++i) {
+        h2_stream_t *st = &s->streams[i];
+        if (st->state != H2_STREAM_SENDING || st->headers_sent) {
+            continue;
+        }
+        if (s->date_len == 0) {
+            build_date(s);
+        }
+        uint8_t *hdr = s->frame[s->frames++];
+        frame_header(hdr, st->headers_len + s->date_len, H2_HEADERS,
+                     H2_FLAG_END_HEADERS | (st->body_len == 0 ? H2_FLAG_END_STREAM : 0), st->id);
+        iov[n].iov_base = hdr;
+        iov[n++].iov_len = H2_FRAME_HEADER;
+        iov[n].iov_base = (void *)st->headers;
+        iov[n++].iov_len = st->headers_len;
+        iov[n].iov_base = s->date;
+        iov[n++].iov_len = s->date_len;
+        st->headers_sent = 1;
+    }
+    for (int progress = 1; progress && n + 2 <= limit; ) {
+        progress = 0;
+        for (int i = 0; i < H2_MAX_STREAMS && n + 2 <= limit; ++i) {
+            h2_stream_t *st = &s->streams[i];
+            int32_t window = st->window < s->send_window ? st->window : s->send_window;
+            if (st->state != H2_STREAM_SENDING || !st->headers_sent ||
+                st->body_sent == st->body_len || window <= 0) {
+                continue; // Остаток - после WINDOW_UPDATE
+            }
+            size_t chunk = st->body_len - st->body_sent;
+            if (chunk > H2_FRAME_SIZE) chunk = H2_FRAME_SIZE;
+            if (chunk > (size_t)window) chunk = window;
+            int last = st->body_sent + chunk == st->body_len;
+
+            uint8_t *hdr = s->frame[s->frames++];
+            frame_header(hdr, chunk, H2_DATA, last ? H2_FLAG_END_STREAM : 0, st->id);
+            iov[n].iov_base = hdr;
+            iov[n++].iov_len = H2_FRAME_HEADER;
+            iov[n].iov_base = (void *)(st->body + st->body_sent);
+            iov[n++].iov_len = chunk;
+            st->body_sent += chunk;
+            st->window -= chunk;
+            s->send_window -= chunk;
+            progress = 1;
+        }
+    }
+    for (int i = 0; i < H2_MAX_STREAMS; ++i) {
+        h2_stream_t *st = &s->streams[i];
+        if (st->state != H2_STREAM_SENDING || !st->headers_sent || st->body_sent != st->body_len) {
+            continue;
+        }
+        st->state = H2_STREAM_DONE;
+    }
+
+    io->response_iovcnt = n;
+    io->response_iov_pos = 0;
+    if (n > 0) {
+        conn->state = STATE_WRITING;
+    }
+}
+
+void h2_respond(connection_t *conn, const response_blob_t *blob) {
+    h2_session_t *s = conn->h2;
+    connection_io_t *io = conn->io;
+    h2_stream_t *st = &s->streams[s->current];
+
+    st->headers = (const uint8_t *)blob->data + blob->h2_off;
+    st->headers_len = blob->h2_len;
+    st->body = blob->body;
+    st->body_len = blob->body_len;
+    st->body_sent = 0;
+    st->headers_sent = 0;
+    // Тело может отправляться дольше пачки - ресурсы ответа держит поток
+    st->owned = io->response_owned;
+    io->response_owned = NULL;
+    st->cached = io->response_cached;
+    io->response_cached = NULL;
+    st->routes = io->routes;
+    routes_ref(io->routes);
+    st->state = H2_STREAM_SENDING;
+
+    if (s->upstream_stream == s->current) {
+        s->upstream_stream = -1;
+    }
+    if (!s->processing) {
+        h2_fill(conn); // Ответ бэкендов пришел вне разбора кадров
+    }
+}
+
+static int on_request_field(void *ctx, const char *name, size_t name_len,
+                            const char *value, size_t value_len) {
+    h2_request_t *req = ctx;
+    if (name_len == 5 && memcmp(name, ":path", 5) == 0) {
+        if (req->url_len != 0 || value_len == 0 || value_len >= URL_MAX_LEN) {
+            req->bad = 1;
+            return 0;
+        }
+        memcpy(req->buf, value, value_len);
+        req->url_len = value_len;
+    } else if (name_len == 7 && memcmp(name, ":method", 7) == 0) {
+        // Ответ зависит только от того, GET ли это: остальные получат 405
+        req->method = value_len == 3 && memcmp(value, "GET", 3) == 0 ? HTTP_GET : HTTP_POST;
+        req->has_method = 1;
+    } else if (name_len == 15 && memcmp(name, "accept-encoding", 15) == 0) {
+        req->accept_encoding |= http_parse_accept_encoding(value, value_len);
+    } else if (name_len == 13 && memcmp(name, "if-none-match", 13) == 0) {
+        if (value_len <= H2_INM_MAX) {
+            memcpy(req->buf + URL_MAX_LEN, value, value_len);
+            req->inm_len = value_len;
+        }
+    }
+    return 0;
+}
+
+// Поля запроса в io - как их оставляет http_parse_request
+static void request_to_io(connection_t *conn, h2_request_t *req) {
+    connection_io_t *io = conn->io;
+    io->request_buf = req->buf;
+    io->url_len = 0;
+    io->route_id = -1;
+    io->method = req->method;
+    io->accept_encoding = req->accept_encoding;
+    io->if_none_match_off = URL_MAX_LEN;
+    io->if_none_match_len = req->inm_len;
+    if (!req->bad && req->has_method) {
+        http_set_request_url(conn, req->buf, req->url_len);
+    }
+}
+
+static int stream_handle(connection_t *conn, h2_session_t *s, int slot) {
+    connection_io_t *io = conn->io;
+    h2_stream_t *st = &s->streams[slot];
+    int aggregate = 0;
+    if (io->url_len != 0 && io->method == HTTP_GET && io->route_id >= 0) {
+        aggregate = io->routes->routes[io->route_id].aggregate;
+    }
+    s->current = slot;
+
+    if (UNLIKELY(aggregate != 0)) {
+        s->upstream_stream = slot;
+        if (!batch_empty(s)) {
+            // Ответ бэкендов придет позже - сначала отправляем готовые
+            st->state = H2_STREAM_DEFERRED;
+            return H2_STOP;
+        }
+        st->state = H2_STREAM_UPSTREAM;
+        int started = upstream_start(conn, aggregate - 1);
+        if (started == UPSTREAM_PENDING) {
+            return H2_WAIT;
+        }
+        if (started < 0) {
+            handle_request_and_prepare_response(conn); // 502
+        }
+    } else {
+        handle_request_and_prepare_response(conn);
+    }
+    // Ошибка запроса закрывает поток, а не соединение
+    conn->keep_alive = !s->closing;
+    return H2_NEXT;
+}
+
+static int on_headers_block(connection_t *conn, h2_session_t *s, uint32_t id,
+                            const uint8_t *block, size_t len) {
+    memset(&s->req, 0, offsetof(h2_request_t, buf));
+    if (hpack_decode(&s->hpack, block, len, on_request_field, &s->req) != 0) {
+        return h2_fail(conn, s, H2_COMPRESSION_ERROR);
+    }
+
+    if (id <= s->last_stream_id) {
+        // Трейлеры открытого потока или кадр закрытого: таблица HPACK уже обновлена
+        return H2_NEXT;
+    }
+    s->last_stream_id = id;
+    if (s->goaway) {
+        return H2_NEXT;
+    }
+    if (worker_metrics) {
+        metric_add(&worker_metrics->h2_streams, 1);
+    }
+
+    int slot = -1;
+    if (s->active < g_config.http2_max_streams) {
+        for (slot = 0; s->streams[slot].state != H2_STREAM_FREE; ++slot) {
+        }
+    }
+    if (slot < 0) {
+        ctrl_rst_stream(s, id, H2_REFUSED_STREAM); // Место проверено до разбора
+        return H2_NEXT;
+    }
+    h2_stream_t *st = &s->streams[slot];
+    memset(st, 0, sizeof(*st));
+    st->id = id;
+    st->window = s->peer_window;
+    s->active++;
+
+    request_to_io(conn, &s->req);
+    return stream_handle(conn, s, slot);
+}
+
+// HEADERS и CONTINUATION до END_HEADERS - все кадры блока уже в буфере
+static int on_headers(connection_t *conn, h2_session_t *s, const uint8_t *frame,
+                      size_t avail, uint32_t len, uint8_t flags, uint32_t id) {
+    if (id == 0 || (id & 1) == 0) {
+        return h2_fail(conn, s, H2_PROTOCOL_ERROR);
+    }
+    if (!ctrl_room(s, H2_RST_LEN)) {
+        return H2_STOP; // Отказ REFUSED_STREAM должен поместиться
+    }
+
+    const uint8_t *payload = frame + H2_FRAME_HEADER;
+    size_t plen = len;
+    if (flags & H2_FLAG_PADDED) {
+        if (plen < 1 || payload[0] >= plen) {
+            return h2_fail(conn, s, H2_PROTOCOL_ERROR);
+        }
+        plen -= 1 + payload[0];
+        payload++;
+    }
+    if (flags & H2_FLAG_PRIORITY) {
+        if (plen < 5) {
+            return h2_fail(conn, s, H2_PROTOCOL_ERROR);
+        }
+        payload += 5;
+        plen -= 5;
+    }
+
+    size_t total = H2_FRAME_HEADER + len;
+    if (flags & H2_FLAG_END_HEADERS) {
+        conn->parse_offset += total;
+        return on_headers_block(conn, s, id, payload, plen);
+    }
+
+    // Блок по частям: собираем продолжения подряд
+    uint8_t block[BUFFER_SIZE];
+    memcpy(block, payload, plen);
+    size_t block_len = plen;
+    uint8_t cont_flags = 0;
+    while (!(cont_flags & H2_FLAG_END_HEADERS)) {
+        if (avail < total + H2_FRAME_HEADER) {
+            return total + H2_FRAME_HEADER > BUFFER_SIZE ? h2_fail(conn, s, H2_ENHANCE_YOUR_CALM)
+                                                         : H2_STOP;
+        }
+        const uint8_t *c = frame + total;
+        uint32_t clen = (uint32_t)c[0] << 16 | c[1] << 8 | c[2];
+        if (c[3] != H2_CONTINUATION || (get32(c + 5) & 0x7fffffff) != id) {
+            return h2_fail(conn, s, H2_PROTOCOL_ERROR);
+        }
+        if (total + H2_FRAME_HEADER + clen > BUFFER_SIZE) {
+            return h2_fail(conn, s, H2_ENHANCE_YOUR_CALM);
+        }
+        if (avail < total + H2_FRAME_HEADER + clen) {
+            return H2_STOP;
+        }
+        memcpy(block + block_len, c + H2_FRAME_HEADER, clen);
+        block_len += clen;
+        cont_flags = c[4];
+        total += H2_FRAME_HEADER + clen;
+    }
+    conn->parse_offset += total;
+    return on_headers_block(conn, s, id, block, block_len);
+}
+
+static int on_settings(connection_t *conn, h2_session_t *s, const uint8_t *p, uint32_t len,
+                       uint8_t flags) {
+    if (flags & H2_FLAG_ACK) {
+        return len == 0 ? H2_NEXT : h2_fail(conn, s, H2_FRAME_SIZE_ERROR);
+    }
+    if (len % 6 != 0) {
+        return h2_fail(conn, s, H2_FRAME_SIZE_ERROR);
+    }
+    if (!ctrl_room(s, H2_FRAME_HEADER)) {
+        return H2_STOP;
+    }
+    for (uint32_t i = 0; i < len; i += 6) {
+        uint16_t key = (uint16_t)(p[i] << 8 | p[i + 1]);
+        uint32_t value = get32(p + i + 2);
+        if (key == H2_SETTINGS_ENABLE_PUSH && value > 1) {
+            return h2_fail(conn, s, H2_PROTOCOL_ERROR);
+        }
+        if (key == H2_SETTINGS_MAX_FRAME_SIZE && (value < H2_FRAME_SIZE || value > 0xffffff)) {
+            return h2_fail(conn, s, H2_PROTOCOL_ERROR);
+        }
+        if (key == H2_SETTINGS_INITIAL_WINDOW_SIZE) {
+            if (value > H2_MAX_WINDOW) {
+                return h2_fail(conn, s, H2_FLOW_CONTROL_ERROR);
+            }
+            // Новое начальное окно сдвигает окна открытых потоков (RFC 9113, 6.9.2)
+            int64_t delta = (int64_t)value - s->peer_window;
+            for (int j = 0; j < H2_MAX_STREAMS; ++j) {
+                h2_stream_t *st = &s->streams[j];
+                if (st->state == H2_STREAM_FREE) continue;
+                if (st->window + delta > H2_MAX_WINDOW) {
+                    return h2_fail(conn, s, H2_FLOW_CONTROL_ERROR);
+                }
+                st->window += delta;
+            }
+            s->peer_window = value;
+        }
+        // Остальное серверу не нужно: ответы без динамической таблицы и не длиннее 16 КБ на кадр
+    }
+    ctrl_frame(s, H2_SETTINGS, H2_FLAG_ACK, 0, NULL, 0);
+    return H2_NEXT;
+}
+
+static int on_window_update(connection_t *conn, h2_session_t *s, const uint8_t *p, uint32_t id) {
+    uint32_t increment = get32(p) & 0x7fffffff;
+    if (id == 0) {
+        if (increment == 0 || (int64_t)s->send_window + increment > H2_MAX_WINDOW) {
+            return h2_fail(conn, s, increment ? H2_FLOW_CONTROL_ERROR : H2_PROTOCOL_ERROR);
+        }
+        s->send_window += increment;
+        return H2_NEXT;
+    }
+    int slot = stream_find(s, id);
+    if (slot >= 0 && increment > 0) {
+        h2_stream_t *st = &s->streams[slot];
+        if ((int64_t)st->window + increment > H2_MAX_WINDOW) {
+            return h2_fail(conn, s, H2_FLOW_CONTROL_ERROR);
+        }
+        st->window += increment;
+    }
+    return H2_NEXT;
+}
+
+// Тела запросов не нужны: DATA пропускается по мере приема, окно
+// соединения возвращается клиенту WINDOW_UPDATE
+static void data_consumed(h2_session_t *s, uint32_t len) {
+    s->recv_unacked += len;
+    if (s->recv_unacked >= H2_DEFAULT_WINDOW / 2 && ctrl_room(s, H2_FRAME_HEADER + 4)) {
+        uint8_t payload[4];
+        put32(payload, s->recv_unacked);
+        ctrl_frame(s, H2_WINDOW_UPDATE, 0, 0, payload, sizeof(payload));
+        s->recv_unacked = 0;
+    }
+}
+
+static int h2_frame(connection_t *conn, h2_session_t *s) {
+    connection_io_t *io = conn->io;
+    const uint8_t *p = (const uint8_t *)io->read_buf + conn->parse_offset;
+    size_t avail = conn->bytes_read - conn->parse_offset;
+
+    if (s->data_skip > 0) {
+        size_t n = avail < s->data_skip ? avail : s->data_skip;
+        if (n == 0) {
+            return H2_STOP;
+        }
+        conn->parse_offset += n;
+        s->data_skip -= n;
+        return H2_NEXT;
+    }
+    if (avail < H2_FRAME_HEADER) {
+        return H2_STOP;
+    }
+
+    uint32_t len = (uint32_t)p[0] << 16 | p[1] << 8 | p[2];
+    uint8_t type = p[3], flags = p[4];
+    uint32_t id = get32(p + 5) & 0x7fffffff;
+    if (len > H2_FRAME_SIZE) {
+        return h2_fail(conn, s, H2_FRAME_SIZE_ERROR);
+    }
+    if (type == H2_DATA) {
+        if (id == 0) {
+            return h2_fail(conn, s, H2_PROTOCOL_ERROR);
+        }
+        conn->parse_offset += H2_FRAME_HEADER;
+        s->data_skip = len;
+        data_consumed(s, len);
+        return H2_NEXT;
+    }
+    if (avail < H2_FRAME_HEADER + len) {
+        return H2_FRAME_HEADER + len > BUFFER_SIZE ? h2_fail(conn, s, H2_ENHANCE_YOUR_CALM)
+                                                   : H2_STOP;
+    }
+    if (type == H2_HEADERS) {
+        return on_headers(conn, s, p, avail, len, flags, id);
+    }
+
+    const uint8_t *payload = p + H2_FRAME_HEADER;
+    int ret = H2_NEXT;
+    switch (type) {
+    case H2_SETTINGS:
+        ret = id != 0 ? h2_fail(conn, s, H2_PROTOCOL_ERROR) : on_settings(conn, s, payload, len, flags);
+        break;
+    case H2_PING:
+        if (len != 8 || id != 0) {
+            ret = h2_fail(conn, s, len != 8 ? H2_FRAME_SIZE_ERROR : H2_PROTOCOL_ERROR);
+        } else if (!(flags & H2_FLAG_ACK)) {
+            if (!ctrl_room(s, H2_FRAME_HEADER + 8)) {
+                return H2_STOP; // Поток PING тормозится отправкой ответов на него
+            }
+            ctrl_frame(s, H2_PING, H2_FLAG_ACK, 0, payload, 8);
+        }
+        break;
+    case H2_WINDOW_UPDATE:
+        ret = len != 4 ? h2_fail(conn, s, H2_FRAME_SIZE_ERROR) : on_window_update(conn, s, payload, id);
+        break;
+    case H2_RST_STREAM:
+        if (len != 4 || id == 0) {
+            ret = h2_fail(conn, s, len != 4 ? H2_FRAME_SIZE_ERROR : H2_PROTOCOL_ERROR);
+        } else {
+            int slot = stream_find(s, id);
+            if (slot >= 0) {
+                if (s->upstream_stream == slot) {
+                    s->upstream_stream = -1;
+                }
+                stream_release(s, &s->streams[slot]);
+            }
+        }
+        break;
+    case H2_GOAWAY:
+        s->goaway = 1; // Начатые потоки дописываем, затем закрываем
+        break;
+    case H2_PUSH_PROMISE:
+    case H2_CONTINUATION:
+        ret = h2_fail(conn, s, H2_PROTOCOL_ERROR);
+        break;
+    default:
+        break; // PRIORITY и неизвестные типы игнорируются
+    }
+    if (ret == H2_NEXT) {
+        conn->parse_offset += H2_FRAME_HEADER + len;
+    }
+    return ret;
+}
+
+int h2_process(connection_t *conn) {
+    connection_io_t *io = conn->io;
+    h2_session_t *s = conn->h2;
+    if (UNLIKELY(s == NULL)) {
+        if (conn->bytes_read < H2_PREFACE_LEN) {
+            return 0; // Начало префейса уже сверено h2_preface
+        }
+        s = session_new();
+        if (!s) {
+            return -1;
+        }
+        conn->h2 = s;
+        conn->parse_offset = H2_PREFACE_LEN;
+        conn->keep_alive = 1;
+    }
+
+    if (UNLIKELY(g_draining) && !s->goaway && ctrl_room(s, H2_GOAWAY_LEN)) {
+        // Сокеты у нового процесса: начатые потоки дописываются, новые
+        // клиент откроет в другом соединении. Запас под GOAWAY ошибки остается
+        ctrl_goaway(s, H2_NO_ERROR);
+    }
+
+    s->processing = 1;
+    int ret = H2_NEXT;
+    if (s->upstream_stream >= 0) {
+        // Отложенный агрегирующий запрос - первым в пустой пачке
+        ret = H2_STOP;
+        if (batch_empty(s)) {
+            request_to_io(conn, &s->req);
+            ret = stream_handle(conn, s, s->upstream_stream);
+        }
+    }
+    while (ret == H2_NEXT && s->upstream_stream < 0 && io->batch_count < PIPELINE_MAX_REQUESTS) {
+        ret = h2_frame(conn, s);
+    }
+    s->processing = 0;
+    if (ret == H2_WAIT) {
+        return HTTP_PIPELINE_PENDING;
+    }
+
+    h2_fill(conn);
+    if (io->response_iovcnt > 0) {
+        return 1;
+    }
+    if (!conn->keep_alive || (s->goaway && s->active == 0)) {
+        return -1; // Отправлять нечего, клиент уходит
+    }
+    connection_reset_for_next_request(conn); // Разобранные кадры больше не нужны
+    return 0;
+}
+
+void h2_sent(connection_t *conn) {
+    h2_session_t *s = conn->h2;
+    for (int i = 0; i < H2_MAX_STREAMS; ++i) {
+        if (s->streams[i].state == H2_STREAM_DONE) {
+            stream_release(s, &s->streams[i]);
+        }
+    }
+    s->ctrl_len = 0;
+    s->date_len = 0;
+    s->frames = 0;
+    if (s->goaway && s->active == 0) {
+        conn->keep_alive = 0;
+    }
+}
+
+void h2_session_free(connection_t *conn) {
+    h2_session_t *s = conn->h2;
+    if (!s) {
+        return;
+    }
+    for (int i = 0; i < H2_MAX_STREAMS; ++i) {
+        if (s->streams[i].state != H2_STREAM_FREE) {
+            stream_release(s, &s->streams[i]);
+        }
+    }
+    free(s);
+    conn->h2 = NULL;
+}
@@ -0,0 +1,45 @@
+#ifndef H2_H
+#define H2_H
+
+#include "connection.h"
+#include "http_handler.h"
+
+// HTTP/2 (RFC 9113) поверх того же FSM соединения: h2c с prior knowledge
+// (префейс в начале потока) и "h2", выбранный ALPN при рукопожатии TLS.
+// Кадры разбираются из read_buf в http_process_pipeline, запросы
+// обрабатываются handle_request_and_prepare_response, как запросы
+// HTTP/1.1, а ответы становятся кадрами HEADERS (готовый HPACK-блок
+// блоба плюс Date) и DATA (срезы тела блоба) в одном response_iov.
+//
+// Потоков на соединение - до http2_max_streams. Поток держит свой ответ
+// (тело, запись кэша, таблицу роутов), пока тело не уйдет целиком:
+// DATA ограничены окнами управления потоком клиента, и большое тело
+// отправляется несколькими пачками по мере WINDOW_UPDATE. Агрегирующий
+// роут, как в HTTP/1.1, ждет бэкендов один и с пустой пачкой: чтение
+// кадров соединения на это время останавливается
+
+// Начало read_buf - префейс HTTP/2 (весь или его начало)
+int h2_preface(const connection_t *conn);
+
+// Кадры из read_buf (первый вызов - после префейса создает сессию).
+// Итог - как у http_process_pipeline
+int h2_process(connection_t *conn);
+
+// Ответ текущему потоку (append_response); динамическое тело и запись
+// кэша из io переходят к потоку
+void h2_respond(connection_t *conn, const response_blob_t *blob);
+
+// Пачка отправлена: отпускает потоки, чей ответ ушел целиком
+void h2_sent(connection_t *conn);
+
+// Есть кадры, которые можно отправить без новых данных от клиента
+int h2_pending(const connection_t *conn);
+
+static inline int h2_output_pending(const connection_t *conn) {
+    return conn->h2 != NULL && h2_pending(conn);
+}
+
+// Соединение возвращается в пул
+void h2_session_free(connection_t *conn);
+
+#endif // H2_H
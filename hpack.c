@@ -0,0 +1,327 @@
+#include "hpack.h"
+#include <string.h>
+#include <strings.h>
+
+#define HPACK_STATIC_COUNT 61
+#define HPACK_ENTRY_OVERHEAD 32
+
+typedef struct {
+    const char *name;
+    const char *value;
+} hpack_static_t;
+
+// RFC 7541, приложение A
+static const hpack_static_t static_table[HPACK_STATIC_COUNT] = {
+    { ":authority", "" }, { ":method", "GET" }, { ":method", "POST" },
+    { ":path", "/" }, { ":path", "/index.html" }, { ":scheme", "http" },
+    { ":scheme", "https" }, { ":status", "200" }, { ":status", "204" },
+    { ":status", "206" }, { ":status", "304" }, { ":status", "400" },
+    { ":status", "404" }, { ":status", "500" }, { "accept-charset", "" },
+    { "accept-encoding", "gzip, deflate" }, { "accept-language", "" },
+    { "accept-ranges", "" }, { "accept", "" }, { "access-control-allow-origin", "" },
+    { "age", "" }, { "allow", "" }, { "authorization", "" }, { "cache-control", "" },
+    { "content-disposition", "" }, { "content-encoding", "" }, { "content-language", "" },
+    { "content-length", "" }, { "content-location", "" }, { "content-range", "" },
+    { "content-type", "" }, { "cookie", "" }, { "date", "" }, { "etag", "" },
+    { "expect", "" }, { "expires", "" }, { "from", "" }, { "host", "" },
+    { "if-match", "" }, { "if-modified-since", "" }, { "if-none-match", "" },
+    { "if-range", "" }, { "if-unmodified-since", "" }, { "last-modified", "" },
+    { "link", "" }, { "location", "" }, { "max-forwards", "" },
+    { "proxy-authenticate", "" }, { "proxy-authorization", "" }, { "range", "" },
+    { "referer", "" }, { "refresh", "" }, { "retry-after", "" }, { "server", "" },
+    { "set-cookie", "" }, { "strict-transport-security", "" },
+    { "transfer-encoding", "" }, { "user-agent", "" }, { "vary", "" }, { "via", "" },
+    { "www-authenticate", "" },
+};
+
+// Код Хаффмана (приложение B) канонический: код задается числом кодов
+// каждой длины и символами, упорядоченными по длине кода, затем по значению
+static const uint8_t huff_count[31] = {
+    0, 0, 0, 0, 0, 10, 26, 32, 6, 0, 5, 3, 2, 6, 2, 3,
+    0, 0, 0, 3, 8, 13, 26, 29, 12, 4, 15, 19, 29, 0, 4,
+};
+
+#define HUFF_EOS 256
+
+static const uint16_t huff_symbol[257] = {
+    48, 49, 50, 97, 99, 101, 105, 111, 115, 116, 32, 37, 45, 46, 47, 51,
+    52, 53, 54, 55, 56, 57, 61, 65, 95, 98, 100, 102, 103, 104, 108, 109,
+    110, 112, 114, 117, 58, 66, 67, 68, 69, 70, 71, 72, 73, 74, 75, 76,
+    77, 78, 79, 80, 81, 82, 83, 84, 85, 86, 87, 89, 106, 107, 113, 118,
+    119, 120, 121, 122, 38, 42, 44, 59, 88, 90, 33, 34, 40, 41, 63, 39,
+    43, 124, 35, 62, 0, 36, 64, 91, 93, 126, 94, 125, 60, 96, 123, 92,
+    195, 208, 128, 130, 131, 162, 184, 194, 224, 226, 153, 161, 167, 172, 176, 177,
+    179, 209, 216, 217, 227, 229, 230, 129, 132, 133, 134, 136, 146, 154, 156, 160,
+    163, 164, 169, 170, 173, 178, 181, 185, 186, 187, 189, 190, 196, 198, 228, 232,
+    233, 1, 135, 137, 138, 139, 140, 141, 143, 147, 149, 150, 151, 152, 155, 157,
+    158, 165, 166, 168, 174, 175, 180, 182, 183, 188, 191, 197, 231, 239, 9, 142,
+    144, 145, 148, 159, 171, 206, 215, 225, 236, 237, 199, 207, 234, 235, 192, 193,
+    200, 201, 202, 205, 210, 213, 218, 219, 238, 240, 242, 243, 255, 203, 204, 211,
+    212, 214, 221, 222, 223, 241, 244, 245, 246, 247, 248, 250, 251, 252, 253, 254,
+    2, 3, 4, 5, 6, 7, 8, 11, 12, 14, 15, 16, 17, 18, 19, 20,
+    21, 23, 24, 25, 26, 27, 28, 29, 30, 31, 127, 220, 249, 10, 13, 22,
+    256,
+};
+
+// Побитовый разбор канонического кода: на каждой длине код сравнивается
+// с диапазоном кодов этой длины. Хвост - не длиннее 7 бит и из единиц
+// (префикс EOS); сам EOS в строке - ошибка
+static int huff_decode(const uint8_t *in, size_t len, char *out, size_t *out_len) {
+    size_t n = 0;
+    int code = 0, first = 0, index = 0, bits = 0, ones = 1;
+
+    for (size_t i = 0; i < len; ++i) {
+        for (int shift = 7; shift >= 0; --shift) {
+            int bit = (in[i] >> shift) & 1;
+            code |= bit;
+            ones &= bit;
+            bits++;
+            int count = huff_count[bits];
+            if (code - first < count) {
+                int symbol = huff_symbol[index + code - first];
+                if (symbol == HUFF_EOS || n == HPACK_STRING_MAX) {
+                    return -1;
+                }
+                out[n++] = (char)symbol;
+                code = first = index = bits = 0;
+                ones = 1;
+                continue;
+            }
+            if (bits == 30) {
+                return -1;
+            }
+            index += count;
+            first = (first + count) << 1;
+            code <<= 1;
+        }
+    }
+    if (bits > 7 || !ones) {
+        return -1;
+    }
+    *out_len = n;
+    return 0;
+}
+
+static int decode_int(const uint8_t **p, const uint8_t *end, int prefix_bits, uint32_t *out) {
+    if (*p >= end) {
+        return -1;
+    }
+    uint32_t max = (1u << prefix_bits) - 1;
+    uint32_t value = *(*p)++ & max;
+    if (value < max) {
+        *out = value;
+        return 0;
+    }
+    for (int shift = 0; *p < end && shift <= 21; shift += 7) {
+        uint8_t byte = *(*p)++;
+        value += (uint32_t)(byte & 0x7f) << shift;
+        if (!(byte & 0x80)) {
+            *out = value;
+            return 0;
+        }
+    }
+    return -1; // Обрыв или больше 2^28 - таких длин и индексов не бывает
+}
+
+// Строка без Хаффмана остается срезом блока, закодированная - в buf
+static int decode_string(const uint8_t **p, const uint8_t *end, char *buf,
+                         const char **str, size_t *len) {
+    if (*p >= end) {
+        return -1;
+    }
+    int huffman = **p & 0x80;
+    uint32_t n;
+    if (decode_int(p, end, 7, &n) != 0 || n > (size_t)(end - *p)) {
+        return -1;
+    }
+    if (huffman) {
+        if (huff_decode(*p, n, buf, len) != 0) {
+            return -1;
+        }
+        *str = buf;
+    } else {
+        *str = (const char *)*p;
+        *len = n;
+    }
+    *p += n;
+    return 0;
+}
+
+void hpack_table_init(hpack_table_t *table) {
+    table->size = 0;
+    table->max_size = HPACK_TABLE_SIZE;
+    table->count = 0;
+    table->used = 0;
+}
+
+static void table_evict(hpack_table_t *t, size_t need) {
+    while (t->count > 0 && t->size + need > t->max_size) {
+        uint16_t bytes = t->name_len[0] + t->value_len[0];
+        memmove(t->data, t->data + bytes, t->used - bytes);
+        t->used -= bytes;
+        t->size -= bytes + HPACK_ENTRY_OVERHEAD;
+        t->count--;
+        for (int i = 0; i < t->count; ++i) {
+            t->off[i] = t->off[i + 1] - bytes;
+            t->name_len[i] = t->name_len[i + 1];
+            t->value_len[i] = t->value_len[i + 1];
+        }
+    }
+}
+
+static void table_add(hpack_table_t *t, const char *name, size_t name_len,
+                      const char *value, size_t value_len) {
+    size_t entry = name_len + value_len + HPACK_ENTRY_OVERHEAD;
+    if (entry > t->max_size) {
+        table_evict(t, t->max_size + 1); // Запись больше таблицы ее очищает (RFC 7541, 4.4)
+        return;
+    }
+    // Имя может ссылаться на запись, которую вытеснит эта же вставка
+    char name_copy[HPACK_TABLE_SIZE];
+    if (name >= t->data && name < t->data + sizeof(t->data)) {
+        memcpy(name_copy, name, name_len);
+        name = name_copy;
+    }
+    table_evict(t, entry);
+
+    int i = t->count++;
+    t->off[i] = t->used;
+    t->name_len[i] = name_len;
+    t->value_len[i] = value_len;
+    memcpy(t->data + t->used, name, name_len);
+    memcpy(t->data + t->used + name_len, value, value_len);
+    t->used += name_len + value_len;
+    t->size += entry;
+}
+
+// Индекс 1..61 - статическая таблица, дальше - динамическая от новой записи
+static int table_get(const hpack_table_t *t, uint32_t index, const char **name, size_t *name_len,
+                     const char **value, size_t *value_len) {
+    if (index == 0) {
+        return -1;
+    }
+    if (index <= HPACK_STATIC_COUNT) {
+        const hpack_static_t *e = &static_table[index - 1];
+        *name = e->name;
+        *name_len = strlen(e->name);
+        *value = e->value;
+        *value_len = strlen(e->value);
+        return 0;
+    }
+    index -= HPACK_STATIC_COUNT + 1;
+    if (index >= t->count) {
+        return -1;
+    }
+    int i = t->count - 1 - index;
+    *name = t->data + t->off[i];
+    *name_len = t->name_len[i];
+    *value = *name + *name_len;
+    *value_len = t->value_len[i];
+    return 0;
+}
+
+int hpack_decode(hpack_table_t *table, const uint8_t *block, size_t len,
+                 hpack_field_fn field, void *ctx) {
+    const uint8_t *p = block, *end = block + len;
+    char name_buf[HPACK_STRING_MAX], value_buf[HPACK_STRING_MAX];
+
+    while (p < end) {
+        uint8_t byte = *p;
+        const char *name, *value;
+        size_t name_len, value_len;
+        uint32_t index;
+
+        if (byte & 0x80) {
+            // Поле целиком из таблицы
+            if (decode_int(&p, end, 7, &index) != 0 ||
+                table_get(table, index, &name, &name_len, &value, &value_len) != 0) {
+                return -1;
+            }
+            int ret = field(ctx, name, name_len, value, value_len);
+            if (ret != 0) return ret;
+            continue;
+        }
+        if ((byte & 0xe0) == 0x20) {
+            // Dynamic Table Size Update: предел не выше объявленного в SETTINGS
+            if (decode_int(&p, end, 5, &index) != 0 || index > HPACK_TABLE_SIZE) {
+                return -1;
+            }
+            table->max_size = index;
+            table_evict(table, 0);
+            continue;
+        }
+
+        // Литерал: с индексированием (01), без (0000) или никогда (0001)
+        int indexing = (byte & 0xc0) == 0x40;
+        if (decode_int(&p, end, indexing ? 6 : 4, &index) != 0) {
+            return -1;
+        }
+        if (index != 0) {
+            const char *unused;
+            size_t unused_len;
+            if (table_get(table, index, &name, &name_len, &unused, &unused_len) != 0) {
+                return -1;
+            }
+        } else if (decode_string(&p, end, name_buf, &name, &name_len) != 0) {
+            return -1;
+        }
+        if (decode_string(&p, end, value_buf, &value, &value_len) != 0) {
+            return -1;
+        }
+        int ret = field(ctx, name, name_len, value, value_len);
+        if (ret != 0) return ret;
+        if (indexing) {
+            table_add(table, name, name_len, value, value_len);
+        }
+    }
+    return 0;
+}
+
+size_t hpack_encode_int(uint8_t *out, uint32_t value, int prefix_bits, uint8_t first) {
+    uint32_t max = (1u << prefix_bits) - 1;
+    if (value < max) {
+        out[0] = first | value;
+        return 1;
+    }
+    size_t n = 0;
+    out[n++] = first | max;
+    value -= max;
+    while (value >= 0x80) {
+        out[n++] = (value & 0x7f) | 0x80;
+        value >>= 7;
+    }
+    out[n++] = value;
+    return n;
+}
+
+size_t hpack_encode_literal(uint8_t *out, size_t cap, int name_index,
+                            const char *name, size_t name_len,
+                            const char *value, size_t value_len) {
+    uint8_t tmp[6];
+    size_t need = hpack_encode_int(tmp, name_index, 4, 0x00) + 6 + value_len +
+                  (name_index == 0 ? 6 + name_len : 0);
+    if (need > cap) {
+        return 0;
+    }
+    size_t n = hpack_encode_int(out, name_index, 4, 0x00);
+    if (name_index == 0) {
+        n += hpack_encode_int(out + n, name_len, 7, 0x00);
+        for (size_t i = 0; i < name_len; ++i) {
+            char c = name[i];
+            out[n++] = (c >= 'A' && c <= 'Z') ? c - 'A' + 'a' : c; // Имена в HTTP/2 - строчные
+        }
+    }
+    n += hpack_encode_int(out + n, value_len, 7, 0x00);
+    memcpy(out + n, value, value_len);
+    return n + value_len;
+}
+
+int hpack_static_name(const char *name, size_t len) {
+    for (int i = 0; i < HPACK_STATIC_COUNT; ++i) {
+        if (strlen(static_table[i].name) == len &&
+            strncasecmp(static_table[i].name, name, len) == 0) {
+            return i + 1;
+        }
+    }
+    return 0;
+}
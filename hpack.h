@@ -0,0 +1,61 @@
+#ifndef HPACK_H
+#define HPACK_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// HPACK (RFC 7541) в объеме, нужном серверу HTTP/2 (h2.c). Декодер
+// запросов - полный: клиенты индексируют заголовки с первого запроса
+// и сжимают строки кодом Хаффмана. Ответы кодируются без индексирования
+// (статическая таблица и литералы), поэтому блок заголовков не зависит
+// от состояния соединения и собирается один раз вместе с блобом ответа
+
+#define HPACK_TABLE_SIZE 4096        // SETTINGS_HEADER_TABLE_SIZE по умолчанию - больше не объявляем
+#define HPACK_TABLE_ENTRIES (HPACK_TABLE_SIZE / 32) // У записи 32 байта накладных (RFC 7541, 4.1)
+#define HPACK_STRING_MAX 4096        // Декодированная строка длиннее - отказ
+
+// Индексы статической таблицы, которыми кодируются ответы
+#define HPACK_STATUS 8               // ":status: 200"; 9..14 - 204, 206, 304, 400, 404, 500
+#define HPACK_CONTENT_LENGTH 28
+#define HPACK_CONTENT_TYPE 31
+#define HPACK_DATE 33
+
+// Динамическая таблица декодера: записи от старой к новой, имена и
+// значения подряд в data. Вытеснение сдвигает оставшееся (до 4 КБ)
+typedef struct {
+    uint16_t size;               // Размер по RFC 7541, 4.1
+    uint16_t max_size;           // Предел от Dynamic Table Size Update
+    uint16_t count;
+    uint16_t used;               // Занято в data
+    uint16_t off[HPACK_TABLE_ENTRIES];
+    uint16_t name_len[HPACK_TABLE_ENTRIES];
+    uint16_t value_len[HPACK_TABLE_ENTRIES];
+    char data[HPACK_TABLE_SIZE];
+} hpack_table_t;
+
+void hpack_table_init(hpack_table_t *table);
+
+// Поле заголовка декодированного блока; строки живут до возврата
+typedef int (*hpack_field_fn)(void *ctx, const char *name, size_t name_len,
+                              const char *value, size_t value_len);
+
+// Декодирует блок заголовков целиком, вызывая field на каждое поле.
+// Возвращает 0, -1 - ошибка сжатия (COMPRESSION_ERROR соединения) или
+// ненулевой результат field
+int hpack_decode(hpack_table_t *table, const uint8_t *block, size_t len,
+                 hpack_field_fn field, void *ctx);
+
+// Целое с префиксом prefix_bits бит; first - старшие биты первого байта.
+// out - не меньше 6 байт
+size_t hpack_encode_int(uint8_t *out, uint32_t value, int prefix_bits, uint8_t first);
+
+// Литерал без индексирования; name_index - индекс имени в статической
+// таблице, 0 - имя литералом (строчными). Возвращает длину, 0 - не помещается
+size_t hpack_encode_literal(uint8_t *out, size_t cap, int name_index,
+                            const char *name, size_t name_len,
+                            const char *value, size_t value_len);
+
+// Индекс имени в статической таблице (без учета регистра), 0 - нет
+int hpack_static_name(const char *name, size_t len);
+
+#endif // HPACK_H
@@ -1,90 +1,213 @@
 #include "http_handler.h"
+#include "routes.h"
+#include "simd_utils.h"
+#include "loop_clock.h"
+#include "metrics.h"
+#include "config.h"
+#include "upstream.h"
+#include "response_cache.h"
+#include "h2.h"
+#include "hpack.h"
+#include "upgrade.h"
+#include "trace.h"
 #include <string.h>
 #include <stdio.h>
-#include <glib.h>
-#include <ctype.h>
+#include <strings.h>
+#include <limits.h>
+#include <stdint.h>
 #include <stdlib.h>
-#include <sys/stat.h>
 
-typedef struct {
-    char *json_buf;    // Указатель на содержимое JSON
-    size_t json_len;   // Длина содержимого
-} json_value_t;
-
-// Prometheus-метрики (заглушки, чтобы избежать C++ зависимостей)
-void metric_total_requests_inc(const char* url) { /* TODO: Prometheus integration */ (void)url; }
-void metric_error_requests_inc(const char* url, int code) { /* TODO: Prometheus integration */ (void)url; (void)code; }
-void metric_request_latency_observe(const char* url, double latency) { /* TODO: Prometheus integration */ (void)url; (void)latency; }
-
-// Security validation functions
-static int is_valid_url_char(char c) {
-    return isalnum(c) || c == '/' || c == '-' || c == '_' || c == '.' || c == '?' || c == '=' || c == '&';
-}
+// Допустимые символы URL: буквы, цифры и / - _ . ? = &
+static const uint8_t url_char_allowed[256] = {
+    ['a' ... 'z'] = 1, ['A' ... 'Z'] = 1, ['0' ... '9'] = 1,
+    ['/'] = 1, ['-'] = 1, ['_'] = 1, ['.'] = 1, ['?'] = 1, ['='] = 1, ['&'] = 1,
+};
 
+// Проверка URL за один проход по срезу (строка не NUL-терминирована):
+// допустимые символы и отсутствие "..", "//"
 static int validate_url(const char* url, size_t len) {
     if (len == 0 || len >= URL_MAX_LEN) return 0;
     if (url[0] != '/') return 0; // Must start with /
 
+    unsigned char prev = 0;
     for (size_t i = 0; i < len; i++) {
-        if (!is_valid_url_char(url[i])) return 0;
-    }
-
-    // Check for path traversal attempts
-    if (strstr(url, "..") != NULL) return 0;
-    if (strstr(url, "//") != NULL) return 0;
+        unsigned char c = url[i];
+        if (!url_char_allowed[c]) return 0;
 
-    return 1;
-}
-
-json_value_t* load_json_value(const char *filename) {
-    FILE *f = fopen(filename, "rb");
-    if (!f) return NULL;
-    struct stat st;
-    if (stat(filename, &st) != 0) { fclose(f); return NULL; }
-    char *buf = malloc(st.st_size + 1);
-    if (!buf) { fclose(f); return NULL; }
-    if (fread(buf, 1, st.st_size, f) != st.st_size) {
-        fclose(f); free(buf); return NULL;
+        // Check for path traversal attempts
+        if ((c == '.' || c == '/') && c == prev) return 0;
+        prev = c;
     }
-    buf[st.st_size] = '\0';
-    fclose(f);
 
-    json_value_t *val = malloc(sizeof(json_value_t));
-    if (!val) { free(buf); return NULL; }
-    val->json_buf = buf;
-    val->json_len = st.st_size;
-    return val;
+    return 1;
 }
 
-// Таблица роутов (используем GHashTable для простоты и эффективности)
-static GHashTable *routes = NULL;
-
 // Статические ответы (zero-copy)
-static const char *bonuses_json = "{\"bonuses\":[10,20,30]}";
-static const char *settings_json = "{\"settings\":{\"theme\":\"dark\"}}";
-static const char *games_json = "{\"games\":[\"chess\",\"poker\"]}";
-static const char *health_json = "{\"status\":\"OK\"}";
 static const char *not_found_json = "{\"error\":\"Not Found\"}";
 static const char *bad_request_json = "{\"error\":\"Bad Request\"}";
 static const char *method_not_allowed_json = "{\"error\":\"Method Not Allowed\"}";
+static const char *internal_error_json = "{\"error\":\"Internal Server Error\"}";
+static const char *overloaded_json = "{\"error\":\"Service Unavailable\"}";
+static const char *bad_gateway_json = "{\"error\":\"Bad Gateway\"}";
+
+static precomputed_response_t not_found_response;
+static precomputed_response_t bad_request_response;
+static precomputed_response_t method_not_allowed_response;
+static precomputed_response_t internal_error_response;
+static precomputed_response_t overloaded_response;
+static precomputed_response_t bad_gateway_response;
+
+// Запоминает срез URL в request_buf и находит роут по пути без query-строки
+static void set_request_url(connection_t *conn, const char *at, size_t length, size_t path_len) {
+    connection_io_t *io = conn->io;
+    io->url_off = at - io->request_buf;
+    io->url_len = length;
+    io->path_len = path_len;
+    io->route_id = route_set_lookup(io->routes, at, path_len);
+}
+
+static const char *content_encoding_names[CONTENT_ENCODING_COUNT] = {
+    [CONTENT_ENCODING_BR] = "br",
+    [CONTENT_ENCODING_GZIP] = "gzip",
+};
+
+const char *http_content_encoding_name(content_encoding_t encoding) {
+    return content_encoding_names[encoding];
+}
+
+// q=0 в параметрах элемента Accept-Encoding ("gzip;q=0", "br; q=0.000")
+static int accept_param_q_zero(const char *p, const char *end) {
+    while (p < end) {
+        const char *semi = memchr(p, ';', end - p);
+        if (!semi) return 0;
+        p = semi + 1;
+        while (p < end && (*p == ' ' || *p == '\t')) p++;
+        if (end - p >= 2 && (*p == 'q' || *p == 'Q') && p[1] == '=') {
+            p += 2;
+            if (p >= end || *p != '0') return 0;
+            for (p++; p < end && *p != ';' && *p != ' ' && *p != '\t'; p++) {
+                if (*p != '.' && *p != '0') return 0;
+            }
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Кодировки, которые клиент согласен принять: перечисленные с q > 0,
+// а при "*" - все, кроме явно перечисленных
+uint8_t http_parse_accept_encoding(const char *value, size_t len) {
+    uint8_t accepted = 0, listed = 0;
+    int wildcard = 0;
+    const char *p = value, *end = value + len;
+
+    while (p < end) {
+        while (p < end && (*p == ' ' || *p == '\t' || *p == ',')) p++;
+        if (p >= end) break;
+        const char *item_end = memchr(p, ',', (size_t)(end - p));
+        if (!item_end) item_end = end;
+        const char *name_end = p;
+        while (name_end < item_end && *name_end != ';' && *name_end != ' ' && *name_end != '\t') {
+            name_end++;
+        }
+
+        size_t name_len = name_end - p;
+        int accept = !accept_param_q_zero(name_end, item_end);
+        uint8_t bit = 0;
+        if (name_len == 2 && strncasecmp(p, "br", 2) == 0) {
+            bit = CONTENT_ENCODING_BIT(CONTENT_ENCODING_BR);
+        } else if ((name_len == 4 && strncasecmp(p, "gzip", 4) == 0) ||
+                   (name_len == 6 && strncasecmp(p, "x-gzip", 6) == 0)) {
+            bit = CONTENT_ENCODING_BIT(CONTENT_ENCODING_GZIP);
+        } else if (name_len == 1 && *p == '*') {
+            wildcard = accept;
+        }
+        listed |= bit;
+        if (accept) accepted |= bit;
+        p = item_end;
+    }
+
+    if (wildcard) {
+        accepted |= ((1u << CONTENT_ENCODING_COUNT) - 1) & ~listed;
+    }
+    return accepted;
+}
+
+void http_set_request_url(connection_t *conn, const char *url, size_t len) {
+    if (!validate_url(url, len)) {
+        return;
+    }
+    const char *q_mark = memchr(url, '?', len);
+    set_request_url(conn, url, len, q_mark ? (size_t)(q_mark - url) : len);
+}
 
 // Callback-функции для http-parser
 static int on_url_callback(http_parser* p, const char* at, size_t length) {
     connection_t* conn = (connection_t*)p->data;
 
     // Validate URL length and content
-    if (length >= URL_MAX_LEN) {
-        return -1; // URL too long
-    }
-
     if (!validate_url(at, length)) {
         return -1; // Invalid URL format
     }
 
-    // Safely copy URL
-    size_t url_len = (length < URL_MAX_LEN - 1) ? length : URL_MAX_LEN - 1;
-    memcpy(conn->url, at, url_len);
-    conn->url[url_len] = '\0';
+    const char *q_mark = memchr(at, '?', length);
+    set_request_url(conn, at, length, q_mark ? (size_t)(q_mark - at) : length);
+
+    return 0;
+}
+
+// Совпадает ли один из тегов If-None-Match с ETag представления.
+// Сравнение слабое (RFC 7232, 3.2): префикс W/ не учитывается
+static int if_none_match_hit(const char *value, size_t len, const char *etag, size_t etag_len) {
+    const char *p = value, *end = value + len;
+    while (p < end) {
+        while (p < end && (*p == ' ' || *p == '\t' || *p == ',')) p++;
+        if (p >= end) break;
+        if (*p == '*') return 1;
+        if (end - p >= 2 && p[0] == 'W' && p[1] == '/') p += 2;
+
+        const char *tag_end = p < end && *p == '"' ? memchr(p + 1, '"', (size_t)(end - p - 1)) : NULL;
+        if (!tag_end) return 0; // Не entity-tag - заголовок некорректен
+        tag_end++;
+        if ((size_t)(tag_end - p) == etag_len && memcmp(p, etag, etag_len) == 0) return 1;
+        p = tag_end;
+    }
+    return 0;
+}
+
+enum {
+    HEADER_OTHER = 0,
+    HEADER_ACCEPT_ENCODING,
+    HEADER_IF_NONE_MATCH,
+};
+
+// Разбор значений заголовков, нужных для выбора ответа
+static void on_request_header(connection_io_t *io, int header, const char *value, size_t len) {
+    if (header == HEADER_ACCEPT_ENCODING) {
+        io->accept_encoding |= http_parse_accept_encoding(value, len);
+    } else if (header == HEADER_IF_NONE_MATCH) {
+        io->if_none_match_off = value - io->request_buf;
+        io->if_none_match_len = len;
+    }
+}
+
+static int match_request_header(const char *name, size_t len) {
+    if (len == 15 && strncasecmp(name, "accept-encoding", 15) == 0) return HEADER_ACCEPT_ENCODING;
+    if (len == 13 && strncasecmp(name, "if-none-match", 13) == 0) return HEADER_IF_NONE_MATCH;
+    return HEADER_OTHER;
+}
+
+// Заголовки разбираются по полному блоку, поэтому имя и значение
+// приходят в callback'и целиком
+static int on_header_field_callback(http_parser* p, const char* at, size_t length) {
+    connection_t* conn = (connection_t*)p->data;
+    conn->io->header_match = match_request_header(at, length);
+    return 0;
+}
+
+static int on_header_value_callback(http_parser* p, const char* at, size_t length) {
+    connection_t* conn = (connection_t*)p->data;
+    on_request_header(conn->io, conn->io->header_match, at, length);
     return 0;
 }
 
@@ -92,7 +215,7 @@ static int on_headers_complete_callback(http_parser* p) {
     connection_t* conn = (connection_t*)p->data;
 
     // Security checks
-    if (p->content_length > 0) {
+    if (p->content_length > 0 && p->content_length != ULLONG_MAX) {
         return -1; // We don't accept request bodies
     }
 
@@ -110,118 +233,552 @@ static int on_headers_complete_callback(http_parser* p) {
     return 1;
 }
 
-void routes_init(void) {
-    if (routes != NULL) {
-        return; // Already initialized
+// Настройки http-parser: URL, заголовки выбора ответа и конец заголовков
+http_parser_settings parser_settings = {
+    .on_url = on_url_callback,
+    .on_header_field = on_header_field_callback,
+    .on_header_value = on_header_value_callback,
+    .on_headers_complete = on_headers_complete_callback,
+};
+
+// Те же заголовки в HPACK: литералы без индексирования, имена по
+// возможности из статической таблицы. Connection и Keep-Alive в HTTP/2
+// запрещены, Date добавляет h2.c
+static int build_h2_headers(uint8_t *out, size_t cap, int status_code, const char *content_type,
+                            size_t body_len, const char *extra_headers) {
+    static const int indexed_status[] = { 200, 204, 206, 304, 400, 404, 500 };
+    size_t n = 0, len;
+    char value[32];
+
+    for (size_t i = 0; i < sizeof(indexed_status) / sizeof(indexed_status[0]); ++i) {
+        if (indexed_status[i] == status_code) {
+            out[n++] = 0x80 | (HPACK_STATUS + i);
+            break;
+        }
+    }
+    if (n == 0) {
+        snprintf(value, sizeof(value), "%d", status_code);
+        if (!(len = hpack_encode_literal(out, cap, HPACK_STATUS, NULL, 0, value, strlen(value)))) {
+            return -1;
+        }
+        n += len;
+    }
+    if (status_code != 304) {
+        int value_len = snprintf(value, sizeof(value), "%zu", body_len);
+        if (!(len = hpack_encode_literal(out + n, cap - n, HPACK_CONTENT_TYPE, NULL, 0,
+                                         content_type, strlen(content_type)))) {
+            return -1;
+        }
+        n += len;
+        if (!(len = hpack_encode_literal(out + n, cap - n, HPACK_CONTENT_LENGTH, NULL, 0,
+                                         value, value_len))) {
+            return -1;
+        }
+        n += len;
+    }
+
+    // extra_headers и постоянные заголовки - строки "Name: value\r\n"
+    char fixed[512];
+    snprintf(fixed, sizeof(fixed),
+             "Server: BFF/1.0\r\n%sX-Content-Type-Options: nosniff\r\nX-Frame-Options: DENY\r\n",
+             extra_headers ? extra_headers : "");
+    for (const char *line = fixed; *line; ) {
+        const char *eol = strstr(line, "\r\n");
+        const char *colon = memchr(line, ':', eol ? (size_t)(eol - line) : 0);
+        if (!eol || !colon) {
+            return -1;
+        }
+        const char *v = colon + 1;
+        while (*v == ' ') v++;
+        size_t name_len = colon - line;
+        if (!(len = hpack_encode_literal(out + n, cap - n, hpack_static_name(line, name_len),
+                                         line, name_len, v, eol - v))) {
+            return -1;
+        }
+        n += len;
+        line = eol + 2;
+    }
+    return (int)n;
+}
+
+// Заголовки ответа; тело копируется в хвост data только при copy_body
+static int build_response_blob(response_blob_t *blob, int status_code, const char *status_text,
+                               const char *content_type, const char *body, size_t body_len,
+                               const char *extra_headers, int keep_alive, int copy_body) {
+    // Keep-Alive объявляет клиенту таймаут простоя из конфигурации
+    char connection_hdr[64];
+    if (keep_alive) {
+        snprintf(connection_hdr, sizeof(connection_hdr),
+                 "Connection: keep-alive\r\nKeep-Alive: timeout=%d\r\n",
+                 g_config.keepalive_timeout_ms / 1000);
+    } else {
+        snprintf(connection_hdr, sizeof(connection_hdr), "Connection: close\r\n");
     }
 
-    routes = g_hash_table_new(g_str_hash, g_str_equal);
-    if (routes == NULL) {
-        return; // Failed to create hash table
+    char head[256];
+    int head_len;
+    if (status_code == 304) {
+        // У 304 нет тела, а Content-Length описывал бы представление
+        head_len = snprintf(head, sizeof(head),
+            "HTTP/1.1 304 %s\r\n"
+            "Server: BFF/1.0\r\n",
+            status_text);
+    } else {
+        head_len = snprintf(head, sizeof(head),
+            "HTTP/1.1 %d %s\r\n"
+            "Content-Type: %s\r\n"
+            "Content-Length: %zu\r\n"
+            "Server: BFF/1.0\r\n",
+            status_code, status_text, content_type, body_len);
     }
 
-    g_hash_table_insert(routes, (gpointer)"/bonuses", (gpointer)bonuses_json);
-    g_hash_table_insert(routes, (gpointer)"/settings", (gpointer)settings_json);
-    g_hash_table_insert(routes, (gpointer)"/games", (gpointer)games_json);
-    g_hash_table_insert(routes, (gpointer)"/health", (gpointer)health_json);
+    char tail_hdr[512];
+    int tail_hdr_len = snprintf(tail_hdr, sizeof(tail_hdr),
+        "%s"
+        "X-Content-Type-Options: nosniff\r\n"
+        "X-Frame-Options: DENY\r\n"
+        "%s"
+        "\r\n",
+        extra_headers ? extra_headers : "", connection_hdr);
+
+    uint8_t h2[512];
+    int h2_len = build_h2_headers(h2, sizeof(h2), status_code, content_type, body_len,
+                                  extra_headers);
+    if (head_len < 0 || (size_t)head_len >= sizeof(head) ||
+        tail_hdr_len < 0 || (size_t)tail_hdr_len >= sizeof(tail_hdr) || h2_len < 0) {
+        return -1;
+    }
+
+    size_t h2_off = head_len + tail_hdr_len;
+    blob->data = malloc(h2_off + h2_len + (copy_body ? body_len : 0));
+    if (!blob->data) return -1;
+
+    memcpy(blob->data, head, head_len);
+    memcpy(blob->data + head_len, tail_hdr, tail_hdr_len);
+    memcpy(blob->data + h2_off, h2, h2_len);
+    blob->head_len = head_len;
+    blob->tail_len = tail_hdr_len;
+    blob->h2_off = h2_off;
+    blob->h2_len = h2_len;
+    if (copy_body) {
+        memcpy(blob->data + h2_off + h2_len, body, body_len);
+        body = blob->data + h2_off + h2_len;
+    }
+    blob->body = body;
+    blob->body_len = body_len;
+    return 0;
 }
 
-void routes_destroy(void) {
-    if (routes) {
-        g_hash_table_destroy(routes);
+int http_build_response(precomputed_response_t *resp, int status_code, const char *status_text,
+                        const char *content_type, const char *body, size_t body_len,
+                        const char *extra_headers) {
+    if (build_response_blob(&resp->keep_alive, status_code, status_text, content_type,
+                            body, body_len, extra_headers, 1, 0) != 0 ||
+        build_response_blob(&resp->close, status_code, status_text, content_type,
+                            body, body_len, extra_headers, 0, 0) != 0) {
+        http_free_response(resp);
+        return -1;
     }
+    return 0;
 }
 
-void handle_request_and_prepare_response(connection_t *conn) {
-    const char *response_body = NULL;
-    int status_code = 200;
-    const char *status_text = "OK";
+void http_free_response(precomputed_response_t *resp) {
+    free(resp->keep_alive.data);
+    free(resp->close.data);
+    memset(resp, 0, sizeof(*resp));
+}
 
-    // Create a copy of URL for safe manipulation
-    char url_copy[URL_MAX_LEN];
-    strncpy(url_copy, conn->url, URL_MAX_LEN - 1);
-    url_copy[URL_MAX_LEN - 1] = '\0';
+static int build_error_response(precomputed_response_t *resp, int status_code,
+                                const char *status_text, const char *body) {
+    return http_build_response(resp, status_code, status_text, JSON_CONTENT_TYPE,
+                               body, strlen(body), NULL);
+}
 
-    // Обрезаем query-параметры из URL для роутинга
-    char *q_mark = strchr(url_copy, '?');
-    if (q_mark) {
-        *q_mark = '\0';
+int http_responses_init(void) {
+    char retry_after[64];
+    snprintf(retry_after, sizeof(retry_after), "Retry-After: %d\r\n",
+             g_config.overload_retry_after_s);
+
+    if (http_build_response(&overloaded_response, 503, "Service Unavailable", JSON_CONTENT_TYPE,
+                            overloaded_json, strlen(overloaded_json), retry_after) != 0 ||
+        build_error_response(&not_found_response, 404, "Not Found", not_found_json) != 0 ||
+        build_error_response(&bad_request_response, 400, "Bad Request", bad_request_json) != 0 ||
+        build_error_response(&method_not_allowed_response, 405, "Method Not Allowed",
+                             method_not_allowed_json) != 0 ||
+        build_error_response(&internal_error_response, 500, "Internal Server Error",
+                             internal_error_json) != 0 ||
+        build_error_response(&bad_gateway_response, 502, "Bad Gateway", bad_gateway_json) != 0) {
+        fprintf(stderr, "Failed to build precomputed responses\n");
+        return -1;
     }
+    return 0;
+}
 
-    // Additional URL validation after query removal
-    if (strlen(url_copy) == 0 || url_copy[0] != '/') {
+void http_responses_destroy(void) {
+    http_free_response(&not_found_response);
+    http_free_response(&bad_request_response);
+    http_free_response(&method_not_allowed_response);
+    http_free_response(&internal_error_response);
+    http_free_response(&overloaded_response);
+    http_free_response(&bad_gateway_response);
+}
+
+int http_send_overload_response(int fd) {
+    const response_blob_t *blob = &overloaded_response.close;
+    struct iovec iov[4] = {
+        { blob->data, blob->head_len },
+        { loop_clock.date_header, loop_clock.date_header_len },
+        { blob->data + blob->head_len, blob->tail_len },
+        { (void *)blob->body, blob->body_len },
+    };
+    struct msghdr msg = { .msg_iov = iov, .msg_iovlen = 4 };
+    // Целиком помещается в пустой буфер отправки; недописанный хвост не ждем
+    return sendmsg(fd, &msg, MSG_DONTWAIT | MSG_NOSIGNAL) < 0 ? -1 : 0;
+}
+
+// Есть ли в значении заголовка токен (список через запятую, без учета регистра)
+static int header_has_token(const char *value, size_t len, const char *token, size_t token_len) {
+    size_t i = 0;
+    while (i < len) {
+        while (i < len && (value[i] == ' ' || value[i] == '\t' || value[i] == ',')) i++;
+        size_t start = i;
+        while (i < len && value[i] != ',') i++;
+        size_t end = i;
+        while (end > start && (value[end - 1] == ' ' || value[end - 1] == '\t')) end--;
+        if (end - start == token_len && strncasecmp(value + start, token, token_len) == 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Быстрый разбор GET-запроса по разметке сканера: метод, путь и query -
+// срезы read_buf, из заголовков смотрим только Connection.
+// Возвращает 1 - разобран, -1 - недопустимый URL, 0 - запрос не для
+// быстрого пути (другой метод, тело, нестандартный синтаксис) - его
+// разбирает http_parser
+static int fast_parse_get(connection_t *conn, const char *req, size_t header_len) {
+    connection_io_t *io = conn->io;
+    const http_scan_t *scan = &io->scan;
+    uint32_t line_end = scan->line_end;
+
+    if (scan->sp_count < 2 || scan->sp[0] != 3 || memcmp(req, "GET", 3) != 0) return 0;
+    if (scan->sp[1] >= line_end || req[line_end - 1] != '\r') return 0;
+
+    // Версия: ровно "HTTP/1.1" или "HTTP/1.0"
+    const char *version = req + scan->sp[1] + 1;
+    if (line_end - 1 - (scan->sp[1] + 1) != 8 || memcmp(version, "HTTP/1.", 7) != 0) return 0;
+    if (version[7] != '1' && version[7] != '0') return 0;
+    int keep_alive = version[7] == '1';
+
+    size_t url_off = scan->sp[0] + 1;
+    size_t url_len = scan->sp[1] - url_off;
+    if (!validate_url(req + url_off, url_len)) return -1;
+
+    // Строки заголовков между строкой запроса и финальным CRLF
+    const char *line = req + line_end + 1;
+    const char *end = req + header_len - 2;
+    while (line < end) {
+        const char *eol = memchr(line, '\n', end - line);
+        if (!eol || eol[-1] != '\r') return 0;
+
+        const char *colon = memchr(line, ':', eol - line);
+        if (!colon || colon == line || *line == ' ' || *line == '\t') return 0;
+
+        size_t name_len = colon - line;
+        int header = match_request_header(line, name_len);
+        if (header != HEADER_OTHER) {
+            const char *value = colon + 1;
+            while (value < eol - 1 && (*value == ' ' || *value == '\t')) value++;
+            on_request_header(io, header, value, eol - 1 - value);
+        } else if (name_len == 10 && strncasecmp(line, "connection", 10) == 0) {
+            const char *value = colon + 1;
+            size_t value_len = eol - 1 - value;
+            if (header_has_token(value, value_len, "close", 5)) {
+                keep_alive = 0;
+            } else if (header_has_token(value, value_len, "keep-alive", 10)) {
+                keep_alive = 1;
+            }
+        } else if ((name_len == 14 && strncasecmp(line, "content-length", 14) == 0) ||
+                   (name_len == 17 && strncasecmp(line, "transfer-encoding", 17) == 0)) {
+            return 0; // Запрос с телом - пусть его проверит http_parser
+        }
+
+        line = eol + 1;
+    }
+
+    size_t path_len = scan->query ? scan->query - url_off : url_len;
+    set_request_url(conn, req + url_off, url_len, path_len);
+    io->method = HTTP_GET;
+    conn->keep_alive = keep_alive;
+    return 1;
+}
+
+int http_parse_request(connection_t *conn) {
+    connection_io_t *io = conn->io;
+    const char *request = io->read_buf + conn->parse_offset;
+    size_t available = conn->bytes_read - conn->parse_offset;
+
+    // Векторный сканер продолжает с места, где остановился на прошлом куске
+    size_t header_len = http_scan_request(&io->scan, request, available);
+    if (!header_len) {
+        return 0; // Заголовки еще не полные
+    }
+
+    io->request_buf = io->read_buf;
+    io->url_len = 0;
+    io->route_id = -1;
+    io->accept_encoding = 0;
+    io->header_match = HEADER_OTHER;
+    io->if_none_match_len = 0;
+
+    int fast = fast_parse_get(conn, request, header_len);
+    if (UNLIKELY(fast < 0)) {
+        return -1;
+    }
+    if (UNLIKELY(fast == 0)) {
+        // Полный разбор http_parser; каждый запрос пачки - с чистого парсера
+        http_parser_init(&io->parser, HTTP_REQUEST);
+        io->parser.data = conn;
+        http_parser_execute(&io->parser, &parser_settings, request, header_len);
+
+        if (UNLIKELY(io->parser.http_errno != HPE_OK && io->parser.http_errno != HPE_PAUSED)) {
+            return -1;
+        }
+        io->method = io->parser.method;
+    }
+    if (UNLIKELY(g_draining)) {
+        conn->keep_alive = 0; // Сокеты у нового процесса: клиент переподключится к нему
+    }
+
+    conn->parse_offset += header_len;
+    http_scan_reset(&io->scan);
+    return 1;
+}
+
+int http_process_pipeline(connection_t *conn) {
+    connection_io_t *io = conn->io;
+    int prepared = 0;
+
+    io->response_iovcnt = 0;
+    io->response_iov_pos = 0;
+    io->bytes_sent = 0;
+    io->batch_count = 0;
+    io->batch_start_ns = loop_clock_now_ns();
+    trace_stamp(&io->trace, TRACE_PARSE);
+    if (LIKELY(io->routes == NULL)) {
+        io->routes = routes_hold(); // Блобы таблицы нужны, пока пачка не отправлена
+    }
+    if (UNLIKELY(conn->h2 != NULL || h2_preface(conn))) {
+        int ret = h2_process(conn); // Кадры HTTP/2 вместо запросов HTTP/1.1
+        trace_stamp(&io->trace, TRACE_PREPARED);
+        return ret;
+    }
+
+    while (prepared < PIPELINE_MAX_REQUESTS) {
+        uint32_t request_start = conn->parse_offset;
+        uint64_t lap = trace_lap_start(&io->trace);
+        int parsed = http_parse_request(conn);
+        lap = trace_lap_end(&io->trace, TRACE_LAP_PARSE, lap);
+        if (parsed == 0) {
+            break; // Остаток - неполный запрос, дочитаем после отправки
+        }
+        if (UNLIKELY(parsed < 0)) {
+            if (prepared == 0) return -1;
+            // Уже подготовленные ответы отправляем, затем закрываем соединение
+            conn->keep_alive = 0;
+            break;
+        }
+
+        int aggregate = 0;
+        if (io->url_len != 0 && io->method == HTTP_GET && io->route_id >= 0) {
+            aggregate = io->routes->routes[io->route_id].aggregate;
+        }
+        if (UNLIKELY(aggregate != 0)) {
+            if (prepared > 0) {
+                // Ответ бэкендов придет позже - сначала отправляем готовые
+                conn->parse_offset = request_start;
+                break;
+            }
+            int started = upstream_start(conn, aggregate - 1);
+            if (started == UPSTREAM_PENDING) {
+                return HTTP_PIPELINE_PENDING;
+            }
+            if (started < 0) {
+                handle_request_and_prepare_response(conn); // 502
+            }
+        } else {
+            handle_request_and_prepare_response(conn);
+        }
+        trace_lap_end(&io->trace, TRACE_LAP_HANDLER, lap);
+        prepared++;
+
+        if (!conn->keep_alive) {
+            break; // После Connection: close следующие запросы не обрабатываем
+        }
+        if (UNLIKELY(io->response_owned != NULL || io->response_cached != NULL)) {
+            break; // Динамическое тело одно на пачку - остальное после отправки
+        }
+    }
+
+    trace_stamp(&io->trace, TRACE_PREPARED);
+    return prepared;
+}
+
+void http_responses_sent(connection_t *conn) {
+    connection_io_t *io = conn->io;
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    uint64_t now_ns = (uint64_t)now.tv_sec * 1000000000ull + now.tv_nsec;
+    uint64_t latency = now_ns > io->batch_start_ns ? now_ns - io->batch_start_ns : 0;
+    trace_sent(&io->trace, conn->fd, io->batch_count, io->bytes_sent);
+
+    // Ответы пачки ушли одним writev - латентность у них общая
+    for (int i = 0; i < io->batch_count; ++i) {
+        metrics_observe_latency(io->batch_route[i], latency);
+    }
+    io->batch_count = 0;
+    if (UNLIKELY(conn->h2 != NULL)) {
+        h2_sent(conn);
+    }
+
+    free(io->response_owned);
+    io->response_owned = NULL;
+    response_cache_put(io->response_cached);
+    io->response_cached = NULL;
+    routes_put(io->routes);
+    io->routes = NULL;
+}
+
+// Добавляет ответ в response_iov пачки: готовый response или собранный blob
+static void append_response(connection_t *conn, const precomputed_response_t *response,
+                            const response_blob_t *blob, int status_code) {
+    connection_io_t *io = conn->io;
+
+    // Обновление метрик: счетчики воркера по ID роута, латентность - после отправки
+    int metric_id = io->route_id >= 0 ? io->routes->routes[io->route_id].metric_id : -1;
+    metrics_count_request(metric_id, status_code);
+    io->batch_route[io->batch_count++] = metric_id;
+
+    if (UNLIKELY(conn->h2 != NULL)) {
+        // Поток HTTP/2: кадры HEADERS и DATA соберет h2.c из HPACK-блока
+        h2_respond(conn, blob ? blob : &response->keep_alive);
+        return;
+    }
+
+    // Date берется из строки, которую воркер пересобирает раз в секунду.
+    // Копия (одна на пачку) нужна, чтобы частичная запись пережила смену секунды
+    if (io->response_iovcnt == 0) {
+        if (UNLIKELY(loop_clock.date_header_len == 0)) {
+            loop_clock_update();
+        }
+        memcpy(io->response_date, loop_clock.date_header, loop_clock.date_header_len);
+    }
+
+    // Ответ - готовый блоб, в iovec только указатели на него
+    if (LIKELY(blob == NULL)) {
+        blob = conn->keep_alive ? &response->keep_alive : &response->close;
+    }
+    struct iovec *iov = &io->response_iov[io->response_iovcnt];
+    iov[0].iov_base = blob->data;
+    iov[0].iov_len = blob->head_len;
+    iov[1].iov_base = io->response_date;
+    iov[1].iov_len = loop_clock.date_header_len;
+    iov[2].iov_base = blob->data + blob->head_len;
+    iov[2].iov_len = blob->tail_len;
+    iov[3].iov_base = (void *)blob->body;
+    iov[3].iov_len = blob->body_len;
+    io->response_iovcnt += RESPONSE_IOV_PER_REQUEST;
+
+    conn->state = STATE_WRITING; // Переводим FSM в состояние записи
+}
+
+// Ответ динамического роута: тело от render, заголовки как у статических
+static int render_dynamic_response(const route_t *route, int keep_alive, response_blob_t *blob) {
+    char *body = NULL;
+    size_t body_len = 0;
+    if (route->render(&body, &body_len) != 0) {
+        return -1;
+    }
+
+    int ret = build_response_blob(blob, 200, "OK", route->content_type,
+                                  body, body_len, NULL, keep_alive, 1);
+    free(body);
+    return ret;
+}
+
+void handle_request_and_prepare_response(connection_t *conn) {
+    connection_io_t *io = conn->io;
+    const precomputed_response_t *response = NULL;
+    const response_blob_t *blob = NULL;
+    response_blob_t dynamic;
+    int status_code = 200;
+
+    // Роут уже найден при разборе по пути без query-строки
+    if (UNLIKELY(io->url_len == 0)) {
         status_code = 400;
-        status_text = "Bad Request";
-        response_body = bad_request_json;
+        response = &bad_request_response;
         conn->keep_alive = 0;
         goto prepare_response;
     }
 
     // Проверка метода
-    if (conn->parser.method != HTTP_GET) {
+    if (io->method != HTTP_GET) {
         status_code = 405;
-        status_text = "Method Not Allowed";
-        response_body = method_not_allowed_json;
+        response = &method_not_allowed_response;
         conn->keep_alive = 0; // Закрываем соединение при ошибке клиента
-    } else {
-        response_body = g_hash_table_lookup(routes, url_copy);
-        if (!response_body) {
-            status_code = 404;
-            status_text = "Not Found";
-            response_body = not_found_json;
+    } else if (LIKELY(io->route_id >= 0)) {
+        const route_t *route = &io->routes->routes[io->route_id];
+        if (UNLIKELY(route->aggregate != 0)) {
+            // Запрос к бэкендам не удалось даже отправить
+            status_code = 502;
+            response = &bad_gateway_response;
+        } else if (LIKELY(route->render == NULL)) {
+            // Сжатый вариант, если клиент его принимает: br, затем gzip
+            uint8_t usable = io->accept_encoding & route->encodings;
+            const route_variant_t *variant = usable ? &route->encoded[__builtin_ctz(usable)]
+                                                    : &route->identity;
+            response = &variant->response;
+            // Клиент уже держит это представление - только заголовки
+            if (io->if_none_match_len != 0 &&
+                if_none_match_hit(io->request_buf + io->if_none_match_off, io->if_none_match_len,
+                                  variant->etag, variant->etag_len)) {
+                status_code = 304;
+                response = &variant->not_modified;
+            }
+        } else if (render_dynamic_response(route, conn->keep_alive, &dynamic) == 0) {
+            io->response_owned = dynamic.data; // Освобождается после отправки
+            blob = &dynamic;
+        } else {
+            status_code = 500;
+            response = &internal_error_response;
             conn->keep_alive = 0;
         }
+    } else {
+        status_code = 404;
+        response = &not_found_response;
+        conn->keep_alive = 0;
     }
 
 prepare_response:
+    append_response(conn, response, blob, status_code);
+}
 
-    // Обновление метрик
-    metric_total_requests_inc(url_copy);
-    if (status_code != 200) {
-        metric_error_requests_inc(url_copy, status_code);
-    }
-
-    // Формирование заголовков ответа
-    char keep_alive_hdr[64] = "";
-    if (conn->keep_alive) {
-        snprintf(keep_alive_hdr, sizeof(keep_alive_hdr), "Connection: keep-alive\r\nKeep-Alive: timeout=%d\r\n", 10);
+void http_prepare_upstream_response(connection_t *conn, const char *body, size_t body_len) {
+    response_blob_t merged;
+    if (body == NULL) {
+        append_response(conn, &bad_gateway_response, NULL, 502);
+    } else if (build_response_blob(&merged, 200, "OK", JSON_CONTENT_TYPE, body, body_len,
+                                   NULL, conn->keep_alive, 1) == 0) {
+        conn->io->response_owned = merged.data; // Освобождается после отправки
+        append_response(conn, NULL, &merged, 200);
     } else {
-        strcpy(keep_alive_hdr, "Connection: close\r\n");
-    }
-
-    size_t response_body_len = strlen(response_body);
-    size_t header_len = snprintf(conn->response_headers, sizeof(conn->response_headers),
-        "HTTP/1.1 %d %s\r\n"
-        "Content-Type: application/json\r\n"
-        "Content-Length: %zu\r\n"
-        "Server: BFF/1.0\r\n"
-        "X-Content-Type-Options: nosniff\r\n"
-        "X-Frame-Options: DENY\r\n"
-        "%s"
-        "\r\n",
-        status_code, status_text, response_body_len, keep_alive_hdr);
-
-    // Validate header length
-    if (header_len >= sizeof(conn->response_headers)) {
-        // Headers too large - this should not happen with our static responses
-        status_code = 500;
-        response_body = "{\"error\":\"Internal Server Error\"}";
         conn->keep_alive = 0;
-        header_len = snprintf(conn->response_headers, sizeof(conn->response_headers),
-            "HTTP/1.1 500 Internal Server Error\r\n"
-            "Content-Type: application/json\r\n"
-            "Content-Length: %zu\r\n"
-            "Connection: close\r\n"
-            "\r\n",
-            strlen(response_body));
+        append_response(conn, &internal_error_response, NULL, 500);
     }
+}
 
-    // Подготовка iovec для zero-copy отправки через writev
-    conn->response_iov[0].iov_base = conn->response_headers;
-    conn->response_iov[0].iov_len = header_len;
-    conn->response_iov[1].iov_base = (void*)response_body;
-    conn->response_iov[1].iov_len = strlen(response_body);
-
-    conn->bytes_sent = 0;
-    conn->state = STATE_WRITING; // Переводим FSM в состояние записи
+void http_prepare_cached_response(connection_t *conn, struct response_cache_entry_s *entry) {
+    conn->io->response_cached = entry; // Ссылка отпускается после отправки
+    append_response(conn, response_cache_response(entry), NULL, 200);
 }
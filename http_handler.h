@@ -3,15 +3,90 @@
 
 #include "connection.h"
 
-// Инициализация роутов
-void routes_init(void);
+#define JSON_CONTENT_TYPE "application/json"
 
-// Уничтожение таблицы роутов
-void routes_destroy(void);
+// Сжатые варианты тела в порядке предпочтения при выборе
+typedef enum {
+    CONTENT_ENCODING_BR,
+    CONTENT_ENCODING_GZIP,
+    CONTENT_ENCODING_COUNT
+} content_encoding_t;
 
-// Главная функция обработки запроса и формирования ответа
+#define CONTENT_ENCODING_BIT(e) (1u << (e))
+
+// Готовый ответ: заголовки сериализуются один раз при сборке таблицы роутов.
+// Date меняется раз в секунду, поэтому заголовки разрезаны вокруг него:
+// [data, data + head_len) - до Date, [data + head_len, + tail_len) - после.
+// Тело лежит отдельно (литерал, mmap файла или хвост data). Для HTTP/2
+// в data собран и HPACK-блок тех же заголовков, кроме Date (h2.c)
+typedef struct {
+    char *data;
+    size_t head_len;
+    size_t tail_len;
+    size_t h2_off;
+    size_t h2_len;
+    const char *body;
+    size_t body_len;
+} response_blob_t;
+
+// Варианты ответа для keep-alive и Connection: close
+typedef struct {
+    response_blob_t keep_alive;
+    response_blob_t close;
+} precomputed_response_t;
+
+// Ответы на ошибки (400, 404, 405, 500, 502, 503 при перегрузке)
+int http_responses_init(void);
+void http_responses_destroy(void);
+
+// Готовый 503 с Retry-After и Connection: close в только что принятый сокет
+int http_send_overload_response(int fd);
+
+// Сборка готового ответа. Тело не копируется и должно жить не меньше ответа;
+// extra_headers (NULL - нет) - готовые строки "Name: value\r\n"
+int http_build_response(precomputed_response_t *resp, int status_code, const char *status_text,
+                        const char *content_type, const char *body, size_t body_len,
+                        const char *extra_headers);
+
+// Значение content-coding для заголовка Content-Encoding
+const char *http_content_encoding_name(content_encoding_t encoding);
+void http_free_response(precomputed_response_t *resp);
+
+// Разбор очередного запроса в read_buf с позиции parse_offset.
+// Возвращает 1 - заголовки разобраны (parse_offset сдвинут за них),
+// 0 - нужны еще данные, -1 - ошибка
+int http_parse_request(connection_t *conn);
+
+// Кодировки из значения Accept-Encoding (CONTENT_ENCODING_BIT)
+uint8_t http_parse_accept_encoding(const char *value, size_t len);
+
+// URL запроса - срез io->request_buf: проверка, путь без query-строки и
+// роут. Недопустимый URL оставляет url_len = 0 (ответ 400)
+void http_set_request_url(connection_t *conn, const char *url, size_t len);
+
+// Главная функция обработки запроса: добавляет ответ в response_iov
 void handle_request_and_prepare_response(connection_t *conn);
 
+// Обработка всех полных запросов, уже лежащих в read_buf (pipelining),
+// не больше PIPELINE_MAX_REQUESTS. Ответы собираются в один response_iov.
+// Возвращает число подготовленных ответов, 0 - нужны еще данные,
+// -1 - ошибка разбора первого же запроса, HTTP_PIPELINE_PENDING - первый
+// запрос ждет бэкендов агрегирующего роута (upstream.h)
+#define HTTP_PIPELINE_PENDING (-2)
+int http_process_pipeline(connection_t *conn);
+
+// Ответ агрегирующего роута в response_iov: объединенный JSON бэкендов
+// (копируется) или 502, если body == NULL
+void http_prepare_upstream_response(connection_t *conn, const char *body, size_t body_len);
+
+// Ответ агрегирующего роута из кэша ответов: передается ссылка на запись
+struct response_cache_entry_s;
+void http_prepare_cached_response(connection_t *conn, struct response_cache_entry_s *entry);
+
+// Вызывается движком, когда ответы пачки полностью отправлены:
+// учитывает латентность и освобождает динамическое тело
+void http_responses_sent(connection_t *conn);
+
 // Настройки http-parser
 extern http_parser_settings parser_settings;
 
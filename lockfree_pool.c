@@ -0,0 +1,303 @@
+#include "lockfree_pool.h"
+#include "log.h"
+#include "h2.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <sched.h>
+#include <pthread.h>
+#include <time.h>
+#include <numa.h>
+
+// Слот пула текущего треда (-1 - тред не привязан, берем по номеру CPU)
+static __thread int current_pool_slot = -1;
+
+static inline int pool_slot_for_thread(const lockfree_pool_t *pool) {
+    if (LIKELY(current_pool_slot >= 0)) {
+        return current_pool_slot;
+    }
+    int cpu = get_current_cpu_id();
+    return (cpu < 0 ? 0 : cpu) % pool->cpu_pool_count;
+}
+
+// Инициализация массива соединений и стека свободных индексов
+static void init_connection_array(connection_t *connections, atomic_uint *next,
+                                  tagged_head_t *head, int capacity, int pool_id) {
+    for (int i = 0; i < capacity; ++i) {
+        connections[i].fd = -1;
+        connections[i].state = STATE_FREE;
+        connections[i].timer_node = NULL;
+        connections[i].io = NULL;
+        connections[i].pool_id = pool_id;
+        // Индекс 0 на вершине - соседние соединения выдаются подряд
+        atomic_init(&next[i], i + 1 < capacity ? (unsigned)(i + 1) : POOL_STACK_EMPTY);
+    }
+    atomic_init(head, TAGGED_HEAD(0, capacity > 0 ? 0 : POOL_STACK_EMPTY));
+}
+
+int lockfree_pool_init(lockfree_pool_t *pool, int cpu_pools,
+                       int connections_per_core, int overflow_connections) {
+    memset(pool, 0, sizeof(*pool));
+
+    // Дескрипторы пулов выровнены по cache line - нужен aligned_alloc
+    size_t pools_size = ALIGN_TO_CACHE_LINE(sizeof(per_cpu_pool_t) * cpu_pools);
+    pool->cpu_pools = aligned_alloc(CACHE_LINE_SIZE, pools_size);
+    if (!pool->cpu_pools) {
+        return -1;
+    }
+    memset(pool->cpu_pools, 0, pools_size);
+    pool->cpu_pool_count = cpu_pools;
+    pool->connections_per_core = connections_per_core;
+
+    for (int i = 0; i < cpu_pools; ++i) {
+        atomic_init(&pool->cpu_pools[i].free_head, TAGGED_HEAD(0, POOL_STACK_EMPTY));
+    }
+
+    // Overflow-пул общий для всех воркеров - чередуем его страницы по нодам
+    pool->global_connections = numa_shared_alloc(sizeof(connection_t) * overflow_connections);
+    pool->global_free_next = numa_shared_alloc(sizeof(atomic_uint) * overflow_connections);
+    if (!pool->global_connections || !pool->global_free_next) {
+        numa_shared_free(pool->global_connections, sizeof(connection_t) * overflow_connections);
+        numa_shared_free(pool->global_free_next, sizeof(atomic_uint) * overflow_connections);
+        free(pool->cpu_pools);
+        pool->global_connections = NULL;
+        pool->global_free_next = NULL;
+        pool->cpu_pools = NULL;
+        return -1;
+    }
+
+    init_connection_array(pool->global_connections, pool->global_free_next,
+                          &pool->global_free_head, overflow_connections, -1);
+    atomic_init(&pool->global_capacity, overflow_connections);
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    pool->last_stats_ns = (uint64_t)now.tv_sec * 1000000000ull + now.tv_nsec;
+    return 0;
+}
+
+void lockfree_pool_destroy(lockfree_pool_t *pool) {
+    for (int i = 0; i < pool->cpu_pool_count; ++i) {
+        per_cpu_pool_t *cpu_pool = &pool->cpu_pools[i];
+        numa_arena_destroy(&cpu_pool->arena);
+        cpu_pool->connections = NULL;
+        cpu_pool->free_next = NULL;
+        cpu_pool->capacity = 0;
+    }
+
+    int capacity = atomic_load(&pool->global_capacity);
+    numa_shared_free(pool->global_connections, sizeof(connection_t) * capacity);
+    numa_shared_free(pool->global_free_next, sizeof(atomic_uint) * capacity);
+    pool->global_connections = NULL;
+    pool->global_free_next = NULL;
+    atomic_store(&pool->global_capacity, 0);
+
+    free(pool->cpu_pools);
+    pool->cpu_pools = NULL;
+    pool->cpu_pool_count = 0;
+}
+
+// Привязывает вызывающий тред к слоту и создает его арену с локальным пулом.
+// Вызывается воркером после установки affinity, чтобы память была локальной
+int lockfree_pool_bind_thread(lockfree_pool_t *pool, int slot,
+                              size_t arena_extra, int numa_node) {
+    slot %= pool->cpu_pool_count;
+    per_cpu_pool_t *cpu_pool = &pool->cpu_pools[slot];
+
+    int expected = 0;
+    if (!atomic_compare_exchange_strong(&cpu_pool->bound, &expected, 1)) {
+        // Слот уже занят другим воркером - делим его (push/pop lock-free)
+        current_pool_slot = slot;
+        return 0;
+    }
+
+    int capacity = pool->connections_per_core;
+    size_t slab_size = sizeof(connection_t) * capacity;
+    size_t next_size = sizeof(atomic_uint) * capacity;
+    size_t arena_size = slab_size + next_size + arena_extra + 2 * CACHE_LINE_SIZE;
+    if (numa_arena_init(&cpu_pool->arena, arena_size, numa_node) != 0) {
+        atomic_store(&cpu_pool->bound, 0);
+        return -1;
+    }
+
+    connection_t *connections = numa_arena_alloc(&cpu_pool->arena, slab_size, CACHE_LINE_SIZE);
+    atomic_uint *next = numa_arena_alloc(&cpu_pool->arena, next_size, CACHE_LINE_SIZE);
+    numa_arena_set_thread(&cpu_pool->arena); // Остаток арены - таймерам и буферам воркера
+
+    cpu_pool->connections = connections;
+    cpu_pool->free_next = next;
+    cpu_pool->capacity = capacity;
+    init_connection_array(connections, next, &cpu_pool->free_head, capacity, slot);
+
+    atomic_fetch_add(&pool->active_cores, 1);
+    current_pool_slot = slot;
+
+    log_info("Worker pool %d: %zu MB arena on NUMA node %d (%s)", slot,
+             cpu_pool->arena.size >> 20, cpu_pool->arena.node,
+             numa_arena_backing_name(&cpu_pool->arena));
+    return 0;
+}
+
+connection_t *lockfree_pool_get(lockfree_pool_t *pool) {
+    per_cpu_pool_t *cpu_pool = &pool->cpu_pools[pool_slot_for_thread(pool)];
+    connection_t *conn;
+
+    int index = cpu_pool->free_next
+        ? lockfree_stack_pop(cpu_pool->free_next, &cpu_pool->free_head)
+        : -1;
+
+    if (LIKELY(index >= 0)) {
+        conn = &cpu_pool->connections[index];
+
+        int used = atomic_fetch_add_explicit(&cpu_pool->used_count, 1, memory_order_relaxed) + 1;
+        if (UNLIKELY(used > atomic_load_explicit(&cpu_pool->peak_usage, memory_order_relaxed))) {
+            atomic_store_explicit(&cpu_pool->peak_usage, used, memory_order_relaxed);
+        }
+        atomic_fetch_add_explicit(&cpu_pool->total_allocations, 1, memory_order_relaxed);
+    } else {
+        // Локальный пул исчерпан - берем из общего
+        index = lockfree_stack_pop(pool->global_free_next, &pool->global_free_head);
+        if (UNLIKELY(index < 0)) {
+            return NULL; // Пул исчерпан
+        }
+        conn = &pool->global_connections[index];
+        atomic_fetch_add_explicit(&pool->global_used_count, 1, memory_order_relaxed);
+        atomic_fetch_add_explicit(&pool->global_allocations, 1, memory_order_relaxed);
+    }
+
+    connection_init_state(conn);
+    return conn;
+}
+
+void lockfree_pool_release(lockfree_pool_t *pool, connection_t *conn) {
+    if (!conn || conn->state == STATE_FREE) {
+        return; // Защита от double-free
+    }
+    if (UNLIKELY(!is_valid_connection(conn, pool))) {
+        return; // Чужой указатель - ошибка логики
+    }
+
+    conn->state = STATE_FREE;
+    conn->fd = -1;
+    conn->timer_node = NULL;
+
+    // Буфер запроса возвращается в пул воркера, закрывающего соединение
+    connection_io_release(conn);
+    h2_session_free(conn);
+
+    if (conn->pool_id < 0) {
+        int index = conn - pool->global_connections;
+        atomic_fetch_sub_explicit(&pool->global_used_count, 1, memory_order_relaxed);
+        atomic_fetch_add_explicit(&pool->global_deallocations, 1, memory_order_relaxed);
+        lockfree_stack_push(pool->global_free_next, &pool->global_free_head, index);
+        return;
+    }
+
+    per_cpu_pool_t *cpu_pool = &pool->cpu_pools[conn->pool_id];
+    int index = conn - cpu_pool->connections;
+
+    if (UNLIKELY(conn->pool_id != pool_slot_for_thread(pool))) {
+        atomic_fetch_add_explicit(&cpu_pool->remote_deallocations, 1, memory_order_relaxed);
+        atomic_fetch_add_explicit(&pool->cross_cpu_allocations, 1, memory_order_relaxed);
+    }
+
+    atomic_fetch_sub_explicit(&cpu_pool->used_count, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&cpu_pool->total_deallocations, 1, memory_order_relaxed);
+    lockfree_stack_push(cpu_pool->free_next, &cpu_pool->free_head, index);
+}
+
+int lockfree_pool_occupancy(lockfree_pool_t *pool) {
+    per_cpu_pool_t *cpu_pool = &pool->cpu_pools[pool_slot_for_thread(pool)];
+    long used = atomic_load_explicit(&cpu_pool->used_count, memory_order_relaxed) +
+                atomic_load_explicit(&pool->global_used_count, memory_order_relaxed);
+    long capacity = (long)cpu_pool->capacity +
+                    atomic_load_explicit(&pool->global_capacity, memory_order_relaxed);
+    if (capacity <= 0) return 1000;
+    return used >= capacity ? 1000 : (int)(used * 1000 / capacity);
+}
+
+int get_current_cpu_id(void) {
+    return sched_getcpu();
+}
+
+int set_thread_affinity(int cpu_id) {
+    cpu_set_t cpuset;
+    CPU_ZERO(&cpuset);
+    CPU_SET(cpu_id, &cpuset);
+    return pthread_setaffinity_np(pthread_self(), sizeof(cpuset), &cpuset) == 0 ? 0 : -1;
+}
+
+// Память треда (в том числе его локальный пул) выделяется на заданной ноде
+int set_thread_memory_node(int numa_node) {
+    if (numa_available() < 0 || numa_node > numa_max_node()) {
+        return -1;
+    }
+    numa_set_preferred(numa_node);
+    return 0;
+}
+
+void print_pool_statistics(lockfree_pool_t *pool) {
+    printf("Connection pool statistics (%d active worker pools):\n",
+           atomic_load(&pool->active_cores));
+
+    for (int i = 0; i < pool->cpu_pool_count; ++i) {
+        per_cpu_pool_t *cpu_pool = &pool->cpu_pools[i];
+        if (!cpu_pool->connections) continue;
+
+        int peak = atomic_load(&cpu_pool->peak_usage);
+        printf("  pool %2d: used %d, peak %d/%d (%.1f%%), allocs %ld, frees %ld, remote frees %ld\n",
+               i, atomic_load(&cpu_pool->used_count), peak, cpu_pool->capacity,
+               (peak * 100.0) / cpu_pool->capacity,
+               atomic_load(&cpu_pool->total_allocations),
+               atomic_load(&cpu_pool->total_deallocations),
+               atomic_load(&cpu_pool->remote_deallocations));
+    }
+
+    printf("  overflow: used %d/%d, allocs %ld, frees %ld; cross-CPU frees %ld\n",
+           atomic_load(&pool->global_used_count), atomic_load(&pool->global_capacity),
+           atomic_load(&pool->global_allocations), atomic_load(&pool->global_deallocations),
+           atomic_load(&pool->cross_cpu_allocations));
+}
+
+void get_pool_performance_stats(lockfree_pool_t *pool, pool_performance_stats_t *stats) {
+    long allocations = atomic_load(&pool->global_allocations);
+    long deallocations = atomic_load(&pool->global_deallocations);
+    long used = atomic_load(&pool->global_used_count);
+    long capacity = atomic_load(&pool->global_capacity);
+
+    for (int i = 0; i < pool->cpu_pool_count; ++i) {
+        per_cpu_pool_t *cpu_pool = &pool->cpu_pools[i];
+        if (!cpu_pool->connections) continue;
+        allocations += atomic_load(&cpu_pool->total_allocations);
+        deallocations += atomic_load(&cpu_pool->total_deallocations);
+        used += atomic_load(&cpu_pool->used_count);
+        capacity += cpu_pool->capacity;
+    }
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    uint64_t now_ns = (uint64_t)now.tv_sec * 1000000000ull + now.tv_nsec;
+    uint64_t elapsed_ns = now_ns - pool->last_stats_ns;
+
+    if (elapsed_ns > 0) {
+        stats->allocations_per_second =
+            (uint64_t)(allocations - pool->last_allocations) * 1000000000ull / elapsed_ns;
+        stats->deallocations_per_second =
+            (uint64_t)(deallocations - pool->last_deallocations) * 1000000000ull / elapsed_ns;
+    } else {
+        stats->allocations_per_second = 0;
+        stats->deallocations_per_second = 0;
+    }
+
+    stats->average_pool_utilization = capacity > 0 ? (double)used / capacity : 0.0;
+
+    long cross = atomic_load(&pool->cross_cpu_allocations);
+    stats->cross_cpu_allocation_ratio = deallocations > 0 ? (double)cross / deallocations : 0.0;
+
+    // Соединения из overflow-пула и освобожденные на чужом CPU - холодные для кэша
+    stats->cache_misses_estimated = (uint64_t)(atomic_load(&pool->global_allocations) + cross);
+
+    pool->last_stats_ns = now_ns;
+    pool->last_allocations = allocations;
+    pool->last_deallocations = deallocations;
+}
@@ -2,93 +2,121 @@
 #define LOCKFREE_POOL_H
 
 #include "connection.h"
+#include "numa_arena.h"
 #include <stdatomic.h>
 #include <stdint.h>
 
 // Lock-free connection pool для максимальной производительности
-// Каждый CPU core имеет свой локальный пул для избежания contention
+// Каждый воркер имеет свой локальный пул для избежания contention,
+// при исчерпании локального пула соединения берутся из общего overflow-пула.
+// Число локальных пулов и их размеры задаются при инициализации
+
+// Голова стека свободных соединений: младшие 32 бита - индекс вершины,
+// старшие 32 бита - счетчик версий. Счетчик меняется при каждом CAS,
+// поэтому pop не может спутать старую вершину с новой (ABA)
+typedef _Atomic uint64_t tagged_head_t;
+
+#define POOL_STACK_EMPTY 0xFFFFFFFFu
+#define TAGGED_HEAD(tag, index) (((uint64_t)(tag) << 32) | (uint32_t)(index))
+#define TAGGED_INDEX(head) ((uint32_t)(head))
+#define TAGGED_TAG(head) ((uint32_t)((head) >> 32))
+
+// Per-CPU connection pool. Слаб соединений лежит в huge-page арене,
+// которую владелец создает при привязке (first touch на его NUMA-ноде)
+typedef struct {
+    connection_t *connections;
+    atomic_uint *free_next;      // Связи стека: индекс следующего свободного
+    int capacity;
+    atomic_int bound;            // Пул привязан к воркеру
+    numa_arena_t arena;          // Арена воркера: слаб, узлы таймеров, буферы
 
-#define MAX_CPU_CORES 32
-#define CONNECTIONS_PER_CORE 512
-#define TOTAL_CONNECTIONS (MAX_CPU_CORES * CONNECTIONS_PER_CORE)
+    // Голова стека на отдельной cache line - в неё пишут удаленные release
+    tagged_head_t free_head __attribute__((aligned(64)));
 
-// Per-CPU connection pool
-typedef struct {
-    connection_t connections[CONNECTIONS_PER_CORE];
-    
-    // Lock-free stack для свободных соединений
-    atomic_int free_stack[CONNECTIONS_PER_CORE];
-    atomic_int free_top;
-    
     // Статистика для мониторинга
-    atomic_int used_count;
+    atomic_int used_count __attribute__((aligned(64)));
     atomic_int peak_usage;
     atomic_long total_allocations;
     atomic_long total_deallocations;
-    
-    // Padding для избежания false sharing
-    char padding[64 - (sizeof(atomic_int) * 4 + sizeof(atomic_long) * 2) % 64];
+    atomic_long remote_deallocations;  // Release из чужого воркера
 } __attribute__((aligned(64))) per_cpu_pool_t;
 
 // Глобальная структура пула
-typedef struct {
-    per_cpu_pool_t cpu_pools[MAX_CPU_CORES];
+typedef struct lockfree_pool_s {
+    per_cpu_pool_t *cpu_pools;
+    int cpu_pool_count;          // Слотов локальных пулов (по числу воркеров)
+    int connections_per_core;
     atomic_int active_cores;
-    
+
     // Fallback pool когда локальный пул исчерпан
     connection_t *global_connections;
-    atomic_int global_free_stack[TOTAL_CONNECTIONS];
-    atomic_int global_free_top;
+    atomic_uint *global_free_next;
+    tagged_head_t global_free_head __attribute__((aligned(64)));
     atomic_int global_capacity;
-    
+    atomic_int global_used_count;
+
     // Статистика
     atomic_long global_allocations;
     atomic_long global_deallocations;
-    atomic_long cross_cpu_allocations;
+    atomic_long cross_cpu_allocations;  // Соединения, освобожденные не тем воркером, что их выдал
+
+    // Снимок для расчета скоростей в get_pool_performance_stats
+    uint64_t last_stats_ns;
+    long last_allocations;
+    long last_deallocations;
 } lockfree_pool_t;
 
 // API функции
-int lockfree_pool_init(lockfree_pool_t *pool);
+int lockfree_pool_init(lockfree_pool_t *pool, int cpu_pools,
+                       int connections_per_core, int overflow_connections);
 void lockfree_pool_destroy(lockfree_pool_t *pool);
+// arena_extra - байт арены сверх слаба (узлы таймеров, буферы движка),
+// numa_node - нода арены, -1 - нода текущего CPU
+int lockfree_pool_bind_thread(lockfree_pool_t *pool, int slot,
+                              size_t arena_extra, int numa_node);
 connection_t *lockfree_pool_get(lockfree_pool_t *pool);
 void lockfree_pool_release(lockfree_pool_t *pool, connection_t *conn);
 
+// Занятость пула текущего воркера вместе с общим overflow, в промилле
+int lockfree_pool_occupancy(lockfree_pool_t *pool);
+
 // Утилиты для CPU affinity
 int get_current_cpu_id(void);
 int set_thread_affinity(int cpu_id);
+int set_thread_memory_node(int numa_node);
 void print_pool_statistics(lockfree_pool_t *pool);
 
 // Inline функции для быстрого доступа
-static inline int lockfree_stack_pop(atomic_int *stack, atomic_int *top) {
-    int current_top, new_top, value;
-    
+static inline int lockfree_stack_pop(atomic_uint *next, tagged_head_t *head) {
+    uint64_t current = atomic_load_explicit(head, memory_order_acquire);
+    uint64_t desired;
+    uint32_t index;
+
     do {
-        current_top = atomic_load_explicit(top, memory_order_acquire);
-        if (current_top < 0) return -1; // Stack empty
-        
-        value = atomic_load_explicit(&stack[current_top], memory_order_relaxed);
-        new_top = current_top - 1;
+        index = TAGGED_INDEX(current);
+        if (index == POOL_STACK_EMPTY) return -1; // Stack empty
+
+        // next[index] может быть уже перезаписан, если вершину забрали -
+        // тогда тег изменился и CAS не пройдет
+        uint32_t next_index = atomic_load_explicit(&next[index], memory_order_relaxed);
+        desired = TAGGED_HEAD(TAGGED_TAG(current) + 1, next_index);
     } while (!atomic_compare_exchange_weak_explicit(
-        top, &current_top, new_top,
-        memory_order_release, memory_order_relaxed));
-    
-    return value;
+        head, &current, desired,
+        memory_order_acquire, memory_order_acquire));
+
+    return (int)index;
 }
 
-static inline int lockfree_stack_push(atomic_int *stack, atomic_int *top, int value, int capacity) {
-    int current_top, new_top;
-    
+static inline void lockfree_stack_push(atomic_uint *next, tagged_head_t *head, int value) {
+    uint64_t current = atomic_load_explicit(head, memory_order_relaxed);
+    uint64_t desired;
+
     do {
-        current_top = atomic_load_explicit(top, memory_order_acquire);
-        new_top = current_top + 1;
-        if (new_top >= capacity) return -1; // Stack full
-        
-        atomic_store_explicit(&stack[new_top], value, memory_order_relaxed);
+        atomic_store_explicit(&next[value], TAGGED_INDEX(current), memory_order_relaxed);
+        desired = TAGGED_HEAD(TAGGED_TAG(current) + 1, value);
     } while (!atomic_compare_exchange_weak_explicit(
-        top, &current_top, new_top,
+        head, &current, desired,
         memory_order_release, memory_order_relaxed));
-    
-    return 0;
 }
 
 // Memory ordering utilities
@@ -97,8 +125,7 @@ static inline int lockfree_stack_push(atomic_int *stack, atomic_int *top, int va
 
 // Cache line prefetching
 static inline void prefetch_connection(connection_t *conn) {
-    __builtin_prefetch(conn, 1, 3);
-    __builtin_prefetch((char*)conn + 64, 1, 3);
+    __builtin_prefetch(conn, 1, 3); // Горячая часть - ровно одна линия
 }
 
 // Fast CPU ID detection using RDTSCP if available
@@ -118,23 +145,17 @@ static inline int fast_get_cpu_id(void) {
 
 // Connection state validation
 static inline int is_valid_connection(connection_t *conn, lockfree_pool_t *pool) {
-    // Check if connection pointer is within valid ranges
-    for (int i = 0; i < MAX_CPU_CORES; i++) {
-        per_cpu_pool_t *cpu_pool = &pool->cpu_pools[i];
-        if (conn >= cpu_pool->connections && 
-            conn < cpu_pool->connections + CONNECTIONS_PER_CORE) {
-            return 1;
-        }
+    if (conn->pool_id >= 0 && conn->pool_id < pool->cpu_pool_count) {
+        per_cpu_pool_t *cpu_pool = &pool->cpu_pools[conn->pool_id];
+        return cpu_pool->connections &&
+               conn >= cpu_pool->connections &&
+               conn < cpu_pool->connections + cpu_pool->capacity;
     }
-    
+
     // Check global pool
-    if (pool->global_connections && 
-        conn >= pool->global_connections && 
-        conn < pool->global_connections + pool->global_capacity) {
-        return 1;
-    }
-    
-    return 0;
+    return pool->global_connections &&
+           conn >= pool->global_connections &&
+           conn < pool->global_connections + pool->global_capacity;
 }
 
 // Performance monitoring
@@ -148,4 +169,4 @@ typedef struct {
 
 void get_pool_performance_stats(lockfree_pool_t *pool, pool_performance_stats_t *stats);
 
-#endif // LOCKFREE_POOL_H
\ No newline at end of file
+#endif // LOCKFREE_POOL_H
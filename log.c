@@ -0,0 +1,196 @@
+#include "log.h"
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+typedef struct {
+    uint64_t ts_ns;                  // CLOCK_REALTIME (coarse) в момент записи
+    int worker_id;                   // 0 - не воркер
+    int err;
+    uint32_t suppressed;
+    uint8_t level;
+    char msg[LOG_MSG_MAX];
+} log_entry_t;
+
+// Кольцо одного воркера: запись только владельцем, чтение только тредом вывода
+typedef struct {
+    _Atomic uint64_t head __attribute__((aligned(64)));   // Пишет воркер
+    _Atomic uint64_t dropped;                            // Отброшено при полном кольце
+    _Atomic uint64_t tail __attribute__((aligned(64)));   // Пишет тред вывода
+    uint64_t dropped_reported;
+    log_entry_t entries[LOG_RING_SIZE];
+} __attribute__((aligned(64))) log_ring_t;
+
+static log_ring_t *log_rings = NULL;
+static int log_ring_count = 0;
+static pthread_t log_thread;
+static atomic_int log_running = 0;
+
+static __thread log_ring_t *thread_ring = NULL;
+static __thread int thread_worker_id = 0;
+
+static const char *level_names[] = { "info", "warn", "error" };
+
+static uint64_t clock_ns(clockid_t clock) {
+    struct timespec ts;
+    clock_gettime(clock, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+// Строка записи: ts=... level=... [worker=N] msg="..." [err="..."] [suppressed=N]
+static void log_print(FILE *out, const log_entry_t *e) {
+    time_t sec = (time_t)(e->ts_ns / 1000000000ull);
+    struct tm tm;
+    gmtime_r(&sec, &tm);
+    char ts[32];
+    strftime(ts, sizeof(ts), "%Y-%m-%dT%H:%M:%S", &tm);
+
+    // Кавычки и обратные слэши в сообщении экранируются, переводы строк заменяются
+    char msg[LOG_MSG_MAX * 2];
+    size_t n = 0;
+    for (const char *p = e->msg; *p && n + 2 < sizeof(msg); ++p) {
+        if (*p == '"' || *p == '\\') msg[n++] = '\\';
+        msg[n++] = (*p == '\n') ? ' ' : *p;
+    }
+    msg[n] = '\0';
+
+    fprintf(out, "ts=%s.%03uZ level=%s", ts,
+            (unsigned)(e->ts_ns / 1000000 % 1000), level_names[e->level]);
+    if (e->worker_id > 0) fprintf(out, " worker=%d", e->worker_id);
+    fprintf(out, " msg=\"%s\"", msg);
+    if (e->err) fprintf(out, " err=\"%s\"", strerror(e->err));
+    if (e->suppressed) fprintf(out, " suppressed=%u", e->suppressed);
+    fputc('\n', out);
+}
+
+static int log_drain(void) {
+    int printed = 0;
+    for (int i = 0; i < log_ring_count; ++i) {
+        log_ring_t *ring = &log_rings[i];
+        uint64_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+        uint64_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+
+        for (; tail != head; ++tail) {
+            const log_entry_t *e = &ring->entries[tail & (LOG_RING_SIZE - 1)];
+            log_print(e->level == LOG_INFO ? stdout : stderr, e);
+            printed = 1;
+        }
+        atomic_store_explicit(&ring->tail, tail, memory_order_release);
+
+        uint64_t dropped = atomic_load_explicit(&ring->dropped, memory_order_relaxed);
+        if (dropped != ring->dropped_reported) {
+            log_entry_t e = { .ts_ns = clock_ns(CLOCK_REALTIME_COARSE), .worker_id = i + 1,
+                              .level = LOG_WARN };
+            snprintf(e.msg, sizeof(e.msg), "log ring full, %lu records dropped",
+                     (unsigned long)(dropped - ring->dropped_reported));
+            log_print(stderr, &e);
+            ring->dropped_reported = dropped;
+        }
+    }
+    if (printed) {
+        fflush(stdout);
+    }
+    return printed;
+}
+
+static void *log_thread_main(void *arg) {
+    (void)arg;
+    struct timespec interval = { 0, LOG_DRAIN_INTERVAL_MS * 1000000L };
+    while (atomic_load_explicit(&log_running, memory_order_acquire)) {
+        log_drain();
+        nanosleep(&interval, NULL);
+    }
+    log_drain(); // Остаток после остановки воркеров
+    return NULL;
+}
+
+int log_init(int workers) {
+    log_rings = aligned_alloc(64, sizeof(log_ring_t) * workers);
+    if (!log_rings) {
+        return -1;
+    }
+    memset(log_rings, 0, sizeof(log_ring_t) * workers);
+    log_ring_count = workers;
+
+    atomic_store(&log_running, 1);
+    if (pthread_create(&log_thread, NULL, log_thread_main, NULL) != 0) {
+        atomic_store(&log_running, 0);
+        free(log_rings);
+        log_rings = NULL;
+        log_ring_count = 0;
+        return -1;
+    }
+    return 0;
+}
+
+void log_shutdown(void) {
+    if (!log_rings) {
+        return;
+    }
+    atomic_store_explicit(&log_running, 0, memory_order_release);
+    pthread_join(log_thread, NULL);
+    free(log_rings);
+    log_rings = NULL;
+    log_ring_count = 0;
+}
+
+void log_register_worker(int worker_id) {
+    thread_worker_id = worker_id;
+    if (log_rings && worker_id >= 1 && worker_id <= log_ring_count) {
+        thread_ring = &log_rings[worker_id - 1];
+    }
+}
+
+void log_write(log_site_t *site, log_level_t level, int err, const char *fmt, ...) {
+    // Окно по грубым часам: без системного вызова, точности в мс хватает
+    uint64_t now_ms = clock_ns(CLOCK_MONOTONIC_COARSE) / 1000000;
+    if (now_ms - site->window_ms >= 1000) {
+        site->window_ms = now_ms;
+        site->count = 0;
+    }
+    if (site->count >= LOG_SITE_PER_SEC) {
+        site->suppressed++;
+        return;
+    }
+    site->count++;
+
+    log_entry_t local;
+    log_entry_t *e = &local;
+    log_ring_t *ring = thread_ring;
+    uint64_t head = 0;
+    if (ring) {
+        head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+        uint64_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+        if (head - tail >= LOG_RING_SIZE) {
+            atomic_store_explicit(&ring->dropped,
+                atomic_load_explicit(&ring->dropped, memory_order_relaxed) + 1,
+                memory_order_relaxed);
+            return;
+        }
+        e = &ring->entries[head & (LOG_RING_SIZE - 1)];
+    }
+
+    e->ts_ns = clock_ns(CLOCK_REALTIME_COARSE);
+    e->worker_id = thread_worker_id;
+    e->err = err;
+    e->suppressed = site->suppressed;
+    e->level = (uint8_t)level;
+    va_list ap;
+    va_start(ap, fmt);
+    vsnprintf(e->msg, sizeof(e->msg), fmt, ap);
+    va_end(ap);
+    site->suppressed = 0;
+
+    if (ring) {
+        atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+        return;
+    }
+
+    // Тред без кольца может позволить себе stdio
+    log_print(level == LOG_INFO ? stdout : stderr, e);
+    if (level == LOG_INFO) fflush(stdout);
+}
@@ -0,0 +1,59 @@
+#ifndef LOG_H
+#define LOG_H
+
+#include <errno.h>
+#include <stdint.h>
+
+// Журнал воркеров. Воркер не пишет в stdio сам: сообщение форматируется
+// в запись его SPSC-кольца, а фоновый тред раз в LOG_DRAIN_INTERVAL_MS
+// выводит записи строками key=value. Если кольцо заполнено, запись
+// отбрасывается и учитывается в счетчике - event loop не блокируется.
+//
+// Каждое место вызова ограничено LOG_SITE_PER_SEC строками в секунду на
+// тред; подавленные строки считаются и выводятся полем suppressed
+// следующей записи того же места. Треды без кольца (главный) пишут
+// в поток сразу, в том же формате
+
+#define LOG_RING_SIZE 512            // Записей в кольце воркера (степень двойки)
+#define LOG_MSG_MAX 200
+#define LOG_SITE_PER_SEC 10
+#define LOG_DRAIN_INTERVAL_MS 10
+
+typedef enum {
+    LOG_INFO = 0,                    // stdout
+    LOG_WARN,                        // stderr
+    LOG_ERROR,                       // stderr
+} log_level_t;
+
+// Состояние места вызова; свое у каждого треда
+typedef struct {
+    uint64_t window_ms;              // Начало текущей секунды
+    uint32_t count;                  // Строк в ней
+    uint32_t suppressed;             // Подавлено с последней выведенной
+} log_site_t;
+
+// Кольца на workers воркеров и тред вывода; главный тред, до запуска воркеров
+int log_init(int workers);
+
+// После остановки воркеров: выводит остаток колец и останавливает тред
+void log_shutdown(void);
+
+// Кольцо текущего треда (worker_id от 1); повторный вызов ничего не меняет
+void log_register_worker(int worker_id);
+
+// err - errno для поля err (0 - нет)
+void log_write(log_site_t *site, log_level_t level, int err, const char *fmt, ...)
+    __attribute__((format(printf, 4, 5)));
+
+#define LOG_AT(level, err, ...) do {                                  \
+        static __thread log_site_t log_site_;                         \
+        log_write(&log_site_, (level), (err), __VA_ARGS__);           \
+    } while (0)
+
+#define log_info(...)  LOG_AT(LOG_INFO, 0, __VA_ARGS__)
+#define log_warn(...)  LOG_AT(LOG_WARN, 0, __VA_ARGS__)
+#define log_error(...) LOG_AT(LOG_ERROR, 0, __VA_ARGS__)
+// Замена perror: errno читается в месте вызова
+#define log_errno(...) LOG_AT(LOG_ERROR, errno, __VA_ARGS__)
+
+#endif // LOG_H
@@ -0,0 +1,28 @@
+#include "loop_clock.h"
+#include <stdio.h>
+#include <string.h>
+
+__thread loop_clock_t loop_clock;
+
+static void rebuild_date_header(void) {
+    struct timespec real;
+    struct tm tm;
+    clock_gettime(CLOCK_REALTIME_COARSE, &real);
+    gmtime_r(&real.tv_sec, &tm);
+
+    size_t len = strftime(loop_clock.date_header, sizeof(loop_clock.date_header),
+                          "Date: %a, %d %b %Y %H:%M:%S GMT\r\n", &tm);
+    loop_clock.date_header_len = len;
+}
+
+void loop_clock_update(void) {
+    clock_gettime(CLOCK_MONOTONIC, &loop_clock.now);
+    loop_clock.now_ms = (uint64_t)loop_clock.now.tv_sec * 1000 +
+                        loop_clock.now.tv_nsec / 1000000;
+
+    if (loop_clock.date_mono_sec != (uint64_t)loop_clock.now.tv_sec ||
+        loop_clock.date_header_len == 0) {
+        loop_clock.date_mono_sec = loop_clock.now.tv_sec;
+        rebuild_date_header();
+    }
+}
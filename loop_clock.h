@@ -0,0 +1,45 @@
+#ifndef LOOP_CLOCK_H
+#define LOOP_CLOCK_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <time.h>
+
+// Время event loop'а воркера. Обновляется один раз после каждого
+// epoll_wait/io_uring_enter и читается таймерами и кодом соединений,
+// вместо clock_gettime на каждое событие
+typedef struct {
+    struct timespec now;         // CLOCK_MONOTONIC на момент обновления
+    uint64_t now_ms;
+    uint64_t date_mono_sec;      // Секунда монотонного времени, для которой собран Date
+    char date_header[48];        // "Date: Sun, 06 Nov 1994 08:49:37 GMT\r\n" (RFC 7231 IMF-fixdate)
+    size_t date_header_len;
+} loop_clock_t;
+
+extern __thread loop_clock_t loop_clock;
+
+// Обновить время; строка Date пересобирается не чаще раза в секунду
+void loop_clock_update(void);
+
+static inline uint64_t loop_clock_now_ms(void) {
+    if (__builtin_expect(loop_clock.now_ms == 0, 0)) {
+        loop_clock_update(); // Тред еще не обновлял часы
+    }
+    return loop_clock.now_ms;
+}
+
+static inline uint64_t loop_clock_now_ns(void) {
+    if (__builtin_expect(loop_clock.now_ms == 0, 0)) {
+        loop_clock_update();
+    }
+    return (uint64_t)loop_clock.now.tv_sec * 1000000000ull + loop_clock.now.tv_nsec;
+}
+
+static inline const struct timespec *loop_clock_now(void) {
+    if (__builtin_expect(loop_clock.now_ms == 0, 0)) {
+        loop_clock_update();
+    }
+    return &loop_clock.now;
+}
+
+#endif // LOOP_CLOCK_H
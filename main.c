@@ -3,15 +3,31 @@
 #include <unistd.h>
 #include <pthread.h>
 #include <signal.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <getopt.h>
+#include <poll.h>
 #include <sys/socket.h>
+#include <sys/sysinfo.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <linux/filter.h>
 
 #include "connection.h"
 #include "worker.h"
+#include "worker_uring.h"
 #include "http_handler.h"
-
-#define PORT 8080
-#define WORKER_THREADS 4 // Должно быть равно или меньше числа ядер CPU
+#include "routes.h"
+#include "simd_utils.h"
+#include "metrics.h"
+#include "config.h"
+#include "log.h"
+#include "tls.h"
+#include "upgrade.h"
+#include "trace.h"
+#include "control.h"
+#include "lockfree_pool.h"
 
 // Глобальная переменная для плавной остановки
 volatile sig_atomic_t g_running = 1;
@@ -19,128 +35,520 @@ volatile sig_atomic_t g_running = 1;
 void sig_handler(int signum) {
     if (signum == SIGINT || signum == SIGTERM) {
         g_running = 0;
+    } else if (signum == SIGHUP) {
+        routes_request_reload();
+    } else if (signum == SIGUSR2) {
+        trace_request_dump();
     }
 }
 
-// Определяем структуру для передачи данных в тред
-typedef struct {
-    int server_fd;
-    int worker_id;
-} worker_args_t;
+// SIGUSR1 от главного треда только прерывает сон воркера в
+// epoll_wait/io_uring_enter: без таймеров он не проснулся бы сам
+static void wake_handler(int signum) {
+    (void)signum;
+}
 
-int main() {
-    // Установка обработчиков сигналов
-    signal(SIGINT, sig_handler);
-    signal(SIGTERM, sig_handler);
-    signal(SIGPIPE, SIG_IGN); // Игнорируем SIGPIPE
+// Будит воркеров и ждет их завершения. Сигнал повторяется: воркер мог
+// проверить g_running или g_draining прямо перед сном
+static void join_workers(pthread_t *workers, int count) {
+    for (int i = 0; i < count; ++i) {
+        pthread_kill(workers[i], SIGUSR1);
+    }
+    for (int i = 0; i < count; ++i) {
+        for (;;) {
+            struct timespec deadline;
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_nsec += 100 * 1000000L;
+            if (deadline.tv_nsec >= 1000000000L) {
+                deadline.tv_sec++;
+                deadline.tv_nsec -= 1000000000L;
+            }
+            if (pthread_timedjoin_np(workers[i], NULL, &deadline) != ETIMEDOUT) {
+                break;
+            }
+            pthread_kill(workers[i], SIGUSR1);
+        }
+    }
+}
 
-    // Инициализация подсистем
-    if (connection_pool_init() != 0) {
-        fprintf(stderr, "Failed to initialize connection pool.\n");
-        return EXIT_FAILURE;
+static void print_usage(const char *prog) {
+    fprintf(stderr,
+            "Usage: %s [options]\n"
+            "  -c, --config=FILE                Load settings from FILE (key = value)\n"
+            "  -e, --io-engine=epoll|uring      I/O event engine (default: epoll)\n"
+            "  -s, --cpu-steering               Steer connections to the worker on the RX CPU\n"
+            "  -p, --port=N                     Listening port (default: 8080)\n"
+            "  -w, --workers=N                  Worker threads (default: 4)\n"
+            "  -r, --routes-dir=DIR             Serve DIR/<name>.json as /<name>, reload on change\n"
+            "      --cpus=LIST                  CPU per worker, e.g. 0,2,4-7\n"
+            "      --numa-nodes=LIST            Preferred memory node per worker\n"
+            "      --backlog=N                  listen() backlog (default: 4096)\n"
+            "      --defer-accept-s=N           Accept once data arrives, up to N s (default: 1, 0 - off)\n"
+            "      --connections-per-worker=N   Worker-local pool size (default: 65536)\n"
+            "      --overflow-connections=N     Shared overflow pool size (default: 4096)\n"
+            "      --io-buffers=N               Request buffers per worker (default: 1024)\n"
+            "      --timer-capacity=N           Timers per worker (default: pool sizes)\n"
+            "      --request-timeout-ms=N       Request read timeout (default: 5000)\n"
+            "      --keepalive-timeout-ms=N     Keep-alive idle timeout (default: 10000)\n"
+            "      --max-events=N               Events per epoll_wait (default: 2048)\n"
+            "      --accept-batch=N             accept4 calls per wakeup (default: 128)\n"
+            "      --io-batch=N                 Read/write batch size (default: 32)\n"
+            "      --uring-entries=N            io_uring SQ entries (default: 4096)\n"
+            "      --uring-buffers=N            io_uring provided buffers (default: 1024)\n"
+            "      --busy-poll-us=N             Poll before blocking for up to N us (default: 0, off)\n"
+            "      --overload-shed-pct=N        Answer new connections with 503 above N%% load (default: 90)\n"
+            "      --overload-lag-ms=N          Pause accept when a loop iteration exceeds N ms (default: 100)\n"
+            "      --overload-retry-after-s=N   Retry-After of the 503 response (default: 1)\n"
+            "      --upstream='NAME HOST:PORT [MS]' Backend for aggregate routes (repeatable)\n"
+            "      --aggregate='/PATH [KEY=]NAME:/path ...' Merge backend JSON into one route (repeatable)\n"
+            "      --upstream-pool-size=N       Idle connections per backend per worker (default: 8)\n"
+            "      --upstream-timeout-ms=N      Backend response deadline (default: 1000)\n"
+            "      --response-cache-ttl-ms=N    Cache aggregate responses for N ms (default: 0, off)\n"
+            "      --response-cache-stale-ms=N  Serve stale while revalidating for N ms more (default: 0)\n"
+            "      --response-cache-size-kb=N   Response cache size per worker (default: 16384)\n"
+            "      --zerocopy-threshold-kb=N    Send batches of N KB and more with zerocopy (default: 64, 0 - off)\n"
+            "      --http2-max-streams=N        Concurrent HTTP/2 streams per connection (default: 16, 0 - off)\n"
+            "      --tls-cert=FILE              Serve TLS with this PEM certificate chain (needs kTLS)\n"
+            "      --tls-key=FILE               PEM private key for --tls-cert\n"
+            "      --upgrade-socket=PATH        Hand listening sockets to a new binary over PATH\n"
+            "      --drain-timeout-ms=N         Drain deadline after handing sockets over (default: 30000)\n"
+            "      --trace-sample=N             Trace 1 of N request batches, SIGUSR2 dumps (default: 0, off)\n"
+            "      --trace-file=FILE            Chrome trace written on SIGUSR2 (default: /tmp/server-trace.json)\n"
+            "      --stats-shm=/NAME            Publish worker counters in shared memory /dev/shm/NAME\n"
+            "      --control-socket=PATH        Accept get/set/metrics commands on a Unix socket\n"
+            "  -h, --help                       Show this help\n",
+            prog);
+}
+
+// Параметры, которые принятые сокеты наследуют от слушающего: accept
+// обходится без setsockopt на каждое соединение. С TCP_DEFER_ACCEPT
+// ядро отдает соединение в accept, когда клиент уже прислал запрос.
+// Выставляется и сокетам, полученным от прежнего процесса
+static void tune_listener(int fd) {
+    int flag = 1;
+    int sndbuf = 65536, rcvbuf = 32768;
+    if (setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &flag, sizeof(flag)) < 0 ||
+        setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(sndbuf)) < 0 ||
+        setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf)) < 0) {
+        perror("setsockopt(listener)");
+    }
+    if (setsockopt(fd, IPPROTO_TCP, TCP_DEFER_ACCEPT, &g_config.defer_accept_s,
+                   sizeof(g_config.defer_accept_s)) < 0) {
+        perror("setsockopt(TCP_DEFER_ACCEPT)");
+    }
+    // Опрос драйвера в ядре при чтении; выше net.core.busy_read требует
+    // CAP_NET_ADMIN, ошибка не мешает опросу в event loop
+    if (g_config.busy_poll_us > 0) {
+        setsockopt(fd, SOL_SOCKET, SO_BUSY_POLL, &g_config.busy_poll_us,
+                   sizeof(g_config.busy_poll_us));
     }
-    routes_init();
+}
 
-    // Создание и настройка слушающего сокета
-    int server_fd = socket(AF_INET, SOCK_STREAM, 0);
-    if (server_fd == -1) {
+// Слушающий сокет воркера. Все сокеты входят в одну группу SO_REUSEPORT,
+// индекс сокета в группе равен порядку вызова listen
+static int create_listener(void) {
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (fd == -1) {
         perror("socket");
-        return EXIT_FAILURE;
+        return -1;
     }
 
     int enable = 1;
-    if (setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(int)) < 0) {
+    if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(int)) < 0) {
         perror("setsockopt(SO_REUSEADDR)");
-        close(server_fd);
-        return EXIT_FAILURE;
+        close(fd);
+        return -1;
     }
-    if (setsockopt(server_fd, SOL_SOCKET, SO_REUSEPORT, &enable, sizeof(int)) < 0) {
+    if (setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &enable, sizeof(int)) < 0) {
         perror("setsockopt(SO_REUSEPORT)");
-        close(server_fd);
-        return EXIT_FAILURE;
+        close(fd);
+        return -1;
     }
 
     struct sockaddr_in addr = {
         .sin_family = AF_INET,
-        .sin_port = htons(PORT),
+        .sin_port = htons(g_config.port),
         .sin_addr.s_addr = INADDR_ANY,
     };
 
-    if (bind(server_fd, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
         perror("bind");
-        close(server_fd);
-        return EXIT_FAILURE;
+        close(fd);
+        return -1;
     }
 
-    if (listen(server_fd, SOMAXCONN) == -1) {
+    if (listen(fd, g_config.backlog) == -1) {
         perror("listen");
-        close(server_fd);
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+// CBPF-программа группы: сравнивает CPU, принявший пакет, с CPU каждого
+// воркера и возвращает индекс его сокета. Для CPU без воркера индекс
+// выходит за группу и ядро выбирает сокет по хешу.
+// Вызывается после listen всех сокетов
+static int attach_cpu_steering(int fd, const int *worker_cpu, int workers) {
+    int len = 2 * workers + 2;
+    struct sock_filter *code = calloc(len, sizeof(*code));
+    if (!code) {
+        perror("calloc");
+        return -1;
+    }
+
+    code[0] = (struct sock_filter){ BPF_LD | BPF_W | BPF_ABS, 0, 0, SKF_AD_OFF + SKF_AD_CPU };
+    for (int i = 0; i < workers; ++i) {
+        code[1 + 2 * i] = (struct sock_filter){ BPF_JMP | BPF_JEQ | BPF_K, 0, 1,
+                                                (unsigned)worker_cpu[i] };
+        code[2 + 2 * i] = (struct sock_filter){ BPF_RET | BPF_K, 0, 0, (unsigned)i };
+    }
+    code[len - 1] = (struct sock_filter){ BPF_RET | BPF_K, 0, 0, 0xFFFFFFFFu };
+
+    struct sock_fprog prog = {
+        .len = len,
+        .filter = code,
+    };
+
+    int ret = setsockopt(fd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog, sizeof(prog));
+    if (ret < 0) {
+        perror("setsockopt(SO_ATTACH_REUSEPORT_CBPF)");
+    }
+    free(code);
+    return ret < 0 ? -1 : 0;
+}
+
+// Настройки: значения по умолчанию, файл из -c, затем остальные опции.
+// Возвращает 0, 1 для --help или -1 при ошибке
+static int load_configuration(int argc, char *argv[]) {
+    static const struct option long_options[] = {
+        { "config",                 required_argument, NULL, 'c' },
+        { "io-engine",              required_argument, NULL, 'e' },
+        { "cpu-steering",           no_argument,       NULL, 's' },
+        { "port",                   required_argument, NULL, 'p' },
+        { "workers",                required_argument, NULL, 'w' },
+        { "routes-dir",             required_argument, NULL, 'r' },
+        { "cpus",                   required_argument, NULL, 0 },
+        { "numa-nodes",             required_argument, NULL, 0 },
+        { "backlog",                required_argument, NULL, 0 },
+        { "defer-accept-s",         required_argument, NULL, 0 },
+        { "connections-per-worker", required_argument, NULL, 0 },
+        { "overflow-connections",   required_argument, NULL, 0 },
+        { "io-buffers",             required_argument, NULL, 0 },
+        { "timer-capacity",         required_argument, NULL, 0 },
+        { "request-timeout-ms",     required_argument, NULL, 0 },
+        { "keepalive-timeout-ms",   required_argument, NULL, 0 },
+        { "max-events",             required_argument, NULL, 0 },
+        { "accept-batch",           required_argument, NULL, 0 },
+        { "io-batch",               required_argument, NULL, 0 },
+        { "uring-entries",          required_argument, NULL, 0 },
+        { "uring-buffers",          required_argument, NULL, 0 },
+        { "busy-poll-us",           required_argument, NULL, 0 },
+        { "overload-shed-pct",      required_argument, NULL, 0 },
+        { "overload-lag-ms",        required_argument, NULL, 0 },
+        { "overload-retry-after-s", required_argument, NULL, 0 },
+        { "upstream",               required_argument, NULL, 0 },
+        { "aggregate",              required_argument, NULL, 0 },
+        { "upstream-pool-size",     required_argument, NULL, 0 },
+        { "upstream-timeout-ms",    required_argument, NULL, 0 },
+        { "response-cache-ttl-ms",  required_argument, NULL, 0 },
+        { "response-cache-stale-ms", required_argument, NULL, 0 },
+        { "response-cache-size-kb", required_argument, NULL, 0 },
+        { "zerocopy-threshold-kb",  required_argument, NULL, 0 },
+        { "http2-max-streams",      required_argument, NULL, 0 },
+        { "tls-cert",               required_argument, NULL, 0 },
+        { "tls-key",                required_argument, NULL, 0 },
+        { "upgrade-socket",         required_argument, NULL, 0 },
+        { "drain-timeout-ms",       required_argument, NULL, 0 },
+        { "trace-sample",           required_argument, NULL, 0 },
+        { "trace-file",             required_argument, NULL, 0 },
+        { "stats-shm",              required_argument, NULL, 0 },
+        { "control-socket",         required_argument, NULL, 0 },
+        { "help",                   no_argument,       NULL, 'h' },
+        { NULL, 0, NULL, 0 }
+    };
+    static const char *short_options = "c:e:sp:w:r:h";
+
+    config_set_defaults(&g_config);
+
+    // Первый проход: только файл, чтобы опции командной строки его перекрывали
+    int opt;
+    while ((opt = getopt_long(argc, argv, short_options, long_options, NULL)) != -1) {
+        if (opt == 'c' && config_load_file(&g_config, optarg) != 0) {
+            return -1;
+        }
+        if (opt == '?') {
+            return -1;
+        }
+    }
+
+    optind = 1;
+    int index;
+    while ((opt = getopt_long(argc, argv, short_options, long_options, &index)) != -1) {
+        int ret = 0;
+        switch (opt) {
+        case 'c':
+            break;
+        case 'e':
+            ret = config_set(&g_config, "io_engine", optarg);
+            break;
+        case 's':
+            g_config.cpu_steering = 1;
+            break;
+        case 'p':
+            ret = config_set(&g_config, "port", optarg);
+            break;
+        case 'w':
+            ret = config_set(&g_config, "workers", optarg);
+            break;
+        case 'r':
+            ret = config_set(&g_config, "routes_dir", optarg);
+            break;
+        case 0:
+            ret = config_set(&g_config, long_options[index].name, optarg);
+            break;
+        case 'h':
+            return 1;
+        default:
+            return -1;
+        }
+        if (ret != 0) {
+            return -1;
+        }
+    }
+
+    return config_validate(&g_config);
+}
+
+int main(int argc, char *argv[]) {
+    int cfg = load_configuration(argc, argv);
+    if (cfg > 0) {
+        print_usage(argv[0]);
+        return EXIT_SUCCESS;
+    }
+    if (cfg < 0) {
+        fprintf(stderr, "Run %s --help for usage.\n", argv[0]);
         return EXIT_FAILURE;
     }
 
-    printf("Server listening on port %d with %d workers...\n", PORT, WORKER_THREADS);
+    // Выбор движка событий: epoll остается движком по умолчанию и fallback'ом
+    void *(*worker_fn)(void *) = worker_loop_optimized;
+    const char *engine_name = "epoll";
+    if (g_config.io_engine == CONFIG_ENGINE_URING) {
+        worker_fn = worker_loop_uring;
+        engine_name = "io_uring";
+    }
+    int workers_count = g_config.workers;
 
-    // Запуск worker-тредов
-    pthread_t workers[WORKER_THREADS];
-    worker_args_t *worker_args[WORKER_THREADS];
-    int created_workers = 0;
+    // Установка обработчиков сигналов
+    signal(SIGINT, sig_handler);
+    signal(SIGTERM, sig_handler);
+    signal(SIGHUP, sig_handler);   // Перечитать роуты
+    signal(SIGUSR2, sig_handler);  // Выгрузить трассу
+    signal(SIGPIPE, SIG_IGN); // Игнорируем SIGPIPE
+    struct sigaction wake = { .sa_handler = wake_handler }; // Без SA_RESTART
+    sigemptyset(&wake.sa_mask);
+    sigaction(SIGUSR1, &wake, NULL);
+
+    // Массивы воркеров по числу из конфигурации
+    pthread_t *workers = calloc(workers_count, sizeof(*workers));
+    worker_args_t *worker_args = calloc(workers_count, sizeof(*worker_args));
+    int *worker_cpu = calloc(workers_count, sizeof(*worker_cpu));
+    int *listeners = calloc(workers_count, sizeof(*listeners));
+    if (!workers || !worker_args || !worker_cpu || !listeners) {
+        fprintf(stderr, "Failed to allocate worker tables\n");
+        return EXIT_FAILURE;
+    }
+
+    // Инициализация подсистем
+    if (connection_pool_init() != 0) {
+        fprintf(stderr, "Failed to initialize connection pool.\n");
+        return EXIT_FAILURE;
+    }
+    if (metrics_init(workers_count) != 0) {
+        fprintf(stderr, "Failed to initialize metrics.\n");
+        connection_pool_destroy();
+        return EXIT_FAILURE;
+    }
+    if (http_responses_init() != 0 || routes_init() != 0 || tls_init() != 0 ||
+        trace_init(workers_count) != 0) {
+        trace_destroy();
+        tls_destroy();
+        routes_destroy();
+        http_responses_destroy();
+        metrics_destroy();
+        connection_pool_destroy();
+        return EXIT_FAILURE;
+    }
+    simd_scanner_init();
 
-    // Инициализируем массив указателей
-    for (int i = 0; i < WORKER_THREADS; ++i) {
-        worker_args[i] = NULL;
+    // CPU воркеров: явная карта из конфигурации или worker_id % nprocs.
+    // Слушающий сокет i принадлежит воркеру i; CBPF-программа ведет
+    // соединение к воркеру на CPU, обработавшем RX-очередь
+    int nprocs = get_nprocs();
+    int cpu_steering = g_config.cpu_steering;
+    int shared_cpu = 0;
+    for (int i = 0; i < workers_count; ++i) {
+        worker_cpu[i] = config_worker_cpu(&g_config, i, nprocs);
+        for (int j = 0; j < i && !shared_cpu; ++j) {
+            if (worker_cpu[j] == worker_cpu[i]) {
+                fprintf(stderr, "Warning: workers %d and %d share CPU %d%s\n",
+                        j + 1, i + 1, worker_cpu[i],
+                        cpu_steering ? ", CPU steering disabled" : "");
+                cpu_steering = 0;
+                shared_cpu = 1;
+            }
+        }
+    }
+    // Опрос на общем CPU отнимает время у соседнего воркера
+    if (shared_cpu && g_config.busy_poll_us > 0) {
+        fprintf(stderr, "Warning: busy polling is enabled but workers share a CPU\n");
     }
 
-    for (int i = 0; i < WORKER_THREADS; ++i) {
-        worker_args[i] = malloc(sizeof(worker_args_t));
-        if (!worker_args[i]) {
-            fprintf(stderr, "Failed to allocate memory for worker args\n");
-            g_running = 0;
+    // Слушающие сокеты: по одному на воркера. При обновлении бинаря -
+    // сокеты прежнего процесса, недостающие добавляются в ту же группу
+    int listener_count = upgrade_adopt_listeners(listeners, workers_count);
+    int adopted = listener_count;
+    if (listener_count < 0) {
+        trace_destroy();
+        tls_destroy();
+        routes_destroy();
+        http_responses_destroy();
+        metrics_destroy();
+        connection_pool_destroy();
+        return EXIT_FAILURE;
+    }
+    for (; listener_count < workers_count; ++listener_count) {
+        listeners[listener_count] = create_listener();
+        if (listeners[listener_count] == -1) {
             break;
         }
-        worker_args[i]->server_fd = server_fd;
-        worker_args[i]->worker_id = i + 1;
-        if (pthread_create(&workers[i], NULL, worker_loop, worker_args[i]) != 0) {
+    }
+    for (int i = 0; i < listener_count; ++i) {
+        tune_listener(listeners[i]);
+    }
+    if (listener_count < workers_count ||
+        (cpu_steering && attach_cpu_steering(listeners[0], worker_cpu, workers_count) != 0)) {
+        for (int i = 0; i < listener_count; ++i) {
+            close(listeners[i]);
+        }
+        upgrade_close();
+        trace_destroy();
+        tls_destroy();
+        routes_destroy();
+        http_responses_destroy();
+        metrics_destroy();
+        connection_pool_destroy();
+        return EXIT_FAILURE;
+    }
+
+    printf("Server listening on port %d with %d workers (%s engine, %s scanner, %s%s)...\n",
+           g_config.port, workers_count, engine_name, simd_scanner_name(),
+           cpu_steering ? "CPU-steered accept" : "hashed accept",
+           adopted > 0 ? ", sockets of the previous process" : "");
+
+    // Сигналы остановки, перезагрузки и выгрузки трассы получает только
+    // главный тред: создаваемые треды наследуют маску, а poll в
+    // routes_watch сразу прерывается. SIGUSR1 остается воркерам
+    sigset_t process_signals, saved_mask;
+    sigemptyset(&process_signals);
+    sigaddset(&process_signals, SIGINT);
+    sigaddset(&process_signals, SIGTERM);
+    sigaddset(&process_signals, SIGHUP);
+    sigaddset(&process_signals, SIGUSR2);
+    pthread_sigmask(SIG_BLOCK, &process_signals, &saved_mask);
+
+    // Воркеры пишут журнал через свои кольца, вывод - в отдельном треде
+    if (log_init(workers_count) != 0) {
+        fprintf(stderr, "Failed to start the log thread\n");
+        g_running = 0;
+    }
+
+    // Запуск worker-тредов
+    int created_workers = 0;
+    for (int i = 0; i < workers_count && g_running; ++i) {
+        worker_args[i].server_fd = listeners[i];
+        worker_args[i].worker_id = i + 1;
+        worker_args[i].cpu_id = worker_cpu[i];
+        worker_args[i].numa_node = config_worker_numa_node(&g_config, i);
+        if (pthread_create(&workers[i], NULL, worker_fn, &worker_args[i]) != 0) {
             perror("pthread_create");
-            free(worker_args[i]);
-            worker_args[i] = NULL;
             g_running = 0; // Останавливаем все, если не удалось создать тред
             break;
         }
         created_workers++;
     }
+    pthread_sigmask(SIG_SETMASK, &saved_mask, NULL);
 
     if (created_workers == 0) {
         fprintf(stderr, "Failed to create any worker threads\n");
-        close(server_fd);
+        for (int i = 0; i < listener_count; ++i) {
+            close(listeners[i]);
+        }
+        upgrade_close(); // Прежний процесс увидит разрыв и продолжит работу
+        log_shutdown();
+        trace_destroy();
+        tls_destroy();
         routes_destroy();
+        http_responses_destroy();
+        metrics_destroy();
         connection_pool_destroy();
         return EXIT_FAILURE;
     }
 
-    // Ожидание сигнала для завершения
+    // Воркеры принимают соединения: прежний процесс может уходить.
+    // Главный тред следит за каталогом роутов, управляющим сокетом и
+    // сокетом обновления до сигнала завершения или передачи сокетов
+    // новому процессу
+    int upgrade_fd = upgrade_listen();
+    control_listen();
+    lockfree_pool_t *pool = connection_pool_handle();
     while (g_running) {
-        sleep(1);
+        struct pollfd wake[ROUTES_WAKE_FDS_MAX] = {{ .fd = upgrade_fd, .events = POLLIN }};
+        int wake_count = 1 + control_poll_fds(wake + 1, ROUTES_WAKE_FDS_MAX - 1);
+        routes_watch(1000, wake, wake_count);
+        control_serve();
+        trace_dump_pending();
+        metrics_shm_publish(atomic_load(&pool->global_used_count),
+                            atomic_load(&pool->global_capacity), 0);
+        if (upgrade_fd != -1 && upgrade_serve(listeners, listener_count) > 0) {
+            g_draining = 1;
+            metrics_shm_publish(atomic_load(&pool->global_used_count),
+                                atomic_load(&pool->global_capacity), 1);
+            break;
+        }
     }
 
-    printf("\nShutting down server...\n");
-
-    // Ожидание завершения всех тредов
-    for (int i = 0; i < created_workers; ++i) {
-        pthread_join(workers[i], NULL);
+    if (g_draining) {
+        printf("\nListening sockets handed over, draining connections (up to %d ms)...\n",
+               g_config.drain_timeout_ms);
+    } else {
+        printf("\nShutting down server...\n");
     }
 
-    // Освобождение памяти для аргументов воркеров
-    for (int i = 0; i < WORKER_THREADS; ++i) {
-        if (worker_args[i]) {
-            free(worker_args[i]);
-        }
-    }
+    // Ожидание завершения всех тредов
+    join_workers(workers, created_workers);
+    control_close();
+    upgrade_close();
+    log_shutdown();
 
     // Очистка ресурсов
-    close(server_fd);
+    for (int i = 0; i < listener_count; ++i) {
+        close(listeners[i]);
+    }
+    trace_destroy();
+    tls_destroy();
     routes_destroy();
+    http_responses_destroy();
+    metrics_destroy();
     connection_pool_destroy();
 
+    free(listeners);
+    free(worker_cpu);
+    free(worker_args);
+    free(workers);
+
     printf("Server shut down gracefully.\n");
 
     return EXIT_SUCCESS;
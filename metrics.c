@@ -0,0 +1,351 @@
+#include "metrics.h"
+#include "simd_utils.h"
+#include "config.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+__thread worker_metrics_t *worker_metrics = NULL;
+
+static worker_metrics_t *metrics_registry;
+static int metrics_worker_count;
+static metrics_shm_header_t *shm_header;   // NULL - реестр в обычной памяти
+static size_t shm_size;
+static ino_t shm_ino;
+static const char *route_names[METRICS_ROUTE_SLOTS] = { "other" };
+
+static const char *status_labels[METRIC_STATUS_COUNT] = {
+    [METRIC_STATUS_200] = "200",
+    [METRIC_STATUS_304] = "304",
+    [METRIC_STATUS_400] = "400",
+    [METRIC_STATUS_404] = "404",
+    [METRIC_STATUS_405] = "405",
+    [METRIC_STATUS_500] = "500",
+    [METRIC_STATUS_502] = "502",
+    [METRIC_STATUS_503] = "503",
+    [METRIC_STATUS_OTHER] = "other",
+};
+
+// Реестр в сегменте stats_shm. Сегмент прежнего процесса (обновление
+// бинаря) остается у него отображенным, имя переходит к новому
+static int metrics_shm_create(int workers, size_t size) {
+    shm_unlink(g_config.stats_shm);
+    int fd = shm_open(g_config.stats_shm, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+    if (fd == -1) {
+        fprintf(stderr, "Stats: shm_open %s: %s\n", g_config.stats_shm, strerror(errno));
+        return -1;
+    }
+    struct stat st;
+    shm_size = sizeof(metrics_shm_header_t) + size;
+    void *map = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && ftruncate(fd, (off_t)shm_size) == 0) {
+        map = mmap(NULL, shm_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    }
+    if (map == MAP_FAILED) {
+        fprintf(stderr, "Stats: map %s: %s\n", g_config.stats_shm, strerror(errno));
+        close(fd);
+        shm_unlink(g_config.stats_shm);
+        return -1;
+    }
+    close(fd);
+    shm_ino = st.st_ino;
+
+    // ftruncate заполнил сегмент нулями; magic - последним, читатель
+    // по нему узнает готовый заголовок
+    shm_header = map;
+    shm_header->version = METRICS_SHM_VERSION;
+    shm_header->header_size = sizeof(metrics_shm_header_t);
+    shm_header->block_size = sizeof(worker_metrics_t);
+    shm_header->workers = (uint32_t)workers;
+    shm_header->pid = (int32_t)getpid();
+    shm_header->max_events = (uint32_t)g_config.max_events;
+    shm_header->io_batch = (uint32_t)g_config.io_batch;
+    __atomic_store_n(&shm_header->magic, METRICS_SHM_MAGIC, __ATOMIC_RELEASE);
+
+    metrics_registry = (worker_metrics_t *)((char *)map + sizeof(metrics_shm_header_t));
+    metrics_worker_count = workers;
+    printf("Stats: %d worker blocks in shared memory %s\n", workers, g_config.stats_shm);
+    return 0;
+}
+
+int metrics_init(int workers) {
+    size_t size = ALIGN_TO_CACHE_LINE(sizeof(worker_metrics_t) * workers);
+    if (g_config.stats_shm[0] != '\0') {
+        return metrics_shm_create(workers, size);
+    }
+    metrics_registry = aligned_alloc(CACHE_LINE_SIZE, size);
+    if (!metrics_registry) {
+        return -1;
+    }
+    memset(metrics_registry, 0, size);
+    metrics_worker_count = workers;
+    return 0;
+}
+
+void metrics_destroy(void) {
+    if (shm_header) {
+        // Имя удаляется, только если его еще не забрал новый процесс
+        char path[sizeof("/dev/shm") + CONFIG_SHM_NAME_MAX];
+        struct stat st;
+        snprintf(path, sizeof(path), "/dev/shm%s", g_config.stats_shm);
+        if (stat(path, &st) == 0 && st.st_ino == shm_ino) {
+            shm_unlink(g_config.stats_shm);
+        }
+        munmap(shm_header, shm_size);
+        shm_header = NULL;
+    } else {
+        free(metrics_registry);
+    }
+    metrics_registry = NULL;
+    metrics_worker_count = 0;
+}
+
+void metrics_shm_publish(int overflow_used, int overflow_capacity, int draining) {
+    if (!shm_header) {
+        return;
+    }
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    metric_set(&shm_header->overflow_used, (uint64_t)overflow_used);
+    metric_set(&shm_header->overflow_capacity, (uint64_t)overflow_capacity);
+    metric_set(&shm_header->draining, (uint64_t)draining);
+    metric_set(&shm_header->updated_ms, (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000);
+}
+
+worker_metrics_t *metrics_register_worker(int worker_id) {
+    // Повторная регистрация (io_uring -> epoll fallback) отдает тот же блок
+    worker_metrics_t *m = &metrics_registry[(worker_id - 1) % metrics_worker_count];
+    m->worker_id = worker_id;
+    atomic_store(&m->active, 1);
+    worker_metrics = m;
+    return m;
+}
+
+void metrics_set_route_name(int slot, const char *name) {
+    if (slot > 0 && slot < METRICS_ROUTE_SLOTS) {
+        route_names[slot] = name;
+    }
+}
+
+static inline uint64_t metric_get(metric_counter_t *counter) {
+    return atomic_load_explicit(counter, memory_order_relaxed);
+}
+
+// Верхняя граница бакета в секундах
+static double latency_bucket_upper(int bucket) {
+    if (bucket == 0) {
+        return (double)(1ull << METRICS_LATENCY_MIN_SHIFT) / 1e9;
+    }
+    int group = (bucket - 1) >> METRICS_LATENCY_SUB_BITS;
+    int sub = (bucket - 1) & ((1 << METRICS_LATENCY_SUB_BITS) - 1);
+    int e = METRICS_LATENCY_MIN_SHIFT + group;
+    uint64_t upper = (1ull << e) + ((uint64_t)(sub + 1) << (e - METRICS_LATENCY_SUB_BITS));
+    return (double)upper / 1e9;
+}
+
+static void render_worker_counter(FILE *out, const char *name, const char *help,
+                                  size_t offset) {
+    fprintf(out, "# HELP %s %s\n# TYPE %s counter\n", name, help, name);
+    for (int w = 0; w < metrics_worker_count; ++w) {
+        worker_metrics_t *m = &metrics_registry[w];
+        if (!atomic_load(&m->active)) continue;
+        metric_counter_t *counter = (metric_counter_t *)((char *)m + offset);
+        fprintf(out, "%s{worker=\"%d\"} %lu\n", name, m->worker_id, metric_get(counter));
+    }
+}
+
+static void render_worker_seconds(FILE *out, const char *name, const char *help,
+                                  size_t offset) {
+    fprintf(out, "# HELP %s %s\n# TYPE %s counter\n", name, help, name);
+    for (int w = 0; w < metrics_worker_count; ++w) {
+        worker_metrics_t *m = &metrics_registry[w];
+        if (!atomic_load(&m->active)) continue;
+        metric_counter_t *counter = (metric_counter_t *)((char *)m + offset);
+        fprintf(out, "%s{worker=\"%d\"} %.9f\n", name, m->worker_id,
+                (double)metric_get(counter) / 1e9);
+    }
+}
+
+// Доля опроса во времени ожидания воркера: 1 - все события пойманы опросом
+static void render_busy_poll_ratio(FILE *out) {
+    fprintf(out, "# HELP bff_worker_busy_poll_ratio Share of wait time spent polling rather than blocked.\n"
+                 "# TYPE bff_worker_busy_poll_ratio gauge\n");
+    for (int w = 0; w < metrics_worker_count; ++w) {
+        worker_metrics_t *m = &metrics_registry[w];
+        if (!atomic_load(&m->active)) continue;
+        uint64_t spin = metric_get(&m->busy_poll_ns);
+        uint64_t total = spin + metric_get(&m->idle_ns);
+        fprintf(out, "bff_worker_busy_poll_ratio{worker=\"%d\"} %.6f\n", m->worker_id,
+                total ? (double)spin / (double)total : 0.0);
+    }
+}
+
+static void render_worker_gauge(FILE *out, const char *name, const char *help,
+                                size_t offset, double scale) {
+    fprintf(out, "# HELP %s %s\n# TYPE %s gauge\n", name, help, name);
+    for (int w = 0; w < metrics_worker_count; ++w) {
+        worker_metrics_t *m = &metrics_registry[w];
+        if (!atomic_load(&m->active)) continue;
+        metric_counter_t *gauge = (metric_counter_t *)((char *)m + offset);
+        fprintf(out, "%s{worker=\"%d\"} %.9g\n", name, m->worker_id,
+                (double)metric_get(gauge) * scale);
+    }
+}
+
+static void render_overload_pressure(FILE *out) {
+    fprintf(out, "# HELP bff_worker_overload_pressure Worst of pool, buffer, queue and lag load (1 = saturated).\n"
+                 "# TYPE bff_worker_overload_pressure gauge\n");
+    for (int w = 0; w < metrics_worker_count; ++w) {
+        worker_metrics_t *m = &metrics_registry[w];
+        if (!atomic_load(&m->active)) continue;
+        fprintf(out, "bff_worker_overload_pressure{worker=\"%d\"} %.3f\n", m->worker_id,
+                (double)metric_get(&m->overload_pressure) / 1000.0);
+    }
+}
+
+int metrics_render(char **body, size_t *len) {
+    FILE *out = open_memstream(body, len);
+    if (!out) return -1;
+
+    // Запросы по роутам и кодам ответа
+    fprintf(out, "# HELP bff_http_requests_total HTTP requests by route and status code.\n"
+                 "# TYPE bff_http_requests_total counter\n");
+    for (int slot = 0; slot < METRICS_ROUTE_SLOTS; ++slot) {
+        if (!route_names[slot]) continue;
+        for (int status = 0; status < METRIC_STATUS_COUNT; ++status) {
+            uint64_t total = 0;
+            for (int w = 0; w < metrics_worker_count; ++w) {
+                total += metric_get(&metrics_registry[w].requests[slot][status]);
+            }
+            if (total == 0) continue;
+            fprintf(out, "bff_http_requests_total{route=\"%s\",code=\"%s\"} %lu\n",
+                    route_names[slot], status_labels[status], total);
+        }
+    }
+
+    // Латентность: от приема запроса до полной отправки ответа
+    fprintf(out, "# HELP bff_http_request_duration_seconds Time from request receipt to response fully written.\n"
+                 "# TYPE bff_http_request_duration_seconds histogram\n");
+    for (int slot = 0; slot < METRICS_ROUTE_SLOTS; ++slot) {
+        if (!route_names[slot]) continue;
+
+        uint64_t buckets[METRICS_LATENCY_BUCKETS] = {0};
+        uint64_t count = 0;
+        uint64_t sum_ns = 0;
+        for (int w = 0; w < metrics_worker_count; ++w) {
+            worker_metrics_t *m = &metrics_registry[w];
+            for (int b = 0; b < METRICS_LATENCY_BUCKETS; ++b) {
+                uint64_t v = metric_get(&m->latency[slot][b]);
+                buckets[b] += v;
+                count += v;
+            }
+            sum_ns += metric_get(&m->latency_sum_ns[slot]);
+        }
+        if (count == 0) continue;
+
+        uint64_t cumulative = 0;
+        for (int b = 0; b < METRICS_LATENCY_BUCKETS - 1; ++b) {
+            cumulative += buckets[b];
+            fprintf(out, "bff_http_request_duration_seconds_bucket{route=\"%s\",le=\"%.9g\"} %lu\n",
+                    route_names[slot], latency_bucket_upper(b), cumulative);
+        }
+        fprintf(out, "bff_http_request_duration_seconds_bucket{route=\"%s\",le=\"+Inf\"} %lu\n"
+                     "bff_http_request_duration_seconds_sum{route=\"%s\"} %.9f\n"
+                     "bff_http_request_duration_seconds_count{route=\"%s\"} %lu\n",
+                route_names[slot], count, route_names[slot], sum_ns / 1e9,
+                route_names[slot], count);
+    }
+
+    // Счетчики event loop по воркерам
+    render_worker_counter(out, "bff_worker_events_total", "Events processed by the worker loop.",
+                          offsetof(worker_metrics_t, events_processed));
+    render_worker_counter(out, "bff_worker_connections_accepted_total", "Accepted connections.",
+                          offsetof(worker_metrics_t, connections_accepted));
+    render_worker_counter(out, "bff_worker_bytes_read_total", "Bytes received from clients.",
+                          offsetof(worker_metrics_t, bytes_read));
+    render_worker_counter(out, "bff_worker_bytes_written_total", "Bytes sent to clients.",
+                          offsetof(worker_metrics_t, bytes_written));
+    render_worker_counter(out, "bff_worker_bytes_zerocopy_total",
+                          "Bytes sent to clients without copying into the socket buffer.",
+                          offsetof(worker_metrics_t, bytes_zerocopy));
+    render_worker_counter(out, "bff_worker_cache_hits_total", "Response cache hits.",
+                          offsetof(worker_metrics_t, cache_hits));
+    render_worker_counter(out, "bff_worker_cache_misses_total", "Response cache misses.",
+                          offsetof(worker_metrics_t, cache_misses));
+    render_worker_counter(out, "bff_worker_recv_no_buffers_total",
+                          "io_uring receives that found no provided buffer.",
+                          offsetof(worker_metrics_t, recv_no_buffers));
+    render_worker_counter(out, "bff_worker_io_buffers_exhausted_total",
+                          "Connections closed because no request buffer was free.",
+                          offsetof(worker_metrics_t, io_buffers_exhausted));
+    render_worker_seconds(out, "bff_worker_busy_poll_seconds_total",
+                          "Time spent polling for events before blocking.",
+                          offsetof(worker_metrics_t, busy_poll_ns));
+    render_worker_seconds(out, "bff_worker_idle_seconds_total",
+                          "Time spent blocked waiting for events while busy polling is on.",
+                          offsetof(worker_metrics_t, idle_ns));
+    render_worker_counter(out, "bff_worker_busy_poll_hits_total",
+                          "Waits that found events while polling.",
+                          offsetof(worker_metrics_t, busy_poll_hits));
+    render_worker_counter(out, "bff_worker_busy_poll_misses_total",
+                          "Waits that fell through to a blocking wait.",
+                          offsetof(worker_metrics_t, busy_poll_misses));
+    render_busy_poll_ratio(out);
+    render_worker_counter(out, "bff_worker_connections_shed_total",
+                          "New connections answered with 503 (reset on TLS listeners) under overload.",
+                          offsetof(worker_metrics_t, connections_shed));
+    render_worker_counter(out, "bff_worker_accept_pauses_total",
+                          "Times accept was paused because the event loop lagged.",
+                          offsetof(worker_metrics_t, accept_pauses));
+    render_overload_pressure(out);
+    render_worker_counter(out, "bff_worker_upstream_requests_total",
+                          "Requests sent to aggregate route backends.",
+                          offsetof(worker_metrics_t, upstream_requests));
+    render_worker_counter(out, "bff_worker_upstream_errors_total",
+                          "Backend requests that failed, timed out or returned non-2xx.",
+                          offsetof(worker_metrics_t, upstream_errors));
+    render_worker_counter(out, "bff_worker_upstream_connections_total",
+                          "Connections opened to backends.",
+                          offsetof(worker_metrics_t, upstream_connections));
+    render_worker_counter(out, "bff_worker_upstream_coalesced_total",
+                          "Aggregate requests answered from an identical in-flight request.",
+                          offsetof(worker_metrics_t, upstream_coalesced));
+    render_worker_counter(out, "bff_worker_tls_handshakes_total",
+                          "TLS handshakes completed with keys installed into kTLS.",
+                          offsetof(worker_metrics_t, tls_handshakes));
+    render_worker_counter(out, "bff_worker_tls_resumed_total",
+                          "TLS handshakes that resumed a session from a ticket.",
+                          offsetof(worker_metrics_t, tls_resumed));
+    render_worker_counter(out, "bff_worker_tls_failures_total",
+                          "TLS handshakes that failed or could not be offloaded to kTLS.",
+                          offsetof(worker_metrics_t, tls_failures));
+    render_worker_counter(out, "bff_worker_h2_connections_total",
+                          "Connections that switched to HTTP/2.",
+                          offsetof(worker_metrics_t, h2_connections));
+    render_worker_counter(out, "bff_worker_h2_streams_total",
+                          "HTTP/2 streams opened by clients.",
+                          offsetof(worker_metrics_t, h2_streams));
+    render_worker_counter(out, "bff_worker_loop_iterations_total", "Event loop iterations.",
+                          offsetof(worker_metrics_t, loop_iterations));
+    render_worker_seconds(out, "bff_worker_loop_busy_seconds_total",
+                          "Time spent handling events after each wakeup.",
+                          offsetof(worker_metrics_t, loop_busy_ns));
+    render_worker_gauge(out, "bff_worker_loop_lag_seconds",
+                        "Moving average of event loop iteration time.",
+                        offsetof(worker_metrics_t, loop_lag_ns), 1e-9);
+    render_worker_gauge(out, "bff_worker_timers_armed", "Connections with an armed timer.",
+                        offsetof(worker_metrics_t, timers_armed), 1.0);
+
+    if (fclose(out) != 0) {
+        free(*body);
+        *body = NULL;
+        return -1;
+    }
+    return 0;
+}
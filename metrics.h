@@ -0,0 +1,205 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stddef.h>
+
+// Prometheus-метрики. Каждый воркер пишет только в свой блок счетчиков,
+// поэтому на горячем пути нет атомарных RMW: relaxed load + store
+// компилируются в обычные mov. /metrics суммирует блоки всех воркеров.
+//
+// С stats_shm блоки лежат в разделяемой памяти (/dev/shm/NAME) после
+// заголовка metrics_shm_header_t, и внешний процесс читает их без
+// участия сервера: счетчики монотонны, скорости - по разности двух
+// чтений, gauges воркер обновляет раз в итерацию event loop'а
+
+#define METRICS_MAX_ROUTES 16
+#define METRICS_ROUTE_SLOTS (METRICS_MAX_ROUTES + 1) // Слот 0 - запросы без роута
+
+// Лог-линейная гистограмма латентности в наносекундах: интервалы
+// [2^e, 2^(e+1)) для e в [MIN_SHIFT, MAX_SHIFT) делятся на 2^SUB_BITS
+// равных частей. Первый бакет - [0, 2^MIN_SHIFT), последний - переполнение
+#define METRICS_LATENCY_MIN_SHIFT 10 // ~1 мкс
+#define METRICS_LATENCY_MAX_SHIFT 30 // ~1 с
+#define METRICS_LATENCY_SUB_BITS 2
+#define METRICS_LATENCY_BUCKETS \
+    (2 + ((METRICS_LATENCY_MAX_SHIFT - METRICS_LATENCY_MIN_SHIFT) << METRICS_LATENCY_SUB_BITS))
+
+// Коды ответов, для которых ведутся счетчики
+typedef enum {
+    METRIC_STATUS_200,
+    METRIC_STATUS_304,
+    METRIC_STATUS_400,
+    METRIC_STATUS_404,
+    METRIC_STATUS_405,
+    METRIC_STATUS_500,
+    METRIC_STATUS_502,
+    METRIC_STATUS_503,
+    METRIC_STATUS_OTHER,
+    METRIC_STATUS_COUNT
+} metric_status_t;
+
+typedef _Atomic uint64_t metric_counter_t;
+
+typedef struct {
+    metric_counter_t requests[METRICS_ROUTE_SLOTS][METRIC_STATUS_COUNT];
+    metric_counter_t latency[METRICS_ROUTE_SLOTS][METRICS_LATENCY_BUCKETS];
+    metric_counter_t latency_sum_ns[METRICS_ROUTE_SLOTS];
+
+    // Счетчики event loop
+    metric_counter_t events_processed;
+    metric_counter_t connections_accepted;
+    metric_counter_t bytes_read;
+    metric_counter_t bytes_written;
+    metric_counter_t bytes_zerocopy;     // Из них отправлено с MSG_ZEROCOPY / SENDMSG_ZC
+    metric_counter_t cache_hits;
+    metric_counter_t cache_misses;
+    metric_counter_t recv_no_buffers;
+    metric_counter_t io_buffers_exhausted;
+    
+    // Опрос перед сном (--busy-poll-us): время опроса и сна, исходы ожиданий
+    metric_counter_t busy_poll_ns;
+    metric_counter_t idle_ns;
+    metric_counter_t busy_poll_hits;
+    metric_counter_t busy_poll_misses;
+    
+    // Контроль перегрузки
+    metric_counter_t connections_shed;
+    metric_counter_t accept_pauses;
+    metric_counter_t overload_pressure;  // Последнее давление, промилле (gauge)
+    
+    // Агрегирующие роуты: запросы к бэкендам, их неудачи, новые соединения
+    // и клиентские запросы, дождавшиеся чужого запроса к бэкендам
+    metric_counter_t upstream_requests;
+    metric_counter_t upstream_errors;
+    metric_counter_t upstream_connections;
+    metric_counter_t upstream_coalesced;
+
+    // TLS: рукопожатия с ключами в kTLS, из них возобновленные, неудачные
+    metric_counter_t tls_handshakes;
+    metric_counter_t tls_resumed;
+    metric_counter_t tls_failures;
+
+    // HTTP/2: соединения и потоки (запросы) в них
+    metric_counter_t h2_connections;
+    metric_counter_t h2_streams;
+
+    // Итерации event loop'а, их суммарное время от пробуждения до конца
+    // обработки; пакеты чтения/записи epoll-воркера и соединений в них
+    metric_counter_t loop_iterations;
+    metric_counter_t loop_busy_ns;
+    metric_counter_t read_batches;
+    metric_counter_t read_batch_items;
+    metric_counter_t write_batches;
+    metric_counter_t write_batch_items;
+
+    // Gauges итерации
+    metric_counter_t loop_lag_ns;        // EWMA времени итерации
+    metric_counter_t event_fill;         // EWMA событий за ожидание, промилле от max_events
+    metric_counter_t pool_occupancy;     // Пул соединений с overflow, промилле
+    metric_counter_t io_occupancy;       // Буферы запросов, промилле
+    metric_counter_t timers_armed;
+
+    int worker_id;
+    atomic_int active;
+} __attribute__((aligned(64))) worker_metrics_t;
+
+// Блок метрик текущего воркера (NULL - тред не зарегистрирован)
+extern __thread worker_metrics_t *worker_metrics;
+
+// Счетчик пишет только владелец - без lock-префикса
+static inline void metric_add(metric_counter_t *counter, uint64_t value) {
+    atomic_store_explicit(counter,
+        atomic_load_explicit(counter, memory_order_relaxed) + value,
+        memory_order_relaxed);
+}
+
+// Gauge пишет только владелец
+static inline void metric_set(metric_counter_t *gauge, uint64_t value) {
+    atomic_store_explicit(gauge, value, memory_order_relaxed);
+}
+
+// Заголовок сегмента stats_shm. За ним workers блоков worker_metrics_t
+// по block_size байт, первый - со смещения header_size. Раскладка блока -
+// структура выше; при ее изменении растет version
+#define METRICS_SHM_MAGIC 0x53464642u    // "BFFS"
+#define METRICS_SHM_VERSION 1
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t header_size;
+    uint32_t block_size;
+    uint32_t workers;
+    int32_t pid;
+    uint32_t max_events;                 // Знаменатели долей заполнения
+    uint32_t io_batch;
+
+    // Обновляет главный тред примерно раз в секунду
+    metric_counter_t updated_ms;         // CLOCK_MONOTONIC
+    metric_counter_t overflow_used;      // Общий overflow-пул соединений
+    metric_counter_t overflow_capacity;
+    metric_counter_t draining;           // Сокеты переданы новому процессу
+} __attribute__((aligned(64))) metrics_shm_header_t;
+
+// Реестр блоков на workers воркеров, до запуска тредов: в stats_shm,
+// если оно задано, иначе в обычной памяти
+int metrics_init(int workers);
+void metrics_destroy(void);
+
+// Главный тред: общие для процесса значения в заголовок stats_shm
+void metrics_shm_publish(int overflow_used, int overflow_capacity, int draining);
+
+// Выделить блок метрик воркеру (worker_id от 1) и привязать его к текущему треду
+worker_metrics_t *metrics_register_worker(int worker_id);
+
+// Имя роута для метки route="..."; slot = route_id + 1
+void metrics_set_route_name(int slot, const char *name);
+
+static inline int metrics_route_slot(int route_id) {
+    return (route_id >= 0 && route_id < METRICS_MAX_ROUTES) ? route_id + 1 : 0;
+}
+
+static inline metric_status_t metrics_status_index(int status_code) {
+    switch (status_code) {
+    case 200: return METRIC_STATUS_200;
+    case 304: return METRIC_STATUS_304;
+    case 400: return METRIC_STATUS_400;
+    case 404: return METRIC_STATUS_404;
+    case 405: return METRIC_STATUS_405;
+    case 500: return METRIC_STATUS_500;
+    case 502: return METRIC_STATUS_502;
+    case 503: return METRIC_STATUS_503;
+    default: return METRIC_STATUS_OTHER;
+    }
+}
+
+static inline int metrics_latency_bucket(uint64_t ns) {
+    if (ns < (1ull << METRICS_LATENCY_MIN_SHIFT)) return 0;
+
+    int e = 63 - __builtin_clzll(ns);
+    if (e >= METRICS_LATENCY_MAX_SHIFT) return METRICS_LATENCY_BUCKETS - 1;
+
+    int sub = (ns >> (e - METRICS_LATENCY_SUB_BITS)) & ((1 << METRICS_LATENCY_SUB_BITS) - 1);
+    return 1 + ((e - METRICS_LATENCY_MIN_SHIFT) << METRICS_LATENCY_SUB_BITS) + sub;
+}
+
+static inline void metrics_count_request(int route_id, int status_code) {
+    if (__builtin_expect(worker_metrics == NULL, 0)) return;
+    metric_add(&worker_metrics->requests[metrics_route_slot(route_id)]
+                                        [metrics_status_index(status_code)], 1);
+}
+
+static inline void metrics_observe_latency(int route_id, uint64_t ns) {
+    if (__builtin_expect(worker_metrics == NULL, 0)) return;
+    int slot = metrics_route_slot(route_id);
+    metric_add(&worker_metrics->latency[slot][metrics_latency_bucket(ns)], 1);
+    metric_add(&worker_metrics->latency_sum_ns[slot], ns);
+}
+
+// Текстовый формат Prometheus по всем воркерам. Буфер выделяется malloc,
+// освобождает вызывающий. Возвращает 0 при успехе
+int metrics_render(char **body, size_t *len);
+
+#endif // METRICS_H
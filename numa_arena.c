@@ -0,0 +1,143 @@
+#include "numa_arena.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <numa.h>
+
+#ifndef MAP_HUGE_2MB
+#define MAP_HUGE_2MB (21 << 26) // MAP_HUGE_SHIFT = 26
+#endif
+
+static __thread numa_arena_t *thread_arena = NULL;
+
+static inline size_t round_up(size_t value, size_t align) {
+    return (value + align - 1) & ~(align - 1);
+}
+
+// Отображение, выровненное по 2 МБ: без выравнивания THP не покрывает
+// первый и последний неполные 2 МБ
+static void *map_aligned(size_t size) {
+    size_t span = size + NUMA_ARENA_HUGE_PAGE;
+    char *raw = mmap(NULL, span, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (raw == MAP_FAILED) {
+        return NULL;
+    }
+
+    char *aligned = (char *)round_up((uintptr_t)raw, NUMA_ARENA_HUGE_PAGE);
+    if (aligned > raw) {
+        munmap(raw, aligned - raw);
+    }
+    size_t tail = (raw + span) - (aligned + size);
+    if (tail > 0) {
+        munmap(aligned + size, tail);
+    }
+    return aligned;
+}
+
+int numa_arena_init(numa_arena_t *arena, size_t size, int node) {
+    memset(arena, 0, sizeof(*arena));
+    size = round_up(size > 0 ? size : 1, NUMA_ARENA_HUGE_PAGE);
+
+    int have_numa = numa_available() >= 0;
+    if (node < 0 && have_numa) {
+        int cpu = sched_getcpu();
+        node = cpu >= 0 ? numa_node_of_cpu(cpu) : -1;
+    }
+    if (!have_numa || node > numa_max_node()) {
+        node = -1;
+    }
+
+    // Сначала зарезервированные huge pages, затем THP на обычном отображении
+    char *base = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | MAP_HUGE_2MB, -1, 0);
+    arena->backing = NUMA_ARENA_HUGETLB;
+    if (base == MAP_FAILED) {
+        base = map_aligned(size);
+        if (!base) {
+            return -1;
+        }
+        madvise(base, size, MADV_HUGEPAGE);
+        arena->backing = NUMA_ARENA_THP;
+    }
+
+    // Привязка до первого касания: страницы сразу выделяются на ноде
+    if (node >= 0) {
+        numa_tonode_memory(base, size, node);
+    }
+
+    // First touch из треда-владельца - по байту на страницу
+    for (size_t off = 0; off < size; off += 4096) {
+        ((volatile char *)base)[off] = 0;
+    }
+
+    arena->base = base;
+    arena->size = size;
+    arena->used = 0;
+    arena->node = node;
+    return 0;
+}
+
+void numa_arena_destroy(numa_arena_t *arena) {
+    if (arena->base) {
+        munmap(arena->base, arena->size);
+    }
+    if (thread_arena == arena) {
+        thread_arena = NULL;
+    }
+    memset(arena, 0, sizeof(*arena));
+}
+
+void *numa_arena_alloc(numa_arena_t *arena, size_t size, size_t align) {
+    if (!arena || !arena->base) {
+        return NULL;
+    }
+    size_t offset = round_up(arena->used, align);
+    if (offset > arena->size || size > arena->size - offset) {
+        return NULL;
+    }
+    arena->used = offset + size;
+    return arena->base + offset;
+}
+
+void numa_arena_set_thread(numa_arena_t *arena) {
+    thread_arena = arena;
+}
+
+void *numa_local_alloc(size_t size) {
+    void *ptr = numa_arena_alloc(thread_arena, size, 64);
+    return ptr ? ptr : malloc(size);
+}
+
+void numa_local_free(void *ptr) {
+    numa_arena_t *arena = thread_arena;
+    if (arena && arena->base && (char *)ptr >= arena->base &&
+        (char *)ptr < arena->base + arena->size) {
+        return; // Память арены освобождается вместе с ней
+    }
+    free(ptr);
+}
+
+void *numa_shared_alloc(size_t size) {
+    size = round_up(size > 0 ? size : 1, 4096);
+    void *ptr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ptr == MAP_FAILED) {
+        return NULL;
+    }
+    if (numa_available() >= 0 && numa_max_node() > 0) {
+        numa_interleave_memory(ptr, size, numa_all_nodes_ptr);
+    }
+    return ptr;
+}
+
+void numa_shared_free(void *ptr, size_t size) {
+    if (ptr) {
+        munmap(ptr, round_up(size > 0 ? size : 1, 4096));
+    }
+}
+
+const char *numa_arena_backing_name(const numa_arena_t *arena) {
+    return arena->backing == NUMA_ARENA_HUGETLB ? "hugetlb" : "thp";
+}
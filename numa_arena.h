@@ -0,0 +1,48 @@
+#ifndef NUMA_ARENA_H
+#define NUMA_ARENA_H
+
+#include <stddef.h>
+
+// Арена воркера: одно mmap-отображение, выровненное по 2 МБ, на huge pages
+// (hugetlbfs, иначе THP) и привязанное к NUMA-ноде воркера. Страницы
+// касаются при создании из треда-владельца, так что first touch
+// приходится на его ноду. Выделение - сдвиг указателя, освобождается
+// арена только целиком
+
+#define NUMA_ARENA_HUGE_PAGE (2u << 20)
+
+typedef enum {
+    NUMA_ARENA_HUGETLB = 0,   // Явные huge pages (vm.nr_hugepages)
+    NUMA_ARENA_THP,           // Обычное отображение с MADV_HUGEPAGE
+} numa_arena_backing_t;
+
+typedef struct {
+    char *base;
+    size_t size;              // Размер отображения, кратен 2 МБ
+    size_t used;
+    int node;                 // NUMA-нода, -1 - без привязки (нет libnuma)
+    numa_arena_backing_t backing;
+} numa_arena_t;
+
+// Создает арену на ноде node (-1 - нода текущего CPU)
+int numa_arena_init(numa_arena_t *arena, size_t size, int node);
+void numa_arena_destroy(numa_arena_t *arena);
+
+// Выровненный кусок арены или NULL, если место кончилось
+void *numa_arena_alloc(numa_arena_t *arena, size_t size, size_t align);
+
+// Арена текущего треда; ставится при привязке воркера к пулу
+void numa_arena_set_thread(numa_arena_t *arena);
+
+// Память из арены треда, при ее отсутствии или нехватке - malloc.
+// numa_local_free отличает одно от другого сам
+void *numa_local_alloc(size_t size);
+void numa_local_free(void *ptr);
+
+// Общая память для всех воркеров (overflow-пул): чередуется по нодам
+void *numa_shared_alloc(size_t size);
+void numa_shared_free(void *ptr, size_t size);
+
+const char *numa_arena_backing_name(const numa_arena_t *arena);
+
+#endif // NUMA_ARENA_H
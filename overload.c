@@ -0,0 +1,139 @@
+#include "overload.h"
+#include "config.h"
+#include "connection.h"
+#include "lockfree_pool.h"
+#include "http_handler.h"
+#include "loop_clock.h"
+#include "metrics.h"
+#include "log.h"
+#include "upgrade.h"
+#include "tls.h"
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+
+#define OVERLOAD_HYSTERESIS 100      // Промилле ниже порога для выхода из сброса
+#define OVERLOAD_MIN_KEEPALIVE_MS 1000
+#define OVERLOAD_PAUSED_WAIT_MS 10
+
+void overload_init(overload_t *ol) {
+    memset(ol, 0, sizeof(*ol));
+}
+
+overload_state_t overload_update(overload_t *ol, int events, uint64_t started_ns) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    uint64_t now_ns = (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+    uint64_t busy_ns = now_ns > started_ns ? now_ns - started_ns : 0;
+
+    // EWMA с весом 1/8: один медленный запрос не переключает режим
+    ol->lag_ns += ((int64_t)busy_ns - (int64_t)ol->lag_ns) / 8;
+    int depth = events >= g_config.max_events ? 1000
+                                              : (int)((long)events * 1000 / g_config.max_events);
+    ol->depth += (depth - ol->depth) / 8;
+
+    uint64_t lag_limit_ns = (uint64_t)CONFIG_LIVE_GET(overload_lag_ms) * 1000000;
+    int lag = ol->lag_ns >= lag_limit_ns ? 1000 : (int)(ol->lag_ns * 1000 / lag_limit_ns);
+
+    int pool = lockfree_pool_occupancy(connection_pool_handle());
+    int io = connection_io_occupancy();
+    int pressure = pool;
+    if (io > pressure) pressure = io;
+    if (ol->depth > pressure) pressure = ol->depth;
+    if (lag > pressure) pressure = lag;
+    ol->pressure = pressure;
+
+    int shed = CONFIG_LIVE_GET(overload_shed_pct) * 10;
+    overload_state_t state = ol->state;
+    switch (state) {
+    case OVERLOAD_NORMAL:
+        if (pressure >= shed) state = OVERLOAD_SHEDDING;
+        break;
+    case OVERLOAD_SHEDDING:
+        if (pressure < shed - OVERLOAD_HYSTERESIS) state = OVERLOAD_NORMAL;
+        break;
+    case OVERLOAD_PAUSED:
+        // Выход из паузы - когда итерации вдвое короче предела
+        if (ol->lag_ns < lag_limit_ns / 2) state = OVERLOAD_SHEDDING;
+        break;
+    }
+    if (state != OVERLOAD_PAUSED && ol->lag_ns >= lag_limit_ns) {
+        state = OVERLOAD_PAUSED;
+    }
+
+    if (worker_metrics) {
+        metric_set(&worker_metrics->overload_pressure, pressure);
+        metric_add(&worker_metrics->loop_iterations, 1);
+        metric_add(&worker_metrics->loop_busy_ns, busy_ns);
+        metric_set(&worker_metrics->loop_lag_ns, ol->lag_ns);
+        metric_set(&worker_metrics->event_fill, ol->depth);
+        metric_set(&worker_metrics->pool_occupancy, pool);
+        metric_set(&worker_metrics->io_occupancy, io);
+        if (state == OVERLOAD_PAUSED && ol->state != OVERLOAD_PAUSED) {
+            metric_add(&worker_metrics->accept_pauses, 1);
+        }
+    }
+    if (state != ol->state) {
+        log_warn("Overload: worker pressure %d.%d%%, %s", pressure / 10, pressure % 10,
+                 state == OVERLOAD_NORMAL ? "accepting" :
+                 state == OVERLOAD_SHEDDING ? "shedding new connections" : "accept paused");
+        ol->state = state;
+    }
+    return state;
+}
+
+int overload_keepalive_ms(const overload_t *ol) {
+    if (UNLIKELY(g_draining)) {
+        return 0; // Процесс уходит: простой закрывается на ближайшем тике
+    }
+    int base = g_config.keepalive_timeout_ms;
+    int shed = CONFIG_LIVE_GET(overload_shed_pct) * 10;
+    int soft = shed / 2;
+    if (ol->pressure <= soft || base <= OVERLOAD_MIN_KEEPALIVE_MS) {
+        return base;
+    }
+    if (ol->pressure >= shed) {
+        return OVERLOAD_MIN_KEEPALIVE_MS;
+    }
+    // Линейно от полного keep-alive на половине порога до минимума на пороге
+    long span = base - OVERLOAD_MIN_KEEPALIVE_MS;
+    return base - (int)(span * (ol->pressure - soft) / (shed - soft));
+}
+
+int overload_wait_timeout(const overload_t *ol, int timeout) {
+    if (ol->state != OVERLOAD_PAUSED) {
+        return timeout;
+    }
+    return (timeout < 0 || timeout > OVERLOAD_PAUSED_WAIT_MS) ? OVERLOAD_PAUSED_WAIT_MS : timeout;
+}
+
+void overload_reject(overload_t *ol, int fd, const char *reason) {
+    if (tls_enabled()) {
+        // Открытый текст 503 TLS-клиент принял бы за ошибку протокола, а
+        // рукопожатие под перегрузкой - лишняя работа: сразу RST
+        struct linger lg = { .l_onoff = 1, .l_linger = 0 };
+        setsockopt(fd, SOL_SOCKET, SO_LINGER, &lg, sizeof(lg));
+    } else {
+        // Запрос мог уже прийти: непрочитанные данные при close дают RST,
+        // и клиент не увидел бы 503
+        char drain[1024];
+        while (recv(fd, drain, sizeof(drain), MSG_DONTWAIT) == (ssize_t)sizeof(drain)) {
+        }
+        http_send_overload_response(fd);
+        metrics_count_request(-1, 503);
+    }
+
+    if (worker_metrics) {
+        metric_add(&worker_metrics->connections_shed, 1);
+    }
+
+    ol->shed_unlogged++;
+    uint64_t now = loop_clock_now_ms();
+    if (now - ol->shed_logged_ms >= 1000) {
+        log_warn("Overload: shed %lu connections (%s)",
+                 (unsigned long)ol->shed_unlogged, reason);
+        ol->shed_logged_ms = now;
+        ol->shed_unlogged = 0;
+    }
+}
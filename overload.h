@@ -0,0 +1,52 @@
+#ifndef OVERLOAD_H
+#define OVERLOAD_H
+
+#include <stdint.h>
+
+// Контроль допуска новых соединений. Раз в итерацию event loop'а воркер
+// сообщает, сколько событий получил и сколько времени их обрабатывал;
+// вместе с занятостью пула соединений и буферов запросов это дает
+// давление в промилле - максимум из четырех сигналов.
+//
+// Под давлением сервер сначала обслуживает уже подключенных клиентов:
+//   - keep-alive простаивающих соединений сокращается, освобождая слоты;
+//   - выше overload_shed_pct новые соединения получают готовый
+//     503 с Retry-After и закрываются, не занимая пул;
+//   - если итерация дольше overload_lag_ms, воркеру не до ответов
+//     даже 503: accept приостанавливается, очередь копится в backlog ядра.
+// Выход из каждого режима - с запасом, чтобы не дребезжать на границе
+
+typedef enum {
+    OVERLOAD_NORMAL = 0,
+    OVERLOAD_SHEDDING,           // Новые соединения получают 503
+    OVERLOAD_PAUSED,             // Слушающий сокет снят с ожидания
+} overload_state_t;
+
+typedef struct {
+    overload_state_t state;
+    int pressure;                // Промилле, 1000 - ресурс исчерпан
+    uint64_t lag_ns;             // EWMA времени обработки итерации
+    int depth;                   // EWMA событий за ожидание, промилле от max_events
+    uint64_t shed_logged_ms;     // Последнее сообщение о сбросе в stderr
+    uint64_t shed_unlogged;      // Сброшено с тех пор
+} overload_t;
+
+void overload_init(overload_t *ol);
+
+// Итог итерации: events - событий из ожидания, started_ns - время
+// пробуждения (loop_clock). Возвращает новое состояние
+overload_state_t overload_update(overload_t *ol, int events, uint64_t started_ns);
+
+// Keep-alive для соединения, которое сейчас уходит в простой
+int overload_keepalive_ms(const overload_t *ol);
+
+// Таймаут ожидания: с приостановленным accept воркер просыпается сам,
+// иначе без таймеров некому заметить, что нагрузка спала
+int overload_wait_timeout(const overload_t *ol, int timeout);
+
+// Ответить 503 только что принятому fd (закрывает вызывающий), с
+// сообщением в stderr не чаще раза в секунду. С TLS ответа нет: до
+// конца рукопожатия его не передать, соединение сбрасывается
+void overload_reject(overload_t *ol, int fd, const char *reason);
+
+#endif // OVERLOAD_H
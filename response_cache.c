@@ -0,0 +1,263 @@
+#include "response_cache.h"
+#include "config.h"
+#include "loop_clock.h"
+#include <stdlib.h>
+#include <string.h>
+
+#define RESPONSE_CACHE_BUCKETS 4096  // Степень двойки
+#define RESPONSE_CACHE_MAX_PARAMS 32 // Больше параметров - ключ без сортировки
+
+struct response_cache_entry_s {
+    uint64_t hash;
+    int route;
+    uint32_t refs;               // Таблица и пачки ответов, указывающие на блоб
+    uint8_t referenced;          // Бит CLOCK: обращались с прошлого прохода стрелки
+    uint64_t fresh_until_ms;
+    uint64_t stale_until_ms;
+    size_t size;                 // Учитываемый объем
+    precomputed_response_t response;
+    struct response_cache_entry_s *next_in_bucket;
+    struct response_cache_entry_s *clock_prev;  // Кольцо обхода стрелки
+    struct response_cache_entry_s *clock_next;
+    size_t key_len;
+    char *body;
+    char key[];
+};
+
+typedef struct {
+    response_cache_entry_t *buckets[RESPONSE_CACHE_BUCKETS];
+    response_cache_entry_t *hand;
+    size_t bytes;
+    size_t limit;
+} response_cache_t;
+
+static __thread response_cache_t *cache = NULL;
+__thread int response_cache_on = 0;
+
+int response_cache_init(void) {
+    if (g_config.response_cache_ttl_ms == 0) {
+        return 0;
+    }
+    cache = calloc(1, sizeof(*cache));
+    if (!cache) {
+        return -1;
+    }
+    cache->limit = (size_t)g_config.response_cache_size_kb * 1024;
+    response_cache_on = 1;
+    return 0;
+}
+
+static void entry_free(response_cache_entry_t *entry) {
+    http_free_response(&entry->response);
+    free(entry->body);
+    free(entry);
+}
+
+void response_cache_put(response_cache_entry_t *entry) {
+    if (entry && --entry->refs == 0) {
+        entry_free(entry);
+    }
+}
+
+// Снимает запись с таблицы и кольца; освобождается с последней ссылкой
+static void entry_unlink(response_cache_entry_t *entry) {
+    response_cache_entry_t **link = &cache->buckets[entry->hash & (RESPONSE_CACHE_BUCKETS - 1)];
+    while (*link != entry) {
+        link = &(*link)->next_in_bucket;
+    }
+    *link = entry->next_in_bucket;
+
+    if (entry->clock_next == entry) {
+        cache->hand = NULL;
+    } else {
+        entry->clock_prev->clock_next = entry->clock_next;
+        entry->clock_next->clock_prev = entry->clock_prev;
+        if (cache->hand == entry) {
+            cache->hand = entry->clock_next;
+        }
+    }
+    cache->bytes -= entry->size;
+    response_cache_put(entry);
+}
+
+void response_cache_destroy(void) {
+    if (!cache) {
+        return;
+    }
+    while (cache->hand) {
+        entry_unlink(cache->hand);
+    }
+    free(cache);
+    cache = NULL;
+    response_cache_on = 0;
+}
+
+typedef struct {
+    const char *p;
+    size_t len;
+} query_param_t;
+
+static int param_cmp(const void *a, const void *b) {
+    const query_param_t *x = a, *y = b;
+    size_t n = x->len < y->len ? x->len : y->len;
+    int c = memcmp(x->p, y->p, n);
+    return c ? c : (x->len > y->len) - (x->len < y->len);
+}
+
+size_t response_cache_key(const char *query, size_t len, char *key) {
+    if (len <= 1) {
+        return 0;
+    }
+
+    query_param_t params[RESPONSE_CACHE_MAX_PARAMS];
+    int count = 0;
+    const char *p = query + 1, *end = query + len;
+    while (p < end) {
+        const char *amp = memchr(p, '&', end - p);
+        const char *stop = amp ? amp : end;
+        if (stop > p) { // Пустые параметры ("a=1&&b=2") ответ не меняют
+            if (count == RESPONSE_CACHE_MAX_PARAMS) {
+                memcpy(key, query, len);
+                return len;
+            }
+            params[count].p = p;
+            params[count].len = stop - p;
+            count++;
+        }
+        p = stop + 1;
+    }
+    qsort(params, count, sizeof(params[0]), param_cmp);
+
+    size_t n = 0;
+    for (int i = 0; i < count; ++i) {
+        key[n++] = i ? '&' : '?';
+        memcpy(key + n, params[i].p, params[i].len);
+        n += params[i].len;
+    }
+    return n;
+}
+
+static uint64_t key_hash(int route, const char *key, size_t len) {
+    uint64_t h = 1469598103934665603ull ^ (uint64_t)route; // FNV-1a
+    for (size_t i = 0; i < len; ++i) {
+        h = (h ^ (unsigned char)key[i]) * 1099511628211ull;
+    }
+    return h;
+}
+
+static response_cache_entry_t *entry_find(int route, const char *key, size_t key_len, uint64_t hash) {
+    for (response_cache_entry_t *e = cache->buckets[hash & (RESPONSE_CACHE_BUCKETS - 1)]; e;
+         e = e->next_in_bucket) {
+        if (e->hash == hash && e->route == route && e->key_len == key_len &&
+            memcmp(e->key, key, key_len) == 0) {
+            return e;
+        }
+    }
+    return NULL;
+}
+
+response_cache_entry_t *response_cache_lookup(int route, const char *key, size_t key_len,
+                                              response_cache_state_t *state) {
+    *state = RESPONSE_CACHE_MISS;
+    uint64_t hash = key_hash(route, key, key_len);
+    response_cache_entry_t *entry = entry_find(route, key, key_len, hash);
+    if (!entry) {
+        return NULL;
+    }
+
+    uint64_t now = loop_clock_now_ms();
+    if (now >= entry->stale_until_ms) {
+        entry_unlink(entry); // Истекла - место освобождаем сразу
+        return NULL;
+    }
+    *state = now < entry->fresh_until_ms ? RESPONSE_CACHE_FRESH : RESPONSE_CACHE_STALE;
+    entry->referenced = 1;
+    entry->refs++;
+    return entry;
+}
+
+// CLOCK: стрелка снимает бит обращения, запись без него вытесняется.
+// Истекшие записи вытесняются сразу
+static void cache_evict(size_t need) {
+    uint64_t now = loop_clock_now_ms();
+    while (cache->hand && cache->bytes + need > cache->limit) {
+        response_cache_entry_t *entry = cache->hand;
+        if (entry->referenced && now < entry->stale_until_ms) {
+            entry->referenced = 0;
+            cache->hand = entry->clock_next;
+            continue;
+        }
+        entry_unlink(entry);
+    }
+}
+
+response_cache_entry_t *response_cache_store(int route, const char *key, size_t key_len,
+                                             const char *body, size_t body_len) {
+    if (!cache || key_len > RESPONSE_CACHE_KEY_MAX) {
+        return NULL;
+    }
+
+    response_cache_entry_t *entry = calloc(1, sizeof(*entry) + key_len);
+    if (!entry) {
+        return NULL;
+    }
+    entry->body = malloc(body_len);
+    if (!entry->body) {
+        free(entry);
+        return NULL;
+    }
+    memcpy(entry->body, body, body_len);
+    if (http_build_response(&entry->response, 200, "OK", JSON_CONTENT_TYPE,
+                            entry->body, body_len, NULL) != 0) {
+        free(entry->body);
+        free(entry);
+        return NULL;
+    }
+    entry->size = sizeof(*entry) + key_len + body_len +
+                  entry->response.keep_alive.head_len + entry->response.keep_alive.tail_len +
+                  entry->response.close.head_len + entry->response.close.tail_len +
+                  entry->response.keep_alive.h2_len + entry->response.close.h2_len;
+    if (entry->size > cache->limit) {
+        entry_free(entry);
+        return NULL;
+    }
+
+    entry->hash = key_hash(route, key, key_len);
+    entry->route = route;
+    memcpy(entry->key, key, key_len);
+    entry->key_len = key_len;
+    uint64_t now = loop_clock_now_ms();
+    entry->fresh_until_ms = now + g_config.response_cache_ttl_ms;
+    entry->stale_until_ms = entry->fresh_until_ms + CONFIG_LIVE_GET(response_cache_stale_ms);
+    entry->refs = 2; // Таблица и вызывающий
+
+    response_cache_entry_t *old = entry_find(route, key, key_len, entry->hash);
+    if (old) {
+        entry_unlink(old); // Пачки, отправляющие старый ответ, держат его сами
+    }
+    cache_evict(entry->size);
+
+    size_t bucket = entry->hash & (RESPONSE_CACHE_BUCKETS - 1);
+    entry->next_in_bucket = cache->buckets[bucket];
+    cache->buckets[bucket] = entry;
+    // Новая запись встает прямо перед стрелкой: до нее стрелка дойдет последней
+    if (cache->hand) {
+        entry->clock_next = cache->hand;
+        entry->clock_prev = cache->hand->clock_prev;
+        entry->clock_prev->clock_next = entry;
+        cache->hand->clock_prev = entry;
+    } else {
+        entry->clock_next = entry->clock_prev = entry;
+        cache->hand = entry;
+    }
+    cache->bytes += entry->size;
+    return entry;
+}
+
+void response_cache_hold(response_cache_entry_t *entry) {
+    entry->refs++;
+}
+
+const precomputed_response_t *response_cache_response(const response_cache_entry_t *entry) {
+    return &entry->response;
+}
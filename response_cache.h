@@ -0,0 +1,58 @@
+#ifndef RESPONSE_CACHE_H
+#define RESPONSE_CACHE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "http_handler.h"
+
+// Кэш ответов агрегирующих роутов, свой у каждого воркера - без
+// блокировок и общих cache line. Ключ - роут и query-строка с
+// параметрами в порядке сортировки. Значение - готовый ответ в форме
+// precomputed_response_t: response_iov указывает на него напрямую, а
+// счетчик ссылок держит запись, пока пачка не отправлена.
+//
+// Свежая запись (response_cache_ttl_ms) отдается без запроса к
+// бэкендам. Еще response_cache_stale_ms после этого запись отдается
+// устаревшей, а бэкенды тем временем опрашиваются в фоне. Объем
+// ограничен response_cache_size_kb; вытесняет CLOCK: запись, к
+// которой обращались с прошлого прохода стрелки, получает второй шанс
+
+typedef struct response_cache_entry_s response_cache_entry_t;
+
+typedef enum {
+    RESPONSE_CACHE_MISS = 0,
+    RESPONSE_CACHE_FRESH,
+    RESPONSE_CACHE_STALE,        // Отдать и обновить
+} response_cache_state_t;
+
+#define RESPONSE_CACHE_KEY_MAX 256
+
+// Кэш текущего воркера по g_config; выключенный кэш ничего не выделяет
+int response_cache_init(void);
+void response_cache_destroy(void);
+
+extern __thread int response_cache_on;
+
+static inline int response_cache_enabled(void) {
+    return response_cache_on;
+}
+
+// Ключ: query-строка (с '?' или пустая) с параметрами, отсортированными
+// по байтам; key - не короче len. Возвращает длину
+size_t response_cache_key(const char *query, size_t len, char *key);
+
+// Запись для роута и ключа со ссылкой вызывающего; state - ее свежесть.
+// Запись живет до response_cache_put, даже если уже вытеснена
+response_cache_entry_t *response_cache_lookup(int route, const char *key, size_t key_len,
+                                              response_cache_state_t *state);
+
+// Новый ответ для ключа (тело копируется); прежний вытесняется.
+// Запись возвращается со ссылкой вызывающего, NULL - не сохранено
+response_cache_entry_t *response_cache_store(int route, const char *key, size_t key_len,
+                                             const char *body, size_t body_len);
+
+const precomputed_response_t *response_cache_response(const response_cache_entry_t *entry);
+void response_cache_hold(response_cache_entry_t *entry);
+void response_cache_put(response_cache_entry_t *entry);
+
+#endif // RESPONSE_CACHE_H
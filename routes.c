@@ -0,0 +1,670 @@
+#include "routes.h"
+#include "metrics.h"
+#include "config.h"
+#include "simd_utils.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/inotify.h>
+#include <sys/eventfd.h>
+#include <zlib.h>
+#include <brotli/encode.h>
+
+// Встроенные роуты; файл с тем же путем в routes_dir их заменяет
+typedef struct {
+    const char *path;
+    const char *body;
+    const char *content_type;
+    route_render_fn render;
+} builtin_route_t;
+
+#define ROUTE(path, body) { path, body, JSON_CONTENT_TYPE, NULL }
+#define ROUTE_DYNAMIC(path, content_type, render) { path, NULL, content_type, render }
+
+static const builtin_route_t builtin_routes[] = {
+    ROUTE("/bonuses", "{\"bonuses\":[10,20,30]}"),
+    ROUTE("/settings", "{\"settings\":{\"theme\":\"dark\"}}"),
+    ROUTE("/games", "{\"games\":[\"chess\",\"poker\"]}"),
+    ROUTE("/health", "{\"status\":\"OK\"}"),
+    ROUTE_DYNAMIC("/metrics", "text/plain; version=0.0.4", metrics_render),
+};
+
+#define BUILTIN_ROUTE_COUNT ((int)(sizeof(builtin_routes) / sizeof(builtin_routes[0])))
+#define ROUTES_MAX 65535            // Индексы в цепочках - uint16_t
+#define ROUTES_JSON_SUFFIX ".json"
+#define ROUTES_SETTLE_MS 50         // Пауза после события каталога: файлы пишутся не одним вызовом
+#define ROUTES_RECLAIM_MS 100       // Период проверки старых таблиц
+#define ROUTES_COMPRESS_MIN 256     // Меньшие тела не сжимаются: выигрыш съедают заголовки
+
+// Эпоха таблицы, которой пользуется воркер; 0 - воркер ждет событий
+typedef struct {
+    _Atomic uint64_t epoch;
+} __attribute__((aligned(64))) route_reader_t;
+
+static _Atomic(route_set_t *) routes_current = NULL;
+static route_set_t *routes_retired = NULL;  // Только главный тред
+
+static route_reader_t *route_readers = NULL;
+static int route_reader_count = 0;
+
+static __thread route_reader_t *this_reader = NULL;
+static __thread int this_reader_slot = 0;
+static __thread route_set_t *this_set = NULL;
+
+// Метки метрик по путям: слоты не переиспользуются, чтобы счетчики
+// роута пережили перезагрузку таблицы
+static char *metric_paths[METRICS_MAX_ROUTES];
+static int metric_path_count = 0;
+
+static int watch_fd = -1;
+static int reload_fd = -1;
+
+static int route_metric_id(const char *path) {
+    for (int i = 0; i < metric_path_count; ++i) {
+        if (strcmp(metric_paths[i], path) == 0) {
+            return i;
+        }
+    }
+    if (metric_path_count == METRICS_MAX_ROUTES) {
+        return -1; // Считается в route="other"
+    }
+    char *copy = strdup(path);
+    if (!copy) {
+        return -1;
+    }
+    metric_paths[metric_path_count] = copy;
+    metrics_set_route_name(metrics_route_slot(metric_path_count), copy);
+    return metric_path_count++;
+}
+
+static void free_variant(route_variant_t *variant) {
+    http_free_response(&variant->response);
+    http_free_response(&variant->not_modified);
+}
+
+static void free_route(route_t *route) {
+    free_variant(&route->identity);
+    for (int e = 0; e < CONTENT_ENCODING_COUNT; ++e) {
+        free_variant(&route->encoded[e]);
+        free(route->encoded_body[e]);
+    }
+    if (route->map) {
+        munmap(route->map, route->map_len);
+    }
+    free(route->path);
+    memset(route, 0, sizeof(*route));
+}
+
+static void route_set_free(route_set_t *set) {
+    for (int i = 0; i < set->count; ++i) {
+        free_route(&set->routes[i]);
+    }
+    free(set->routes);
+    free(set->refs);
+    free(set);
+}
+
+// Роут с путем path: существующий (его заменяет файл) или новый в конце
+static route_t *route_slot(route_set_t *set, int *capacity, const char *path) {
+    for (int i = 0; i < set->count; ++i) {
+        if (strcmp(set->routes[i].path, path) == 0) {
+            free_route(&set->routes[i]);
+            return &set->routes[i];
+        }
+    }
+    if (set->count == ROUTES_MAX) {
+        return NULL;
+    }
+    if (set->count == *capacity) {
+        int grown = *capacity ? *capacity * 2 : 16;
+        route_t *routes = realloc(set->routes, sizeof(route_t) * grown);
+        if (!routes) {
+            return NULL;
+        }
+        set->routes = routes;
+        *capacity = grown;
+    }
+    route_t *route = &set->routes[set->count++];
+    memset(route, 0, sizeof(*route));
+    return route;
+}
+
+// Сжатие делается один раз на сборку таблицы, поэтому уровни максимальные
+static int compress_gzip(const char *body, size_t len, char **out, size_t *out_len) {
+    z_stream zs = { 0 };
+    if (deflateInit2(&zs, Z_BEST_COMPRESSION, Z_DEFLATED, 15 + 16, 9, Z_DEFAULT_STRATEGY) != Z_OK) {
+        return -1;
+    }
+    size_t bound = deflateBound(&zs, len);
+    char *buf = malloc(bound);
+    if (!buf) {
+        deflateEnd(&zs);
+        return -1;
+    }
+    zs.next_in = (Bytef *)body;
+    zs.avail_in = len;
+    zs.next_out = (Bytef *)buf;
+    zs.avail_out = bound;
+    int ret = deflate(&zs, Z_FINISH);
+    *out_len = zs.total_out;
+    deflateEnd(&zs);
+    if (ret != Z_STREAM_END) {
+        free(buf);
+        return -1;
+    }
+    *out = buf;
+    return 0;
+}
+
+static int compress_brotli(const char *body, size_t len, char **out, size_t *out_len) {
+    size_t bound = BrotliEncoderMaxCompressedSize(len);
+    char *buf = bound ? malloc(bound) : NULL;
+    if (!buf) {
+        return -1;
+    }
+    *out_len = bound;
+    if (!BrotliEncoderCompress(BROTLI_MAX_QUALITY, BROTLI_DEFAULT_WINDOW, BROTLI_MODE_TEXT,
+                               len, (const uint8_t *)body, out_len, (uint8_t *)buf)) {
+        free(buf);
+        return -1;
+    }
+    *out = buf;
+    return 0;
+}
+
+typedef int (*route_compress_fn)(const char *body, size_t len, char **out, size_t *out_len);
+
+static const route_compress_fn route_compressors[CONTENT_ENCODING_COUNT] = {
+    [CONTENT_ENCODING_BR] = compress_brotli,
+    [CONTENT_ENCODING_GZIP] = compress_gzip,
+};
+
+// Хэш исходного тела для ETag (FNV-1a): тело меняется - меняется и тег
+static uint64_t body_hash(const char *body, size_t len) {
+    uint64_t h = 0xcbf29ce484222325ull;
+    for (size_t i = 0; i < len; ++i) {
+        h ^= (unsigned char)body[i];
+        h *= 0x100000001b3ull;
+    }
+    return h ^ len;
+}
+
+// Ответы 200 и 304 представления. У сжатых вариантов свой суффикс ETag:
+// строгий тег различает байты представления, а не только исходный JSON
+static int build_variant(route_variant_t *variant, const char *content_type,
+                         const char *body, size_t body_len, uint64_t hash,
+                         const char *encoding, int vary) {
+    variant->etag_len = snprintf(variant->etag, sizeof(variant->etag), "\"%016lx%s%s\"",
+                                 (unsigned long)hash, encoding ? "-" : "", encoding ? encoding : "");
+
+    char headers[160];
+    int len = snprintf(headers, sizeof(headers), "ETag: %s\r\n%s", variant->etag,
+                       vary ? "Vary: Accept-Encoding\r\n" : "");
+    if (encoding) {
+        snprintf(headers + len, sizeof(headers) - len, "Content-Encoding: %s\r\n", encoding);
+    }
+    if (http_build_response(&variant->response, 200, "OK", content_type,
+                            body, body_len, headers) != 0) {
+        return -1;
+    }
+    // 304 - только заголовки; Content-Encoding в нем не нужен
+    headers[len] = '\0';
+    return http_build_response(&variant->not_modified, 304, "Not Modified", content_type,
+                               NULL, 0, headers);
+}
+
+// Варианты, которые хотя бы на 1/8 меньше исходного тела; иначе
+// экономия трафика не окупает распаковку у клиента
+static int build_encodings(route_t *route, const char *content_type,
+                           const char *body, size_t body_len, uint64_t hash) {
+    if (body_len < ROUTES_COMPRESS_MIN) {
+        return 0;
+    }
+    for (int e = 0; e < CONTENT_ENCODING_COUNT; ++e) {
+        char *packed;
+        size_t packed_len;
+        if (route_compressors[e](body, body_len, &packed, &packed_len) != 0) {
+            continue; // Роут остается без этого варианта
+        }
+        if (packed_len > body_len - body_len / 8) {
+            free(packed);
+            continue;
+        }
+
+        route->encoded_body[e] = packed;
+        if (build_variant(&route->encoded[e], content_type, packed, packed_len, hash,
+                          http_content_encoding_name(e), 1) != 0) {
+            return -1;
+        }
+        route->encodings |= CONTENT_ENCODING_BIT(e);
+    }
+    return 0;
+}
+
+static int init_route(route_t *route, const char *path, const char *content_type,
+                      route_render_fn render, const char *body, size_t body_len) {
+    route->path = strdup(path);
+    if (!route->path) {
+        return -1;
+    }
+    route->path_len = strlen(path);
+    route->content_type = content_type;
+    route->render = render;
+    route->metric_id = route_metric_id(path);
+    if (render) {
+        return 0; // Динамический роут - ответ собирается на каждый запрос
+    }
+    uint64_t hash = body_hash(body, body_len);
+    if (build_encodings(route, content_type, body, body_len, hash) != 0) {
+        return -1;
+    }
+    // Несжатый ответ тоже зависит от Accept-Encoding - кэшам нужен Vary
+    return build_variant(&route->identity, content_type, body, body_len, hash,
+                         NULL, route->encodings != 0);
+}
+
+// Тело агрегирующего роута собирают бэкенды, готовых ответов у него нет
+static int init_aggregate_route(route_t *route, const char *path, int aggregate) {
+    route->path = strdup(path);
+    if (!route->path) {
+        return -1;
+    }
+    route->path_len = strlen(path);
+    route->content_type = JSON_CONTENT_TYPE;
+    route->metric_id = route_metric_id(path);
+    route->aggregate = aggregate + 1;
+    return 0;
+}
+
+// Имя файла без ".json" становится путем роута: только [A-Za-z0-9._-]
+static int route_path_from_name(const char *name, char *path, size_t path_size) {
+    size_t len = strlen(name);
+    size_t suffix = sizeof(ROUTES_JSON_SUFFIX) - 1;
+    if (name[0] == '.' || len <= suffix || strcmp(name + len - suffix, ROUTES_JSON_SUFFIX) != 0) {
+        return -1;
+    }
+    len -= suffix;
+    if (len + 1 >= path_size) {
+        return -1;
+    }
+    for (size_t i = 0; i < len; ++i) {
+        unsigned char c = name[i];
+        if (!((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') ||
+              c == '-' || c == '_' || c == '.')) {
+            return -1;
+        }
+    }
+    path[0] = '/';
+    memcpy(path + 1, name, len);
+    path[len + 1] = '\0';
+    return 0;
+}
+
+// Файл отображается целиком: тело ответа отдается прямо из page cache.
+// Файлы надо заменять атомарно (запись во временный и rename), иначе
+// клиенты увидят перезапись на месте
+static int load_route_file(route_set_t *set, int *capacity, int dir_fd, const char *name) {
+    char path[URL_MAX_LEN];
+    if (route_path_from_name(name, path, sizeof(path)) != 0) {
+        return 0; // Временные файлы редакторов и прочее - не роуты
+    }
+
+    int fd = openat(dir_fd, name, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        fprintf(stderr, "Routes: %s/%s: %s\n", g_config.routes_dir, name, strerror(errno));
+        return -1;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+        close(fd);
+        return 0; // Каталоги и специальные файлы не роуты
+    }
+
+    size_t len = (size_t)st.st_size;
+    void *map = NULL;
+    if (len > 0) {
+        map = mmap(NULL, len, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0);
+        if (map == MAP_FAILED) {
+            fprintf(stderr, "Routes: mmap %s/%s: %s\n", g_config.routes_dir, name, strerror(errno));
+            close(fd);
+            return -1;
+        }
+    }
+    close(fd);
+
+    route_t *route = route_slot(set, capacity, path);
+    if (!route) {
+        if (map) munmap(map, len);
+        return -1;
+    }
+    route->map = map;
+    route->map_len = len;
+    return init_route(route, path, JSON_CONTENT_TYPE, NULL, map ? map : "", len);
+}
+
+static int load_route_dir(route_set_t *set, int *capacity) {
+    DIR *dir = opendir(g_config.routes_dir);
+    if (!dir) {
+        fprintf(stderr, "Routes: %s: %s\n", g_config.routes_dir, strerror(errno));
+        return -1;
+    }
+
+    int ret = 0;
+    struct dirent *entry;
+    while (ret == 0 && (entry = readdir(dir)) != NULL) {
+        ret = load_route_file(set, capacity, dirfd(dir), entry->d_name);
+    }
+    closedir(dir);
+    return ret;
+}
+
+static route_set_t *route_set_build(void) {
+    route_set_t *set = calloc(1, sizeof(*set));
+    if (!set) {
+        return NULL;
+    }
+    int capacity = 0;
+
+    for (int i = 0; i < BUILTIN_ROUTE_COUNT; ++i) {
+        const builtin_route_t *b = &builtin_routes[i];
+        route_t *route = route_slot(set, &capacity, b->path);
+        if (!route || init_route(route, b->path, b->content_type, b->render,
+                                 b->body, b->body ? strlen(b->body) : 0) != 0) {
+            goto fail;
+        }
+    }
+    if (g_config.routes_dir[0] != '\0' && load_route_dir(set, &capacity) != 0) {
+        goto fail;
+    }
+    // Агрегирующие роуты перекрывают встроенные и файлы с тем же путем
+    for (int i = 0; i < g_config.aggregate_count; ++i) {
+        const char *path = g_config.aggregates[i].path;
+        route_t *route = route_slot(set, &capacity, path);
+        if (!route || init_aggregate_route(route, path, i) != 0) {
+            goto fail;
+        }
+    }
+
+    // Цепочки вставляются с конца, чтобы внутри корзины сохранялся порядок таблицы
+    for (int i = set->count - 1; i >= 0; --i) {
+        route_t *route = &set->routes[i];
+        route->next_same_len = set->by_len[route->path_len];
+        set->by_len[route->path_len] = (uint16_t)(i + 1);
+    }
+
+    size_t refs_size = sizeof(route_ref_t) * route_reader_count;
+    set->refs = aligned_alloc(CACHE_LINE_SIZE, refs_size);
+    if (!set->refs) {
+        goto fail;
+    }
+    memset(set->refs, 0, refs_size);
+    return set;
+
+fail:
+    route_set_free(set);
+    return NULL;
+}
+
+static void route_set_publish(route_set_t *set) {
+    route_set_t *old = atomic_load(&routes_current);
+    set->epoch = old ? old->epoch + 1 : 1;
+    atomic_store(&routes_current, set);
+
+    if (old) {
+        old->retired_at = set->epoch;
+        old->next_retired = routes_retired;
+        routes_retired = old;
+    }
+}
+
+// Таблицу можно освободить, когда ни один воркер не объявил более старую
+// эпоху (новых ссылок не будет) и все ответы из нее отправлены
+static int route_set_quiescent(route_set_t *set) {
+    for (int i = 0; i < route_reader_count; ++i) {
+        uint64_t epoch = atomic_load(&route_readers[i].epoch);
+        if (epoch != 0 && epoch < set->retired_at) {
+            return 0;
+        }
+    }
+    for (int i = 0; i < route_reader_count; ++i) {
+        if (atomic_load_explicit(&set->refs[i].count, memory_order_acquire) != 0) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static void routes_reclaim(void) {
+    route_set_t **link = &routes_retired;
+    while (*link) {
+        route_set_t *set = *link;
+        if (route_set_quiescent(set)) {
+            *link = set->next_retired;
+            route_set_free(set);
+        } else {
+            link = &set->next_retired;
+        }
+    }
+}
+
+static void routes_watch_dir(void) {
+    if (g_config.routes_dir[0] == '\0' || watch_fd != -1) {
+        return;
+    }
+    watch_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (watch_fd == -1) {
+        perror("inotify_init1");
+        return;
+    }
+    if (inotify_add_watch(watch_fd, g_config.routes_dir,
+                          IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM | IN_DELETE |
+                          IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR) == -1) {
+        fprintf(stderr, "Routes: inotify %s: %s (reload with SIGHUP)\n",
+                g_config.routes_dir, strerror(errno));
+        close(watch_fd);
+        watch_fd = -1;
+    }
+}
+
+int routes_init(void) {
+    route_reader_count = g_config.workers;
+    route_readers = aligned_alloc(CACHE_LINE_SIZE, sizeof(route_reader_t) * route_reader_count);
+    if (!route_readers) {
+        return -1;
+    }
+    memset(route_readers, 0, sizeof(route_reader_t) * route_reader_count);
+
+    route_set_t *set = route_set_build();
+    if (!set) {
+        fprintf(stderr, "Failed to build route table\n");
+        return -1;
+    }
+    route_set_publish(set);
+
+    reload_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    routes_watch_dir();
+    printf("Routes: %d routes%s%s\n", set->count,
+           g_config.routes_dir[0] ? " from " : "", g_config.routes_dir);
+    return 0;
+}
+
+void routes_destroy(void) {
+    // Воркеры уже остановлены - ссылки больше не нужны
+    route_set_t *set = atomic_exchange(&routes_current, NULL);
+    if (set) {
+        route_set_free(set);
+    }
+    while (routes_retired) {
+        set = routes_retired;
+        routes_retired = set->next_retired;
+        route_set_free(set);
+    }
+
+    if (watch_fd != -1) close(watch_fd);
+    if (reload_fd != -1) close(reload_fd);
+    watch_fd = reload_fd = -1;
+
+    free(route_readers);
+    route_readers = NULL;
+    route_reader_count = 0;
+}
+
+void routes_register_worker(int worker_id) {
+    if (route_reader_count == 0) {
+        return;
+    }
+    this_reader_slot = (worker_id - 1) % route_reader_count;
+    this_reader = &route_readers[this_reader_slot];
+    routes_reader_online();
+}
+
+void routes_unregister_worker(void) {
+    routes_reader_offline();
+    this_reader = NULL;
+    this_set = NULL;
+}
+
+void routes_reader_offline(void) {
+    if (LIKELY(this_reader != NULL)) {
+        atomic_store_explicit(&this_reader->epoch, 0, memory_order_release);
+    }
+}
+
+void routes_reader_online(void) {
+    route_reader_t *reader = this_reader;
+    if (UNLIKELY(reader == NULL)) {
+        return;
+    }
+    // Объявленная эпоха действительна, только если таблица не сменилась
+    // после объявления - иначе главный тред мог ее не увидеть
+    route_set_t *set;
+    do {
+        set = atomic_load(&routes_current);
+        atomic_store(&reader->epoch, set->epoch);
+    } while (UNLIKELY(atomic_load(&routes_current) != set));
+    this_set = set;
+}
+
+route_set_t *routes_hold(void) {
+    route_set_t *set = this_set;
+    if (UNLIKELY(set == NULL)) {
+        return atomic_load(&routes_current); // Тред не воркер - без учета ссылок
+    }
+    _Atomic uint64_t *count = &set->refs[this_reader_slot].count;
+    atomic_store_explicit(count, atomic_load_explicit(count, memory_order_relaxed) + 1,
+                          memory_order_relaxed);
+    return set;
+}
+
+void routes_ref(route_set_t *set) {
+    if (!set || UNLIKELY(this_reader == NULL)) {
+        return;
+    }
+    _Atomic uint64_t *count = &set->refs[this_reader_slot].count;
+    atomic_store_explicit(count, atomic_load_explicit(count, memory_order_relaxed) + 1,
+                          memory_order_relaxed);
+}
+
+void routes_put(route_set_t *set) {
+    if (!set || UNLIKELY(this_reader == NULL)) {
+        return;
+    }
+    // release: отправка ответа закончена до того, как главный тред увидит 0
+    _Atomic uint64_t *count = &set->refs[this_reader_slot].count;
+    atomic_store_explicit(count, atomic_load_explicit(count, memory_order_relaxed) - 1,
+                          memory_order_release);
+}
+
+void routes_request_reload(void) {
+    uint64_t one = 1;
+    if (reload_fd != -1) {
+        ssize_t ret = write(reload_fd, &one, sizeof(one));
+        (void)ret;
+    }
+}
+
+// Сбрасывает счетчик eventfd; 1 - была запрошена перезагрузка
+static int drain_reload(int fd) {
+    uint64_t count;
+    return fd != -1 && read(fd, &count, sizeof(count)) == sizeof(count);
+}
+
+// События каталога; *lost - наблюдение снято (каталог удален или переименован)
+static int drain_watch(int fd, int *lost) {
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    int any = 0;
+    ssize_t len;
+    while ((len = read(fd, buf, sizeof(buf))) > 0) {
+        for (char *p = buf; p < buf + len; ) {
+            const struct inotify_event *ev = (const struct inotify_event *)p;
+            if (ev->mask & (IN_IGNORED | IN_DELETE_SELF | IN_MOVE_SELF)) {
+                *lost = 1;
+            }
+            p += sizeof(*ev) + ev->len;
+        }
+        any = 1;
+    }
+    return any;
+}
+
+static void routes_reload(void) {
+    route_set_t *set = route_set_build();
+    if (!set) {
+        fprintf(stderr, "Routes: reload failed, keeping the current table\n");
+        return;
+    }
+    route_set_publish(set);
+    printf("Routes: reloaded %d routes (epoch %lu)\n", set->count, (unsigned long)set->epoch);
+}
+
+void routes_watch(int timeout_ms, const struct pollfd *wake, int wake_count) {
+    if (routes_retired && timeout_ms > ROUTES_RECLAIM_MS) {
+        timeout_ms = ROUTES_RECLAIM_MS;
+    }
+    if (wake_count > ROUTES_WAKE_FDS_MAX) {
+        wake_count = ROUTES_WAKE_FDS_MAX;
+    }
+
+    // Отрицательный fd poll пропускает
+    struct pollfd fds[2 + ROUTES_WAKE_FDS_MAX] = {
+        { .fd = reload_fd, .events = POLLIN },
+        { .fd = watch_fd, .events = POLLIN },
+    };
+    for (int i = 0; i < wake_count; ++i) {
+        fds[2 + i] = (struct pollfd){ .fd = wake[i].fd, .events = wake[i].events };
+    }
+    int ready = poll(fds, 2 + wake_count, timeout_ms);
+
+    int reload = 0;
+    if (ready > 0) {
+        reload = drain_reload(reload_fd);
+        if (watch_fd != -1 && (fds[1].revents & POLLIN)) {
+            // Редактор или rename пишут несколько событий подряд - ждем тишины
+            int lost = 0;
+            do {
+                reload |= drain_watch(watch_fd, &lost);
+            } while (poll(&fds[1], 1, ROUTES_SETTLE_MS) > 0);
+
+            // Каталог заменили целиком - наблюдение ставится заново при перезагрузке
+            if (lost) {
+                close(watch_fd);
+                watch_fd = -1;
+            }
+        }
+    }
+
+    if (reload) {
+        if (watch_fd == -1) {
+            routes_watch_dir();
+        }
+        routes_reload();
+    }
+    routes_reclaim();
+}
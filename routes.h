@@ -0,0 +1,118 @@
+#ifndef ROUTES_H
+#define ROUTES_H
+
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include "http_handler.h"
+
+// Таблица роутов: встроенные роуты и JSON-файлы из routes_dir
+// (settings.json -> /settings), отображенные через mmap только для чтения,
+// и агрегирующие роуты конфигурации (ответ собирается из бэкендов).
+// Заголовки ответов сериализуются при сборке таблицы, тогда же тела
+// сжимаются в brotli и gzip - на запрос остается только выбор варианта.
+//
+// Перезагрузка (inotify каталога или SIGHUP) собирает новую таблицу в
+// главном треде и публикует ее одной записью указателя. Воркеры читают
+// таблицу без блокировок, по схеме RCU: между ожиданиями событий воркер
+// объявляет эпоху таблицы, которой пользуется, а каждая пачка ответов
+// держит ссылку на свою таблицу, пока iovec не отправлены целиком.
+// Старая таблица освобождается, когда все воркеры перешли на новую
+// эпоху и ссылок на нее не осталось
+
+// Генератор тела динамического роута: буфер из malloc, освобождает вызывающий
+typedef int (*route_render_fn)(char **body, size_t *len);
+
+#define ROUTE_ETAG_MAX 32
+
+// Представление тела роута: ответ 200 и заголовки 304 с его ETag
+typedef struct {
+    precomputed_response_t response;
+    precomputed_response_t not_modified;
+    char etag[ROUTE_ETAG_MAX];   // Строгий ETag в кавычках, как в заголовке
+    size_t etag_len;
+} route_variant_t;
+
+typedef struct {
+    char *path;
+    size_t path_len;
+    const char *content_type;
+    route_render_fn render;      // Не NULL - тело строится на каждый запрос
+    int aggregate;               // Индекс + 1 в g_config.aggregates, 0 - ответ сервера
+    route_variant_t identity;
+    // Сжатые при сборке таблицы варианты тела со своими заголовками
+    route_variant_t encoded[CONTENT_ENCODING_COUNT];
+    char *encoded_body[CONTENT_ENCODING_COUNT];
+    uint8_t encodings;           // CONTENT_ENCODING_BIT готовых вариантов
+    int metric_id;               // route_id для метрик (по пути, стабилен между таблицами)
+    uint16_t next_same_len;      // Следующий роут с той же длиной пути (индекс + 1, 0 - конец)
+    void *map;                   // mmap файла с телом, NULL - встроенный роут
+    size_t map_len;
+} route_t;
+
+// Ссылки пачек ответов на таблицу от одного воркера. Пишет только
+// владелец, поэтому счетчик - без lock-префикса, как у метрик
+typedef struct {
+    _Atomic uint64_t count;
+} __attribute__((aligned(64))) route_ref_t;
+
+typedef struct route_set_s {
+    uint64_t epoch;              // Номер публикации, с 1
+    uint64_t retired_at;         // Эпоха таблицы, сменившей эту (0 - текущая)
+    int count;
+    route_t *routes;
+    // Первый роут для каждой длины пути (индекс + 1, 0 - роутов такой длины нет)
+    uint16_t by_len[URL_MAX_LEN];
+    route_ref_t *refs;           // По счетчику на воркера
+    struct route_set_s *next_retired;
+} route_set_t;
+
+// Первая таблица; главный тред, до запуска воркеров
+int routes_init(void);
+void routes_destroy(void);
+
+// Регистрация воркера (worker_id от 1) как читателя таблиц
+void routes_register_worker(int worker_id);
+void routes_unregister_worker(void);
+
+// Границы ожидания событий: снаружи воркер не обращается к таблицам и
+// не мешает освобождению старых; после пробуждения берет текущую
+void routes_reader_offline(void);
+void routes_reader_online(void);
+
+// Ссылка пачки ответов на текущую таблицу воркера и ее возврат
+route_set_t *routes_hold(void);
+void routes_put(route_set_t *set);
+
+// Еще одна ссылка воркера на таблицу, которую он уже держит (поток
+// HTTP/2 отправляет ответ дольше одной пачки)
+void routes_ref(route_set_t *set);
+
+// Перечитать каталог при следующем routes_watch; безопасно из обработчика сигнала
+void routes_request_reload(void);
+
+#define ROUTES_WAKE_FDS_MAX 16
+
+struct pollfd;
+
+// Главный тред: ждет событий каталога или запроса перезагрузки до
+// timeout_ms, публикует новую таблицу и освобождает старые. События
+// wake (fd -1 пропускается, не больше ROUTES_WAKE_FDS_MAX) прерывают
+// ожидание: это другие события главного треда
+void routes_watch(int timeout_ms, const struct pollfd *wake, int wake_count);
+
+// Поиск роута: корзина по длине пути и memcmp внутри нее, без
+// копирования и NUL-терминации URL
+static inline int route_set_lookup(const route_set_t *set, const char *path, size_t len) {
+    if (__builtin_expect(len >= URL_MAX_LEN || set == NULL, 0)) return -1;
+
+    for (int i = set->by_len[len]; i != 0; i = set->routes[i - 1].next_same_len) {
+        if (memcmp(set->routes[i - 1].path, path, len) == 0) {
+            return i - 1;
+        }
+    }
+    return -1;
+}
+
+#endif // ROUTES_H
@@ -0,0 +1,207 @@
+#include "simd_utils.h"
+#include <stdio.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define SCAN_X86 1
+#else
+#define SCAN_X86 0
+#endif
+
+// Битовые маски интересных символов блока: бит i - байт base + i
+typedef struct {
+    uint64_t cr;
+    uint64_t lf;
+    uint64_t sp;
+    uint64_t q;
+} scan_masks_t;
+
+typedef uint32_t (*scan_fn_t)(http_scan_t *scan, const char *data, size_t len);
+
+// Сдвиг маски на k позиций с подстановкой трех байт перед блоком
+#define SCAN_SHL(x, tail, k) (((x) << (k)) | ((uint64_t)(tail) >> (3 - (k))))
+
+// Разбор масок блока [base, base + width), width <= 64.
+// Возвращает 1, если в блоке закончились заголовки
+static inline __attribute__((always_inline))
+int scan_consume(http_scan_t *scan, uint32_t base, unsigned width, const scan_masks_t *m) {
+    // Строка запроса: первые два пробела и '?' между ними, до первого '\n'
+    if (scan->line_end == 0) {
+        uint64_t before_lf = m->lf ? (m->lf & -m->lf) - 1 : ~0ull;
+        uint64_t sp = m->sp & before_lf;
+
+        while (sp && scan->sp_count < 2) {
+            scan->sp[scan->sp_count++] = base + __builtin_ctzll(sp);
+            sp &= sp - 1;
+        }
+
+        if (scan->query == 0 && scan->sp_count > 0) {
+            uint64_t q = m->q & before_lf;
+            while (q) {
+                uint32_t pos = base + __builtin_ctzll(q);
+                if (scan->sp_count == 2 && pos > scan->sp[1]) break;
+                if (pos > scan->sp[0]) {
+                    scan->query = pos;
+                    break;
+                }
+                q &= q - 1;
+            }
+        }
+
+        if (m->lf) {
+            scan->line_end = base + __builtin_ctzll(m->lf);
+        }
+    }
+
+    // "\r\n\r\n" заканчивается в позиции i: LF(i), CR(i-1), LF(i-2), CR(i-3)
+    uint64_t end = m->lf &
+                   SCAN_SHL(m->cr, scan->tail_cr, 1) &
+                   SCAN_SHL(m->lf, scan->tail_lf, 2) &
+                   SCAN_SHL(m->cr, scan->tail_cr, 3);
+    if (width < 64) {
+        end &= (1ull << width) - 1;
+    }
+    if (end) {
+        scan->header_end = base + __builtin_ctzll(end) + 1;
+        scan->scanned = scan->header_end;
+        return 1;
+    }
+
+    if (width >= 3) {
+        scan->tail_cr = (m->cr >> (width - 3)) & 7;
+        scan->tail_lf = (m->lf >> (width - 3)) & 7;
+    } else {
+        scan->tail_cr = ((scan->tail_cr >> width) | (m->cr << (3 - width))) & 7;
+        scan->tail_lf = ((scan->tail_lf >> width) | (m->lf << (3 - width))) & 7;
+    }
+    scan->scanned = base + width;
+    return 0;
+}
+
+// Скалярное построение масок для хвоста короче векторного блока
+static inline __attribute__((always_inline))
+void scan_masks_scalar(const char *p, unsigned n, scan_masks_t *m) {
+    m->cr = m->lf = m->sp = m->q = 0;
+    for (unsigned i = 0; i < n; ++i) {
+        uint64_t bit = 1ull << i;
+        switch (p[i]) {
+        case '\r': m->cr |= bit; break;
+        case '\n': m->lf |= bit; break;
+        case ' ':  m->sp |= bit; break;
+        case '?':  m->q |= bit; break;
+        default: break;
+        }
+    }
+}
+
+static uint32_t scan_scalar(http_scan_t *scan, const char *data, size_t len) {
+    size_t pos = scan->scanned;
+    while (pos < len) {
+        unsigned n = len - pos < 64 ? (unsigned)(len - pos) : 64;
+        scan_masks_t m;
+        scan_masks_scalar(data + pos, n, &m);
+        if (scan_consume(scan, pos, n, &m)) return scan->header_end;
+        pos += n;
+    }
+    return 0;
+}
+
+#if SCAN_X86
+
+__attribute__((target("sse4.2")))
+static uint32_t scan_sse42(http_scan_t *scan, const char *data, size_t len) {
+    const __m128i cr = _mm_set1_epi8('\r');
+    const __m128i lf = _mm_set1_epi8('\n');
+    const __m128i sp = _mm_set1_epi8(' ');
+    const __m128i q = _mm_set1_epi8('?');
+    size_t pos = scan->scanned;
+
+    for (; pos + 16 <= len; pos += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(data + pos));
+        scan_masks_t m = {
+            .cr = (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(v, cr)),
+            .lf = (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(v, lf)),
+            .sp = (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(v, sp)),
+            .q = (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(v, q)),
+        };
+        if (scan_consume(scan, pos, 16, &m)) return scan->header_end;
+    }
+    return scan_scalar(scan, data, len);
+}
+
+__attribute__((target("avx2")))
+static uint32_t scan_avx2(http_scan_t *scan, const char *data, size_t len) {
+    const __m256i cr = _mm256_set1_epi8('\r');
+    const __m256i lf = _mm256_set1_epi8('\n');
+    const __m256i sp = _mm256_set1_epi8(' ');
+    const __m256i q = _mm256_set1_epi8('?');
+    size_t pos = scan->scanned;
+
+    for (; pos + 32 <= len; pos += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(data + pos));
+        scan_masks_t m = {
+            .cr = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, cr)),
+            .lf = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, lf)),
+            .sp = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, sp)),
+            .q = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, q)),
+        };
+        if (scan_consume(scan, pos, 32, &m)) return scan->header_end;
+    }
+    return scan_scalar(scan, data, len);
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static uint32_t scan_avx512(http_scan_t *scan, const char *data, size_t len) {
+    const __m512i cr = _mm512_set1_epi8('\r');
+    const __m512i lf = _mm512_set1_epi8('\n');
+    const __m512i sp = _mm512_set1_epi8(' ');
+    const __m512i q = _mm512_set1_epi8('?');
+    size_t pos = scan->scanned;
+
+    for (; pos + 64 <= len; pos += 64) {
+        __m512i v = _mm512_loadu_si512((const void *)(data + pos));
+        scan_masks_t m = {
+            .cr = _mm512_cmpeq_epi8_mask(v, cr),
+            .lf = _mm512_cmpeq_epi8_mask(v, lf),
+            .sp = _mm512_cmpeq_epi8_mask(v, sp),
+            .q = _mm512_cmpeq_epi8_mask(v, q),
+        };
+        if (scan_consume(scan, pos, 64, &m)) return scan->header_end;
+    }
+    return scan_scalar(scan, data, len);
+}
+
+#endif // SCAN_X86
+
+static scan_fn_t scan_impl = scan_scalar;
+static const char *scan_impl_name = "scalar";
+
+void simd_scanner_init(void) {
+#if SCAN_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512bw")) {
+        scan_impl = scan_avx512;
+        scan_impl_name = "avx512bw";
+    } else if (__builtin_cpu_supports("avx2")) {
+        scan_impl = scan_avx2;
+        scan_impl_name = "avx2";
+    } else if (__builtin_cpu_supports("sse4.2")) {
+        scan_impl = scan_sse42;
+        scan_impl_name = "sse4.2";
+    }
+#endif
+}
+
+const char *simd_scanner_name(void) {
+    return scan_impl_name;
+}
+
+uint32_t http_scan_request(http_scan_t *scan, const char *data, size_t len) {
+    if (scan->header_end) {
+        return scan->header_end;
+    }
+    if (UNLIKELY(len <= scan->scanned)) {
+        return 0;
+    }
+    return scan_impl(scan, data, len);
+}
@@ -45,118 +45,52 @@ static inline const char* simd_find_char(const char* haystack, size_t len, char
     return NULL;
 }
 
-// Быстрая валидация URL символов
-static inline int simd_validate_url_chars(const char* url, size_t len) {
-    const char* end = url + len;
-    const char* aligned_start = (const char*)((uintptr_t)(url + 15) & ~15);
-    
-    // Валидные символы: a-z, A-Z, 0-9, /, -, _, ., ?, =, &
-    __m128i lower_bound = _mm_set1_epi8(0x20);  // ' '
-    __m128i upper_bound = _mm_set1_epi8(0x7E);  // '~'
-    
-    // Обрабатываем неaligned начало
-    for (const char* p = url; p < aligned_start && p < end; p++) {
-        char c = *p;
-        if (c < 0x20 || c > 0x7E) return 0;
-        if (c == ' ' || c == '\t' || c == '\n' || c == '\r') return 0;
-    }
-    
-    if (aligned_start >= end) return 1;
-    
-    // SIMD валидация по 16 байт за раз
-    for (const char* p = aligned_start; p + 16 <= end; p += 16) {
-        __m128i data = _mm_load_si128((__m128i*)p);
-        
-        // Проверяем границы ASCII
-        __m128i too_low = _mm_cmplt_epi8(data, lower_bound);
-        __m128i too_high = _mm_cmpgt_epi8(data, upper_bound);
-        __m128i invalid = _mm_or_si128(too_low, too_high);
-        
-        if (_mm_movemask_epi8(invalid)) return 0;
-        
-        // Проверяем запрещенные символы (пробелы, табы, переводы строк)
-        __m128i space = _mm_set1_epi8(' ');
-        __m128i tab = _mm_set1_epi8('\t');
-        __m128i lf = _mm_set1_epi8('\n');
-        __m128i cr = _mm_set1_epi8('\r');
-        
-        __m128i has_space = _mm_cmpeq_epi8(data, space);
-        __m128i has_tab = _mm_cmpeq_epi8(data, tab);
-        __m128i has_lf = _mm_cmpeq_epi8(data, lf);
-        __m128i has_cr = _mm_cmpeq_epi8(data, cr);
-        
-        __m128i forbidden = _mm_or_si128(_mm_or_si128(has_space, has_tab), 
-                                       _mm_or_si128(has_lf, has_cr));
-        
-        if (_mm_movemask_epi8(forbidden)) return 0;
-    }
-    
-    // Обрабатываем остаток
-    for (const char* p = end - (end - aligned_start) % 16; p < end; p++) {
-        char c = *p;
-        if (c < 0x20 || c > 0x7E) return 0;
-        if (c == ' ' || c == '\t' || c == '\n' || c == '\r') return 0;
-    }
-    
-    return 1;
-}
-
-// Быстрый поиск конца HTTP заголовков (\r\n\r\n)
-static inline const char* simd_find_header_end(const char* data, size_t len) {
-    if (len < 4) return NULL;
-    
-    const char* end = data + len - 3;
-    __m128i pattern = _mm_set_epi32(0x0A0D0A0D, 0x0A0D0A0D, 0x0A0D0A0D, 0x0A0D0A0D);
-    
-    for (const char* p = data; p <= end - 13; p += 16) {
-        __m128i chunk = _mm_loadu_si128((__m128i*)p);
-        
-        // Ищем \r\n\r\n pattern
-        for (int i = 0; i < 13; i++) {
-            __m128i shifted = _mm_srli_si128(chunk, i);
-            if (_mm_extract_epi32(shifted, 0) == 0x0A0D0A0D) {
-                return p + i;
-            }
-        }
-    }
-    
-    // Fallback для остатка
-    for (const char* p = end - 13; p <= end; p++) {
-        if (p[0] == '\r' && p[1] == '\n' && p[2] == '\r' && p[3] == '\n') {
-            return p;
-        }
-    }
-    
-    return NULL;
-}
-
 #else
 
+#include <string.h>
+
 // Fallback реализации без SIMD
 static inline const char* simd_find_char(const char* haystack, size_t len, char needle) {
     return memchr(haystack, needle, len);
 }
 
-static inline int simd_validate_url_chars(const char* url, size_t len) {
-    for (size_t i = 0; i < len; i++) {
-        char c = url[i];
-        if (c < 0x20 || c > 0x7E) return 0;
-        if (c == ' ' || c == '\t' || c == '\n' || c == '\r') return 0;
-    }
-    return 1;
-}
+#endif // SIMD_AVAILABLE
 
-static inline const char* simd_find_header_end(const char* data, size_t len) {
-    for (size_t i = 0; i < len - 3; i++) {
-        if (data[i] == '\r' && data[i+1] == '\n' && 
-            data[i+2] == '\r' && data[i+3] == '\n') {
-            return &data[i];
-        }
-    }
-    return NULL;
+// Состояние векторного сканера запроса. Один проход по каждому новому
+// куску данных находит границы строки запроса и конец заголовков;
+// следующий вызов продолжает с места остановки, не пересматривая буфер.
+// Все смещения - от начала запроса
+typedef struct {
+    uint32_t scanned;            // Сколько байт уже просмотрено
+    uint32_t header_end;         // Смещение за "\r\n\r\n", 0 - еще не найден
+    uint32_t line_end;           // Смещение '\n' строки запроса, 0 - еще не найден
+    uint16_t sp[2];              // Пробелы строки запроса: после метода и после URL
+    uint16_t query;              // Первый '?' внутри URL, 0 - query-строки нет
+    uint8_t sp_count;
+    uint8_t tail_cr;             // '\r'/'\n' среди трех последних просмотренных байт
+    uint8_t tail_lf;             // (бит 2 - последний байт) - для "\r\n\r\n" на стыке кусков
+} http_scan_t;
+
+static inline void http_scan_reset(http_scan_t *scan) {
+    scan->scanned = 0;
+    scan->header_end = 0;
+    scan->line_end = 0;
+    scan->query = 0;
+    scan->sp_count = 0;
+    scan->tail_cr = 0;
+    scan->tail_lf = 0;
 }
 
-#endif // SIMD_AVAILABLE
+// Выбор реализации сканера (AVX-512BW / AVX2 / SSE4.2 / скалярная) по
+// возможностям CPU. Вызывается один раз при старте, до запуска воркеров
+void simd_scanner_init(void);
+
+// Имя выбранной реализации для диагностики
+const char *simd_scanner_name(void);
+
+// Досканировать запрос [data, data + len). Возвращает длину заголовков
+// (смещение за "\r\n\r\n") или 0, если они еще не полные
+uint32_t http_scan_request(http_scan_t *scan, const char *data, size_t len);
 
 // Утилиты для выравнивания памяти
 #define CACHE_LINE_SIZE 64
@@ -1,35 +1,38 @@
 #include "timer.h"
 #include "worker.h" // Для close_connection_from_worker
+#include "loop_clock.h"
+#include "numa_arena.h"
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 
-// Функции-помощники для работы с кучей (min-heap)
-static void sift_up(timer_heap_t *th, int index);
-static void sift_down(timer_heap_t *th, int index);
-static void swap_nodes(timer_heap_t *th, int a, int b);
-static void update_heap_index(timer_heap_t *th, int index);
+// Функции-помощники для работы с колесом
+static void wheel_insert(timer_heap_t *th, timer_node_t *node);
+static void wheel_unlink(timer_heap_t *th, timer_node_t *node);
+static void wheel_cascade(timer_heap_t *th);
+static int wheel_next_slot(const uint64_t *bits, unsigned start, unsigned limit);
 
 // Функции для управления пулом узлов таймеров
 int timer_node_pool_init(timer_node_pool_t *pool, int capacity) {
-    pool->nodes = malloc(sizeof(timer_node_t) * capacity);
+    // Узлы - из арены воркера, рядом с его соединениями
+    pool->nodes = numa_local_alloc(sizeof(timer_node_t) * capacity);
     if (!pool->nodes) return -1;
-    
+
     pool->capacity = capacity;
     pool->used_count = 0;
     pool->free_head = NULL;
-    
+
     // Инициализируем список свободных узлов
     for (int i = 0; i < capacity; i++) {
         pool->nodes[i].next = pool->free_head;
         pool->free_head = &pool->nodes[i];
     }
-    
+
     return 0;
 }
 
 void timer_node_pool_destroy(timer_node_pool_t *pool) {
-    free(pool->nodes);
+    numa_local_free(pool->nodes);
     pool->nodes = NULL;
     pool->free_head = NULL;
     pool->capacity = 0;
@@ -38,35 +41,35 @@ void timer_node_pool_destroy(timer_node_pool_t *pool) {
 
 timer_node_t *timer_node_pool_get(timer_node_pool_t *pool) {
     if (!pool->free_head) return NULL;
-    
+
     timer_node_t *node = pool->free_head;
     pool->free_head = node->next;
     pool->used_count++;
-    
+
     // Очищаем узел
     memset(node, 0, sizeof(timer_node_t));
-    node->heap_index = -1;
-    
+
     return node;
 }
 
 void timer_node_pool_release(timer_node_pool_t *pool, timer_node_t *node) {
     if (!node) return;
-    
+
     node->next = pool->free_head;
+    node->pprev = NULL;
     pool->free_head = node;
     pool->used_count--;
 }
 
 int timer_heap_init(timer_heap_t *th, int capacity) {
-    th->heap = malloc(sizeof(timer_node_t*) * capacity);
-    if (!th->heap) return -1;
-    
+    memset(th->wheel, 0, sizeof(th->wheel));
+    memset(th->occupied, 0, sizeof(th->occupied));
+
     if (timer_node_pool_init(&th->node_pool, capacity) != 0) {
-        free(th->heap);
         return -1;
     }
-    
+
+    th->current_ms = loop_clock_now_ms();
     th->capacity = capacity;
     th->size = 0;
     return 0;
@@ -74,30 +77,29 @@ int timer_heap_init(timer_heap_t *th, int capacity) {
 
 void timer_heap_destroy(timer_heap_t *th) {
     timer_node_pool_destroy(&th->node_pool);
-    free(th->heap);
+    memset(th->wheel, 0, sizeof(th->wheel));
+    th->size = 0;
 }
 
 int timer_heap_add(timer_heap_t *th, struct connection_s *conn, int timeout_ms) {
-    if (th->size >= th->capacity) return -1; // Куча заполнена
+    timer_node_t *node = conn->timer_node;
 
-    timer_node_t *node = timer_node_pool_get(&th->node_pool);
-    if (!node) return -1;
+    if (node) {
+        // Таймер еще не сработал - просто перевешиваем узел
+        wheel_unlink(th, node);
+    } else {
+        if (th->size >= th->capacity) return -1; // Колесо заполнено
 
-    clock_gettime(CLOCK_MONOTONIC, &node->expiry_time);
-    node->expiry_time.tv_sec += timeout_ms / 1000;
-    node->expiry_time.tv_nsec += (timeout_ms % 1000) * 1000000;
-    if (node->expiry_time.tv_nsec >= 1000000000) {
-        node->expiry_time.tv_sec++;
-        node->expiry_time.tv_nsec -= 1000000000;
-    }
+        node = timer_node_pool_get(&th->node_pool);
+        if (!node) return -1;
 
-    node->conn = conn;
-    node->heap_index = th->size;
-    conn->timer_node = node;
+        node->conn = conn;
+        conn->timer_node = node;
+        th->size++;
+    }
 
-    th->heap[th->size] = node;
-    sift_up(th, th->size);
-    th->size++;
+    node->expiry_ms = loop_clock_now_ms() + (timeout_ms > 0 ? timeout_ms : 0);
+    wheel_insert(th, node);
 
     return 0;
 }
@@ -105,120 +107,185 @@ int timer_heap_add(timer_heap_t *th, struct connection_s *conn, int timeout_ms)
 void timer_heap_remove(timer_heap_t *th, struct connection_s *conn) {
     if (!conn->timer_node) return;
 
-    timer_node_t *node_to_remove = conn->timer_node;
-    int index = node_to_remove->heap_index;
-    
-    if (index < 0 || index >= th->size || th->heap[index] != node_to_remove) {
-        return; // Invalid index or corrupted heap
+    timer_node_t *node = conn->timer_node;
+    if (!node->pprev) {
+        return; // Узел не в колесе - повреждение состояния
     }
 
+    wheel_unlink(th, node);
+    timer_node_pool_release(&th->node_pool, node);
     th->size--;
-    if (index != th->size) {
-        th->heap[index] = th->heap[th->size];
-        th->heap[index]->heap_index = index;
-        
-        // Restore heap property
-        if (index > 0 && 
-            (th->heap[index]->expiry_time.tv_sec < th->heap[(index-1)/2]->expiry_time.tv_sec ||
-             (th->heap[index]->expiry_time.tv_sec == th->heap[(index-1)/2]->expiry_time.tv_sec &&
-              th->heap[index]->expiry_time.tv_nsec < th->heap[(index-1)/2]->expiry_time.tv_nsec))) {
-            sift_up(th, index);
-        } else {
-            sift_down(th, index);
-        }
-    }
-
-    timer_node_pool_release(&th->node_pool, node_to_remove);
     conn->timer_node = NULL;
 }
 
 int timer_heap_get_next_timeout(timer_heap_t *th) {
     if (th->size == 0) return -1; // Бесконечное ожидание
 
-    struct timespec now;
-    clock_gettime(CLOCK_MONOTONIC, &now);
+    uint64_t now = loop_clock_now_ms();
+    uint64_t next = UINT64_MAX;
+
+    // Уровень 0 дает точное время ближайшего таймера, верхние уровни -
+    // нижнюю границу (момент каскада слота вниз)
+    for (int level = 0; level < TIMER_WHEEL_LEVELS; ++level) {
+        unsigned shift = level * TIMER_WHEEL_BITS;
+        uint64_t base = th->current_ms >> shift;
+        unsigned index = base & TIMER_WHEEL_MASK;
+        // Слот под текущим индексом верхнего уровня уже перенесен вниз,
+        // если только current_ms не стоит ровно на границе (каскад впереди).
+        // Но wheel_insert мог положить туда таймер следующего оборота
+        // (delta чуть меньше 2^(shift + 8)): просмотр по кругу включает
+        // этот слот последним, его каскад - через полный оборот
+        unsigned first = (th->current_ms & ((1ull << shift) - 1)) == 0 ? 0 : 1;
+
+        int distance = wheel_next_slot(th->occupied[level], index + first, TIMER_WHEEL_SLOTS);
+        if (distance < 0) continue;
+
+        uint64_t when = (base + first + distance) << shift;
+        if (when < next) next = when;
+    }
 
-    long long diff_ms = (th->heap[0]->expiry_time.tv_sec - now.tv_sec) * 1000;
-    diff_ms += (th->heap[0]->expiry_time.tv_nsec - now.tv_nsec) / 1000000;
+    if (next == UINT64_MAX) return -1;
+    if (next <= now) return 0;
 
-    return (diff_ms > 0) ? diff_ms : 0;
+    uint64_t diff_ms = next - now;
+    return diff_ms > 0x7FFFFFFF ? 0x7FFFFFFF : (int)diff_ms;
 }
 
 void timer_heap_process_expired(timer_heap_t *th) {
-    struct timespec now;
-    clock_gettime(CLOCK_MONOTONIC, &now);
-
-    while (th->size > 0) {
-        timer_node_t *top = th->heap[0];
-        if (top->expiry_time.tv_sec > now.tv_sec ||
-           (top->expiry_time.tv_sec == now.tv_sec && top->expiry_time.tv_nsec > now.tv_nsec)) {
-            break; // Вершина кучи еще не истекла
+    uint64_t now = loop_clock_now_ms();
+
+    while (th->size > 0 && th->current_ms <= now) {
+        unsigned index = th->current_ms & TIMER_WHEEL_MASK;
+        if (index == 0) {
+            wheel_cascade(th);
         }
 
-        // Таймер истек, закрываем соединение
-        connection_t *conn = top->conn;
-        if (conn->state != STATE_FREE && conn->state != STATE_CLOSING) {
-            //printf("Worker: Closing connection %d due to timeout (state: %d)\n", conn->fd, conn->state);
-            conn->state = STATE_CLOSING;
-            close_connection_from_worker(conn);
+        timer_node_t *node;
+        while ((node = th->wheel[0][index]) != NULL) {
+            // Таймер истек: снимаем узел до колбэка, чтобы закрытие
+            // соединения не могло зациклить обработку слота
+            struct connection_s *conn = node->conn;
+            timer_heap_remove(th, conn);
+
+            if (conn->state != STATE_FREE && conn->state != STATE_CLOSING) {
+                //printf("Worker: Closing connection %d due to timeout (state: %d)\n", conn->fd, conn->state);
+                conn->state = STATE_CLOSING;
+                close_connection_from_worker(conn);
+            }
         }
-        // Удаляем из кучи (close_connection_from_worker уже это делает)
+
+        // Перескакиваем пустые слоты до следующего занятого или до границы оборота
+        // (но не дальше текущего времени, иначе новые таймеры сработают позже)
+        int distance = wheel_next_slot(th->occupied[0], index + 1, TIMER_WHEEL_MASK - index);
+        uint64_t next = th->current_ms +
+            (distance < 0 ? (uint64_t)(TIMER_WHEEL_SLOTS - index) : (uint64_t)distance + 1);
+        th->current_ms = next <= now + 1 ? next : now + 1;
     }
-}
 
-// Реализация sift_up, sift_down, swap_nodes
-static void swap_nodes(timer_heap_t *th, int a, int b) {
-    timer_node_t *temp = th->heap[a];
-    th->heap[a] = th->heap[b];
-    th->heap[b] = temp;
-    
-    // Update heap indices
-    th->heap[a]->heap_index = a;
-    th->heap[b]->heap_index = b;
+    if (th->size == 0 && th->current_ms <= now) {
+        th->current_ms = now; // Колесо пустое - догоняем время без обхода слотов
+    }
 }
 
-static void update_heap_index(timer_heap_t *th, int index) {
-    if (index >= 0 && index < th->size) {
-        th->heap[index]->heap_index = index;
+void timer_heap_close_idle(timer_heap_t *th) {
+    for (int level = 0; level < TIMER_WHEEL_LEVELS; ++level) {
+        for (int index = 0; index < TIMER_WHEEL_SLOTS; ++index) {
+            timer_node_t *node = th->wheel[level][index];
+            while (node) {
+                // Закрытие снимает только свой узел - следующий уже запомнен
+                timer_node_t *next = node->next;
+                struct connection_s *conn = node->conn;
+                if (conn->state == STATE_KEEP_ALIVE) {
+                    timer_heap_remove(th, conn);
+                    conn->state = STATE_CLOSING;
+                    close_connection_from_worker(conn);
+                }
+                node = next;
+            }
+        }
     }
 }
 
-static void sift_up(timer_heap_t *th, int index) {
-    if (index == 0) return;
-    int parent_index = (index - 1) / 2;
+// Кладет узел в слот по времени срабатывания относительно current_ms
+static void wheel_insert(timer_heap_t *th, timer_node_t *node) {
+    uint64_t expires = node->expiry_ms;
+    if (expires < th->current_ms) {
+        expires = th->current_ms; // Просроченный - сработает на ближайшем тике
+    }
 
-    if (th->heap[index]->expiry_time.tv_sec < th->heap[parent_index]->expiry_time.tv_sec ||
-       (th->heap[index]->expiry_time.tv_sec == th->heap[parent_index]->expiry_time.tv_sec &&
-        th->heap[index]->expiry_time.tv_nsec < th->heap[parent_index]->expiry_time.tv_nsec))
-    {
-        swap_nodes(th, index, parent_index);
-        sift_up(th, parent_index);
+    uint64_t delta = expires - th->current_ms;
+    int level = 0;
+    while (level < TIMER_WHEEL_LEVELS - 1 &&
+           delta >= (1ull << ((level + 1) * TIMER_WHEEL_BITS))) {
+        level++;
     }
+
+    uint64_t max_delta = (1ull << (TIMER_WHEEL_LEVELS * TIMER_WHEEL_BITS)) - 1;
+    if (delta > max_delta) {
+        expires = th->current_ms + max_delta;
+    }
+
+    unsigned slot = (expires >> (level * TIMER_WHEEL_BITS)) & TIMER_WHEEL_MASK;
+    timer_node_t **head = &th->wheel[level][slot];
+
+    node->level = level;
+    node->slot = slot;
+    node->next = *head;
+    node->pprev = head;
+    if (*head) (*head)->pprev = &node->next;
+    *head = node;
+
+    th->occupied[level][slot >> 6] |= 1ull << (slot & 63);
 }
 
-static void sift_down(timer_heap_t *th, int index) {
-    int left_child = 2 * index + 1;
-    int right_child = 2 * index + 2;
-    int smallest = index;
-
-    if (left_child < th->size &&
-       (th->heap[left_child]->expiry_time.tv_sec < th->heap[smallest]->expiry_time.tv_sec ||
-       (th->heap[left_child]->expiry_time.tv_sec == th->heap[smallest]->expiry_time.tv_sec &&
-        th->heap[left_child]->expiry_time.tv_nsec < th->heap[smallest]->expiry_time.tv_nsec)))
-    {
-        smallest = left_child;
+static void wheel_unlink(timer_heap_t *th, timer_node_t *node) {
+    if (!node->pprev) return;
+
+    *node->pprev = node->next;
+    if (node->next) node->next->pprev = node->pprev;
+
+    if (!th->wheel[node->level][node->slot]) {
+        th->occupied[node->level][node->slot >> 6] &= ~(1ull << (node->slot & 63));
     }
 
-    if (right_child < th->size &&
-       (th->heap[right_child]->expiry_time.tv_sec < th->heap[smallest]->expiry_time.tv_sec ||
-       (th->heap[right_child]->expiry_time.tv_sec == th->heap[smallest]->expiry_time.tv_sec &&
-        th->heap[right_child]->expiry_time.tv_nsec < th->heap[smallest]->expiry_time.tv_nsec)))
-    {
-        smallest = right_child;
+    node->next = NULL;
+    node->pprev = NULL;
+}
+
+// На границе оборота нулевого уровня переносим вниз слоты верхних уровней,
+// чьи таймеры попадают в начинающийся интервал
+static void wheel_cascade(timer_heap_t *th) {
+    for (int level = 1; level < TIMER_WHEEL_LEVELS; ++level) {
+        unsigned shift = level * TIMER_WHEEL_BITS;
+        unsigned slot = (th->current_ms >> shift) & TIMER_WHEEL_MASK;
+
+        timer_node_t *node = th->wheel[level][slot];
+        th->wheel[level][slot] = NULL;
+        th->occupied[level][slot >> 6] &= ~(1ull << (slot & 63));
+
+        while (node) {
+            timer_node_t *next = node->next;
+            wheel_insert(th, node);
+            node = next;
+        }
+
+        // Следующий уровень каскадируется только на его собственной границе
+        if (slot != 0) break;
     }
+}
 
-    if (smallest != index) {
-        swap_nodes(th, index, smallest);
-        sift_down(th, smallest);
+// Расстояние от start до ближайшего занятого слота (по кругу),
+// просматривается не больше limit слотов; -1 если таких нет
+static int wheel_next_slot(const uint64_t *bits, unsigned start, unsigned limit) {
+    for (unsigned scanned = 0; scanned < limit; ) {
+        unsigned slot = (start + scanned) & TIMER_WHEEL_MASK;
+        uint64_t word = bits[slot >> 6] >> (slot & 63);
+
+        if (word) {
+            unsigned distance = scanned + __builtin_ctzll(word);
+            return distance < limit ? (int)distance : -1;
+        }
+        scanned += 64 - (slot & 63);
     }
+    return -1;
 }
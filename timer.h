@@ -2,13 +2,23 @@
 #define TIMER_H
 
 #include <sys/time.h>
+#include <stdint.h>
 
-// Узел в куче таймеров
+// Иерархическое колесо таймеров: 4 уровня по 256 слотов,
+// слот нулевого уровня - 1 мс. Добавление, удаление и перевзвод - O(1)
+#define TIMER_WHEEL_LEVELS 4
+#define TIMER_WHEEL_BITS 8
+#define TIMER_WHEEL_SLOTS (1 << TIMER_WHEEL_BITS)
+#define TIMER_WHEEL_MASK (TIMER_WHEEL_SLOTS - 1)
+
+// Узел колеса таймеров
 typedef struct timer_node_s {
-    struct timespec expiry_time; // Время, когда таймер сработает
+    uint64_t expiry_ms;          // Монотонное время срабатывания, мс
     struct connection_s *conn;   // Ссылка на соединение
-    int heap_index;              // Индекс узла в куче для O(1) удаления
-    struct timer_node_s *next;   // Для пула свободных узлов
+    struct timer_node_s *next;   // Следующий в слоте / в пуле свободных узлов
+    struct timer_node_s **pprev; // Указатель на ссылку на себя для O(1) удаления
+    uint8_t level;               // Уровень и слот, где сейчас лежит узел
+    uint8_t slot;
 } timer_node_t;
 
 // Пул узлов таймеров для избежания malloc/free
@@ -19,9 +29,11 @@ typedef struct {
     int used_count;
 } timer_node_pool_t;
 
-// Структура таймера (min-heap)
+// Структура таймеров (имя сохранено ради совместимости API)
 typedef struct {
-    timer_node_t **heap;
+    timer_node_t *wheel[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS];
+    uint64_t occupied[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS / 64]; // Непустые слоты
+    uint64_t current_ms;         // Следующий необработанный тик
     timer_node_pool_t node_pool; // Пул узлов
     int capacity;
     int size;
@@ -34,7 +46,9 @@ void timer_node_pool_destroy(timer_node_pool_t *pool);
 timer_node_t *timer_node_pool_get(timer_node_pool_t *pool);
 void timer_node_pool_release(timer_node_pool_t *pool, timer_node_t *node);
 
-// API для управления таймерами
+// API для управления таймерами.
+// timer_heap_add для соединения с уже взведенным таймером только
+// перевешивает узел на новое время срабатывания
 int timer_heap_init(timer_heap_t *th, int capacity);
 void timer_heap_destroy(timer_heap_t *th);
 int timer_heap_add(timer_heap_t *th, struct connection_s *conn, int timeout_ms);
@@ -42,4 +56,8 @@ void timer_heap_remove(timer_heap_t *th, struct connection_s *conn);
 int timer_heap_get_next_timeout(timer_heap_t *th);
 void timer_heap_process_expired(timer_heap_t *th);
 
+// Закрыть соединения, простаивающие в keep-alive, не дожидаясь их
+// таймеров (дренаж перед завершением процесса)
+void timer_heap_close_idle(timer_heap_t *th);
+
 #endif // TIMER_H
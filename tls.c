@@ -0,0 +1,176 @@
+#include "tls.h"
+#include "config.h"
+#include "metrics.h"
+#include "log.h"
+#include <stdio.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+
+// Наборы, которые ядро умеет шифровать (include/uapi/linux/tls.h)
+#define TLS_CIPHERS "ECDHE+AESGCM:ECDHE+CHACHA20"
+#define TLS_CIPHERSUITES "TLS_AES_128_GCM_SHA256:TLS_AES_256_GCM_SHA384:" \
+                         "TLS_CHACHA20_POLY1305_SHA256"
+
+static SSL_CTX *tls_ctx = NULL;
+int tls_on = 0;
+
+// ULP "tls" подгружается модулем ядра: без него setsockopt дает ENOENT
+// еще до проверки, что сокет подключен
+static int tls_kernel_supported(void) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd == -1) {
+        return 0;
+    }
+    int ret = setsockopt(fd, IPPROTO_TCP, TCP_ULP, "tls", sizeof("tls"));
+    int supported = ret == 0 || errno != ENOENT;
+    close(fd);
+    return supported;
+}
+
+static void tls_print_errors(const char *what) {
+    unsigned long err = ERR_get_error();
+    char buf[256];
+    ERR_error_string_n(err, buf, sizeof(buf));
+    fprintf(stderr, "TLS: %s: %s\n", what, err ? buf : "unknown error");
+    ERR_clear_error();
+}
+
+// ALPN: "h2", если HTTP/2 включен, затем http/1.1. Клиент без ALPN или
+// без общих протоколов говорит HTTP/1.1; префейс h2 узнается в потоке
+static int tls_alpn_select(SSL *ssl, const unsigned char **out, unsigned char *out_len,
+                           const unsigned char *in, unsigned int in_len, void *arg) {
+    static const unsigned char protocols[] = "\x02h2\x08http/1.1";
+    const unsigned char *server = protocols;
+    unsigned int server_len = sizeof(protocols) - 1;
+    (void)ssl;
+    (void)arg;
+    if (g_config.http2_max_streams == 0) {
+        server += 3;
+        server_len -= 3;
+    }
+    if (SSL_select_next_proto((unsigned char **)out, out_len, server, server_len,
+                              in, in_len) != OPENSSL_NPN_NEGOTIATED) {
+        return SSL_TLSEXT_ERR_NOACK;
+    }
+    return SSL_TLSEXT_ERR_OK;
+}
+
+int tls_init(void) {
+    if (g_config.tls_cert[0] == '\0') {
+        return 0;
+    }
+    if (!tls_kernel_supported()) {
+        fprintf(stderr, "TLS: kernel TLS is unavailable (modprobe tls)\n");
+        return -1;
+    }
+
+    SSL_CTX *ctx = SSL_CTX_new(TLS_server_method());
+    if (!ctx) {
+        tls_print_errors("SSL_CTX_new");
+        return -1;
+    }
+    SSL_CTX_set_min_proto_version(ctx, TLS1_2_VERSION);
+#if OPENSSL_VERSION_NUMBER < 0x30200000L
+    // kTLS на прием для TLS 1.3 появился в OpenSSL 3.2
+    SSL_CTX_set_max_proto_version(ctx, TLS1_2_VERSION);
+#endif
+    SSL_CTX_set_options(ctx, SSL_OP_ENABLE_KTLS | SSL_OP_NO_RENEGOTIATION |
+                             SSL_OP_CIPHER_SERVER_PREFERENCE | SSL_OP_NO_COMPRESSION);
+    SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_OFF);
+    SSL_CTX_set_num_tickets(ctx, 1);
+    SSL_CTX_set_alpn_select_cb(ctx, tls_alpn_select, NULL);
+
+    if (SSL_CTX_set_cipher_list(ctx, TLS_CIPHERS) != 1 ||
+        SSL_CTX_set_ciphersuites(ctx, TLS_CIPHERSUITES) != 1) {
+        tls_print_errors("cipher list");
+        SSL_CTX_free(ctx);
+        return -1;
+    }
+    if (SSL_CTX_use_certificate_chain_file(ctx, g_config.tls_cert) != 1) {
+        tls_print_errors(g_config.tls_cert);
+        SSL_CTX_free(ctx);
+        return -1;
+    }
+    if (SSL_CTX_use_PrivateKey_file(ctx, g_config.tls_key, SSL_FILETYPE_PEM) != 1 ||
+        SSL_CTX_check_private_key(ctx) != 1) {
+        tls_print_errors(g_config.tls_key);
+        SSL_CTX_free(ctx);
+        return -1;
+    }
+
+    tls_ctx = ctx;
+    tls_on = 1;
+    printf("TLS: certificate %s, kTLS\n", g_config.tls_cert);
+    return 0;
+}
+
+void tls_destroy(void) {
+    SSL_CTX_free(tls_ctx);
+    tls_ctx = NULL;
+    tls_on = 0;
+}
+
+static void tls_failed(void) {
+    if (worker_metrics) {
+        metric_add(&worker_metrics->tls_failures, 1);
+    }
+    ERR_clear_error(); // Очередь ошибок OpenSSL - своя у треда
+}
+
+int tls_handshake(connection_t *conn) {
+    connection_io_t *io = conn->io;
+    SSL *ssl = io->tls;
+    if (!ssl) {
+        ssl = SSL_new(tls_ctx);
+        if (!ssl || SSL_set_fd(ssl, conn->fd) != 1) {
+            SSL_free(ssl);
+            tls_failed();
+            return -1;
+        }
+        SSL_set_accept_state(ssl);
+        io->tls = ssl;
+    }
+
+    int ret = SSL_do_handshake(ssl);
+    if (ret != 1) {
+        switch (SSL_get_error(ssl, ret)) {
+        case SSL_ERROR_WANT_READ:
+            return TLS_WANT_READ;
+        case SSL_ERROR_WANT_WRITE:
+            return TLS_WANT_WRITE;
+        default:
+            tls_failed(); // Сканеры и старые клиенты - обычное дело, в журнал не пишем
+            return -1;
+        }
+    }
+
+    // Дальше с сокетом работаем мимо OpenSSL: ключи должны быть в ядре в обе
+    // стороны, а в буфере SSL не должно остаться прочитанных данных
+    if (!BIO_get_ktls_send(SSL_get_wbio(ssl)) || !BIO_get_ktls_recv(SSL_get_rbio(ssl)) ||
+        SSL_has_pending(ssl)) {
+        log_warn("TLS: %s with %s was not offloaded to kTLS",
+                 SSL_get_version(ssl), SSL_get_cipher_name(ssl));
+        tls_failed();
+        return -1;
+    }
+    if (worker_metrics) {
+        metric_add(&worker_metrics->tls_handshakes, 1);
+        if (SSL_session_reused(ssl)) {
+            metric_add(&worker_metrics->tls_resumed, 1);
+        }
+    }
+    SSL_free(ssl); // Сокет не закрывается (BIO_NOCLOSE), ключи остаются в ядре
+    io->tls = NULL;
+    conn->zerocopy = ZEROCOPY_OFF; // kTLS шифрует в свой буфер, MSG_ZEROCOPY ему не подходит
+    return TLS_DONE;
+}
+
+void tls_connection_free(connection_io_t *io) {
+    SSL_free(io->tls);
+    io->tls = NULL;
+}
@@ -0,0 +1,39 @@
+#ifndef TLS_H
+#define TLS_H
+
+#include "connection.h"
+
+// TLS в воркере. Рукопожатие ведет OpenSSL на неблокирующем сокете в
+// event loop воркера (STATE_TLS_HANDSHAKE), с SSL_OP_ENABLE_KTLS ключи
+// сессии сразу уходят в ядро (TCP_ULP "tls"). После рукопожатия SSL
+// освобождается: recv, writev и io_uring работают с сокетом как с
+// открытым - шифрует ядро или, если умеет, сетевая карта.
+//
+// SSL_CTX один на процесс, поэтому и ключи тикетов сессий общие: клиент
+// возобновляет сессию у любого воркера. Кэша сессий на сервере нет.
+// Шифры - только те, что поддерживает kTLS (AES-GCM, ChaCha20-Poly1305)
+
+// Итог tls_handshake
+#define TLS_DONE 0                   // Ключи в ядре, соединение работает как открытое
+#define TLS_WANT_READ 1
+#define TLS_WANT_WRITE 2
+
+// Контекст по tls_cert/tls_key; главный тред, до запуска воркеров.
+// Ядро без kTLS - ошибка запуска
+int tls_init(void);
+void tls_destroy(void);
+
+extern int tls_on;
+
+static inline int tls_enabled(void) {
+    return tls_on;
+}
+
+// Очередной шаг рукопожатия принятого соединения; conn->io уже выдан.
+// -1 - рукопожатие не удалось, соединение закрывается
+int tls_handshake(connection_t *conn);
+
+// Состояние OpenSSL незавершенного рукопожатия
+void tls_connection_free(connection_io_t *io);
+
+#endif // TLS_H
@@ -0,0 +1,417 @@
+#include "trace.h"
+#include "config.h"
+#include "log.h"
+#include <errno.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+
+#define TRACE_RING_MASK (TRACE_RING_SIZE - 1)
+#define TRACE_COUNTERS 3               // Группа perf: такты, инструкции, промахи LLC
+
+typedef enum {
+    TRACE_RECORD_SPAN = 0,             // Пачка запросов соединения
+    TRACE_RECORD_BATCH,                // Пакет event loop'а
+} trace_record_kind_t;
+
+// Запись кольца. seq нечетный, пока воркер ее пишет
+typedef struct {
+    _Atomic uint64_t seq;
+    uint8_t kind;                      // trace_record_kind_t
+    uint8_t batch;                     // trace_batch_t для TRACE_RECORD_BATCH
+    uint8_t has_counters;
+    int32_t fd;
+    uint32_t items;                    // Запросов в пачке или элементов пакета
+    uint64_t bytes;
+    uint64_t stamp[TRACE_STAGES];      // Пакет: [0] - начало, [1] - конец
+    uint64_t lap[TRACE_LAPS];
+    uint64_t counters[TRACE_COUNTERS];
+} trace_record_t;
+
+typedef struct trace_worker_s {
+    _Atomic uint64_t head;             // Записей всего; пишет только воркер
+    int worker_id;
+    int perf_fd;                       // Лидер группы, -1 - без счетчиков
+    int perf_members[TRACE_COUNTERS - 1];
+    uint32_t batch_countdown[TRACE_BATCH_KINDS];
+    uint64_t batch_counters[TRACE_COUNTERS]; // Значения в начале замеряемого пакета
+    trace_record_t ring[TRACE_RING_SIZE];
+} __attribute__((aligned(CACHE_LINE_SIZE))) trace_worker_t;
+
+__thread trace_worker_t *trace_worker = NULL;
+__thread uint64_t trace_wake_tsc = 0;
+__thread uint32_t trace_countdown = 0;
+
+static trace_worker_t *trace_registry;
+static int trace_worker_count;
+static volatile sig_atomic_t dump_requested = 0;
+
+// Пара отметок для перевода TSC в наносекунды. Частота считается при
+// выгрузке по интервалу от trace_init - без калибровки на старте
+static uint64_t origin_tsc;
+static uint64_t origin_ns;
+
+static const char *batch_names[TRACE_BATCH_KINDS] = {
+    [TRACE_BATCH_READ] = "read_batch",
+    [TRACE_BATCH_WRITE] = "write_batch",
+    [TRACE_BATCH_URING] = "uring_batch",
+};
+
+static uint64_t monotonic_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+int trace_init(int workers) {
+    if (g_config.trace_sample == 0) {
+        return 0;
+    }
+    size_t size = ALIGN_TO_CACHE_LINE(sizeof(trace_worker_t) * workers);
+    trace_registry = aligned_alloc(CACHE_LINE_SIZE, size);
+    if (!trace_registry) {
+        return -1;
+    }
+    memset(trace_registry, 0, size);
+    for (int i = 0; i < workers; ++i) {
+        trace_registry[i].perf_fd = -1;
+        for (int j = 0; j < TRACE_COUNTERS - 1; ++j) {
+            trace_registry[i].perf_members[j] = -1;
+        }
+    }
+    trace_worker_count = workers;
+    origin_ns = monotonic_ns();
+    origin_tsc = trace_now();
+    printf("Tracing 1 of %d request batches, SIGUSR2 writes %s\n",
+           g_config.trace_sample, g_config.trace_file);
+    return 0;
+}
+
+static void close_counters(trace_worker_t *w) {
+    for (int j = 0; j < TRACE_COUNTERS - 1; ++j) {
+        if (w->perf_members[j] != -1) {
+            close(w->perf_members[j]);
+            w->perf_members[j] = -1;
+        }
+    }
+    if (w->perf_fd != -1) {
+        close(w->perf_fd);
+        w->perf_fd = -1;
+    }
+}
+
+void trace_destroy(void) {
+    for (int i = 0; i < trace_worker_count; ++i) {
+        close_counters(&trace_registry[i]);
+    }
+    free(trace_registry);
+    trace_registry = NULL;
+    trace_worker_count = 0;
+}
+
+static int perf_open(uint64_t config, int group_fd, int exclude_kernel) {
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.config = config;
+    attr.read_format = PERF_FORMAT_GROUP;
+    attr.exclude_kernel = exclude_kernel;
+    attr.exclude_hv = 1;
+    // Только текущий тред, на любом CPU
+    return (int)syscall(SYS_perf_event_open, &attr, 0, -1, group_fd, 0);
+}
+
+// Группа счетчиков треда воркера. Без CAP_PERFMON при perf_event_paranoid
+// >= 2 ядро разрешает только пользовательский режим
+static void open_counters(trace_worker_t *w) {
+    static const uint64_t events[TRACE_COUNTERS] = {
+        PERF_COUNT_HW_CPU_CYCLES,
+        PERF_COUNT_HW_INSTRUCTIONS,
+        PERF_COUNT_HW_CACHE_MISSES,
+    };
+    int exclude_kernel = 0;
+    int fd = perf_open(events[0], -1, exclude_kernel);
+    if (fd == -1 && (errno == EACCES || errno == EPERM)) {
+        exclude_kernel = 1;
+        fd = perf_open(events[0], -1, exclude_kernel);
+    }
+    if (fd == -1) {
+        log_warn("event=trace_counters worker=%d status=unavailable "
+                 "detail=\"perf_event_open: %s, batches are timed without counters\"",
+                 w->worker_id, strerror(errno));
+        return;
+    }
+    w->perf_fd = fd;
+    for (int j = 0; j < TRACE_COUNTERS - 1; ++j) {
+        w->perf_members[j] = perf_open(events[j + 1], fd, exclude_kernel);
+        if (w->perf_members[j] == -1) {
+            log_warn("event=trace_counters worker=%d status=unavailable "
+                     "detail=\"perf_event_open: %s, batches are timed without counters\"",
+                     w->worker_id, strerror(errno));
+            close_counters(w);
+            return;
+        }
+    }
+}
+
+void trace_register_worker(int worker_id) {
+    if (!trace_registry) {
+        return;
+    }
+    // Повторная регистрация (io_uring -> epoll fallback) отдает тот же блок
+    trace_worker_t *w = &trace_registry[(worker_id - 1) % trace_worker_count];
+    if (w->worker_id == 0) {
+        w->worker_id = worker_id;
+        for (int k = 0; k < TRACE_BATCH_KINDS; ++k) {
+            w->batch_countdown[k] = (uint32_t)CONFIG_LIVE_GET(trace_sample);
+        }
+        open_counters(w);
+    }
+    trace_countdown = (uint32_t)CONFIG_LIVE_GET(trace_sample);
+    trace_worker = w;
+}
+
+uint32_t trace_sample_next(void) {
+    return (uint32_t)CONFIG_LIVE_GET(trace_sample);
+}
+
+// Следующая запись кольца: нечетный seq до trace_record_publish
+static trace_record_t *trace_record_begin(trace_worker_t *w) {
+    uint64_t head = atomic_load_explicit(&w->head, memory_order_relaxed);
+    trace_record_t *r = &w->ring[head & TRACE_RING_MASK];
+    uint64_t seq = atomic_load_explicit(&r->seq, memory_order_relaxed);
+    atomic_store_explicit(&r->seq, seq + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    return r;
+}
+
+static void trace_record_publish(trace_worker_t *w, trace_record_t *r) {
+    uint64_t seq = atomic_load_explicit(&r->seq, memory_order_relaxed);
+    atomic_store_explicit(&r->seq, seq + 1, memory_order_release);
+    uint64_t head = atomic_load_explicit(&w->head, memory_order_relaxed);
+    atomic_store_explicit(&w->head, head + 1, memory_order_release);
+}
+
+void trace_commit(trace_span_t *span, int fd, int requests, uint64_t bytes) {
+    span->stamp[TRACE_SENT] = trace_now();
+    span->active = 0;
+
+    trace_worker_t *w = trace_worker;
+    trace_record_t *r = trace_record_begin(w);
+    r->kind = TRACE_RECORD_SPAN;
+    r->has_counters = 0;
+    r->fd = fd;
+    r->items = (uint32_t)requests;
+    r->bytes = bytes;
+    memcpy(r->stamp, span->stamp, sizeof(r->stamp));
+    memcpy(r->lap, span->lap, sizeof(r->lap));
+    trace_record_publish(w, r);
+}
+
+// Значения группы: nr, затем счетчики в порядке открытия
+static int read_counters(trace_worker_t *w, uint64_t *values) {
+    uint64_t buf[1 + TRACE_COUNTERS];
+    if (read(w->perf_fd, buf, sizeof(buf)) != (ssize_t)sizeof(buf) || buf[0] != TRACE_COUNTERS) {
+        return -1;
+    }
+    memcpy(values, buf + 1, sizeof(uint64_t) * TRACE_COUNTERS);
+    return 0;
+}
+
+uint64_t trace_batch_start(trace_batch_t kind) {
+    trace_worker_t *w = trace_worker;
+    if (--w->batch_countdown[kind] != 0) {
+        return 0;
+    }
+    w->batch_countdown[kind] = (uint32_t)CONFIG_LIVE_GET(trace_sample);
+    if (w->perf_fd != -1 && read_counters(w, w->batch_counters) != 0) {
+        w->batch_counters[0] = UINT64_MAX; // Пакет без счетчиков
+    }
+    return trace_now();
+}
+
+void trace_batch_finish(uint64_t start, trace_batch_t kind, int items) {
+    if (items <= 0) {
+        return; // Пустое пробуждение - в трассе только шум
+    }
+    uint64_t end = trace_now();
+    trace_worker_t *w = trace_worker;
+    uint64_t counters[TRACE_COUNTERS];
+    int has_counters = w->perf_fd != -1 && w->batch_counters[0] != UINT64_MAX &&
+                       read_counters(w, counters) == 0;
+
+    trace_record_t *r = trace_record_begin(w);
+    r->kind = TRACE_RECORD_BATCH;
+    r->batch = (uint8_t)kind;
+    r->has_counters = (uint8_t)has_counters;
+    r->fd = -1;
+    r->items = (uint32_t)items;
+    r->bytes = 0;
+    r->stamp[0] = start;
+    r->stamp[1] = end;
+    if (has_counters) {
+        for (int j = 0; j < TRACE_COUNTERS; ++j) {
+            r->counters[j] = counters[j] - w->batch_counters[j];
+        }
+    }
+    trace_record_publish(w, r);
+}
+
+void trace_request_dump(void) {
+    dump_requested = 1;
+}
+
+// Копия записи; -1 - воркер пишет ее прямо сейчас
+static int trace_record_read(trace_record_t *r, trace_record_t *out) {
+    uint64_t seq = atomic_load_explicit(&r->seq, memory_order_acquire);
+    if (seq & 1) {
+        return -1;
+    }
+    memcpy((char *)out + sizeof(out->seq), (char *)r + sizeof(r->seq),
+           sizeof(*r) - sizeof(r->seq));
+    atomic_thread_fence(memory_order_acquire);
+    return atomic_load_explicit(&r->seq, memory_order_relaxed) == seq ? 0 : -1;
+}
+
+typedef struct {
+    FILE *out;
+    int tid;
+    double ns_per_tick;
+    int first;
+} trace_writer_t;
+
+static double to_us(const trace_writer_t *tw, uint64_t tsc) {
+    return (double)(int64_t)(tsc - origin_tsc) * tw->ns_per_tick / 1000.0;
+}
+
+// Событие "X" от from до to; пропускается, если отметок нет
+static void write_span(trace_writer_t *tw, const char *name, uint64_t from, uint64_t to,
+                       const char *args) {
+    if (from == 0 || to < from) {
+        return;
+    }
+    fprintf(tw->out, "%s\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,"
+            "\"ts\":%.3f,\"dur\":%.3f%s%s%s}",
+            tw->first ? "" : ",", name, tw->tid, to_us(tw, from),
+            (double)(to - from) * tw->ns_per_tick / 1000.0,
+            args ? ",\"args\":{" : "", args ? args : "", args ? "}" : "");
+    tw->first = 0;
+}
+
+// Пачка сверху, этапы - вложенными событиями. Разбор и обработчик -
+// суммы по запросам, поэтому выложены подряд от начала разбора
+static void write_request(trace_writer_t *tw, const trace_record_t *r) {
+    const uint64_t *s = r->stamp;
+    char args[128];
+    snprintf(args, sizeof(args), "\"fd\":%d,\"requests\":%u,\"bytes\":%llu",
+             r->fd, r->items, (unsigned long long)r->bytes);
+    uint64_t begin = s[TRACE_WAKE] != 0 ? s[TRACE_WAKE] : s[TRACE_READ];
+    write_span(tw, "request", begin, s[TRACE_SENT], args);
+    write_span(tw, "batch_wait", s[TRACE_WAKE], s[TRACE_READ], NULL);
+    write_span(tw, "read", s[TRACE_READ], s[TRACE_PARSE], NULL);
+    write_span(tw, "process", s[TRACE_PARSE], s[TRACE_PREPARED], NULL);
+    if (s[TRACE_PARSE] != 0) {
+        uint64_t parse_end = s[TRACE_PARSE] + r->lap[TRACE_LAP_PARSE];
+        write_span(tw, "parse", s[TRACE_PARSE], parse_end, NULL);
+        write_span(tw, "handler", parse_end, parse_end + r->lap[TRACE_LAP_HANDLER], NULL);
+    }
+    write_span(tw, "queued", s[TRACE_PREPARED], s[TRACE_SEND], NULL);
+    uint64_t sent_from = s[TRACE_SEND] != 0 ? s[TRACE_SEND] : s[TRACE_PREPARED];
+    write_span(tw, "write", sent_from, s[TRACE_SENT], NULL);
+}
+
+static void write_batch(trace_writer_t *tw, const trace_record_t *r) {
+    char args[192];
+    if (r->has_counters) {
+        double ipc = r->counters[0] ? (double)r->counters[1] / (double)r->counters[0] : 0.0;
+        snprintf(args, sizeof(args),
+                 "\"items\":%u,\"cycles\":%llu,\"instructions\":%llu,\"llc_misses\":%llu,"
+                 "\"ipc\":%.2f",
+                 r->items, (unsigned long long)r->counters[0],
+                 (unsigned long long)r->counters[1], (unsigned long long)r->counters[2], ipc);
+    } else {
+        snprintf(args, sizeof(args), "\"items\":%u", r->items);
+    }
+    write_span(tw, batch_names[r->batch % TRACE_BATCH_KINDS], r->stamp[0], r->stamp[1], args);
+}
+
+static int trace_dump(const char *path) {
+    char tmp[CONFIG_PATH_MAX + 8];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    FILE *out = fopen(tmp, "w");
+    if (!out) {
+        fprintf(stderr, "Trace: %s: %s\n", tmp, strerror(errno));
+        return -1;
+    }
+
+    uint64_t now_ns = monotonic_ns();
+    uint64_t now_tsc = trace_now();
+    trace_writer_t tw = {
+        .out = out,
+        .ns_per_tick = now_tsc > origin_tsc
+                       ? (double)(now_ns - origin_ns) / (double)(now_tsc - origin_tsc) : 1.0,
+        .first = 1,
+    };
+
+    size_t records = 0, torn = 0;
+    fputs("{\"displayTimeUnit\":\"ns\",\"traceEvents\":[", out);
+    for (int i = 0; i < trace_worker_count; ++i) {
+        trace_worker_t *w = &trace_registry[i];
+        if (w->worker_id == 0) {
+            continue;
+        }
+        tw.tid = w->worker_id;
+        fprintf(out, "%s\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,"
+                "\"args\":{\"name\":\"worker %d\"}}", tw.first ? "" : ",", tw.tid, tw.tid);
+        tw.first = 0;
+
+        uint64_t head = atomic_load_explicit(&w->head, memory_order_acquire);
+        uint64_t from = head > TRACE_RING_SIZE ? head - TRACE_RING_SIZE : 0;
+        for (uint64_t n = from; n < head; ++n) {
+            trace_record_t r;
+            if (trace_record_read(&w->ring[n & TRACE_RING_MASK], &r) != 0) {
+                torn++;
+                continue;
+            }
+            if (r.kind == TRACE_RECORD_SPAN) {
+                write_request(&tw, &r);
+            } else {
+                write_batch(&tw, &r);
+            }
+            records++;
+        }
+    }
+    fputs("\n]}\n", out);
+
+    if (ferror(out) | fclose(out)) {
+        fprintf(stderr, "Trace: failed to write %s\n", tmp);
+        unlink(tmp);
+        return -1;
+    }
+    if (rename(tmp, path) != 0) {
+        fprintf(stderr, "Trace: rename to %s: %s\n", path, strerror(errno));
+        unlink(tmp);
+        return -1;
+    }
+    printf("Trace: %zu records written to %s (%zu skipped while being written)\n",
+           records, path, torn);
+    return 0;
+}
+
+int trace_dump_pending(void) {
+    if (!dump_requested) {
+        return 0;
+    }
+    dump_requested = 0;
+    if (!trace_registry) {
+        fprintf(stderr, "Trace: tracing is off (set trace_sample)\n");
+        return 0;
+    }
+    return trace_dump(g_config.trace_file) == 0;
+}
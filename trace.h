@@ -0,0 +1,170 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>
+#include <time.h>
+#include "simd_utils.h"
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+// Выборочная трассировка конвейера запроса (trace_sample = N, 0 - выключено).
+// Каждая N-я пачка запросов соединения получает отметки TSC на этапах:
+// пробуждение воркера, чтение, разбор, ответы собраны, первая и последняя
+// отправка. Каждый N-й пакет чтения/записи event loop'а замеряется
+// целиком, вместе со счетчиками perf_event_open (такты, инструкции,
+// промахи LLC), если ядро их дает.
+//
+// Записи ложатся в кольцо воркера, старые перезаписываются. По SIGUSR2
+// главный тред выгружает кольца в trace_file в формате Chrome trace
+// (chrome://tracing, Perfetto). Воркер кольцо не блокирует: запись
+// защищена seqlock'ом, недописанная при выгрузке пропускается
+
+#define TRACE_RING_SIZE 4096           // Записей в кольце воркера (степень двойки)
+
+typedef enum {
+    TRACE_WAKE = 0,                    // Возврат из epoll_wait/io_uring_enter
+    TRACE_READ,                        // Начало чтения, завершившего пачку
+    TRACE_PARSE,                       // Начало разбора пачки
+    TRACE_PREPARED,                    // Ответы пачки собраны
+    TRACE_SEND,                        // Первая отправка пачки
+    TRACE_SENT,                        // Последний байт отдан ядру
+    TRACE_STAGES
+} trace_stage_t;
+
+// Суммы по запросам пачки
+typedef enum {
+    TRACE_LAP_PARSE = 0,
+    TRACE_LAP_HANDLER,
+    TRACE_LAPS
+} trace_lap_t;
+
+typedef enum {
+    TRACE_BATCH_READ = 0,              // process_read_batch
+    TRACE_BATCH_WRITE,                 // process_write_batch
+    TRACE_BATCH_URING,                 // Разбор CQE за одно пробуждение
+    TRACE_BATCH_KINDS
+} trace_batch_t;
+
+// Отметки пачки соединения; живет в connection_io_t
+typedef struct {
+    uint64_t stamp[TRACE_STAGES];
+    uint64_t lap[TRACE_LAPS];
+    uint8_t active;                    // Пачка попала в выборку
+} trace_span_t;
+
+struct trace_worker_s;
+
+// Состояние трассировки воркера; NULL - трассировка выключена
+extern __thread struct trace_worker_s *trace_worker;
+extern __thread uint64_t trace_wake_tsc;
+extern __thread uint32_t trace_countdown;
+
+// Главный тред, до запуска воркеров. 0 - успех (и при trace_sample = 0)
+int trace_init(int workers);
+
+// После остановки воркеров
+void trace_destroy(void);
+
+// Кольцо и счетчики текущего треда (worker_id от 1); повторный вызов
+// ничего не меняет
+void trace_register_worker(int worker_id);
+
+// Асинхронно-безопасна: выгрузку выполнит trace_dump_pending
+void trace_request_dump(void);
+
+// Главный тред: выгружает кольца, если выгрузку запросили. 1 - выгружено
+int trace_dump_pending(void);
+
+// Вызываются только из inline-функций ниже
+uint32_t trace_sample_next(void);
+void trace_commit(trace_span_t *span, int fd, int requests, uint64_t bytes);
+uint64_t trace_batch_start(trace_batch_t kind);
+void trace_batch_finish(uint64_t start, trace_batch_t kind, int items);
+
+// Без lfence: отметки этапов нужны с точностью до десятков тактов
+static inline uint64_t trace_now(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+#endif
+}
+
+// Сразу после возврата из ожидания событий
+static inline void trace_wake(void) {
+    if (UNLIKELY(trace_worker != NULL)) {
+        trace_wake_tsc = trace_now();
+    }
+}
+
+// Начало чтения в соединение. Пачка, уже попавшая в выборку, получает
+// новые отметки: запрос мог прийти несколькими чтениями
+static inline void trace_read(trace_span_t *span) {
+    if (LIKELY(trace_worker == NULL)) {
+        return;
+    }
+    if (!span->active) {
+        if (--trace_countdown != 0) {
+            return;
+        }
+        trace_countdown = trace_sample_next();
+        *span = (trace_span_t){ .active = 1 };
+    }
+    span->stamp[TRACE_WAKE] = trace_wake_tsc;
+    span->stamp[TRACE_READ] = trace_now();
+}
+
+static inline void trace_stamp(trace_span_t *span, trace_stage_t stage) {
+    if (UNLIKELY(span->active)) {
+        span->stamp[stage] = trace_now();
+    }
+}
+
+// Для этапов, которые повторяются (частичная запись): первая отметка
+static inline void trace_stamp_once(trace_span_t *span, trace_stage_t stage) {
+    if (UNLIKELY(span->active) && span->stamp[stage] == 0) {
+        span->stamp[stage] = trace_now();
+    }
+}
+
+// Начало отрезка, который суммируется в lap; 0 - пачка не в выборке
+static inline uint64_t trace_lap_start(const trace_span_t *span) {
+    return UNLIKELY(span->active) ? trace_now() : 0;
+}
+
+// Конец отрезка; возвращает начало следующего
+static inline uint64_t trace_lap_end(trace_span_t *span, trace_lap_t lap, uint64_t start) {
+    if (LIKELY(start == 0)) {
+        return 0;
+    }
+    uint64_t now = trace_now();
+    span->lap[lap] += now - start;
+    return now;
+}
+
+// Ответы пачки отправлены: запись в кольцо воркера
+static inline void trace_sent(trace_span_t *span, int fd, int requests, uint64_t bytes) {
+    if (UNLIKELY(span->active)) {
+        trace_commit(span, fd, requests, bytes);
+    }
+}
+
+// Замер пакета event loop'а; 0 - пакет не в выборке. Выборка своя у
+// каждого вида: пакеты чтения и записи чередуются
+static inline uint64_t trace_batch_begin(trace_batch_t kind) {
+    if (LIKELY(trace_worker == NULL)) {
+        return 0;
+    }
+    return trace_batch_start(kind);
+}
+
+static inline void trace_batch_end(uint64_t start, trace_batch_t kind, int items) {
+    if (UNLIKELY(start != 0)) {
+        trace_batch_finish(start, kind, items);
+    }
+}
+
+#endif // TRACE_H
@@ -0,0 +1,276 @@
+#include "upgrade.h"
+#include "config.h"
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+
+#define UPGRADE_MAGIC 0x42464655u    // "UFFB"
+#define UPGRADE_FDS_PER_MSG 64       // Ядро принимает до 253 fd в одном сообщении
+#define UPGRADE_TIMEOUT_MS 10000     // Срок каждого шага обмена
+#define UPGRADE_ACK 'A'
+
+// Сообщение со слушающими сокетами [first, first + count) из total
+typedef struct {
+    uint32_t magic;
+    uint16_t total;
+    uint16_t first;
+    uint16_t count;
+    uint16_t port;
+} upgrade_msg_t;
+
+volatile sig_atomic_t g_draining = 0;
+
+static int listen_fd = -1;           // Свой сокет обновления на пути upgrade_socket
+static int previous_fd = -1;         // Соединение со старым процессом до подтверждения
+
+static void upgrade_address(struct sockaddr_un *addr) {
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    // Длина пути проверена config_set
+    memcpy(addr->sun_path, g_config.upgrade_socket, strlen(g_config.upgrade_socket) + 1);
+}
+
+static void set_timeouts(int fd) {
+    struct timeval tv = {
+        .tv_sec = UPGRADE_TIMEOUT_MS / 1000,
+        .tv_usec = (UPGRADE_TIMEOUT_MS % 1000) * 1000,
+    };
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+}
+
+// Полученный сокет должен слушать порт этого процесса
+static int check_listener(int fd) {
+    struct sockaddr_in addr;
+    socklen_t len = sizeof(addr);
+    int listening = 0;
+    socklen_t optlen = sizeof(listening);
+    if (getsockname(fd, (struct sockaddr *)&addr, &len) != 0 || addr.sin_family != AF_INET ||
+        getsockopt(fd, SOL_SOCKET, SO_ACCEPTCONN, &listening, &optlen) != 0 || !listening) {
+        return -1;
+    }
+    return ntohs(addr.sin_port) == g_config.port ? 0 : -1;
+}
+
+static int receive_listeners(int fd, int *fds, int max) {
+    int received = 0;
+    int total = -1;
+
+    while (total < 0 || received < total) {
+        upgrade_msg_t msg;
+        union {
+            struct cmsghdr hdr;
+            char buf[CMSG_SPACE(sizeof(int) * UPGRADE_FDS_PER_MSG)];
+        } control;
+        struct iovec iov = { .iov_base = &msg, .iov_len = sizeof(msg) };
+        struct msghdr mh = {
+            .msg_iov = &iov,
+            .msg_iovlen = 1,
+            .msg_control = control.buf,
+            .msg_controllen = sizeof(control.buf),
+        };
+
+        ssize_t n = recvmsg(fd, &mh, MSG_CMSG_CLOEXEC);
+        if (n != (ssize_t)sizeof(msg) || msg.magic != UPGRADE_MAGIC) {
+            fprintf(stderr, "Upgrade: bad message from the previous process%s%s\n",
+                    n < 0 ? ": " : "", n < 0 ? strerror(errno) : "");
+            goto fail;
+        }
+
+        // Дескрипторы сообщения принимаются до проверок, чтобы не утекли
+        int got = 0;
+        int batch[UPGRADE_FDS_PER_MSG];
+        for (struct cmsghdr *c = CMSG_FIRSTHDR(&mh); c; c = CMSG_NXTHDR(&mh, c)) {
+            if (c->cmsg_level == SOL_SOCKET && c->cmsg_type == SCM_RIGHTS) {
+                got = (int)((c->cmsg_len - CMSG_LEN(0)) / sizeof(int));
+                memcpy(batch, CMSG_DATA(c), sizeof(int) * got);
+            }
+        }
+        const char *bad = NULL;
+        if ((mh.msg_flags & MSG_CTRUNC) || got != msg.count || msg.first != received ||
+            (total >= 0 && msg.total != total)) {
+            bad = "malformed handoff message";
+        } else if (msg.port != g_config.port) {
+            bad = "the previous process listens on another port";
+        } else if (msg.total > max) {
+            bad = "the previous process has more workers (the worker count may only grow)";
+        }
+        for (int i = 0; i < got; ++i) {
+            if (!bad && check_listener(batch[i]) != 0) {
+                bad = "not a listening socket for this port";
+            }
+            if (!bad) {
+                fds[received++] = batch[i];
+            } else {
+                close(batch[i]);
+            }
+        }
+        if (bad) {
+            fprintf(stderr, "Upgrade: %s\n", bad);
+            goto fail;
+        }
+        total = msg.total;
+    }
+    return received;
+
+fail:
+    for (int i = 0; i < received; ++i) {
+        close(fds[i]);
+    }
+    return -1;
+}
+
+int upgrade_adopt_listeners(int *fds, int max) {
+    if (g_config.upgrade_socket[0] == '\0') {
+        return 0;
+    }
+
+    struct sockaddr_un addr;
+    upgrade_address(&addr);
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd == -1) {
+        perror("socket(AF_UNIX)");
+        return -1;
+    }
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+        int err = errno;
+        close(fd);
+        if (err == ENOENT || err == ECONNREFUSED) {
+            return 0; // Старого процесса нет - обычный запуск
+        }
+        fprintf(stderr, "Upgrade: connect %s: %s\n", g_config.upgrade_socket, strerror(err));
+        return -1;
+    }
+    set_timeouts(fd);
+
+    int count = receive_listeners(fd, fds, max);
+    if (count < 0) {
+        close(fd); // Старый процесс увидит разрыв и продолжит принимать
+        return -1;
+    }
+    previous_fd = fd;
+    printf("Upgrade: took over %d listening sockets from the previous process\n", count);
+    return count;
+}
+
+int upgrade_listen(void) {
+    if (g_config.upgrade_socket[0] == '\0') {
+        return -1;
+    }
+
+    if (previous_fd != -1) {
+        char ack = UPGRADE_ACK;
+        if (send(previous_fd, &ack, 1, MSG_NOSIGNAL) != 1) {
+            // Сокеты уже общие: старый процесс всего лишь продолжит принимать
+            fprintf(stderr, "Upgrade: failed to confirm to the previous process: %s\n",
+                    strerror(errno));
+        }
+        close(previous_fd);
+        previous_fd = -1;
+    }
+
+    struct sockaddr_un addr;
+    upgrade_address(&addr);
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd == -1) {
+        perror("socket(AF_UNIX)");
+        return -1;
+    }
+    // Путь прежнего процесса или оставшийся от аварийного завершения
+    unlink(g_config.upgrade_socket);
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 || listen(fd, 1) != 0) {
+        fprintf(stderr, "Upgrade: listen %s: %s (binary upgrade unavailable)\n",
+                g_config.upgrade_socket, strerror(errno));
+        close(fd);
+        return -1;
+    }
+    listen_fd = fd;
+    return fd;
+}
+
+static int send_listeners(int fd, const int *fds, int count) {
+    for (int first = 0; first < count; first += UPGRADE_FDS_PER_MSG) {
+        int n = count - first < UPGRADE_FDS_PER_MSG ? count - first : UPGRADE_FDS_PER_MSG;
+        upgrade_msg_t msg = {
+            .magic = UPGRADE_MAGIC,
+            .total = (uint16_t)count,
+            .first = (uint16_t)first,
+            .count = (uint16_t)n,
+            .port = (uint16_t)g_config.port,
+        };
+        union {
+            struct cmsghdr hdr;
+            char buf[CMSG_SPACE(sizeof(int) * UPGRADE_FDS_PER_MSG)];
+        } control;
+        memset(&control, 0, sizeof(control));
+        struct iovec iov = { .iov_base = &msg, .iov_len = sizeof(msg) };
+        struct msghdr mh = {
+            .msg_iov = &iov,
+            .msg_iovlen = 1,
+            .msg_control = control.buf,
+            .msg_controllen = CMSG_SPACE(sizeof(int) * n),
+        };
+        struct cmsghdr *c = CMSG_FIRSTHDR(&mh);
+        c->cmsg_level = SOL_SOCKET;
+        c->cmsg_type = SCM_RIGHTS;
+        c->cmsg_len = CMSG_LEN(sizeof(int) * n);
+        memcpy(CMSG_DATA(c), fds + first, sizeof(int) * n);
+
+        if (sendmsg(fd, &mh, MSG_NOSIGNAL) != (ssize_t)sizeof(msg)) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+int upgrade_serve(const int *fds, int count) {
+    if (listen_fd == -1) {
+        return 0;
+    }
+    int fd = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+    if (fd == -1) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+            perror("Upgrade: accept");
+        }
+        return 0;
+    }
+    set_timeouts(fd);
+
+    // Новый процесс подтверждает прием после запуска своих воркеров;
+    // до тех пор соединения принимает этот процесс
+    char ack = 0;
+    if (send_listeners(fd, fds, count) != 0) {
+        fprintf(stderr, "Upgrade: failed to pass listening sockets: %s\n", strerror(errno));
+        close(fd);
+        return 0;
+    }
+    if (recv(fd, &ack, 1, 0) != 1 || ack != UPGRADE_ACK) {
+        fprintf(stderr, "Upgrade: the new process did not start, still serving\n");
+        close(fd);
+        return 0;
+    }
+    close(fd);
+
+    // Путь upgrade_socket уже принадлежит новому процессу
+    close(listen_fd);
+    listen_fd = -1;
+    return 1;
+}
+
+void upgrade_close(void) {
+    if (previous_fd != -1) {
+        close(previous_fd);
+        previous_fd = -1;
+    }
+    if (listen_fd != -1) {
+        close(listen_fd);
+        unlink(g_config.upgrade_socket);
+        listen_fd = -1;
+    }
+}
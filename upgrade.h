@@ -0,0 +1,42 @@
+#ifndef UPGRADE_H
+#define UPGRADE_H
+
+#include <signal.h>
+
+// Плавное обновление бинаря без отказов в соединении. Новый процесс
+// инициализируется целиком (пулы, роуты, TLS), пока старый обслуживает
+// клиентов, затем подключается к upgrade_socket старого процесса и
+// получает его слушающие сокеты через SCM_RIGHTS - очередь accept ядра
+// не сбрасывается. Когда воркеры нового процесса запущены, он
+// подтверждает прием и забирает путь upgrade_socket себе, а старый
+// перестает принимать соединения и уходит в дренаж: простаивающие
+// keep-alive соединения закрываются, текущие запросы получают ответ с
+// Connection: close (HTTP/2 - GOAWAY), после последнего соединения или
+// drain_timeout_ms процесс завершается.
+//
+// Воркеров у нового процесса может быть больше, но не меньше: сокет
+// группы SO_REUSEPORT, который никто не слушает, продолжал бы получать
+// свою долю соединений
+
+// Дренаж начат: воркеры не принимают новых соединений и не держат keep-alive
+extern volatile sig_atomic_t g_draining;
+
+// Новый процесс, до запуска воркеров: слушающие сокеты старого процесса
+// в fds (не больше max). Возвращает их число, 0 - обновление выключено
+// или старого процесса нет, -1 - ошибка (старый процесс продолжает работу)
+int upgrade_adopt_listeners(int *fds, int max);
+
+// Воркеры запущены: подтверждение старому процессу (если сокеты от него)
+// и свой сокет обновления на пути upgrade_socket. Возвращает его fd для
+// ожидания в главном треде, -1 - обновление недоступно
+int upgrade_listen(void);
+
+// Сокет обновления готов: передать fds новому процессу. 1 - он подтвердил
+// прием и пора начинать дренаж, 0 - обновления не было или оно сорвалось
+int upgrade_serve(const int *fds, int count);
+
+// Завершение процесса: закрыть сокет обновления и удалить путь, если
+// он еще принадлежит этому процессу
+void upgrade_close(void);
+
+#endif // UPGRADE_H
@@ -0,0 +1,605 @@
+#include "upstream.h"
+#include "http_handler.h"
+#include "response_cache.h"
+#include "lockfree_pool.h"
+#include "metrics.h"
+#include "config.h"
+#include "log.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#define UPSTREAM_BODY_MAX (1 << 20)  // Больший ответ бэкенда считается ошибкой
+#define UPSTREAM_REQUEST_MAX 1024
+
+// Ответ одного бэкенда на запрос
+typedef struct {
+    char request[UPSTREAM_REQUEST_MAX]; // Готовый запрос к бэкенду
+    size_t request_len;
+    char *body;
+    size_t body_len;
+    size_t body_cap;
+    int ok;                      // Ответ 2xx получен целиком
+} upstream_part_t;
+
+// Запрос к бэкендам агрегирующего роута и клиенты, которые его ждут
+typedef struct upstream_flight_s {
+    int aggregate;
+    char key[URL_MAX_LEN];       // Ключ кэша: query-строка с отсортированными параметрами
+    size_t key_len;
+    int pending;                 // Части без итога
+    int starting;                // Части еще запускаются: итог подведет upstream_start
+    connection_t *waiters;       // Через io->upstream_next
+    upstream_part_t parts[CONFIG_AGGREGATE_PARTS];
+    struct upstream_flight_s *next;
+} upstream_flight_t;
+
+typedef struct {
+    const upstream_engine_t *engine;
+    timer_heap_t *timers;
+    upstream_flight_t *flights;  // Ждущие бэкендов
+    connection_t **idle;         // upstream_pool_size на бэкенд, стек
+    int idle_count[CONFIG_MAX_UPSTREAMS];
+} upstream_worker_t;
+
+static __thread upstream_worker_t *uw = NULL;
+
+static int part_start(upstream_flight_t *flight, int part, int allow_reuse);
+static void part_finish(upstream_flight_t *flight, int part, int ok);
+
+static int on_upstream_body(http_parser *p, const char *at, size_t length) {
+    connection_t *conn = p->data;
+    upstream_part_t *part = &conn->io->upstream_flight->parts[conn->io->upstream_part];
+    if (part->body_len + length > part->body_cap) {
+        size_t cap = part->body_cap ? part->body_cap * 2 : 1024;
+        while (cap < part->body_len + length) cap *= 2;
+        if (cap > UPSTREAM_BODY_MAX) {
+            return -1;
+        }
+        char *body = realloc(part->body, cap);
+        if (!body) {
+            return -1;
+        }
+        part->body = body;
+        part->body_cap = cap;
+    }
+    memcpy(part->body + part->body_len, at, length);
+    part->body_len += length;
+    return 0;
+}
+
+static int on_upstream_message_complete(http_parser *p) {
+    http_parser_pause(p, 1); // Ответ целиком: остаток буфера уже не наш
+    return 0;
+}
+
+static const http_parser_settings upstream_parser_settings = {
+    .on_body = on_upstream_body,
+    .on_message_complete = on_upstream_message_complete,
+};
+
+int upstream_worker_init(const upstream_engine_t *engine, timer_heap_t *timers) {
+    uw = calloc(1, sizeof(*uw));
+    if (!uw) {
+        return -1;
+    }
+    size_t idle_slots = (size_t)g_config.upstream_count * g_config.upstream_pool_size;
+    if (idle_slots > 0) {
+        uw->idle = calloc(idle_slots, sizeof(connection_t *));
+        if (!uw->idle) {
+            free(uw);
+            uw = NULL;
+            return -1;
+        }
+    }
+    if (g_config.aggregate_count > 0 && response_cache_init() != 0) {
+        free(uw->idle);
+        free(uw);
+        uw = NULL;
+        return -1;
+    }
+    uw->engine = engine;
+    uw->timers = timers;
+    return 0;
+}
+
+void upstream_worker_destroy(void) {
+    if (!uw) {
+        return;
+    }
+    for (int u = 0; u < g_config.upstream_count; ++u) {
+        for (int i = 0; i < uw->idle_count[u]; ++i) {
+            connection_t *conn = uw->idle[u * g_config.upstream_pool_size + i];
+            close(conn->fd);
+            lockfree_pool_release(connection_pool_handle(), conn);
+        }
+    }
+    // Незавершенные запросы остаются соединениям, закрывающимся вместе с процессом
+    while (uw->flights) {
+        upstream_flight_t *flight = uw->flights;
+        uw->flights = flight->next;
+        for (int i = 0; i < CONFIG_AGGREGATE_PARTS; ++i) {
+            free(flight->parts[i].body);
+        }
+        free(flight);
+    }
+    response_cache_destroy();
+    free(uw->idle);
+    free(uw);
+    uw = NULL;
+}
+
+static void idle_remove(connection_t *conn) {
+    int u = conn->io->upstream_id;
+    connection_t **idle = &uw->idle[u * g_config.upstream_pool_size];
+    for (int i = 0; i < uw->idle_count[u]; ++i) {
+        if (idle[i] == conn) {
+            idle[i] = idle[--uw->idle_count[u]];
+            return;
+        }
+    }
+}
+
+// Новое неблокирующее соединение к бэкенду; connected - connect завершился сразу
+static connection_t *upstream_connect(int upstream, int *connected) {
+    const config_upstream_t *up = &g_config.upstreams[upstream];
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd == -1) {
+        log_errno("upstream %s: socket", up->name);
+        return NULL;
+    }
+    int flag = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &flag, sizeof(flag));
+
+    struct sockaddr_in addr = {
+        .sin_family = AF_INET,
+        .sin_port = up->port,
+        .sin_addr.s_addr = up->addr,
+    };
+    *connected = connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0;
+    if (!*connected && errno != EINPROGRESS) {
+        LOG_AT(LOG_WARN, errno, "upstream %s: connect", up->name);
+        close(fd);
+        return NULL;
+    }
+
+    connection_t *conn = lockfree_pool_get(connection_pool_handle());
+    if (!conn) {
+        close(fd);
+        return NULL;
+    }
+    conn->fd = fd;
+    conn->role = CONN_ROLE_UPSTREAM;
+    conn->peer_addr = up->addr;
+    conn->peer_port = up->port;
+    if (connection_io_acquire(conn) != 0) {
+        close(fd);
+        lockfree_pool_release(connection_pool_handle(), conn);
+        return NULL;
+    }
+    conn->io->upstream_id = (int16_t)upstream;
+    if (worker_metrics) {
+        metric_add(&worker_metrics->upstream_connections, 1);
+    }
+    return conn;
+}
+
+// Соединение больше не выполняет запрос части
+static void conn_detach(connection_t *conn) {
+    conn->io->upstream_flight = NULL;
+    timer_heap_remove(uw->timers, conn);
+}
+
+// Запрос не удался. Переиспользованное соединение, не отдавшее ни байта,
+// скорее всего закрыто бэкендом по простою - пробуем один раз в новом
+static void conn_fail(connection_t *conn) {
+    upstream_flight_t *flight = conn->io->upstream_flight;
+    int part = conn->io->upstream_part;
+    int retry = conn->io->upstream_reused;
+
+    conn_detach(conn);
+    uw->engine->close(conn);
+    if (retry && part_start(flight, part, 0) == 0) {
+        return;
+    }
+    part_finish(flight, part, 0);
+}
+
+// Ответ получен: соединение уходит в простой или закрывается
+static void conn_complete(connection_t *conn) {
+    upstream_flight_t *flight = conn->io->upstream_flight;
+    int part = conn->io->upstream_part;
+    http_parser *p = &conn->io->parser;
+    int ok = p->status_code >= 200 && p->status_code < 300 && flight->parts[part].body_len > 0;
+    int u = conn->io->upstream_id;
+
+    conn_detach(conn);
+    if (http_should_keep_alive(p) && uw->idle_count[u] < g_config.upstream_pool_size) {
+        uw->idle[u * g_config.upstream_pool_size + uw->idle_count[u]++] = conn;
+        conn->state = STATE_KEEP_ALIVE;
+        uw->engine->watch(conn, 0); // Закрытие бэкендом заметим по готовности к чтению
+    } else {
+        uw->engine->close(conn);
+    }
+    part_finish(flight, part, ok);
+}
+
+static void conn_recv(connection_t *conn) {
+    connection_io_t *io = conn->io;
+    for (;;) {
+        ssize_t n = recv(conn->fd, io->read_buf, BUFFER_SIZE, 0);
+        if (n < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                uw->engine->watch(conn, 0);
+                return;
+            }
+            if (errno == EINTR) continue;
+            conn_fail(conn);
+            return;
+        }
+        if (n > 0) {
+            io->upstream_reused = 0; // Бэкенд ответил - повтор уже небезопасен
+        }
+
+        // n == 0 завершает ответ без Content-Length (до закрытия соединения)
+        size_t parsed = http_parser_execute(&io->parser, &upstream_parser_settings,
+                                            io->read_buf, (size_t)n);
+        enum http_errno err = (enum http_errno)io->parser.http_errno;
+        if (err == HPE_PAUSED) {
+            if (parsed < (size_t)n) {
+                io->parser.http_errno = HPE_OK; // Лишние байты после ответа:
+                conn_fail(conn);                // соединение рассинхронизировано
+                return;
+            }
+            conn_complete(conn);
+            return;
+        }
+        if (err != HPE_OK || n == 0) {
+            conn_fail(conn);
+            return;
+        }
+    }
+}
+
+static void conn_send(connection_t *conn) {
+    connection_io_t *io = conn->io;
+    const upstream_part_t *part = &io->upstream_flight->parts[io->upstream_part];
+    while (io->bytes_sent < part->request_len) {
+        ssize_t n = send(conn->fd, part->request + io->bytes_sent,
+                         part->request_len - io->bytes_sent, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                uw->engine->watch(conn, 1); // В том числе завершения connect
+                return;
+            }
+            if (errno == EINTR) continue;
+            conn_fail(conn);
+            return;
+        }
+        io->bytes_sent += n;
+    }
+
+    conn->state = STATE_READING;
+    http_parser_init(&io->parser, HTTP_RESPONSE);
+    io->parser.data = conn;
+    conn_recv(conn);
+}
+
+// Запрос части в простаивающее или новое соединение. -1 - запрос не ушел
+static int part_start(upstream_flight_t *flight, int part, int allow_reuse) {
+    const config_aggregate_part_t *cfg = &g_config.aggregates[flight->aggregate].parts[part];
+    connection_t *conn = NULL;
+    int connected = 1;
+    int reused = 0;
+
+    int u = cfg->upstream;
+    if (allow_reuse && uw->idle_count[u] > 0) {
+        conn = uw->idle[u * g_config.upstream_pool_size + --uw->idle_count[u]];
+        reused = 1;
+    } else {
+        conn = upstream_connect(u, &connected);
+        if (!conn) {
+            return -1;
+        }
+    }
+
+    connection_io_t *io = conn->io;
+    io->upstream_flight = flight;
+    io->upstream_part = (int8_t)part;
+    io->upstream_reused = (uint8_t)reused;
+    io->bytes_sent = 0;
+    conn->state = STATE_WRITING;
+    if (worker_metrics) {
+        metric_add(&worker_metrics->upstream_requests, 1);
+    }
+    // Срок ответа бэкенда - от отправки запроса, включая connect
+    timer_heap_add(uw->timers, conn, g_config.upstreams[u].timeout_ms);
+
+    if (connected) {
+        conn_send(conn);
+    } else {
+        uw->engine->watch(conn, 1);
+    }
+    return 0;
+}
+
+// Объединенный JSON; NULL - ни один бэкенд не ответил (или нет памяти).
+// complete - ответили все части
+static char *flight_merge(upstream_flight_t *flight, size_t *len, int *complete) {
+    const config_aggregate_t *agg = &g_config.aggregates[flight->aggregate];
+    size_t size = 2;
+    int any_ok = 0;
+    *complete = 1;
+    for (int i = 0; i < agg->part_count; ++i) {
+        const upstream_part_t *part = &flight->parts[i];
+        size += strlen(agg->parts[i].key) + 4 + (part->ok ? part->body_len : 4);
+        any_ok |= part->ok;
+        *complete &= part->ok;
+    }
+    if (!any_ok) {
+        return NULL;
+    }
+
+    char *body = malloc(size);
+    if (!body) {
+        return NULL;
+    }
+    char *p = body;
+    *p++ = '{';
+    for (int i = 0; i < agg->part_count; ++i) {
+        const upstream_part_t *part = &flight->parts[i];
+        p += sprintf(p, "%s\"%s\":", i ? "," : "", agg->parts[i].key);
+        if (part->ok) {
+            memcpy(p, part->body, part->body_len);
+            p += part->body_len;
+        } else {
+            memcpy(p, "null", 4);
+            p += 4;
+        }
+    }
+    *p++ = '}';
+    *len = p - body;
+    return body;
+}
+
+static void flight_free(upstream_flight_t *flight) {
+    upstream_flight_t **link = &uw->flights;
+    while (*link && *link != flight) {
+        link = &(*link)->next;
+    }
+    if (*link) {
+        *link = flight->next;
+    }
+    for (int i = 0; i < CONFIG_AGGREGATE_PARTS; ++i) {
+        free(flight->parts[i].body);
+    }
+    free(flight);
+}
+
+static void flight_respond(connection_t *conn, response_cache_entry_t *entry,
+                           const char *body, size_t len) {
+    if (entry) {
+        response_cache_hold(entry); // Общий блоб записи вместо копии на каждого
+        http_prepare_cached_response(conn, entry);
+    } else {
+        http_prepare_upstream_response(conn, body, len);
+    }
+}
+
+// Все части с итогом: полный ответ - в кэш, ответ - клиенту, получившему
+// итог сразу (conn), и каждому ожидающему
+static void flight_complete(upstream_flight_t *flight, connection_t *conn) {
+    size_t len = 0;
+    int complete = 0;
+    char *body = NULL;
+    response_cache_entry_t *entry = NULL;
+    if (conn || flight->waiters || response_cache_enabled()) {
+        body = flight_merge(flight, &len, &complete);
+    }
+    // Ответ с null вместо части в кэш не попадает - следующий запрос повторит ее
+    if (body && complete && response_cache_enabled()) {
+        entry = response_cache_store(flight->aggregate, flight->key, flight->key_len, body, len);
+    }
+    if (conn) {
+        flight_respond(conn, entry, body, len);
+    }
+
+    // Ответ одного клиента может закрыть его соединение - список
+    // каждый раз читается заново
+    while ((conn = flight->waiters) != NULL) {
+        flight->waiters = conn->io->upstream_next;
+        conn->io->upstream_flight = NULL;
+        conn->io->upstream_next = NULL;
+        flight_respond(conn, entry, body, len);
+        uw->engine->respond(conn);
+    }
+    response_cache_put(entry);
+    free(body);
+    flight_free(flight);
+}
+
+static void part_finish(upstream_flight_t *flight, int part, int ok) {
+    upstream_part_t *p = &flight->parts[part];
+    p->ok = ok;
+    if (!ok && worker_metrics) {
+        metric_add(&worker_metrics->upstream_errors, 1);
+    }
+    if (--flight->pending == 0 && !flight->starting) {
+        flight_complete(flight, NULL);
+    }
+}
+
+// Запрос к бэкенду: путь части, query-строка клиента дополняет его query
+static int build_part_request(upstream_part_t *part, const config_aggregate_part_t *cfg,
+                              const char *query, size_t query_len) {
+    const config_upstream_t *up = &g_config.upstreams[cfg->upstream];
+    int has_query = strchr(cfg->path, '?') != NULL;
+    int len = snprintf(part->request, sizeof(part->request),
+        "GET %s%s%.*s HTTP/1.1\r\n"
+        "Host: %s:%u\r\n"
+        "Accept: application/json\r\n"
+        "%s"
+        "\r\n",
+        cfg->path, query_len > 1 && has_query ? "&" : "",
+        query_len > 1 ? (int)(query_len - has_query) : 0, query + has_query,
+        up->host, (unsigned)ntohs(up->port),
+        g_config.upstream_pool_size > 0 ? "" : "Connection: close\r\n");
+    if (len < 0 || (size_t)len >= sizeof(part->request)) {
+        return -1;
+    }
+    part->request_len = len;
+    return 0;
+}
+
+static upstream_flight_t *flight_find(int aggregate, const char *key, size_t key_len) {
+    for (upstream_flight_t *flight = uw->flights; flight; flight = flight->next) {
+        if (flight->aggregate == aggregate && flight->key_len == key_len &&
+            memcmp(flight->key, key, key_len) == 0) {
+            return flight;
+        }
+    }
+    return NULL;
+}
+
+// Новый запрос к бэкендам. Части, получившие итог сразу, его не подводят:
+// при pending == 0 это дело вызывающего. NULL - запрос не отправлен
+static upstream_flight_t *flight_start(int aggregate, const char *query, size_t query_len,
+                                       const char *key, size_t key_len) {
+    const config_aggregate_t *agg = &g_config.aggregates[aggregate];
+    upstream_flight_t *flight = calloc(1, sizeof(*flight));
+    if (!flight) {
+        return NULL;
+    }
+    flight->aggregate = aggregate;
+    memcpy(flight->key, key, key_len);
+    flight->key_len = key_len;
+    for (int i = 0; i < agg->part_count; ++i) {
+        if (build_part_request(&flight->parts[i], &agg->parts[i], query, query_len) != 0) {
+            free(flight);
+            return NULL;
+        }
+    }
+    flight->next = uw->flights;
+    uw->flights = flight;
+
+    flight->pending = agg->part_count;
+    flight->starting = 1;
+    for (int i = 0; i < agg->part_count; ++i) {
+        if (part_start(flight, i, 1) != 0) {
+            part_finish(flight, i, 0);
+        }
+    }
+    flight->starting = 0;
+    return flight;
+}
+
+int upstream_start(connection_t *conn, int aggregate) {
+    connection_io_t *io = conn->io;
+    if (UNLIKELY(!uw)) {
+        return -1;
+    }
+    const char *query = io->request_buf + io->url_off + io->path_len;
+    size_t query_len = io->url_len - io->path_len;
+    char key[URL_MAX_LEN];
+    size_t key_len = response_cache_key(query, query_len, key);
+
+    if (response_cache_enabled()) {
+        response_cache_state_t state;
+        response_cache_entry_t *entry = response_cache_lookup(aggregate, key, key_len, &state);
+        if (worker_metrics) {
+            metric_add(entry ? &worker_metrics->cache_hits : &worker_metrics->cache_misses, 1);
+        }
+        if (entry) {
+            if (state == RESPONSE_CACHE_STALE && !flight_find(aggregate, key, key_len)) {
+                // Обновление в фоне: новый ответ получат следующие запросы
+                upstream_flight_t *refresh = flight_start(aggregate, query, query_len, key, key_len);
+                if (refresh && refresh->pending == 0) {
+                    flight_complete(refresh, NULL);
+                }
+            }
+            http_prepare_cached_response(conn, entry);
+            return UPSTREAM_READY;
+        }
+    }
+
+    // Такой же запрос уже ждет бэкендов - присоединяемся к нему
+    upstream_flight_t *flight = flight_find(aggregate, key, key_len);
+    if (flight) {
+        if (worker_metrics) {
+            metric_add(&worker_metrics->upstream_coalesced, 1);
+        }
+    } else {
+        flight = flight_start(aggregate, query, query_len, key, key_len);
+        if (!flight) {
+            return -1;
+        }
+        if (flight->pending == 0) {
+            // Все части уже с итогом (отказ connect, ответ за один проход)
+            flight_complete(flight, conn);
+            return UPSTREAM_READY;
+        }
+    }
+
+    io->upstream_next = flight->waiters;
+    flight->waiters = conn;
+    io->upstream_flight = flight;
+    conn->state = STATE_UPSTREAM_WAIT;
+    return UPSTREAM_PENDING;
+}
+
+void upstream_on_event(connection_t *conn) {
+    if (conn->io->upstream_flight == NULL) {
+        // Простаивающее соединение: данные или EOF от бэкенда - закрываем
+        char byte;
+        ssize_t n = recv(conn->fd, &byte, 1, MSG_PEEK | MSG_DONTWAIT);
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            uw->engine->watch(conn, 0);
+            return;
+        }
+        uw->engine->close(conn);
+        return;
+    }
+    if (conn->state == STATE_WRITING) {
+        conn_send(conn);
+    } else {
+        conn_recv(conn);
+    }
+}
+
+void upstream_on_close(connection_t *conn) {
+    connection_io_t *io = conn->io;
+    if (!uw || !io) {
+        return;
+    }
+    upstream_flight_t *flight = io->upstream_flight;
+
+    if (conn->role == CONN_ROLE_CLIENT) {
+        // Клиент ушел, не дождавшись: запрос к бэкендам продолжается для остальных
+        if (flight) {
+            connection_t **link = &flight->waiters;
+            while (*link && *link != conn) {
+                link = &(*link)->io->upstream_next;
+            }
+            if (*link) {
+                *link = io->upstream_next;
+            }
+            io->upstream_flight = NULL;
+            io->upstream_next = NULL;
+        }
+        return;
+    }
+
+    if (!flight) {
+        idle_remove(conn);
+        return;
+    }
+    // Движок закрывает соединение посреди запроса: срок ответа истек или ошибка сокета
+    int part = io->upstream_part;
+    io->upstream_flight = NULL;
+    part_finish(flight, part, 0);
+}
@@ -0,0 +1,56 @@
+#ifndef UPSTREAM_H
+#define UPSTREAM_H
+
+#include "connection.h"
+#include "timer.h"
+
+// Агрегирующие роуты: запрос клиента расходится параллельно на несколько
+// бэкендов, их JSON-ответы собираются в один объект {"key":тело,...}.
+// Все происходит в event loop воркера: соединения к бэкендам - обычные
+// connection_t из пула с ролью CONN_ROLE_UPSTREAM, неблокирующие, со
+// своими таймерами в колесе воркера (срок ответа бэкенда).
+//
+// У воркера на каждый бэкенд - до upstream_pool_size простаивающих
+// keep-alive соединений. Если переиспользованное соединение оказалось
+// закрыто бэкендом до первого байта ответа, запрос один раз повторяется
+// в новом. Одинаковые (путь и query-строка) запросы, пришедшие, пока
+// предыдущий еще ждет бэкендов, к ним не уходят - ждут общего ответа.
+//
+// Часть, не ответившая 2xx в срок, становится null; если не ответил
+// никто - клиент получает 502
+
+// Итог upstream_start
+#define UPSTREAM_PENDING 0           // Ответ подготовит respond движка
+#define UPSTREAM_READY 1             // Все бэкенды ответили сразу: ответ уже в response_iov
+
+// Операции движка над соединениями; задает воркер при старте
+typedef struct {
+    // Однократное ожидание готовности сокета бэкенда к чтению или записи
+    void (*watch)(connection_t *conn, int writable);
+    // Ответ клиенту в response_iov готов к отправке
+    void (*respond)(connection_t *conn);
+    void (*close)(connection_t *conn);
+} upstream_engine_t;
+
+int upstream_worker_init(const upstream_engine_t *engine, timer_heap_t *timers);
+
+// Закрывает простаивающие соединения воркера
+void upstream_worker_destroy(void);
+
+// Запрос клиента к агрегирующему роуту aggregate (индекс в g_config.aggregates),
+// уже разобранный в conn->io. UPSTREAM_PENDING переводит соединение
+// в STATE_UPSTREAM_WAIT. -1 - запрос не отправлен
+int upstream_start(connection_t *conn, int aggregate);
+
+// Событие готовности сокета соединения с ролью CONN_ROLE_UPSTREAM
+void upstream_on_event(connection_t *conn);
+
+// Движок закрывает соединение: ожидающий клиент снимается с запроса,
+// запрос к бэкенду считается неудавшимся
+void upstream_on_close(connection_t *conn);
+
+static inline int upstream_involved(const connection_t *conn) {
+    return conn->role == CONN_ROLE_UPSTREAM || (conn->io && conn->io->upstream_flight);
+}
+
+#endif // UPSTREAM_H
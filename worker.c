@@ -1,27 +1,41 @@
+#ifndef _GNU_SOURCE
 #define _GNU_SOURCE
+#endif
 #include "worker.h"
+#include "worker_uring.h"
 #include "http_handler.h"
 #include "timer.h"
 #include "simd_utils.h"
 #include "lockfree_pool.h"
+#include "loop_clock.h"
+#include "metrics.h"
+#include "config.h"
+#include "routes.h"
+#include "busy_poll.h"
+#include "overload.h"
+#include "log.h"
+#include "upstream.h"
+#include "tls.h"
+#include "h2.h"
+#include "upgrade.h"
+#include "trace.h"
 #include <sys/epoll.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <errno.h>
 #include <string.h>
 #include <netinet/tcp.h>
 #include <sched.h>
+#include <signal.h>
 #include <sys/mman.h>
+#include <sys/resource.h>
+#include <linux/errqueue.h>
 
-#define MAX_EVENTS_PER_WORKER 2048
-#define REQUEST_TIMEOUT_MS 5000
-#define KEEP_ALIVE_TIMEOUT_MS 10000
-#define MAX_ACCEPTS_PER_LOOP 128
 #define MAX_REQUEST_SIZE 8192
-#define BATCH_SIZE 32
-#define IO_URING_ENTRIES 4096
 
 // Оптимизированная структура воркера с выравниванием по cache line
 typedef struct {
@@ -33,23 +47,38 @@ typedef struct {
     // Lock-free пул соединений
     lockfree_pool_t *connection_pool;
     
-    // Batch processing буферы
-    struct epoll_event event_batch[MAX_EVENTS_PER_WORKER];
-    connection_t *read_batch[BATCH_SIZE];
-    connection_t *write_batch[BATCH_SIZE];
+    // Batch processing буферы, размеры из конфигурации
+    struct epoll_event *event_batch;
+    connection_t **read_batch;
+    connection_t **write_batch;
+    int max_events;
+    int batch_capacity;
     int read_batch_size;
     int write_batch_size;
     
+    // Перевзводы EPOLLONESHOT итерации, применяются после пакетов
+    connection_t **rearm_list;
+    int rearm_capacity;
+    int rearm_count;
+    
     // Таймеры с оптимизированной кучей
     timer_heap_t timer_heap;
     
-    // Статистика производительности
-    uint64_t events_processed;
-    uint64_t connections_accepted;
-    uint64_t bytes_read;
-    uint64_t bytes_written;
-    uint64_t cache_hits;
-    uint64_t cache_misses;
+    // Счетчики воркера (пишет только он, читает /metrics)
+    worker_metrics_t *metrics;
+    
+    // Опрос перед блокирующим epoll_wait (--busy-poll-us)
+    busy_poll_t busy_poll;
+    
+    // Контроль перегрузки; accept_paused - server_fd снят с epoll
+    overload_t overload;
+    int accept_paused;
+    
+    // Дренаж после передачи слушающих сокетов новому процессу: воркер
+    // выходит, когда закрыто последнее клиентское соединение или к сроку
+    int connections;
+    int draining;
+    uint64_t drain_deadline_ms;
     
     // Padding для избежания false sharing
     char padding[64];
@@ -61,6 +90,10 @@ static __thread optimized_worker_t *current_worker = NULL;
 // Функции для batch processing
 static void process_read_batch(optimized_worker_t *worker);
 static void process_write_batch(optimized_worker_t *worker);
+static void queue_read(optimized_worker_t *worker, connection_t *conn);
+static void queue_write(optimized_worker_t *worker, connection_t *conn);
+static void rearm_later(optimized_worker_t *worker, connection_t *conn, conn_arm_t arm);
+static void flush_rearms(optimized_worker_t *worker);
 static void flush_batches(optimized_worker_t *worker);
 
 // Оптимизированные функции обработки событий
@@ -69,10 +102,28 @@ static void handle_connection_event_optimized(optimized_worker_t *worker,
                                             connection_t *conn, uint32_t events);
 static int do_read_optimized(optimized_worker_t *worker, connection_t *conn);
 static int do_write_optimized(optimized_worker_t *worker, connection_t *conn);
+static int zerocopy_complete(connection_t *conn);
+static void do_tls_handshake_optimized(optimized_worker_t *worker, connection_t *conn);
+static void close_connection_from_worker_optimized(optimized_worker_t *worker, connection_t *conn);
 
 // Функции для CPU affinity и NUMA оптимизации
 static int setup_worker_affinity(optimized_worker_t *worker);
-static void setup_memory_policy(void);
+static void setup_memory_policy(int numa_node);
+static void free_worker_batches(optimized_worker_t *worker);
+static int wait_for_events(optimized_worker_t *worker, int timeout);
+static void apply_overload_state(optimized_worker_t *worker, overload_state_t state);
+static int drain_step(optimized_worker_t *worker);
+
+// Операции над соединениями для upstream.c
+static void upstream_watch(connection_t *conn, int writable);
+static void upstream_respond(connection_t *conn);
+static void upstream_close(connection_t *conn);
+
+static const upstream_engine_t epoll_upstream_engine = {
+    .watch = upstream_watch,
+    .respond = upstream_respond,
+    .close = upstream_close,
+};
 
 void *worker_loop_optimized(void *arg) {
     worker_args_t *args = (worker_args_t*)arg;
@@ -81,61 +132,129 @@ void *worker_loop_optimized(void *arg) {
     optimized_worker_t worker = {0};
     worker.worker_id = args->worker_id;
     worker.server_fd = args->server_fd;
-    worker.cpu_id = args->worker_id % get_nprocs();
+    worker.cpu_id = args->cpu_id;
+    worker.connection_pool = connection_pool_handle();
+    worker.metrics = metrics_register_worker(worker.worker_id);
+    log_register_worker(worker.worker_id);
+    trace_register_worker(worker.worker_id);
     current_worker = &worker;
     
-    // Устанавливаем CPU affinity
+    // Устанавливаем CPU affinity. Опрос имеет смысл только у закрепленного
+    // воркера: иначе он отнимает CPU у соседей
+    busy_poll_init(&worker.busy_poll, g_config.busy_poll_us);
     if (setup_worker_affinity(&worker) != 0) {
-        fprintf(stderr, "Warning: Failed to set CPU affinity for worker %d\n", 
-                worker.worker_id);
+        log_warn("Failed to set CPU affinity for worker %d", worker.worker_id);
+        busy_poll_init(&worker.busy_poll, 0);
     }
     
     // Настраиваем NUMA memory policy
-    setup_memory_policy();
+    setup_memory_policy(args->numa_node);
+    
+    // Локальный пул соединений выделяется уже на CPU воркера
+    size_t arena_extra = sizeof(timer_node_t) * g_config.timer_capacity +
+                         sizeof(connection_io_t) * g_config.io_buffers;
+    if (lockfree_pool_bind_thread(worker.connection_pool, worker.worker_id,
+                                  arena_extra, args->numa_node) != 0) {
+        log_error("Failed to allocate connection pool for worker %d", worker.worker_id);
+        return NULL;
+    }
+    
+    // Буферы запросов - только соединениям, у которых запрос в обработке
+    if (connection_io_pool_init(g_config.io_buffers) != 0) {
+        log_error("Failed to allocate request buffers for worker %d", worker.worker_id);
+        return NULL;
+    }
     
     // Создаем epoll с оптимизированными флагами
     worker.epoll_fd = epoll_create1(EPOLL_CLOEXEC);
     if (worker.epoll_fd == -1) {
-        perror("epoll_create1");
+        log_errno("epoll_create1");
         return NULL;
     }
     
+    // Буферы пакетной обработки
+    worker.max_events = g_config.max_events;
+    worker.batch_capacity = g_config.io_batch;
+    worker.event_batch = malloc(sizeof(struct epoll_event) * worker.max_events);
+    // Перевзвод нужен соединениям событий итерации и принятым за нее
+    worker.rearm_capacity = worker.max_events + g_config.accept_batch;
+    worker.read_batch = malloc(sizeof(connection_t*) *
+                               (worker.batch_capacity * 2 + worker.rearm_capacity));
+    if (!worker.event_batch || !worker.read_batch) {
+        log_errno("malloc: worker batches");
+        free_worker_batches(&worker);
+        close(worker.epoll_fd);
+        return NULL;
+    }
+    worker.write_batch = worker.read_batch + worker.batch_capacity;
+    worker.rearm_list = worker.write_batch + worker.batch_capacity;
+    
     // Инициализируем таймеры
-    if (timer_heap_init(&worker.timer_heap, 16384) != 0) {
-        perror("timer_heap_init");
+    if (timer_heap_init(&worker.timer_heap, g_config.timer_capacity) != 0) {
+        log_errno("timer_heap_init");
+        free_worker_batches(&worker);
+        close(worker.epoll_fd);
+        return NULL;
+    }
+    
+    // Соединения к бэкендам агрегирующих роутов живут в том же event loop
+    if (upstream_worker_init(&epoll_upstream_engine, &worker.timer_heap) != 0) {
+        log_errno("upstream_worker_init");
+        timer_heap_destroy(&worker.timer_heap);
+        free_worker_batches(&worker);
         close(worker.epoll_fd);
         return NULL;
     }
     
-    // Добавляем server socket в epoll
+    // Слушающий сокет у каждого воркера свой - EPOLLEXCLUSIVE не нужен,
+    // соединения между воркерами распределяет ядро (SO_REUSEPORT)
     struct epoll_event ev = {
-        .events = EPOLLIN | EPOLLEXCLUSIVE,
+        .events = EPOLLIN,
         .data.fd = worker.server_fd
     };
     if (epoll_ctl(worker.epoll_fd, EPOLL_CTL_ADD, worker.server_fd, &ev) == -1) {
-        perror("epoll_ctl: server_fd");
+        log_errno("epoll_ctl: server_fd");
+        upstream_worker_destroy();
         timer_heap_destroy(&worker.timer_heap);
+        free_worker_batches(&worker);
         close(worker.epoll_fd);
         return NULL;
     }
     
-    printf("Optimized worker %d started on CPU %d\n", 
-           worker.worker_id, worker.cpu_id);
+    log_info("Optimized worker %d started on CPU %d", worker.worker_id, worker.cpu_id);
     
     extern volatile sig_atomic_t g_running;
-    uint64_t loop_iterations = 0;
+    loop_clock_update();
+    routes_register_worker(worker.worker_id);
+    overload_init(&worker.overload);
     
     while (LIKELY(g_running)) {
+        if (UNLIKELY(g_draining) && drain_step(&worker)) {
+            break;
+        }
+        
         // Получаем timeout для следующего таймера
-        int timeout = timer_heap_get_next_timeout(&worker.timer_heap);
+        int timeout = overload_wait_timeout(&worker.overload,
+                                            timer_heap_get_next_timeout(&worker.timer_heap));
+        if (UNLIKELY(worker.draining)) {
+            // Срок дренажа воркер должен заметить и без событий
+            int left = (int)(worker.drain_deadline_ms - loop_clock_now_ms());
+            if (timeout < 0 || timeout > left) timeout = left;
+        }
+        
+        // Batch epoll_wait для лучшей производительности.
+        // На время ожидания воркер не держит таблицу роутов
+        routes_reader_offline();
+        int n = wait_for_events(&worker, timeout);
+        trace_wake();
+        routes_reader_online();
         
-        // Batch epoll_wait для лучшей производительности
-        int n = epoll_wait(worker.epoll_fd, worker.event_batch, 
-                          MAX_EVENTS_PER_WORKER, timeout);
+        // Одно чтение часов на итерацию: таймеры и соединения берут время отсюда
+        loop_clock_update();
         
         if (UNLIKELY(n == -1)) {
             if (errno == EINTR) continue;
-            perror("epoll_wait");
+            log_errno("epoll_wait");
             break;
         }
         
@@ -159,143 +278,229 @@ void *worker_loop_optimized(void *arg) {
             }
         }
         
-        // Обрабатываем накопленные batch'и
-        if (UNLIKELY(worker.read_batch_size > 0 || worker.write_batch_size > 0)) {
-            flush_batches(&worker);
-        }
+        // Обрабатываем накопленные batch'и и перевзводим соединения
+        flush_batches(&worker);
         
-        worker.events_processed += n;
-        loop_iterations++;
-        
-        // Периодически выводим статистику (каждые 100K итераций)
-        if (UNLIKELY((loop_iterations & 0xFFFF) == 0)) {
-            printf("Worker %d: %lu events, %lu connections, %lu KB read, %lu KB written\n",
-                   worker.worker_id, worker.events_processed, 
-                   worker.connections_accepted,
-                   worker.bytes_read / 1024, worker.bytes_written / 1024);
-        }
+        metric_add(&worker.metrics->events_processed, n);
+        apply_overload_state(&worker, overload_update(&worker.overload, n, loop_clock_now_ns()));
+        metric_set(&worker.metrics->timers_armed, worker.timer_heap.size);
     }
     
-    printf("Optimized worker %d shutting down. Stats: %lu events processed\n",
-           worker.worker_id, worker.events_processed);
+    log_info("Optimized worker %d shutting down. Stats: %lu events processed",
+             worker.worker_id,
+           (unsigned long)atomic_load(&worker.metrics->events_processed));
     
     // Cleanup
     flush_batches(&worker);
+    upstream_worker_destroy();
     timer_heap_destroy(&worker.timer_heap);
+    connection_io_pool_destroy();
+    routes_unregister_worker();
+    free_worker_batches(&worker);
     close(worker.epoll_fd);
     
     return NULL;
 }
 
+// epoll_wait с опросом: сначала неблокирующие вызовы в пределах бюджета,
+// затем сон до события или таймера
+static int wait_for_events(optimized_worker_t *worker, int timeout) {
+    extern volatile sig_atomic_t g_running;
+    busy_poll_t *bp = &worker->busy_poll;
+    uint64_t budget = busy_poll_budget(bp, timeout);
+    
+    if (budget > 0) {
+        uint64_t start = busy_poll_now_ns();
+        uint64_t now = start;
+        int n;
+        do {
+            n = epoll_wait(worker->epoll_fd, worker->event_batch, worker->max_events, 0);
+            now = busy_poll_now_ns();
+        } while (n == 0 && now - start < budget && g_running);
+        
+        metric_add(&worker->metrics->busy_poll_ns, now - start);
+        if (n != 0) {
+            metric_add(&worker->metrics->busy_poll_hits, 1);
+            busy_poll_update(bp, 1, 0);
+            return n;
+        }
+        if (timeout > 0) {
+            timeout -= (int)((now - start) / 1000000);
+            if (timeout < 0) timeout = 0;
+        }
+    }
+    
+    if (bp->max_ns == 0) {
+        return epoll_wait(worker->epoll_fd, worker->event_batch, worker->max_events, timeout);
+    }
+    
+    // Сон учитывается только в режиме опроса: по нему подстраивается бюджет
+    uint64_t start = busy_poll_now_ns();
+    int n = epoll_wait(worker->epoll_fd, worker->event_batch, worker->max_events, timeout);
+    uint64_t blocked = busy_poll_now_ns() - start;
+    metric_add(&worker->metrics->idle_ns, blocked);
+    metric_add(&worker->metrics->busy_poll_misses, 1);
+    busy_poll_update(bp, 0, blocked);
+    return n;
+}
+
+// Пауза accept: слушающий сокет снимается с epoll, и новые соединения
+// ждут в backlog ядра, пока воркер разбирает уже принятые. При дренаже -
+// насовсем: backlog разбирает новый процесс
+static void apply_overload_state(optimized_worker_t *worker, overload_state_t state) {
+    int paused = state == OVERLOAD_PAUSED || worker->draining;
+    if (LIKELY(paused == worker->accept_paused)) {
+        return;
+    }
+    
+    if (paused) {
+        epoll_ctl(worker->epoll_fd, EPOLL_CTL_DEL, worker->server_fd, NULL);
+    } else {
+        struct epoll_event ev = { .events = EPOLLIN, .data.fd = worker->server_fd };
+        if (epoll_ctl(worker->epoll_fd, EPOLL_CTL_ADD, worker->server_fd, &ev) == -1) {
+            log_errno("epoll_ctl: server_fd");
+            return; // Попробуем на следующей итерации
+        }
+    }
+    worker->accept_paused = paused;
+}
+
 static void handle_new_connections_batch(optimized_worker_t *worker) {
     struct sockaddr_in client_addr;
     socklen_t client_len = sizeof(client_addr);
     int accepts_count = 0;
     
     // Batch accept для лучшей производительности
-    while (accepts_count < MAX_ACCEPTS_PER_LOOP) {
+    while (accepts_count < g_config.accept_batch) {
         int client_fd = accept4(worker->server_fd, 
                                (struct sockaddr *)&client_addr, 
                                &client_len, SOCK_NONBLOCK | SOCK_CLOEXEC);
         
         if (UNLIKELY(client_fd == -1)) {
             if (errno == EAGAIN || errno == EWOULDBLOCK) break;
-            if (errno != EINTR) perror("accept4");
+            if (errno != EINTR) log_errno("accept4");
             break;
         }
         
         accepts_count++;
-        worker->connections_accepted++;
+        metric_add(&worker->metrics->connections_accepted, 1);
         
-        // TCP оптимизации
-        int flag = 1;
-        setsockopt(client_fd, IPPROTO_TCP, TCP_NODELAY, &flag, sizeof(flag));
+        // Под перегрузкой новое соединение получает 503, не занимая пул
+        if (UNLIKELY(worker->overload.state != OVERLOAD_NORMAL)) {
+            overload_reject(&worker->overload, client_fd, "overload");
+            close(client_fd);
+            continue;
+        }
         
-        // Оптимальные размеры буферов
-        int sndbuf = 65536, rcvbuf = 32768;
-        setsockopt(client_fd, SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(sndbuf));
-        setsockopt(client_fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+        // TCP_NODELAY, размеры буферов и SO_BUSY_POLL сокет унаследовал
+        // от слушающего (tune_listener в main.c)
         
         // Получаем соединение из lock-free пула
         connection_t *conn = lockfree_pool_get(worker->connection_pool);
         if (UNLIKELY(!conn)) {
-            fprintf(stderr, "Connection pool exhausted\n");
+            overload_reject(&worker->overload, client_fd, "connection pool exhausted");
             close(client_fd);
             continue;
         }
         
         // Быстрая инициализация соединения
         conn->fd = client_fd;
-        conn->client_addr = client_addr;
-        conn->state = STATE_READING;
-        clock_gettime(CLOCK_MONOTONIC, &conn->last_active);
+        conn->peer_addr = client_addr.sin_addr.s_addr;
+        conn->peer_port = client_addr.sin_port;
+        conn->state = tls_enabled() ? STATE_TLS_HANDSHAKE : STATE_READING;
         
         // Prefetch connection data для лучшей производительности
         prefetch_connection(conn);
         
-        // Добавляем в epoll
-        struct epoll_event ev = {
-            .events = EPOLLIN | EPOLLET | EPOLLONESHOT | EPOLLRDHUP,
-            .data.ptr = conn
-        };
+        timer_heap_add(&worker->timer_heap, conn, CONFIG_LIVE_GET(request_timeout_ms));
+        worker->connections++;
         
-        if (UNLIKELY(epoll_ctl(worker->epoll_fd, EPOLL_CTL_ADD, client_fd, &ev) == -1)) {
-            perror("epoll_ctl: client_fd");
-            lockfree_pool_release(worker->connection_pool, conn);
-            close(client_fd);
-            continue;
+        // С TCP_DEFER_ACCEPT accept4 отдает сокет, когда запрос уже пришел:
+        // первое чтение идет в пакете этой итерации, без круга через
+        // epoll_wait. В epoll сокет попадает перевзводом после пакета
+        if (g_config.defer_accept_s == 0) {
+            rearm_later(worker, conn, CONN_ARM_READ);
+        } else if (UNLIKELY(conn->state == STATE_TLS_HANDSHAKE)) {
+            do_tls_handshake_optimized(worker, conn);
+        } else {
+            queue_read(worker, conn);
         }
-        
-        // Добавляем таймер
-        timer_heap_add(&worker->timer_heap, conn, REQUEST_TIMEOUT_MS);
     }
 }
 
+// Начало дренажа: прием прекращается, простаивающие соединения
+// закрываются, остальные - после ответа с Connection: close.
+// Возвращает 1, когда воркеру пора выходить
+static int drain_step(optimized_worker_t *worker) {
+    if (!worker->draining) {
+        worker->draining = 1;
+        worker->drain_deadline_ms = loop_clock_now_ms() + CONFIG_LIVE_GET(drain_timeout_ms);
+        apply_overload_state(worker, worker->overload.state);
+        timer_heap_close_idle(&worker->timer_heap);
+        log_info("Worker %d draining, %d connections left", worker->worker_id,
+                 worker->connections);
+    }
+    if (worker->connections == 0) {
+        return 1;
+    }
+    if (loop_clock_now_ms() >= worker->drain_deadline_ms) {
+        log_warn("Worker %d: drain deadline, dropping %d connections", worker->worker_id,
+                 worker->connections);
+        return 1;
+    }
+    return 0;
+}
+
 static void handle_connection_event_optimized(optimized_worker_t *worker,
                                             connection_t *conn, uint32_t events) {
     if (UNLIKELY(conn->state == STATE_CLOSING || conn->state == STATE_FREE)) {
         return;
     }
     
-    // Обновляем время последней активности
-    clock_gettime(CLOCK_MONOTONIC, &conn->last_active);
+    // Соединение к бэкенду: EOF и ошибки разбирает upstream.c - после
+    // ответа без Content-Length EOF и есть его конец
+    if (UNLIKELY(conn->role == CONN_ROLE_UPSTREAM)) {
+        upstream_on_event(conn);
+        return;
+    }
     
+    // EPOLLERR пачки, отправленной с MSG_ZEROCOPY, - уведомления в очереди ошибок
+    if (UNLIKELY(conn->state == STATE_WRITING && conn->io->zerocopy_pending > 0 &&
+                 (events & EPOLLERR))) {
+        if (zerocopy_complete(conn) != 0 ||
+            ((events & EPOLLHUP) && conn->io->zerocopy_pending > 0)) {
+            close_connection_from_worker_optimized(worker, conn);
+            return;
+        }
+        do_write_optimized(worker, conn); // Дописать пачку или завершить ее
+        return;
+    }
+
     // Обрабатываем ошибки и отключения
     if (UNLIKELY(events & (EPOLLERR | EPOLLHUP | EPOLLRDHUP))) {
         close_connection_from_worker_optimized(worker, conn);
         return;
     }
     
+    if (UNLIKELY(conn->state == STATE_TLS_HANDSHAKE)) {
+        do_tls_handshake_optimized(worker, conn);
+        return;
+    }
+    
     // Batch processing для чтения
     if ((conn->state == STATE_READING || conn->state == STATE_KEEP_ALIVE) && 
         (events & EPOLLIN)) {
-        
-        if (LIKELY(worker->read_batch_size < BATCH_SIZE)) {
-            worker->read_batch[worker->read_batch_size++] = conn;
-        } else {
-            // Batch полон, обрабатываем немедленно
-            if (do_read_optimized(worker, conn) == 0) {
-                // Переходим к записи
-                if (LIKELY(worker->write_batch_size < BATCH_SIZE)) {
-                    worker->write_batch[worker->write_batch_size++] = conn;
-                } else {
-                    do_write_optimized(worker, conn);
-                }
-            }
-        }
+        queue_read(worker, conn);
     }
     
     // Batch processing для записи
     if (conn->state == STATE_WRITING && (events & EPOLLOUT)) {
-        if (LIKELY(worker->write_batch_size < BATCH_SIZE)) {
-            worker->write_batch[worker->write_batch_size++] = conn;
-        } else {
-            do_write_optimized(worker, conn);
-        }
+        queue_write(worker, conn);
     }
 }
 
 static void process_read_batch(optimized_worker_t *worker) {
+    uint64_t trace_start = trace_batch_begin(TRACE_BATCH_READ);
     for (int i = 0; i < worker->read_batch_size; i++) {
         connection_t *conn = worker->read_batch[i];
         
@@ -305,18 +510,17 @@ static void process_read_batch(optimized_worker_t *worker) {
         }
         
         if (do_read_optimized(worker, conn) == 0) {
-            // Успешно прочитали, добавляем в write batch
-            if (LIKELY(worker->write_batch_size < BATCH_SIZE)) {
-                worker->write_batch[worker->write_batch_size++] = conn;
-            } else {
-                do_write_optimized(worker, conn);
-            }
+            queue_write(worker, conn); // Успешно прочитали, добавляем в write batch
         }
     }
+    trace_batch_end(trace_start, TRACE_BATCH_READ, worker->read_batch_size);
+    metric_add(&worker->metrics->read_batches, 1);
+    metric_add(&worker->metrics->read_batch_items, worker->read_batch_size);
     worker->read_batch_size = 0;
 }
 
 static void process_write_batch(optimized_worker_t *worker) {
+    uint64_t trace_start = trace_batch_begin(TRACE_BATCH_WRITE);
     for (int i = 0; i < worker->write_batch_size; i++) {
         connection_t *conn = worker->write_batch[i];
         
@@ -327,9 +531,71 @@ static void process_write_batch(optimized_worker_t *worker) {
         
         do_write_optimized(worker, conn);
     }
+    trace_batch_end(trace_start, TRACE_BATCH_WRITE, worker->write_batch_size);
+    metric_add(&worker->metrics->write_batches, 1);
+    metric_add(&worker->metrics->write_batch_items, worker->write_batch_size);
     worker->write_batch_size = 0;
 }
 
+// Соединение в пакет чтения; полный пакет - чтение сразу
+static void queue_read(optimized_worker_t *worker, connection_t *conn) {
+    if (LIKELY(worker->read_batch_size < worker->batch_capacity)) {
+        worker->read_batch[worker->read_batch_size++] = conn;
+    } else if (do_read_optimized(worker, conn) == 0) {
+        queue_write(worker, conn);
+    }
+}
+
+static void queue_write(optimized_worker_t *worker, connection_t *conn) {
+    if (LIKELY(worker->write_batch_size < worker->batch_capacity)) {
+        worker->write_batch[worker->write_batch_size++] = conn;
+    } else {
+        do_write_optimized(worker, conn);
+    }
+}
+
+static void apply_rearm(optimized_worker_t *worker, connection_t *conn) {
+    static const uint32_t arm_events[] = {
+        [CONN_ARM_READ] = EPOLLIN | EPOLLET | EPOLLONESHOT | EPOLLRDHUP,
+        [CONN_ARM_WRITE] = EPOLLOUT | EPOLLET | EPOLLONESHOT | EPOLLRDHUP,
+        [CONN_ARM_ERRQUEUE] = EPOLLET | EPOLLONESHOT,
+    };
+    struct epoll_event ev = { .events = arm_events[conn->epoll_arm], .data.ptr = conn };
+    int op = conn->epoll_added ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+    conn->epoll_arm = CONN_ARM_NONE;
+    if (UNLIKELY(epoll_ctl(worker->epoll_fd, op, conn->fd, &ev) == -1)) {
+        log_errno("epoll_ctl: client_fd");
+        close_connection_from_worker_optimized(worker, conn);
+        return;
+    }
+    conn->epoll_added = 1;
+}
+
+// Перевзвод EPOLLONESHOT откладывается до конца итерации: запросы одного
+// соединения за итерацию сливаются в один epoll_ctl (действует последний),
+// а новое соединение после чтения при accept получает один EPOLL_CTL_ADD
+static void rearm_later(optimized_worker_t *worker, connection_t *conn, conn_arm_t arm) {
+    if (conn->epoll_arm == CONN_ARM_NONE) {
+        if (UNLIKELY(worker->rearm_count == worker->rearm_capacity)) {
+            conn->epoll_arm = arm;
+            apply_rearm(worker, conn);
+            return;
+        }
+        worker->rearm_list[worker->rearm_count++] = conn;
+    }
+    conn->epoll_arm = arm;
+}
+
+static void flush_rearms(optimized_worker_t *worker) {
+    for (int i = 0; i < worker->rearm_count; i++) {
+        connection_t *conn = worker->rearm_list[i];
+        if (LIKELY(conn->epoll_arm != CONN_ARM_NONE)) {
+            apply_rearm(worker, conn);
+        }
+    }
+    worker->rearm_count = 0;
+}
+
 static void flush_batches(optimized_worker_t *worker) {
     if (worker->read_batch_size > 0) {
         process_read_batch(worker);
@@ -337,12 +603,39 @@ static void flush_batches(optimized_worker_t *worker) {
     if (worker->write_batch_size > 0) {
         process_write_batch(worker);
     }
+    if (worker->rearm_count > 0) {
+        flush_rearms(worker);
+    }
+}
+
+// Шаг рукопожатия TLS; срок - таймер запроса, взведенный при accept
+static void do_tls_handshake_optimized(optimized_worker_t *worker, connection_t *conn) {
+    if (UNLIKELY(connection_io_acquire(conn) != 0)) {
+        metric_add(&worker->metrics->io_buffers_exhausted, 1);
+        close_connection_from_worker_optimized(worker, conn);
+        return;
+    }
+    int ret = tls_handshake(conn);
+    if (UNLIKELY(ret < 0)) {
+        close_connection_from_worker_optimized(worker, conn);
+        return;
+    }
+    if (ret == TLS_DONE) {
+        conn->state = STATE_READING; // Запрос, пришедший вслед за Finished, даст EPOLLIN сразу
+    }
+    rearm_later(worker, conn, ret == TLS_WANT_WRITE ? CONN_ARM_WRITE : CONN_ARM_READ);
 }
 
 static int do_read_optimized(optimized_worker_t *worker, connection_t *conn) {
+    // Буфер берется только на время запроса
+    if (UNLIKELY(connection_io_acquire(conn) != 0)) {
+        metric_add(&worker->metrics->io_buffers_exhausted, 1);
+        close_connection_from_worker_optimized(worker, conn);
+        return -1;
+    }
     conn->state = STATE_READING;
-    timer_heap_remove(&worker->timer_heap, conn);
-    timer_heap_add(&worker->timer_heap, conn, REQUEST_TIMEOUT_MS);
+    trace_read(&conn->io->trace);
+    timer_heap_add(&worker->timer_heap, conn, CONFIG_LIVE_GET(request_timeout_ms)); // Перевзвод без удаления
     
     ssize_t nread;
     int read_attempts = 0;
@@ -355,21 +648,15 @@ static int do_read_optimized(optimized_worker_t *worker, connection_t *conn) {
             return -1;
         }
         
-        nread = recv(conn->fd, conn->read_buf + conn->bytes_read, space_left, 0);
+        nread = recv(conn->fd, conn->io->read_buf + conn->bytes_read, space_left, 0);
         if (LIKELY(nread > 0)) {
             conn->bytes_read += nread;
-            worker->bytes_read += nread;
+            metric_add(&worker->metrics->bytes_read, nread);
             
             if (UNLIKELY(conn->bytes_read > MAX_REQUEST_SIZE)) {
                 close_connection_from_worker_optimized(worker, conn);
                 return -1;
             }
-            
-            // SIMD валидация входных данных
-            if (UNLIKELY(!simd_validate_url_chars(conn->read_buf + conn->bytes_read - nread, nread))) {
-                close_connection_from_worker_optimized(worker, conn);
-                return -1;
-            }
         }
         
         read_attempts++;
@@ -380,127 +667,229 @@ static int do_read_optimized(optimized_worker_t *worker, connection_t *conn) {
         return -1;
     }
     
-    // Быстрый поиск конца заголовков с SIMD
-    const char *header_end = simd_find_header_end(conn->read_buf, conn->bytes_read);
-    if (header_end) {
-        // Заголовки получены полностью, парсим
-        size_t header_len = header_end - conn->read_buf + 4;
-        size_t parsed = http_parser_execute(&conn->parser, &parser_settings, 
-                                          conn->read_buf, header_len);
-        
-        if (UNLIKELY(conn->parser.http_errno != HPE_OK && conn->parser.http_errno != HPE_PAUSED)) {
-            close_connection_from_worker_optimized(worker, conn);
-            return -1;
-        }
-        
-        // Переходим к обработке запроса
+    // Обрабатываем все полные запросы в буфере, ответы уйдут одним writev
+    int prepared = http_process_pipeline(conn);
+    if (prepared == HTTP_PIPELINE_PENDING) {
+        return 1; // Ответ отправит upstream_respond; таймер запроса остается
+    }
+    if (UNLIKELY(prepared < 0)) {
+        close_connection_from_worker_optimized(worker, conn);
+        return -1;
+    }
+    if (prepared > 0) {
         timer_heap_remove(&worker->timer_heap, conn);
-        handle_request_and_prepare_response(conn);
         return 0; // Готов к записи
     }
+    if (UNLIKELY(conn->bytes_read == 0)) {
+        // Кадры HTTP/2 разобраны целиком и ответа не требуют - простой
+        connection_io_release(conn);
+        conn->state = STATE_KEEP_ALIVE;
+        timer_heap_add(&worker->timer_heap, conn, overload_keepalive_ms(&worker->overload));
+    }
     
     // Заголовки еще не полные, продолжаем чтение
-    struct epoll_event ev = { 
-        .events = EPOLLIN | EPOLLET | EPOLLONESHOT | EPOLLRDHUP, 
-        .data.ptr = conn 
-    };
-    epoll_ctl(worker->epoll_fd, EPOLL_CTL_MOD, conn->fd, &ev);
+    rearm_later(worker, conn, CONN_ARM_READ);
     return 1; // Продолжаем чтение
 }
 
-static int do_write_optimized(optimized_worker_t *worker, connection_t *conn) {
-    ssize_t nwritten;
-    size_t total_len = conn->response_iov[0].iov_len + conn->response_iov[1].iov_len;
-    
-    if (UNLIKELY(total_len > 65536)) {
-        close_connection_from_worker_optimized(worker, conn);
-        return -1;
+// Разбирает уведомления MSG_ZEROCOPY из очереди ошибок сокета.
+// -1 - в очереди настоящая ошибка сокета
+static int zerocopy_complete(connection_t *conn) {
+    char control[128];
+    for (;;) {
+        struct msghdr msg = { .msg_control = control, .msg_controllen = sizeof(control) };
+        if (recvmsg(conn->fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0) {
+            return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+        }
+        for (struct cmsghdr *cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm)) {
+            if (!((cm->cmsg_level == SOL_IP && cm->cmsg_type == IP_RECVERR) ||
+                  (cm->cmsg_level == SOL_IPV6 && cm->cmsg_type == IPV6_RECVERR))) {
+                continue;
+            }
+            const struct sock_extended_err *err = (const void *)CMSG_DATA(cm);
+            if (err->ee_origin != SO_EE_ORIGIN_ZEROCOPY) {
+                return -1;
+            }
+            // Отправки нумеруются подряд; уведомление - диапазон [ee_info, ee_data]
+            uint32_t done = err->ee_data - err->ee_info + 1;
+            conn->io->zerocopy_pending -= done < conn->io->zerocopy_pending
+                                              ? done : conn->io->zerocopy_pending;
+            if (err->ee_code & SO_EE_CODE_ZEROCOPY_COPIED) {
+                conn->zerocopy = ZEROCOPY_OFF; // Ядро все равно копировало - не стоит пиннинга
+            }
+        }
     }
-    
-    int write_attempts = 0;
-    const int MAX_WRITE_ATTEMPTS = 16;
-    
-    while (LIKELY(conn->bytes_sent < total_len && write_attempts < MAX_WRITE_ATTEMPTS)) {
-        // Оптимизированная настройка iovec для частичной записи
-        struct iovec iov[2];
-        int iov_count = 0;
-        size_t remaining = total_len - conn->bytes_sent;
-        
-        if (conn->bytes_sent < conn->response_iov[0].iov_len) {
-            // Записываем заголовки
-            iov[0].iov_base = (char*)conn->response_iov[0].iov_base + conn->bytes_sent;
-            iov[0].iov_len = conn->response_iov[0].iov_len - conn->bytes_sent;
-            iov_count++;
+}
+
+// Отправка хвоста response_iov; с MSG_ZEROCOPY, если пачка большая и
+// сокет его принимает. ENOBUFS (лимит optmem) - обычная отправка
+static ssize_t send_response_iov(optimized_worker_t *worker, connection_t *conn) {
+    connection_io_t *io = conn->io;
+    struct msghdr msg = {
+        .msg_iov = &io->response_iov[io->response_iov_pos],
+        .msg_iovlen = io->response_iovcnt - io->response_iov_pos,
+    };
+    if (connection_wants_zerocopy(conn, CONFIG_LIVE_GET(zerocopy_threshold_kb))) {
+        if (conn->zerocopy == ZEROCOPY_UNSET) {
+            int one = 1;
+            conn->zerocopy = setsockopt(conn->fd, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one)) == 0
+                                 ? ZEROCOPY_ON : ZEROCOPY_OFF;
+        }
+        if (conn->zerocopy == ZEROCOPY_ON) {
+            ssize_t n = sendmsg(conn->fd, &msg, MSG_ZEROCOPY);
+            if (n > 0) {
+                io->zerocopy_pending++;
+                metric_add(&worker->metrics->bytes_zerocopy, n);
+                return n;
+            }
+            if (n == 0 || errno != ENOBUFS) {
+                return n;
+            }
+        }
+    }
+    return sendmsg(conn->fd, &msg, 0);
+}
+
+static int do_write_optimized(optimized_worker_t *worker, connection_t *conn) {
+    // Цикл по пачкам: если после ответа в буфере уже лежат следующие
+    // запросы, обрабатываем их сразу - с EPOLLET нового события не будет
+    for (;;) {
+        connection_io_t *io = conn->io;
+        trace_stamp_once(&io->trace, TRACE_SEND);
+
+        // Пишем до EAGAIN: большая пачка дописывается по EPOLLOUT с того
+        // места, где остановилась, частичная запись продвигает response_iov
+        while (LIKELY(io->response_iov_pos < io->response_iovcnt)) {
+            ssize_t nwritten = send_response_iov(worker, conn);
+            if (UNLIKELY(nwritten < 0)) {
+                if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                    rearm_later(worker, conn, CONN_ARM_WRITE);
+                    return 1; // Будем ждать EPOLLOUT
+                }
+                close_connection_from_worker_optimized(worker, conn);
+                return -1;
+            }
             
-            if (remaining > iov[0].iov_len) {
-                // Добавляем тело ответа
-                iov[1] = conn->response_iov[1];
-                iov_count++;
+            connection_consume_iov(conn, nwritten);
+            metric_add(&worker->metrics->bytes_written, nwritten);
+        }
+
+        // Страницы пачки еще у ядра: держим ее до уведомлений (EPOLLERR);
+        // срок - как у запроса
+        if (UNLIKELY(io->zerocopy_pending > 0)) {
+            if (zerocopy_complete(conn) != 0) {
+                close_connection_from_worker_optimized(worker, conn);
+                return -1;
             }
-        } else {
-            // Записываем только тело
-            size_t body_offset = conn->bytes_sent - conn->response_iov[0].iov_len;
-            iov[0].iov_base = (char*)conn->response_iov[1].iov_base + body_offset;
-            iov[0].iov_len = conn->response_iov[1].iov_len - body_offset;
-            iov_count = 1;
+            if (io->zerocopy_pending > 0) {
+                rearm_later(worker, conn, CONN_ARM_ERRQUEUE);
+                timer_heap_add(&worker->timer_heap, conn, CONFIG_LIVE_GET(request_timeout_ms));
+                return 1;
+            }
+            timer_heap_remove(&worker->timer_heap, conn);
         }
         
-        nwritten = writev(conn->fd, iov, iov_count);
-        if (UNLIKELY(nwritten < 0)) {
-            if (errno == EAGAIN || errno == EWOULDBLOCK) {
-                struct epoll_event ev = { 
-                    .events = EPOLLOUT | EPOLLET | EPOLLONESHOT | EPOLLRDHUP, 
-                    .data.ptr = conn 
-                };
-                epoll_ctl(worker->epoll_fd, EPOLL_CTL_MOD, conn->fd, &ev);
-                return 1; // Будем ждать EPOLLOUT
-            }
+        // Ответы отправлены полностью
+        http_responses_sent(conn);
+        if (UNLIKELY(!conn->keep_alive)) {
             close_connection_from_worker_optimized(worker, conn);
-            return -1;
+            return 0;
         }
         
-        conn->bytes_sent += nwritten;
-        worker->bytes_written += nwritten;
-        write_attempts++;
-    }
-    
-    if (UNLIKELY(write_attempts >= MAX_WRITE_ATTEMPTS)) {
-        close_connection_from_worker_optimized(worker, conn);
-        return -1;
-    }
-    
-    // Ответ отправлен полностью
-    if (LIKELY(conn->keep_alive)) {
-        // Подготавливаем к новому запросу
+        // Подготавливаем к новому запросу, сохраняя уже принятый остаток
+        connection_reset_for_next_request(conn);
         conn->state = STATE_KEEP_ALIVE;
-        http_parser_init(&conn->parser, HTTP_REQUEST);
-        conn->parser.data = conn;
-        conn->bytes_read = 0;
-        conn->bytes_sent = 0;
-        conn->url[0] = '\0';
         
-        struct epoll_event ev = { 
-            .events = EPOLLIN | EPOLLET | EPOLLONESHOT | EPOLLRDHUP, 
-            .data.ptr = conn 
-        };
-        epoll_ctl(worker->epoll_fd, EPOLL_CTL_MOD, conn->fd, &ev);
-        timer_heap_add(&worker->timer_heap, conn, KEEP_ALIVE_TIMEOUT_MS);
-    } else {
-        close_connection_from_worker_optimized(worker, conn);
+        // Потоку HTTP/2 может оставаться тело, которое окна уже пропускают
+        if (conn->bytes_read > 0 || h2_output_pending(conn)) {
+            int prepared = http_process_pipeline(conn);
+            if (prepared == HTTP_PIPELINE_PENDING) {
+                timer_heap_add(&worker->timer_heap, conn, CONFIG_LIVE_GET(request_timeout_ms));
+                return 1;
+            }
+            if (UNLIKELY(prepared < 0)) {
+                close_connection_from_worker_optimized(worker, conn);
+                return -1;
+            }
+            if (prepared > 0) {
+                continue;
+            }
+        }
+        
+        if (conn->bytes_read == 0) {
+            connection_io_release(conn); // Простаивающему соединению буфер не нужен
+        }
+        
+        rearm_later(worker, conn, CONN_ARM_READ);
+        timer_heap_add(&worker->timer_heap, conn, overload_keepalive_ms(&worker->overload));
+        return 0;
     }
-    
-    return 0;
 }
 
-void close_connection_from_worker_optimized(optimized_worker_t *worker, connection_t *conn) {
+static void close_connection_from_worker_optimized(optimized_worker_t *worker, connection_t *conn) {
     if (UNLIKELY(conn->fd == -1)) return;
     
-    epoll_ctl(worker->epoll_fd, EPOLL_CTL_DEL, conn->fd, NULL);
+    if (UNLIKELY(upstream_involved(conn))) {
+        upstream_on_close(conn);
+    }
+    if (LIKELY(conn->role != CONN_ROLE_UPSTREAM)) {
+        worker->connections--;
+    }
+    if (UNLIKELY(conn->epoll_arm != CONN_ARM_NONE)) {
+        // Соединение уйдет в пул, возможно чужого воркера, - убираем его
+        // из перевзводов итерации
+        for (int i = worker->rearm_count - 1; i >= 0; i--) {
+            if (worker->rearm_list[i] == conn) {
+                worker->rearm_list[i] = worker->rearm_list[--worker->rearm_count];
+                break;
+            }
+        }
+        conn->epoll_arm = CONN_ARM_NONE;
+    }
+    if (conn->epoll_added) {
+        epoll_ctl(worker->epoll_fd, EPOLL_CTL_DEL, conn->fd, NULL);
+    }
     close(conn->fd);
     timer_heap_remove(&worker->timer_heap, conn);
     lockfree_pool_release(worker->connection_pool, conn);
 }
 
+// Сокет бэкенда добавляется в epoll при первом ожидании
+static void upstream_watch(connection_t *conn, int writable) {
+    struct epoll_event ev = {
+        .events = (writable ? EPOLLOUT : EPOLLIN) | EPOLLONESHOT | EPOLLRDHUP,
+        .data.ptr = conn
+    };
+    if (epoll_ctl(current_worker->epoll_fd, EPOLL_CTL_MOD, conn->fd, &ev) == -1 &&
+        (errno != ENOENT ||
+         epoll_ctl(current_worker->epoll_fd, EPOLL_CTL_ADD, conn->fd, &ev) == -1)) {
+        log_errno("epoll_ctl: upstream");
+        close_connection_from_worker_optimized(current_worker, conn);
+        return;
+    }
+    conn->epoll_added = 1;
+}
+
+// Ответ клиенту уходит с пакетом записи текущей итерации
+static void upstream_respond(connection_t *conn) {
+    optimized_worker_t *worker = current_worker;
+    timer_heap_remove(&worker->timer_heap, conn);
+    queue_write(worker, conn);
+}
+
+static void upstream_close(connection_t *conn) {
+    close_connection_from_worker_optimized(current_worker, conn);
+}
+
+void close_connection_from_worker(connection_t *conn) {
+    if (UNLIKELY(!current_worker)) {
+        // Тред работает на io_uring-движке
+        uring_close_connection_from_worker(conn);
+        return;
+    }
+    close_connection_from_worker_optimized(current_worker, conn);
+}
+
 static int setup_worker_affinity(optimized_worker_t *worker) {
     cpu_set_t cpuset;
     CPU_ZERO(&cpuset);
@@ -515,18 +904,27 @@ static int setup_worker_affinity(optimized_worker_t *worker) {
     if (sched_setscheduler(0, SCHED_FIFO, &param) == -1) {
         // Fallback на обычный приоритет
         if (setpriority(PRIO_PROCESS, 0, -10) == -1) {
-            perror("setpriority");
+            log_errno("setpriority");
         }
     }
     
     return 0;
 }
 
-static void setup_memory_policy(void) {
-    // Настраиваем NUMA policy для локального доступа к памяти
-#ifdef __linux__
-    if (madvise(NULL, 0, MADV_HUGEPAGE) == -1) {
-        // Huge pages недоступны, продолжаем без них
+static void free_worker_batches(optimized_worker_t *worker) {
+    free(worker->event_batch);
+    free(worker->read_batch);
+    worker->event_batch = NULL;
+    worker->read_batch = NULL;
+    worker->write_batch = NULL;
+    worker->rearm_list = NULL;
+}
+
+static void setup_memory_policy(int numa_node) {
+    // Явная нода из карты конфигурации, иначе локальная политика ядра.
+    // Слаб соединений и таймеры идут из арены пула (huge pages, своя нода),
+    // политика покрывает остальные выделения треда
+    if (numa_node >= 0 && set_thread_memory_node(numa_node) != 0) {
+        log_warn("Failed to prefer NUMA node %d for worker memory", numa_node);
     }
-#endif
 }
\ No newline at end of file
@@ -3,8 +3,16 @@
 
 #include "connection.h"
 
+// Аргументы, передаваемые в worker-тред
+typedef struct {
+    int server_fd;  // Собственный слушающий сокет воркера (группа SO_REUSEPORT)
+    int worker_id;
+    int cpu_id;     // CPU, к которому привязывается воркер
+    int numa_node;  // Предпочтительная нода для памяти воркера, -1 - локальная
+} worker_args_t;
+
 // Основная функция-цикл для worker-треда
-void *worker_loop(void *arg);
+void *worker_loop_optimized(void *arg);
 
 // Функция для закрытия соединения из любого места в воркере
 void close_connection_from_worker(connection_t *conn);
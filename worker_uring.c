@@ -0,0 +1,1083 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include "worker_uring.h"
+#include "worker.h"
+#include "http_handler.h"
+#include "timer.h"
+#include "simd_utils.h"
+#include "lockfree_pool.h"
+#include "loop_clock.h"
+#include "metrics.h"
+#include "config.h"
+#include "numa_arena.h"
+#include "routes.h"
+#include "busy_poll.h"
+#include "overload.h"
+#include "log.h"
+#include "upstream.h"
+#include "tls.h"
+#include "h2.h"
+#include "upgrade.h"
+#include "trace.h"
+#include <linux/io_uring.h>
+#include <poll.h>
+#include <sys/syscall.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <netinet/tcp.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <signal.h>
+#include <sched.h>
+
+#define URING_BUF_SIZE BUFFER_SIZE
+#define URING_BUF_GROUP 0
+
+// Тип операции хранится в младших битах user_data:
+// connection_t выровнен минимум по 8 байтам
+enum {
+    URING_OP_ACCEPT = 1,
+    URING_OP_RECV = 2,
+    URING_OP_SEND = 3,
+    URING_OP_SHUTDOWN = 4,
+    URING_OP_CANCEL = 5,
+    URING_OP_POLL_IN = 6,        // Готовность сокета бэкенда (upstream.c)
+    URING_OP_POLL_OUT = 7,
+};
+#define URING_OP_MASK 7ull
+
+#define URING_USER_DATA(conn, op) ((uint64_t)(uintptr_t)(conn) | (op))
+#define URING_USER_CONN(data) ((connection_t*)(uintptr_t)((data) & ~URING_OP_MASK))
+#define URING_USER_OP(data) ((int)((data) & URING_OP_MASK))
+
+// Submission queue, отображенная из ядра
+typedef struct {
+    _Atomic unsigned *head;
+    _Atomic unsigned *tail;
+    unsigned ring_mask;
+    unsigned ring_entries;
+    unsigned *array;
+    struct io_uring_sqe *sqes;
+    unsigned sqe_tail;           // Подготовленные, но еще не опубликованные SQE
+    unsigned sqe_head;           // Уже отданные ядру
+} uring_sq_t;
+
+// Completion queue
+typedef struct {
+    _Atomic unsigned *head;
+    _Atomic unsigned *tail;
+    unsigned ring_mask;
+    struct io_uring_cqe *cqes;
+} uring_cq_t;
+
+typedef struct {
+    int worker_id;
+    int cpu_id;
+    int server_fd;
+    int ring_fd;
+
+    uring_sq_t sq;
+    uring_cq_t cq;
+    void *sq_ptr;
+    void *cq_ptr;
+    size_t sq_map_size;
+    size_t cq_map_size;
+    size_t sqes_map_size;
+
+    // Provided buffer ring для multishot recv
+    struct io_uring_buf_ring *buf_ring;
+    char *buf_base;
+    unsigned buf_count;          // Размер provided buffer ring (степень двойки)
+    unsigned short buf_tail;
+
+    int accept_armed;
+
+    lockfree_pool_t *connection_pool;
+    timer_heap_t timer_heap;
+
+    // Счетчики воркера (пишет только он, читает /metrics)
+    worker_metrics_t *metrics;
+    
+    // Опрос CQ перед блокирующим io_uring_enter (--busy-poll-us)
+    busy_poll_t busy_poll;
+    
+    // Контроль перегрузки; accept_paused - multishot accept отменен
+    overload_t overload;
+    int accept_paused;
+
+    // Дренаж после передачи слушающих сокетов новому процессу: воркер
+    // выходит, когда закрыто последнее клиентское соединение или к сроку
+    int connections;
+    int draining;
+    uint64_t drain_deadline_ms;
+
+    int zerocopy_unsupported;    // Ядро отвергло SENDMSG_ZC - большие пачки через writev
+} __attribute__((aligned(64))) uring_worker_t;
+
+static __thread uring_worker_t *current_uring_worker = NULL;
+
+static int uring_setup(uring_worker_t *w);
+static void uring_teardown(uring_worker_t *w);
+static void uring_arm_accept(uring_worker_t *w);
+static void uring_apply_overload_state(uring_worker_t *w, overload_state_t state);
+static int uring_drain_step(uring_worker_t *w);
+static void uring_arm_recv(uring_worker_t *w, connection_t *conn);
+static void uring_arm_poll(uring_worker_t *w, connection_t *conn, int writable);
+static void uring_submit_response(uring_worker_t *w, connection_t *conn);
+static void uring_process_input(uring_worker_t *w, connection_t *conn);
+static void uring_close_connection(uring_worker_t *w, connection_t *conn);
+static void uring_handle_cqe(uring_worker_t *w, struct io_uring_cqe *cqe);
+
+static void uring_upstream_watch(connection_t *conn, int writable);
+static void uring_upstream_respond(connection_t *conn);
+static void uring_upstream_close(connection_t *conn);
+
+static const upstream_engine_t uring_upstream_engine = {
+    .watch = uring_upstream_watch,
+    .respond = uring_upstream_respond,
+    .close = uring_upstream_close,
+};
+
+static inline int sys_io_uring_setup(unsigned entries, struct io_uring_params *p) {
+    return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static inline int sys_io_uring_enter(int fd, unsigned to_submit, unsigned min_complete,
+                                     unsigned flags, void *arg, size_t argsz) {
+    return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, arg, argsz);
+}
+
+static inline int sys_io_uring_register(int fd, unsigned opcode, void *arg, unsigned nr_args) {
+    return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+// Отдает ядру подготовленные SQE и, если min_complete > 0, ждет CQE
+// не дольше timeout_ms (-1 - без ограничения)
+static int uring_enter(uring_worker_t *w, unsigned min_complete, int timeout_ms) {
+    unsigned to_submit = w->sq.sqe_tail - w->sq.sqe_head;
+    atomic_store_explicit(w->sq.tail, w->sq.sqe_tail, memory_order_release);
+
+    unsigned flags = min_complete ? IORING_ENTER_GETEVENTS : 0;
+    struct __kernel_timespec ts;
+    struct io_uring_getevents_arg arg = {0};
+    void *argp = NULL;
+    size_t argsz = 0;
+
+    if (min_complete && timeout_ms >= 0) {
+        ts.tv_sec = timeout_ms / 1000;
+        ts.tv_nsec = (long long)(timeout_ms % 1000) * 1000000;
+        arg.ts = (uint64_t)(uintptr_t)&ts;
+        argp = &arg;
+        argsz = sizeof(arg);
+        flags |= IORING_ENTER_EXT_ARG;
+    }
+
+    int ret = sys_io_uring_enter(w->ring_fd, to_submit, min_complete, flags, argp, argsz);
+    if (ret >= 0) {
+        w->sq.sqe_head += ret;
+        return 0;
+    }
+    return (errno == ETIME || errno == EINTR || errno == EBUSY) ? 0 : -1;
+}
+
+static inline int uring_cq_ready(uring_worker_t *w) {
+    return atomic_load_explicit(w->cq.head, memory_order_relaxed) !=
+           atomic_load_explicit(w->cq.tail, memory_order_acquire);
+}
+
+// Отдает SQE и ждет CQE, сначала опрашивая кольцо в пределах бюджета.
+// С DEFER_TASKRUN завершения появляются в CQ только внутри
+// io_uring_enter(GETEVENTS), поэтому опрос - вызовы с min_complete = 0
+static int uring_wait(uring_worker_t *w, int timeout) {
+    extern volatile sig_atomic_t g_running;
+    busy_poll_t *bp = &w->busy_poll;
+    uint64_t budget = busy_poll_budget(bp, timeout);
+    
+    if (budget > 0) {
+        uint64_t start = busy_poll_now_ns();
+        uint64_t now = start;
+        atomic_store_explicit(w->sq.tail, w->sq.sqe_tail, memory_order_release);
+        do {
+            unsigned to_submit = w->sq.sqe_tail - w->sq.sqe_head;
+            int ret = sys_io_uring_enter(w->ring_fd, to_submit, 0, IORING_ENTER_GETEVENTS, NULL, 0);
+            if (ret > 0) {
+                w->sq.sqe_head += ret;
+            } else if (ret < 0 && errno != EINTR && errno != EBUSY) {
+                return -1;
+            }
+            now = busy_poll_now_ns();
+        } while (!uring_cq_ready(w) && now - start < budget && g_running);
+        
+        metric_add(&w->metrics->busy_poll_ns, now - start);
+        if (uring_cq_ready(w)) {
+            metric_add(&w->metrics->busy_poll_hits, 1);
+            busy_poll_update(bp, 1, 0);
+            return 0;
+        }
+        if (timeout > 0) {
+            timeout -= (int)((now - start) / 1000000);
+            if (timeout < 0) timeout = 0;
+        }
+    }
+    
+    if (bp->max_ns == 0) {
+        return uring_enter(w, 1, timeout);
+    }
+    
+    uint64_t start = busy_poll_now_ns();
+    int ret = uring_enter(w, 1, timeout);
+    uint64_t blocked = busy_poll_now_ns() - start;
+    metric_add(&w->metrics->idle_ns, blocked);
+    metric_add(&w->metrics->busy_poll_misses, 1);
+    busy_poll_update(bp, 0, blocked);
+    return ret;
+}
+
+static struct io_uring_sqe *uring_get_sqe(uring_worker_t *w) {
+    unsigned head = atomic_load_explicit(w->sq.head, memory_order_acquire);
+    if (UNLIKELY(w->sq.sqe_tail - head >= w->sq.ring_entries)) {
+        // SQ заполнена - отдаем накопленное ядру
+        uring_enter(w, 0, 0);
+        head = atomic_load_explicit(w->sq.head, memory_order_acquire);
+        if (w->sq.sqe_tail - head >= w->sq.ring_entries) {
+            return NULL;
+        }
+    }
+
+    struct io_uring_sqe *sqe = &w->sq.sqes[w->sq.sqe_tail & w->sq.ring_mask];
+    w->sq.sqe_tail++;
+    memset(sqe, 0, sizeof(*sqe));
+    return sqe;
+}
+
+// Возвращает буфер в provided buffer ring
+static inline void uring_recycle_buffer(uring_worker_t *w, unsigned short bid) {
+    struct io_uring_buf *buf = &w->buf_ring->bufs[w->buf_tail & (w->buf_count - 1)];
+    buf->addr = (uint64_t)(uintptr_t)(w->buf_base + (size_t)bid * URING_BUF_SIZE);
+    buf->len = URING_BUF_SIZE;
+    buf->bid = bid;
+    w->buf_tail++;
+    atomic_store_explicit((_Atomic unsigned short*)&w->buf_ring->tail, w->buf_tail,
+                          memory_order_release);
+}
+
+void *worker_loop_uring(void *arg) {
+    worker_args_t *args = (worker_args_t*)arg;
+
+    uring_worker_t *w = aligned_alloc(64, sizeof(uring_worker_t));
+    if (!w) {
+        return worker_loop_optimized(arg);
+    }
+    memset(w, 0, sizeof(*w));
+    w->worker_id = args->worker_id;
+    w->server_fd = args->server_fd;
+    w->cpu_id = args->cpu_id;
+    w->connection_pool = connection_pool_handle();
+    w->ring_fd = -1;
+    w->buf_count = g_config.uring_buffers;
+    w->metrics = metrics_register_worker(w->worker_id);
+    log_register_worker(w->worker_id);
+    trace_register_worker(w->worker_id);
+
+    // Affinity до создания кольца: его память выделяется на CPU воркера
+    cpu_set_t cpuset;
+    CPU_ZERO(&cpuset);
+    CPU_SET(w->cpu_id, &cpuset);
+    busy_poll_init(&w->busy_poll, g_config.busy_poll_us);
+    if (sched_setaffinity(0, sizeof(cpuset), &cpuset) == -1) {
+        log_warn("Failed to set CPU affinity for worker %d", w->worker_id);
+        busy_poll_init(&w->busy_poll, 0);
+    }
+    if (args->numa_node >= 0 && set_thread_memory_node(args->numa_node) != 0) {
+        log_warn("Failed to prefer NUMA node %d for worker %d",
+                 args->numa_node, w->worker_id);
+    }
+
+    // Арена пула создается до кольца: provided buffers берутся из нее.
+    // При откате на epoll тред остается привязан к тому же пулу
+    size_t arena_extra = sizeof(timer_node_t) * g_config.timer_capacity +
+                         sizeof(connection_io_t) * g_config.io_buffers +
+                         (size_t)w->buf_count * URING_BUF_SIZE;
+    if (lockfree_pool_bind_thread(w->connection_pool, w->worker_id,
+                                  arena_extra, args->numa_node) != 0) {
+        log_error("Failed to allocate connection pool for worker %d", w->worker_id);
+        free(w);
+        return NULL;
+    }
+    if (connection_io_pool_init(g_config.io_buffers) != 0) {
+        log_error("Failed to allocate request buffers for worker %d", w->worker_id);
+        free(w);
+        return NULL;
+    }
+
+    if (uring_setup(w) != 0) {
+        log_warn("Worker %d: io_uring unavailable (%s), falling back to epoll",
+                 w->worker_id, strerror(errno));
+        free(w);
+        return worker_loop_optimized(arg);
+    }
+
+    if (timer_heap_init(&w->timer_heap, g_config.timer_capacity) != 0) {
+        log_errno("timer_heap_init");
+        uring_teardown(w);
+        free(w);
+        return NULL;
+    }
+    if (upstream_worker_init(&uring_upstream_engine, &w->timer_heap) != 0) {
+        log_errno("upstream_worker_init");
+        timer_heap_destroy(&w->timer_heap);
+        uring_teardown(w);
+        free(w);
+        return NULL;
+    }
+
+    current_uring_worker = w;
+    uring_arm_accept(w);
+
+    log_info("io_uring worker %d started on CPU %d", w->worker_id, w->cpu_id);
+
+    extern volatile sig_atomic_t g_running;
+    loop_clock_update();
+    routes_register_worker(w->worker_id);
+    overload_init(&w->overload);
+
+    while (LIKELY(g_running)) {
+        if (UNLIKELY(g_draining) && uring_drain_step(w)) {
+            break;
+        }
+
+        int timeout = overload_wait_timeout(&w->overload,
+                                            timer_heap_get_next_timeout(&w->timer_heap));
+        if (UNLIKELY(w->draining)) {
+            // Срок дренажа воркер должен заметить и без событий
+            int left = (int)(w->drain_deadline_ms - loop_clock_now_ms());
+            if (timeout < 0 || timeout > left) timeout = left;
+        }
+
+        // Одним вызовом отдаем накопленные SQE и ждем хотя бы одно событие.
+        // На время ожидания воркер не держит таблицу роутов
+        routes_reader_offline();
+        int entered = uring_wait(w, timeout);
+        trace_wake();
+        routes_reader_online();
+        if (UNLIKELY(entered != 0)) {
+            log_errno("io_uring_enter");
+            break;
+        }
+
+        // Одно чтение часов на итерацию: таймеры и соединения берут время отсюда
+        loop_clock_update();
+
+        timer_heap_process_expired(&w->timer_heap);
+
+        unsigned head = atomic_load_explicit(w->cq.head, memory_order_relaxed);
+        unsigned tail = atomic_load_explicit(w->cq.tail, memory_order_acquire);
+        unsigned n = 0;
+        uint64_t trace_start = trace_batch_begin(TRACE_BATCH_URING);
+
+        while (head != tail) {
+            struct io_uring_cqe *cqe = &w->cq.cqes[head & w->cq.ring_mask];
+            uring_handle_cqe(w, cqe);
+            head++;
+            n++;
+
+            if (head == tail) {
+                // Обработка могла породить новые CQE (inline completion)
+                atomic_store_explicit(w->cq.head, head, memory_order_release);
+                tail = atomic_load_explicit(w->cq.tail, memory_order_acquire);
+            }
+        }
+        atomic_store_explicit(w->cq.head, head, memory_order_release);
+        trace_batch_end(trace_start, TRACE_BATCH_URING, (int)n);
+
+        metric_add(&w->metrics->events_processed, n);
+        uring_apply_overload_state(w, overload_update(&w->overload, (int)n, loop_clock_now_ns()));
+        metric_set(&w->metrics->timers_armed, w->timer_heap.size);
+
+        if (UNLIKELY(!w->accept_armed && !w->accept_paused)) {
+            uring_arm_accept(w);
+        }
+    }
+
+    log_info("io_uring worker %d shutting down. Stats: %lu events processed",
+             w->worker_id, (unsigned long)atomic_load(&w->metrics->events_processed));
+
+    upstream_worker_destroy();
+    current_uring_worker = NULL;
+    timer_heap_destroy(&w->timer_heap);
+    connection_io_pool_destroy();
+    routes_unregister_worker();
+    uring_teardown(w);
+    free(w);
+    return NULL;
+}
+
+static int uring_setup(uring_worker_t *w) {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    params.flags = IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN;
+
+    w->ring_fd = sys_io_uring_setup(g_config.uring_entries, &params);
+    if (w->ring_fd < 0 && errno == EINVAL) {
+        // Старое ядро без SINGLE_ISSUER/DEFER_TASKRUN
+        memset(&params, 0, sizeof(params));
+        w->ring_fd = sys_io_uring_setup(g_config.uring_entries, &params);
+    }
+    if (w->ring_fd < 0) {
+        return -1;
+    }
+
+    if (!(params.features & IORING_FEAT_SINGLE_MMAP) ||
+        !(params.features & IORING_FEAT_EXT_ARG)) {
+        close(w->ring_fd);
+        w->ring_fd = -1;
+        errno = ENOSYS;
+        return -1;
+    }
+
+    w->sq_map_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    w->cq_map_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (w->cq_map_size > w->sq_map_size) {
+        w->sq_map_size = w->cq_map_size;
+    }
+
+    w->sq_ptr = mmap(NULL, w->sq_map_size, PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_POPULATE, w->ring_fd, IORING_OFF_SQ_RING);
+    if (w->sq_ptr == MAP_FAILED) {
+        w->sq_ptr = NULL;
+        uring_teardown(w);
+        return -1;
+    }
+    w->cq_ptr = w->sq_ptr; // IORING_FEAT_SINGLE_MMAP
+
+    w->sqes_map_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    w->sq.sqes = mmap(NULL, w->sqes_map_size, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, w->ring_fd, IORING_OFF_SQES);
+    if (w->sq.sqes == MAP_FAILED) {
+        w->sq.sqes = NULL;
+        uring_teardown(w);
+        return -1;
+    }
+
+    char *sq = w->sq_ptr;
+    w->sq.head = (_Atomic unsigned*)(sq + params.sq_off.head);
+    w->sq.tail = (_Atomic unsigned*)(sq + params.sq_off.tail);
+    w->sq.ring_mask = *(unsigned*)(sq + params.sq_off.ring_mask);
+    w->sq.ring_entries = *(unsigned*)(sq + params.sq_off.ring_entries);
+    w->sq.array = (unsigned*)(sq + params.sq_off.array);
+    w->sq.sqe_tail = w->sq.sqe_head = atomic_load(w->sq.tail);
+
+    // Индексы SQE совпадают с позициями в кольце - заполняем один раз
+    for (unsigned i = 0; i < w->sq.ring_entries; ++i) {
+        w->sq.array[i] = i;
+    }
+
+    char *cq = w->cq_ptr;
+    w->cq.head = (_Atomic unsigned*)(cq + params.cq_off.head);
+    w->cq.tail = (_Atomic unsigned*)(cq + params.cq_off.tail);
+    w->cq.ring_mask = *(unsigned*)(cq + params.cq_off.ring_mask);
+    w->cq.cqes = (struct io_uring_cqe*)(cq + params.cq_off.cqes);
+
+    // Provided buffer ring: ядро само выбирает буфер для каждого recv
+    size_t ring_size = w->buf_count * sizeof(struct io_uring_buf);
+    w->buf_ring = mmap(NULL, ring_size, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (w->buf_ring == MAP_FAILED) {
+        w->buf_ring = NULL;
+        uring_teardown(w);
+        return -1;
+    }
+
+    struct io_uring_buf_reg reg = {
+        .ring_addr = (uint64_t)(uintptr_t)w->buf_ring,
+        .ring_entries = w->buf_count,
+        .bgid = URING_BUF_GROUP,
+    };
+    if (sys_io_uring_register(w->ring_fd, IORING_REGISTER_PBUF_RING, &reg, 1) != 0) {
+        uring_teardown(w);
+        return -1;
+    }
+
+    w->buf_base = numa_local_alloc((size_t)w->buf_count * URING_BUF_SIZE);
+    if (!w->buf_base) {
+        uring_teardown(w);
+        return -1;
+    }
+
+    w->buf_tail = 0;
+    for (unsigned bid = 0; bid < w->buf_count; ++bid) {
+        uring_recycle_buffer(w, bid);
+    }
+
+    return 0;
+}
+
+static void uring_teardown(uring_worker_t *w) {
+    if (w->buf_base) {
+        numa_local_free(w->buf_base);
+        w->buf_base = NULL;
+    }
+    if (w->buf_ring) {
+        munmap(w->buf_ring, w->buf_count * sizeof(struct io_uring_buf));
+        w->buf_ring = NULL;
+    }
+    if (w->sq.sqes) {
+        munmap(w->sq.sqes, w->sqes_map_size);
+        w->sq.sqes = NULL;
+    }
+    if (w->sq_ptr) {
+        munmap(w->sq_ptr, w->sq_map_size);
+        w->sq_ptr = w->cq_ptr = NULL;
+    }
+    if (w->ring_fd >= 0) {
+        close(w->ring_fd);
+        w->ring_fd = -1;
+    }
+}
+
+static void uring_arm_accept(uring_worker_t *w) {
+    struct io_uring_sqe *sqe = uring_get_sqe(w);
+    if (UNLIKELY(!sqe)) return;
+
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = w->server_fd;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+    sqe->user_data = URING_OP_ACCEPT;
+    w->accept_armed = 1;
+}
+
+// Пауза accept: multishot accept отменяется, новые соединения ждут в
+// backlog ядра. Перевзводится в конце итерации, когда пауза снята.
+// При дренаже - насовсем: backlog разбирает новый процесс
+static void uring_apply_overload_state(uring_worker_t *w, overload_state_t state) {
+    int paused = state == OVERLOAD_PAUSED || w->draining;
+    if (LIKELY(paused == w->accept_paused)) {
+        return;
+    }
+
+    if (paused && w->accept_armed) {
+        struct io_uring_sqe *sqe = uring_get_sqe(w);
+        if (UNLIKELY(!sqe)) return; // Попробуем на следующей итерации
+
+        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+        sqe->fd = -1;
+        sqe->addr = URING_OP_ACCEPT;
+        sqe->user_data = URING_OP_CANCEL;
+    }
+    w->accept_paused = paused;
+}
+
+// Начало дренажа: прием прекращается, простаивающие соединения
+// закрываются, остальные - после ответа с Connection: close.
+// Возвращает 1, когда воркеру пора выходить
+static int uring_drain_step(uring_worker_t *w) {
+    if (!w->draining) {
+        w->draining = 1;
+        w->drain_deadline_ms = loop_clock_now_ms() + CONFIG_LIVE_GET(drain_timeout_ms);
+        uring_apply_overload_state(w, w->overload.state);
+        timer_heap_close_idle(&w->timer_heap);
+        log_info("io_uring worker %d draining, %d connections left", w->worker_id,
+                 w->connections);
+    }
+    if (w->connections == 0) {
+        return 1;
+    }
+    if (loop_clock_now_ms() >= w->drain_deadline_ms) {
+        log_warn("io_uring worker %d: drain deadline, dropping %d connections", w->worker_id,
+                 w->connections);
+        return 1;
+    }
+    return 0;
+}
+
+static void uring_arm_recv(uring_worker_t *w, connection_t *conn) {
+    struct io_uring_sqe *sqe = uring_get_sqe(w);
+    if (UNLIKELY(!sqe)) {
+        uring_close_connection(w, conn);
+        return;
+    }
+
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = conn->fd;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_BUF_GROUP;
+    sqe->user_data = URING_USER_DATA(conn, URING_OP_RECV);
+    conn->uring_inflight++;
+}
+
+// Отправка оставшейся части response_iov. Для Connection: close за writev
+// сразу связан shutdown - соединение закрывается без лишнего круга через
+// userspace. При частичной записи связь рвется и shutdown отменяется.
+// Большая пачка уходит через SENDMSG_ZC: кроме итога отправки придет
+// уведомление, что ядро больше не читает ее страницы
+static void uring_submit_response(uring_worker_t *w, connection_t *conn) {
+    connection_io_t *io = conn->io;
+    struct io_uring_sqe *sqe = uring_get_sqe(w);
+    struct io_uring_sqe *shut = NULL;
+    trace_stamp_once(&io->trace, TRACE_SEND);
+    if (UNLIKELY(!sqe)) {
+        uring_close_connection(w, conn);
+        return;
+    }
+
+    sqe->fd = conn->fd;
+    io->zerocopy_send = !w->zerocopy_unsupported &&
+                        connection_wants_zerocopy(conn, CONFIG_LIVE_GET(zerocopy_threshold_kb));
+    if (io->zerocopy_send) {
+        memset(&io->zerocopy_msg, 0, sizeof(io->zerocopy_msg));
+        io->zerocopy_msg.msg_iov = &io->response_iov[io->response_iov_pos];
+        io->zerocopy_msg.msg_iovlen = io->response_iovcnt - io->response_iov_pos;
+        sqe->opcode = IORING_OP_SENDMSG_ZC;
+        sqe->addr = (uint64_t)(uintptr_t)&io->zerocopy_msg;
+        sqe->len = 1;
+        sqe->ioprio = IORING_SEND_ZC_REPORT_USAGE;
+    } else {
+        sqe->opcode = IORING_OP_WRITEV;
+        sqe->addr = (uint64_t)(uintptr_t)&io->response_iov[io->response_iov_pos];
+        sqe->len = io->response_iovcnt - io->response_iov_pos;
+    }
+    sqe->user_data = URING_USER_DATA(conn, URING_OP_SEND);
+    conn->uring_inflight++;
+
+    if (!conn->keep_alive) {
+        shut = uring_get_sqe(w);
+    }
+    if (shut) {
+        sqe->flags |= IOSQE_IO_LINK;
+        // Короткая SENDMSG_ZC без MSG_WAITALL считается успехом и связь не
+        // рвет - shutdown обрезал бы ответ. С MSG_WAITALL ядро дописывает
+        // пачку само, а недописанная рвет связь, как у WRITEV
+        if (io->zerocopy_send) {
+            sqe->msg_flags = MSG_WAITALL;
+        }
+        shut->opcode = IORING_OP_SHUTDOWN;
+        shut->fd = conn->fd;
+        shut->len = SHUT_RDWR;
+        shut->user_data = URING_USER_DATA(conn, URING_OP_SHUTDOWN);
+        conn->uring_inflight++;
+    }
+}
+
+// Копирует в read_buf отложенные буферы, сколько поместится
+static void uring_drain_pending(uring_worker_t *w, connection_t *conn) {
+    while (conn->io->uring_pending_count > 0 && conn->bytes_read < BUFFER_SIZE) {
+        unsigned idx = conn->io->uring_pending_head;
+        unsigned short bid = conn->io->uring_pending_bid[idx];
+        size_t len = conn->io->uring_pending_len[idx] - conn->io->uring_pending_off;
+        size_t space = BUFFER_SIZE - conn->bytes_read;
+        size_t chunk = len < space ? len : space;
+
+        memcpy(conn->io->read_buf + conn->bytes_read,
+               w->buf_base + (size_t)bid * URING_BUF_SIZE + conn->io->uring_pending_off, chunk);
+        conn->bytes_read += chunk;
+
+        if (chunk < len) {
+            conn->io->uring_pending_off += chunk;
+            break;
+        }
+
+        conn->io->uring_pending_off = 0;
+        conn->io->uring_pending_head = (idx + 1) % URING_PENDING_BUFS;
+        conn->io->uring_pending_count--;
+        uring_recycle_buffer(w, bid);
+    }
+}
+
+static void uring_finalize_connection(uring_worker_t *w, connection_t *conn) {
+    // Отложенные буферы возвращаем в кольцо
+    connection_io_t *io = conn->io;
+    while (io && io->uring_pending_count > 0) {
+        uring_recycle_buffer(w, io->uring_pending_bid[io->uring_pending_head]);
+        io->uring_pending_head = (io->uring_pending_head + 1) % URING_PENDING_BUFS;
+        io->uring_pending_count--;
+    }
+
+    if (LIKELY(conn->role != CONN_ROLE_UPSTREAM)) {
+        w->connections--;
+    }
+    close(conn->fd);
+    lockfree_pool_release(w->connection_pool, conn);
+}
+
+static void uring_begin_close(uring_worker_t *w, connection_t *conn) {
+    if (UNLIKELY(upstream_involved(conn))) {
+        upstream_on_close(conn);
+    }
+    conn->state = STATE_CLOSING;
+    timer_heap_remove(&w->timer_heap, conn);
+
+    if (conn->uring_inflight == 0) {
+        uring_finalize_connection(w, conn);
+        return;
+    }
+
+    // shutdown разбудит multishot recv и незавершенный writev,
+    // последний CQE вернет соединение в пул
+    shutdown(conn->fd, SHUT_RDWR);
+}
+
+static void uring_close_connection(uring_worker_t *w, connection_t *conn) {
+    if (UNLIKELY(conn->state == STATE_CLOSING || conn->state == STATE_FREE)) {
+        return;
+    }
+    uring_begin_close(w, conn);
+}
+
+void uring_close_connection_from_worker(connection_t *conn) {
+    // Таймеры выставляют STATE_CLOSING до вызова, поэтому без проверки состояния
+    if (current_uring_worker && conn->state != STATE_FREE) {
+        uring_begin_close(current_uring_worker, conn);
+    }
+}
+
+// Шаг рукопожатия TLS: OpenSSL читает сокет сам, поэтому до передачи
+// ключей в kTLS вместо multishot recv - однократные poll
+static void uring_tls_handshake(uring_worker_t *w, connection_t *conn) {
+    if (UNLIKELY(connection_io_acquire(conn) != 0)) {
+        metric_add(&w->metrics->io_buffers_exhausted, 1);
+        uring_close_connection(w, conn);
+        return;
+    }
+    int ret = tls_handshake(conn);
+    if (UNLIKELY(ret < 0)) {
+        uring_close_connection(w, conn);
+    } else if (ret == TLS_DONE) {
+        conn->state = STATE_READING;
+        uring_arm_recv(w, conn);
+    } else {
+        uring_arm_poll(w, conn, ret == TLS_WANT_WRITE);
+    }
+}
+
+static void uring_on_accept(uring_worker_t *w, int client_fd) {
+    metric_add(&w->metrics->connections_accepted, 1);
+
+    // Под перегрузкой новое соединение получает 503, не занимая пул
+    if (UNLIKELY(w->overload.state != OVERLOAD_NORMAL)) {
+        overload_reject(&w->overload, client_fd, "overload");
+        close(client_fd);
+        return;
+    }
+
+    // TCP_NODELAY и SO_BUSY_POLL сокет унаследовал от слушающего
+    connection_t *conn = lockfree_pool_get(w->connection_pool);
+    if (UNLIKELY(!conn)) {
+        overload_reject(&w->overload, client_fd, "connection pool exhausted");
+        close(client_fd);
+        return;
+    }
+
+    conn->fd = client_fd;
+    conn->state = STATE_READING;
+    w->connections++;
+
+    timer_heap_add(&w->timer_heap, conn, CONFIG_LIVE_GET(request_timeout_ms));
+    if (UNLIKELY(tls_enabled())) {
+        conn->state = STATE_TLS_HANDSHAKE;
+        uring_tls_handshake(w, conn);
+        return;
+    }
+    uring_arm_recv(w, conn);
+}
+
+static void uring_process_input(uring_worker_t *w, connection_t *conn) {
+    // Данные уже скопированы из provided buffers: чтение - это разбор CQE
+    trace_read(&conn->io->trace);
+    conn->state = STATE_READING;
+    timer_heap_add(&w->timer_heap, conn, CONFIG_LIVE_GET(request_timeout_ms)); // Перевзвод без удаления
+
+    // Все полные запросы в буфере - одним writev
+    int prepared = http_process_pipeline(conn);
+    if (prepared == HTTP_PIPELINE_PENDING) {
+        return; // Ответ отправит uring_upstream_respond, recv копит следующие запросы
+    }
+    if (UNLIKELY(prepared < 0)) {
+        uring_close_connection(w, conn);
+        return;
+    }
+    if (prepared == 0) {
+        if (UNLIKELY(conn->bytes_read == BUFFER_SIZE)) {
+            uring_close_connection(w, conn); // Заголовки не помещаются в буфер
+        } else if (UNLIKELY(conn->bytes_read == 0 && conn->io->uring_pending_count == 0)) {
+            // Кадры HTTP/2 разобраны целиком и ответа не требуют - простой
+            connection_io_release(conn);
+            conn->state = STATE_KEEP_ALIVE;
+            timer_heap_add(&w->timer_heap, conn, overload_keepalive_ms(&w->overload));
+        }
+        return; // Ждем продолжения - multishot recv все еще активен
+    }
+
+    timer_heap_remove(&w->timer_heap, conn);
+    uring_submit_response(w, conn);
+}
+
+static void uring_on_recv(uring_worker_t *w, connection_t *conn, struct io_uring_cqe *cqe) {
+    int res = cqe->res;
+
+    if (res > 0 && (cqe->flags & IORING_CQE_F_BUFFER)) {
+        unsigned short bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+        const char *data = w->buf_base + (size_t)bid * URING_BUF_SIZE;
+
+        if (UNLIKELY(conn->state == STATE_CLOSING)) {
+            uring_recycle_buffer(w, bid);
+        } else if (UNLIKELY(connection_io_acquire(conn) != 0)) {
+            // Буферы запросов воркера кончились
+            metric_add(&w->metrics->io_buffers_exhausted, 1);
+            uring_recycle_buffer(w, bid);
+            uring_close_connection(w, conn);
+        } else if (LIKELY(conn->io->uring_pending_count == 0 &&
+                          conn->bytes_read + res <= BUFFER_SIZE)) {
+            memcpy(conn->io->read_buf + conn->bytes_read, data, res);
+            conn->bytes_read += res;
+            metric_add(&w->metrics->bytes_read, res);
+            uring_recycle_buffer(w, bid);
+        } else if (conn->io->uring_pending_count < URING_PENDING_BUFS) {
+            // read_buf занят конвейером запросов - откладываем буфер
+            unsigned idx = (conn->io->uring_pending_head + conn->io->uring_pending_count) % URING_PENDING_BUFS;
+            conn->io->uring_pending_bid[idx] = bid;
+            conn->io->uring_pending_len[idx] = res;
+            conn->io->uring_pending_count++;
+            metric_add(&w->metrics->bytes_read, res);
+            uring_drain_pending(w, conn);
+        } else {
+            uring_recycle_buffer(w, bid);
+            uring_close_connection(w, conn);
+        }
+    }
+
+    int more = cqe->flags & IORING_CQE_F_MORE;
+    if (!more) {
+        conn->uring_inflight--;
+    }
+
+    if (conn->state == STATE_CLOSING) {
+        if (conn->uring_inflight == 0) {
+            uring_finalize_connection(w, conn);
+        }
+        return;
+    }
+
+    if (res > 0) {
+        // Во время записи и ожидания бэкендов данные только накапливаются
+        if (conn->state == STATE_READING || conn->state == STATE_KEEP_ALIVE) {
+            uring_process_input(w, conn);
+        }
+        if (!more && conn->state != STATE_CLOSING) {
+            uring_arm_recv(w, conn);
+        }
+    } else if (res == -ENOBUFS) {
+        // Все буферы заняты - перевзводим, они возвращаются сразу после копирования
+        metric_add(&w->metrics->recv_no_buffers, 1);
+        uring_arm_recv(w, conn);
+    } else {
+        // EOF или ошибка
+        uring_close_connection(w, conn);
+    }
+}
+
+// Пачка ответов отправлена и ядру больше не нужна
+static void uring_response_sent(uring_worker_t *w, connection_t *conn) {
+    http_responses_sent(conn);
+    if (LIKELY(conn->keep_alive)) {
+        // Подготавливаем к новому запросу; recv остается взведенным.
+        // Запросы, пришедшие во время записи, уже в буфере - обрабатываем их
+        connection_reset_for_next_request(conn);
+        uring_drain_pending(w, conn);
+        conn->state = STATE_KEEP_ALIVE;
+        // Потоку HTTP/2 может оставаться тело, которое окна уже пропускают
+        if (conn->bytes_read > 0 || h2_output_pending(conn)) {
+            uring_process_input(w, conn);
+        } else {
+            connection_io_release(conn); // Простаивающему соединению буфер не нужен
+            timer_heap_add(&w->timer_heap, conn, overload_keepalive_ms(&w->overload));
+        }
+    } else {
+        // Связанный shutdown уже в пути - ждем его CQE
+        conn->state = STATE_CLOSING;
+        timer_heap_remove(&w->timer_heap, conn);
+        if (conn->uring_inflight == 0) {
+            uring_finalize_connection(w, conn);
+        }
+    }
+}
+
+// Уведомление SENDMSG_ZC: за ним соединение держало uring_inflight
+static void uring_on_zerocopy_notif(uring_worker_t *w, connection_t *conn, int res) {
+    connection_io_t *io = conn->io;
+    conn->uring_inflight--;
+    io->zerocopy_pending--;
+    if ((unsigned)res & IORING_NOTIF_USAGE_ZC_COPIED) {
+        conn->zerocopy = ZEROCOPY_OFF; // Ядро все равно копировало - не стоит пиннинга
+    }
+
+    if (conn->state == STATE_CLOSING) {
+        if (conn->uring_inflight == 0) {
+            uring_finalize_connection(w, conn);
+        }
+        return;
+    }
+    if (io->zerocopy_pending == 0 && conn->state == STATE_WRITING &&
+        io->response_iov_pos == io->response_iovcnt) {
+        uring_response_sent(w, conn);
+    }
+}
+
+static void uring_on_send(uring_worker_t *w, connection_t *conn, struct io_uring_cqe *cqe) {
+    connection_io_t *io = conn->io;
+    int res = cqe->res;
+    if (UNLIKELY(cqe->flags & IORING_CQE_F_NOTIF)) {
+        uring_on_zerocopy_notif(w, conn, res);
+        return;
+    }
+    if (cqe->flags & IORING_CQE_F_MORE) {
+        io->zerocopy_pending++; // uring_inflight остается за уведомлением
+    } else {
+        conn->uring_inflight--;
+    }
+    int zerocopy = io->zerocopy_send;
+    io->zerocopy_send = 0;
+
+    if (conn->state == STATE_CLOSING) {
+        if (conn->uring_inflight == 0) {
+            uring_finalize_connection(w, conn);
+        }
+        return;
+    }
+
+    if (UNLIKELY(res < 0)) {
+        if (zerocopy && (res == -EINVAL || res == -EOPNOTSUPP)) {
+            w->zerocopy_unsupported = 1; // Ядро без SENDMSG_ZC
+            uring_submit_response(w, conn);
+            return;
+        }
+        uring_close_connection(w, conn);
+        return;
+    }
+
+    metric_add(&w->metrics->bytes_written, res);
+    if (zerocopy) {
+        metric_add(&w->metrics->bytes_zerocopy, res);
+    }
+
+    // Продвигаем iovec на записанное количество байт
+    if (connection_consume_iov(conn, res) > 0) {
+        uring_submit_response(w, conn); // Частичная запись
+        return;
+    }
+    if (io->zerocopy_pending > 0) {
+        return; // Пачку завершит последнее уведомление
+    }
+    uring_response_sent(w, conn);
+}
+
+static void uring_on_shutdown(uring_worker_t *w, connection_t *conn, int res) {
+    conn->uring_inflight--;
+
+    if (res == -ECANCELED && conn->state == STATE_WRITING) {
+        return; // Частичная запись порвала связь, shutdown будет перевзведен
+    }
+    if (res >= 0 && conn->state == STATE_WRITING && conn->io->zerocopy_pending > 0) {
+        return; // Пачка отправлена, соединение закроет ее последнее уведомление
+    }
+
+    if (conn->state != STATE_CLOSING) {
+        uring_close_connection(w, conn);
+    } else if (conn->uring_inflight == 0) {
+        uring_finalize_connection(w, conn);
+    }
+}
+
+// Однократный poll на сокет бэкенда или клиента в рукопожатии TLS;
+// ожидание, уже взведенное в ту же сторону, не дублируется - иначе
+// лишние CQE копились бы на соединении
+static void uring_arm_poll(uring_worker_t *w, connection_t *conn, int writable) {
+    unsigned mask = writable ? POLLOUT : POLLIN;
+    if (conn->io->uring_poll & mask) {
+        return;
+    }
+    struct io_uring_sqe *sqe = uring_get_sqe(w);
+    if (UNLIKELY(!sqe)) {
+        uring_close_connection(w, conn);
+        return;
+    }
+
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = conn->fd;
+    sqe->poll32_events = mask | POLLRDHUP;
+    sqe->user_data = URING_USER_DATA(conn, writable ? URING_OP_POLL_OUT : URING_OP_POLL_IN);
+    conn->io->uring_poll |= mask;
+    conn->uring_inflight++;
+}
+
+static void uring_upstream_watch(connection_t *conn, int writable) {
+    uring_arm_poll(current_uring_worker, conn, writable);
+}
+
+static void uring_upstream_respond(connection_t *conn) {
+    uring_worker_t *w = current_uring_worker;
+    timer_heap_remove(&w->timer_heap, conn);
+    uring_submit_response(w, conn);
+}
+
+static void uring_upstream_close(connection_t *conn) {
+    uring_close_connection(current_uring_worker, conn);
+}
+
+static void uring_on_poll(uring_worker_t *w, connection_t *conn, unsigned mask) {
+    conn->uring_inflight--;
+    conn->io->uring_poll &= ~mask;
+
+    if (conn->state == STATE_CLOSING) {
+        if (conn->uring_inflight == 0) {
+            uring_finalize_connection(w, conn);
+        }
+        return;
+    }
+    if (conn->state == STATE_TLS_HANDSHAKE) {
+        uring_tls_handshake(w, conn);
+        return;
+    }
+    upstream_on_event(conn); // Итог poll не нужен: upstream.c пробует неблокирующую операцию
+}
+
+static void uring_handle_cqe(uring_worker_t *w, struct io_uring_cqe *cqe) {
+    uint64_t data = cqe->user_data;
+    connection_t *conn = URING_USER_CONN(data);
+
+    switch (URING_USER_OP(data)) {
+    case URING_OP_ACCEPT:
+        if (LIKELY(cqe->res >= 0)) {
+            uring_on_accept(w, cqe->res);
+        } else if (cqe->res != -EAGAIN && cqe->res != -EINTR && cqe->res != -ECANCELED) {
+            LOG_AT(LOG_ERROR, -cqe->res, "accept");
+        }
+        if (!(cqe->flags & IORING_CQE_F_MORE)) {
+            w->accept_armed = 0; // Перевзведем в конце итерации
+        }
+        break;
+    case URING_OP_RECV:
+        uring_on_recv(w, conn, cqe);
+        break;
+    case URING_OP_SEND:
+        uring_on_send(w, conn, cqe);
+        break;
+    case URING_OP_SHUTDOWN:
+        uring_on_shutdown(w, conn, cqe->res);
+        break;
+    case URING_OP_CANCEL:
+        break; // Итог отмены accept придет в CQE самого accept'а
+    case URING_OP_POLL_IN:
+    case URING_OP_POLL_OUT:
+        uring_on_poll(w, conn, URING_USER_OP(data) == URING_OP_POLL_IN ? POLLIN : POLLOUT);
+        break;
+    default:
+        break;
+    }
+}
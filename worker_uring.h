@@ -0,0 +1,14 @@
+#ifndef WORKER_URING_H
+#define WORKER_URING_H
+
+#include "connection.h"
+
+// Цикл воркера на io_uring: multishot accept, multishot recv с provided
+// buffer ring и writev со связанным shutdown. Если ядро не поддерживает
+// нужные возможности, воркер откатывается на worker_loop_optimized (epoll)
+void *worker_loop_uring(void *arg);
+
+// Закрытие соединения io_uring-воркера (вызывается из таймеров)
+void uring_close_connection_from_worker(connection_t *conn);
+
+#endif // WORKER_URING_H